@@ -0,0 +1,41 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mitmqtt {
+namespace bench {
+
+// Percentiles of a set of samples, in the samples' unit
+struct LatencySummary {
+  size_t count = 0;
+  double p50 = 0;
+  double p99 = 0;
+  double p999 = 0;
+  double max = 0;
+};
+
+// Nearest-rank percentile of sorted samples
+inline double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t rank = static_cast<size_t>(p * static_cast<double>(sorted.size()));
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+// Sorts `samples`
+inline LatencySummary summarize(std::vector<double> &samples) {
+  LatencySummary summary;
+  std::sort(samples.begin(), samples.end());
+  summary.count = samples.size();
+  summary.p50 = percentile(samples, 0.50);
+  summary.p99 = percentile(samples, 0.99);
+  summary.p999 = percentile(samples, 0.999);
+  summary.max = samples.empty() ? 0 : samples.back();
+  return summary;
+}
+
+}
+}
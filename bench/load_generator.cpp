@@ -0,0 +1,510 @@
+#include "latency_stats.hpp"
+#include "core/io_context_pool.hpp"
+#include "core/mqtt_framer.hpp"
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// MQTT load generator.
+//
+// Opens many concurrent clients against a broker, each subscribed to a topic
+// of its own, and has them publish timestamped messages at a fixed rate.
+// Every message comes back through the subscription, so its round trip is
+// measured on one clock. Run once against the broker directly and once
+// through the proxy to get the latency the proxy adds.
+
+namespace {
+namespace asio = boost::asio;
+using asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::string proxy;  // HOST:PORT, required
+  std::string broker; // HOST:PORT of the baseline run, optional
+  size_t clients = 1000;
+  double rate = 1.0;   // Messages per second per client
+  size_t size = 64;    // Payload bytes, at least the timestamp
+  double duration = 10; // Seconds of publishing
+  size_t threads = 0;
+  size_t connectRate = 2000; // New connections per second
+};
+
+// State shared by the clients of one run
+struct Run {
+  std::string topicPrefix;
+  std::atomic<size_t> ready{0};
+  std::atomic<size_t> failed{0};
+  std::atomic<uint64_t> sent{0};
+  std::atomic<uint64_t> received{0};
+  std::atomic<uint64_t> skipped{0}; // Not sent, the socket was backed up
+};
+
+int64_t nowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Clock::now().time_since_epoch())
+      .count();
+}
+
+void appendString(std::vector<uint8_t> &out, const std::string &text) {
+  out.push_back(static_cast<uint8_t>(text.size() >> 8));
+  out.push_back(static_cast<uint8_t>(text.size() & 0xFF));
+  out.insert(out.end(), text.begin(), text.end());
+}
+
+void appendPacket(std::vector<uint8_t> &out, uint8_t header,
+                  const std::vector<uint8_t> &body) {
+  out.push_back(header);
+  mitmqtt::encodeRemainingLength(body.size(), out);
+  out.insert(out.end(), body.begin(), body.end());
+}
+
+class LoadClient : public std::enable_shared_from_this<LoadClient> {
+public:
+  LoadClient(asio::io_context &ioc, Run &run, size_t index)
+      : socket_(ioc), timer_(ioc), run_(run),
+        topic_(run.topicPrefix + std::to_string(index)),
+        clientId_("mitmqtt-loadgen-" + std::to_string(index)) {}
+
+  void start(const tcp::endpoint &endpoint) {
+    auto self = shared_from_this();
+    asio::post(socket_.get_executor(), [this, self, endpoint]() {
+      socket_.async_connect(endpoint,
+                            [this, self](const boost::system::error_code &ec) {
+                              if (ec) {
+                                fail();
+                                return;
+                              }
+                              socket_.set_option(tcp::no_delay(true));
+                              handshake();
+                              doRead();
+                            });
+    });
+  }
+
+  // Publish every `interval` until stopPublishing()
+  void startPublishing(Clock::duration interval, size_t payloadSize,
+                       Clock::duration offset) {
+    auto self = shared_from_this();
+    asio::post(socket_.get_executor(), [this, self, interval, payloadSize,
+                                       offset]() {
+      if (!ready_)
+        return;
+      interval_ = interval;
+      payload_.assign(payloadSize, 'x');
+      publishing_ = true;
+      timer_.expires_after(offset);
+      schedule();
+    });
+  }
+
+  void stopPublishing() {
+    auto self = shared_from_this();
+    asio::post(socket_.get_executor(), [this, self]() {
+      publishing_ = false;
+      timer_.cancel();
+    });
+  }
+
+  void stop() {
+    auto self = shared_from_this();
+    asio::post(socket_.get_executor(), [this, self]() {
+      publishing_ = false;
+      timer_.cancel();
+      boost::system::error_code ec;
+      socket_.close(ec);
+    });
+  }
+
+  // Round trips in microseconds; read once the I/O threads are stopped
+  std::vector<double> &latencies() { return latencies_; }
+
+private:
+  void handshake() {
+    // CONNECT, MQTT 3.1.1, clean session, no keep alive
+    std::vector<uint8_t> body;
+    appendString(body, "MQTT");
+    body.push_back(0x04);
+    body.push_back(0x02);
+    body.push_back(0x00);
+    body.push_back(0x00);
+    appendString(body, clientId_);
+    appendPacket(outbox_, 0x10, body);
+
+    // SUBSCRIBE to our own topic at QoS 0
+    body.clear();
+    body.push_back(0x00);
+    body.push_back(0x01);
+    appendString(body, topic_);
+    body.push_back(0x00);
+    appendPacket(outbox_, 0x82, body);
+    flush();
+  }
+
+  void schedule() {
+    auto self = shared_from_this();
+    timer_.async_wait([this, self](const boost::system::error_code &ec) {
+      if (ec || !publishing_)
+        return;
+      publish();
+      timer_.expires_at(timer_.expiry() + interval_);
+      schedule();
+    });
+  }
+
+  void publish() {
+    // Don't queue behind a socket that can't keep up
+    if (outbox_.size() > kMaxOutbox) {
+      run_.skipped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    int64_t sentAt = nowNanos();
+    std::memcpy(&payload_[0], &sentAt, sizeof(sentAt));
+
+    std::vector<uint8_t> body;
+    body.reserve(2 + topic_.size() + payload_.size());
+    appendString(body, topic_);
+    body.insert(body.end(), payload_.begin(), payload_.end());
+    appendPacket(outbox_, 0x30, body);
+    run_.sent.fetch_add(1, std::memory_order_relaxed);
+    flush();
+  }
+
+  void flush() {
+    if (writing_ || outbox_.empty())
+      return;
+    writing_ = true;
+    inflight_.swap(outbox_);
+    auto self = shared_from_this();
+    asio::async_write(socket_, asio::buffer(inflight_),
+                      [this, self](const boost::system::error_code &ec,
+                                   size_t) {
+                        writing_ = false;
+                        inflight_.clear();
+                        if (ec)
+                          return;
+                        flush();
+                      });
+  }
+
+  void doRead() {
+    size_t writable = 0;
+    uint8_t *buffer = framer_.prepare(writable);
+    auto self = shared_from_this();
+    socket_.async_read_some(
+        asio::buffer(buffer, writable),
+        [this, self](const boost::system::error_code &ec, size_t length) {
+          if (ec) {
+            if (!ready_)
+              fail();
+            return;
+          }
+          framer_.commit(length);
+          mitmqtt::FrameView frame;
+          while (framer_.next(frame))
+            handleFrame(frame);
+          if (framer_.malformed()) {
+            fail();
+            return;
+          }
+          doRead();
+        });
+  }
+
+  void handleFrame(const mitmqtt::FrameView &frame) {
+    switch (frame.typeNibble()) {
+    case 2: // CONNACK
+      if (frame.size < 4 || frame.data[3] != 0)
+        fail();
+      break;
+    case 9: // SUBACK
+      if (!ready_) {
+        ready_ = true;
+        run_.ready.fetch_add(1, std::memory_order_relaxed);
+      }
+      break;
+    case 3: { // PUBLISH, QoS 0
+      uint32_t remaining = 0;
+      size_t lengthBytes =
+          mitmqtt::decodeRemainingLength(frame.data + 1, frame.size - 1,
+                                         remaining);
+      size_t offset = 1 + lengthBytes;
+      if (lengthBytes == 0 || offset + 2 > frame.size)
+        break;
+      size_t topicLength = (frame.data[offset] << 8) | frame.data[offset + 1];
+      offset += 2 + topicLength;
+      if (offset + sizeof(int64_t) > frame.size)
+        break;
+      int64_t sentAt = 0;
+      std::memcpy(&sentAt, frame.data + offset, sizeof(sentAt));
+      latencies_.push_back(static_cast<double>(nowNanos() - sentAt) / 1000.0);
+      run_.received.fetch_add(1, std::memory_order_relaxed);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  void fail() {
+    if (failed_)
+      return;
+    failed_ = true;
+    run_.failed.fetch_add(1, std::memory_order_relaxed);
+    publishing_ = false;
+    timer_.cancel();
+    boost::system::error_code ec;
+    socket_.close(ec);
+  }
+
+  static constexpr size_t kMaxOutbox = 1 << 20;
+
+  tcp::socket socket_;
+  asio::steady_timer timer_;
+  Run &run_;
+  std::string topic_;
+  std::string clientId_;
+
+  mitmqtt::MQTTFramer framer_;
+  std::vector<uint8_t> outbox_;
+  std::vector<uint8_t> inflight_;
+  bool writing_ = false;
+
+  bool ready_ = false;
+  bool failed_ = false;
+  bool publishing_ = false;
+  Clock::duration interval_{};
+  std::string payload_;
+
+  std::vector<double> latencies_;
+};
+
+struct Report {
+  std::string name;
+  size_t clients = 0;
+  size_t ready = 0;
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  uint64_t skipped = 0;
+  double seconds = 0;
+  size_t payloadSize = 0;
+  mitmqtt::bench::LatencySummary latency;
+};
+
+bool resolve(const std::string &target, tcp::endpoint &endpoint) {
+  size_t colon = target.rfind(':');
+  if (colon == std::string::npos) {
+    std::fprintf(stderr, "expected HOST:PORT, got %s\n", target.c_str());
+    return false;
+  }
+  try {
+    asio::io_context ioc;
+    tcp::resolver resolver(ioc);
+    auto results =
+        resolver.resolve(target.substr(0, colon), target.substr(colon + 1));
+    endpoint = *results.begin();
+    return true;
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "cannot resolve %s: %s\n", target.c_str(), e.what());
+    return false;
+  }
+}
+
+bool runLoad(const std::string &name, const tcp::endpoint &endpoint,
+             const Options &options, Report &report) {
+  std::random_device seed;
+  std::mt19937_64 random(seed());
+
+  Run run;
+  run.topicPrefix =
+      "mitmqtt/loadgen/" + std::to_string(random() % 1000000) + "/";
+  mitmqtt::IOContextPool pool(options.threads);
+  pool.run();
+
+  std::printf("%s: connecting %zu clients to %s:%u\n", name.c_str(),
+              options.clients, endpoint.address().to_string().c_str(),
+              static_cast<unsigned>(endpoint.port()));
+  std::vector<std::shared_ptr<LoadClient>> clients;
+  clients.reserve(options.clients);
+  auto connectStart = Clock::now();
+  for (size_t i = 0; i < options.clients; ++i) {
+    clients.push_back(
+        std::make_shared<LoadClient>(pool.getIOContext(), run, i));
+    clients.back()->start(endpoint);
+
+    // Pace connection attempts so the listen backlog does not overflow
+    if (options.connectRate > 0) {
+      auto due = connectStart + std::chrono::duration_cast<Clock::duration>(
+                                    std::chrono::duration<double>(
+                                        static_cast<double>(i + 1) /
+                                        options.connectRate));
+      std::this_thread::sleep_until(due);
+    }
+  }
+
+  auto deadline = Clock::now() + std::chrono::seconds(30);
+  while (run.ready + run.failed < options.clients && Clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  std::printf("%s: %zu connected, %zu failed\n", name.c_str(),
+              run.ready.load(), run.failed.load());
+  if (run.ready == 0) {
+    pool.stop();
+    return false;
+  }
+
+  // Spread the clients' publish times evenly over one interval
+  auto interval = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(1.0 / options.rate));
+  std::uniform_int_distribution<Clock::rep> phase(0, interval.count());
+  for (auto &client : clients)
+    client->startPublishing(interval, options.size,
+                            Clock::duration(phase(random)));
+
+  auto publishStart = Clock::now();
+  std::this_thread::sleep_for(std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(options.duration)));
+  for (auto &client : clients)
+    client->stopPublishing();
+  auto publishEnd = Clock::now();
+
+  // Let messages in flight arrive
+  uint64_t sent = run.sent;
+  deadline = Clock::now() + std::chrono::seconds(2);
+  while (run.received < sent && Clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  for (auto &client : clients)
+    client->stop();
+  pool.stop();
+
+  // The I/O threads are gone, the samples can be read
+  std::vector<double> samples;
+  for (auto &client : clients) {
+    auto &latencies = client->latencies();
+    samples.insert(samples.end(), latencies.begin(), latencies.end());
+  }
+
+  report.name = name;
+  report.clients = options.clients;
+  report.ready = run.ready;
+  report.sent = run.sent;
+  report.received = run.received;
+  report.skipped = run.skipped;
+  report.seconds =
+      std::chrono::duration<double>(publishEnd - publishStart).count();
+  report.payloadSize = options.size;
+  report.latency = mitmqtt::bench::summarize(samples);
+  return true;
+}
+
+void printHeader() {
+  std::printf("\n%-8s %8s %10s %10s %8s %10s %8s %9s %9s %9s %9s\n", "target",
+              "clients", "sent", "received", "lost", "msg/s", "MB/s",
+              "p50 us", "p99 us", "p999 us", "max us");
+}
+
+void printReport(const Report &report) {
+  double messages = static_cast<double>(report.received) / report.seconds;
+  std::printf("%-8s %8zu %10llu %10llu %8llu %10.0f %8.2f %9.0f %9.0f %9.0f "
+              "%9.0f\n",
+              report.name.c_str(), report.ready,
+              static_cast<unsigned long long>(report.sent),
+              static_cast<unsigned long long>(report.received),
+              static_cast<unsigned long long>(report.sent - report.received),
+              messages, messages * report.payloadSize / 1e6,
+              report.latency.p50, report.latency.p99, report.latency.p999,
+              report.latency.max);
+  if (report.skipped > 0)
+    std::printf("%-8s %llu publishes skipped, sockets backed up\n", "",
+                static_cast<unsigned long long>(report.skipped));
+}
+
+void usage() {
+  std::printf(
+      "Usage: mitmqtt_loadgen --proxy HOST:PORT [options]\n"
+      "\n"
+      "  --proxy HOST:PORT    Proxy listener to load\n"
+      "  --broker HOST:PORT   Broker behind the proxy, for a baseline run\n"
+      "  --clients N          Concurrent clients (default 1000)\n"
+      "  --rate R             Messages per second per client (default 1)\n"
+      "  --size BYTES         Payload size, at least 8 (default 64)\n"
+      "  --duration SECONDS   Publishing time per run (default 10)\n"
+      "  --threads N          I/O threads, 0 for one per core\n"
+      "  --connect-rate N     New connections per second (default 2000)\n"
+      "\n"
+      "Every client subscribes to its own topic, so the broker must route\n"
+      "each message back. Thousands of clients need a matching file\n"
+      "descriptor limit (ulimit -n).\n");
+}
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--proxy" && hasValue) {
+      options.proxy = argv[++i];
+    } else if (arg == "--broker" && hasValue) {
+      options.broker = argv[++i];
+    } else if (arg == "--clients" && hasValue) {
+      options.clients = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--rate" && hasValue) {
+      options.rate = std::atof(argv[++i]);
+    } else if (arg == "--size" && hasValue) {
+      options.size = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--duration" && hasValue) {
+      options.duration = std::atof(argv[++i]);
+    } else if (arg == "--threads" && hasValue) {
+      options.threads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--connect-rate" && hasValue) {
+      options.connectRate = std::strtoul(argv[++i], nullptr, 10);
+    } else {
+      usage();
+      return arg == "--help" || arg == "-h" ? 0 : 2;
+    }
+  }
+  if (options.proxy.empty() || options.clients == 0 || options.rate <= 0 ||
+      options.duration <= 0) {
+    usage();
+    return 2;
+  }
+  options.size = std::max(options.size, sizeof(int64_t));
+
+  tcp::endpoint proxy, broker;
+  if (!resolve(options.proxy, proxy) ||
+      (!options.broker.empty() && !resolve(options.broker, broker)))
+    return 1;
+
+  Report baseline, proxied;
+  bool haveBaseline = false;
+  if (!options.broker.empty()) {
+    haveBaseline = runLoad("broker", broker, options, baseline);
+    if (!haveBaseline)
+      return 1;
+  }
+  if (!runLoad("proxy", proxy, options, proxied))
+    return 1;
+
+  printHeader();
+  if (haveBaseline)
+    printReport(baseline);
+  printReport(proxied);
+  if (haveBaseline) {
+    std::printf("\nadded latency: p50 %+.0f us, p99 %+.0f us, "
+                "p999 %+.0f us\n",
+                proxied.latency.p50 - baseline.latency.p50,
+                proxied.latency.p99 - baseline.latency.p99,
+                proxied.latency.p999 - baseline.latency.p999);
+  }
+  return 0;
+}
@@ -0,0 +1,332 @@
+#include "broker_pool.hpp"
+#include "../utils/logger.hpp"
+#include <algorithm>
+
+namespace mitmqtt {
+
+namespace {
+// Points per broker on the hash ring; more spread clients more evenly
+constexpr size_t kRingPoints = 160;
+
+// How long a broker that refused a connect is passed over
+constexpr std::chrono::milliseconds kDownAfterFailure(10000);
+
+// Health check connects give up after this long, or the interval if shorter
+constexpr std::chrono::milliseconds kProbeTimeout(5000);
+
+int64_t nowTicks() {
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+// FNV-1a, then a splitmix64 finalizer so that similar keys land far apart
+uint64_t hashKey(const std::string &key) {
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : key) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebull;
+  hash ^= hash >> 31;
+  return hash;
+}
+}
+
+const char *brokerBalanceName(BrokerBalance balance) {
+  switch (balance) {
+  case BrokerBalance::RoundRobin:
+    return "round-robin";
+  case BrokerBalance::LeastConnections:
+    return "least-connections";
+  case BrokerBalance::ClientHash:
+    return "client-hash";
+  }
+  return "unknown";
+}
+
+bool parseBrokerBalance(const std::string &name, BrokerBalance &balance) {
+  for (BrokerBalance candidate :
+       {BrokerBalance::RoundRobin, BrokerBalance::LeastConnections,
+        BrokerBalance::ClientHash}) {
+    if (name == brokerBalanceName(candidate)) {
+      balance = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+BrokerPool::Upstream::Upstream(BrokerAddress address)
+    : address_(std::move(address)),
+      name_(address_.host + ":" + std::to_string(address_.port)) {}
+
+bool BrokerPool::Upstream::up() const {
+  return downUntil_.load(std::memory_order_relaxed) <= nowTicks();
+}
+
+BrokerPool::Lease::Lease(UpstreamPtr upstream)
+    : upstream_(std::move(upstream)) {
+  if (upstream_)
+    upstream_->connections_.fetch_add(1, std::memory_order_relaxed);
+}
+
+BrokerPool::Lease &BrokerPool::Lease::operator=(Lease &&other) noexcept {
+  if (this != &other) {
+    release();
+    upstream_ = std::move(other.upstream_);
+  }
+  return *this;
+}
+
+void BrokerPool::Lease::release() {
+  if (upstream_) {
+    upstream_->connections_.fetch_sub(1, std::memory_order_relaxed);
+    upstream_.reset();
+  }
+}
+
+// Probes every broker each interval. Holds no reference to the pool; the
+// pool's brokers are read under `mutex` until stop() has run. Shares the DNS
+// cache, which pending probes may use after the pool and handler are gone.
+struct BrokerPool::HealthCheck
+    : std::enable_shared_from_this<BrokerPool::HealthCheck> {
+  HealthCheck(const boost::asio::any_io_executor &executor,
+              std::shared_ptr<DNSCache> dns,
+              std::chrono::milliseconds interval, BrokerPool &pool)
+      : executor(executor), timer(executor), dns(std::move(dns)),
+        interval(interval), pool(&pool) {}
+
+  void schedule() {
+    auto self = shared_from_this();
+    timer.expires_after(interval);
+    timer.async_wait([self](boost::system::error_code ec) {
+      if (!ec)
+        self->probeAll();
+    });
+  }
+
+  void probeAll() {
+    std::vector<UpstreamPtr> upstreams;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!pool)
+        return;
+      upstreams = pool->upstreams();
+    }
+    for (const auto &upstream : upstreams)
+      probe(upstream);
+    schedule();
+  }
+
+  void probe(const UpstreamPtr &upstream) {
+    auto self = shared_from_this();
+    dns->asyncResolve(
+        executor, upstream->host(), upstream->port(),
+        [self, upstream](boost::system::error_code ec,
+                         const DNSCache::Endpoints &endpoints) {
+          if (ec) {
+            self->report(*upstream, false);
+            return;
+          }
+
+          auto socket =
+              std::make_shared<boost::asio::ip::tcp::socket>(self->executor);
+          auto deadline = std::make_shared<boost::asio::steady_timer>(
+              self->executor, std::min(self->interval, kProbeTimeout));
+          deadline->async_wait([socket](boost::system::error_code ec) {
+            if (!ec)
+              socket->close(ec);
+          });
+          boost::asio::async_connect(
+              *socket, endpoints,
+              [self, upstream, socket,
+               deadline](boost::system::error_code ec,
+                         const boost::asio::ip::tcp::endpoint &) {
+                deadline->cancel();
+                boost::system::error_code ignored;
+                socket->close(ignored);
+                self->report(*upstream, !ec);
+              });
+        });
+  }
+
+  void report(Upstream &upstream, bool reachable) {
+    bool wasUp = upstream.up();
+    if (reachable) {
+      upstream.downUntil_ = 0;
+      if (!wasUp)
+        MITMQTT_LOG_INFO("Broker " << upstream.name() << " is up");
+      return;
+    }
+    // Down until a later check or connect succeeds
+    markDown(upstream, interval * 2);
+    if (wasUp)
+      MITMQTT_LOG_WARN("Broker " << upstream.name()
+                       << " failed its health check");
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pool = nullptr;
+    }
+    auto self = shared_from_this();
+    boost::asio::post(executor, [self]() { self->timer.cancel(); });
+  }
+
+  boost::asio::any_io_executor executor;
+  boost::asio::steady_timer timer; // Used only on `executor`
+  std::shared_ptr<DNSCache> dns;
+  std::chrono::milliseconds interval;
+
+  std::mutex mutex;
+  BrokerPool *pool; // Null once stopped
+};
+
+BrokerPool::BrokerPool()
+    : config_(std::make_shared<Config>()), nextRoundRobin_(0) {}
+
+BrokerPool::~BrokerPool() { stopHealthChecks(); }
+
+void BrokerPool::configure(std::vector<BrokerAddress> brokers,
+                           BrokerBalance balance) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto config = std::make_shared<Config>();
+  config->balance = balance;
+  for (auto &address : brokers) {
+    auto upstream = std::make_shared<Upstream>(std::move(address));
+    for (const auto &old : config_->upstreams) {
+      if (old->name() == upstream->name()) {
+        upstream = old;
+        break;
+      }
+    }
+    config->upstreams.push_back(std::move(upstream));
+  }
+
+  // A broker's points depend only on its name, so adding or removing one
+  // moves only the clients that hash next to its points
+  for (size_t i = 0; i < config->upstreams.size(); ++i) {
+    const std::string &name = config->upstreams[i]->name();
+    for (size_t point = 0; point < kRingPoints; ++point)
+      config->ring.emplace_back(hashKey(name + "#" + std::to_string(point)),
+                                i);
+  }
+  std::sort(config->ring.begin(), config->ring.end());
+  config_ = std::move(config);
+}
+
+std::shared_ptr<const BrokerPool::Config> BrokerPool::config() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return config_;
+}
+
+std::vector<BrokerPool::UpstreamPtr> BrokerPool::upstreams() const {
+  return config()->upstreams;
+}
+
+BrokerBalance BrokerPool::balance() const { return config()->balance; }
+
+BrokerPool::Lease BrokerPool::select(const std::string &clientId,
+                                     const std::vector<UpstreamPtr> &tried) {
+  auto current = config();
+  ptrdiff_t index = pick(*current, clientId, tried);
+  if (index < 0)
+    return Lease();
+  return Lease(current->upstreams[index]);
+}
+
+ptrdiff_t BrokerPool::pick(const Config &config, const std::string &clientId,
+                           const std::vector<UpstreamPtr> &tried) {
+  size_t count = config.upstreams.size();
+  if (count == 0)
+    return -1;
+
+  // The first untried broker in order of preference that is up, else the
+  // first untried one at all
+  ptrdiff_t fallback = -1;
+  auto usable = [&](size_t i) {
+    const UpstreamPtr &upstream = config.upstreams[i];
+    if (std::find(tried.begin(), tried.end(), upstream) != tried.end())
+      return false;
+    if (upstream->up())
+      return true;
+    if (fallback < 0)
+      fallback = static_cast<ptrdiff_t>(i);
+    return false;
+  };
+
+  if (config.balance == BrokerBalance::ClientHash && !clientId.empty()) {
+    // Clockwise from the client's point on the ring
+    auto start = std::lower_bound(config.ring.begin(), config.ring.end(),
+                                  std::make_pair(hashKey(clientId), size_t(0)));
+    size_t offset = static_cast<size_t>(start - config.ring.begin());
+    for (size_t k = 0; k < config.ring.size(); ++k) {
+      size_t i = config.ring[(offset + k) % config.ring.size()].second;
+      if (usable(i))
+        return static_cast<ptrdiff_t>(i);
+    }
+    return fallback;
+  }
+
+  // Ties, and every choice under RoundRobin, rotate through the brokers
+  size_t start = nextRoundRobin_.fetch_add(1, std::memory_order_relaxed);
+  ptrdiff_t best = -1;
+  for (size_t k = 0; k < count; ++k) {
+    size_t i = (start + k) % count;
+    if (!usable(i))
+      continue;
+    if (config.balance != BrokerBalance::LeastConnections)
+      return static_cast<ptrdiff_t>(i);
+    if (best < 0 || config.upstreams[i]->connections() <
+                        config.upstreams[best]->connections())
+      best = static_cast<ptrdiff_t>(i);
+  }
+  return best >= 0 ? best : fallback;
+}
+
+void BrokerPool::markDown(Upstream &upstream, std::chrono::milliseconds time) {
+  upstream.downUntil_ =
+      nowTicks() +
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(time)
+          .count();
+  upstream.failures_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BrokerPool::reportSuccess(const UpstreamPtr &upstream) {
+  upstream->downUntil_ = 0;
+}
+
+void BrokerPool::reportFailure(const UpstreamPtr &upstream) {
+  markDown(*upstream, kDownAfterFailure);
+}
+
+void BrokerPool::startHealthChecks(const boost::asio::any_io_executor &executor,
+                                   std::shared_ptr<DNSCache> dns,
+                                   std::chrono::milliseconds interval) {
+  stopHealthChecks();
+  if (interval.count() <= 0)
+    return;
+
+  auto check = std::make_shared<HealthCheck>(executor, std::move(dns),
+                                             interval, *this);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    healthCheck_ = check;
+  }
+  boost::asio::post(executor, [check]() { check->probeAll(); });
+}
+
+void BrokerPool::stopHealthChecks() {
+  std::shared_ptr<HealthCheck> check;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    check.swap(healthCheck_);
+  }
+  if (check)
+    check->stop();
+}
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "dns_cache.hpp"
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mitmqtt {
+
+// How a BrokerPool picks the broker for a new client
+enum class BrokerBalance {
+  RoundRobin,
+  LeastConnections, // Fewest proxied connections open or connecting
+  ClientHash        // Consistent hash of the client id
+};
+
+const char *brokerBalanceName(BrokerBalance balance);
+// "round-robin", "least-connections" or "client-hash"
+bool parseBrokerBalance(const std::string &name, BrokerBalance &balance);
+
+struct BrokerAddress {
+  std::string host;
+  uint16_t port = 1883;
+};
+
+// The upstream brokers a proxy spreads its clients over.
+//
+// select() picks one when a client's CONNECT arrives; if connecting to it
+// fails the connection reports it and selects again, skipping the brokers
+// it has tried. A broker that failed a connect or a health check is passed
+// over for a while, unless every broker left to try is down. ClientHash
+// keeps a client on the same broker as long as that broker is up, and a
+// broker going down moves only its own clients. Clients without an id are
+// spread round robin. Safe to use from any thread.
+class BrokerPool {
+public:
+  class Upstream {
+  public:
+    explicit Upstream(BrokerAddress address);
+
+    const std::string &host() const { return address_.host; }
+    uint16_t port() const { return address_.port; }
+    // host:port
+    const std::string &name() const { return name_; }
+
+    bool up() const;
+    size_t connections() const {
+      return connections_.load(std::memory_order_relaxed);
+    }
+    // Failed connects and health checks
+    uint64_t failures() const {
+      return failures_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    friend class BrokerPool;
+
+    BrokerAddress address_;
+    std::string name_;
+    std::atomic<int64_t> downUntil_{0}; // Raw steady_clock ticks
+    std::atomic<size_t> connections_{0};
+    std::atomic<uint64_t> failures_{0};
+  };
+  using UpstreamPtr = std::shared_ptr<Upstream>;
+
+  // A connection's claim on the broker it uses, counted by
+  // LeastConnections until it is released or destroyed
+  class Lease {
+  public:
+    Lease() = default;
+    explicit Lease(UpstreamPtr upstream);
+    Lease(Lease &&other) noexcept : upstream_(std::move(other.upstream_)) {}
+    Lease &operator=(Lease &&other) noexcept;
+    ~Lease() { release(); }
+
+    void release();
+    const UpstreamPtr &get() const { return upstream_; }
+    explicit operator bool() const { return upstream_ != nullptr; }
+
+  private:
+    UpstreamPtr upstream_;
+  };
+
+  BrokerPool();
+  ~BrokerPool();
+
+  BrokerPool(const BrokerPool &) = delete;
+  BrokerPool &operator=(const BrokerPool &) = delete;
+
+  // Replace the brokers. Those that stay keep their health and counts;
+  // connections to the others are left alone.
+  void configure(std::vector<BrokerAddress> brokers, BrokerBalance balance);
+  std::vector<UpstreamPtr> upstreams() const;
+  BrokerBalance balance() const;
+
+  // The broker for `clientId`, other than those in `tried`. Empty once
+  // every broker has been tried.
+  Lease select(const std::string &clientId,
+               const std::vector<UpstreamPtr> &tried);
+
+  // How connecting to `upstream` went. A failure marks it down for a while.
+  void reportSuccess(const UpstreamPtr &upstream);
+  void reportFailure(const UpstreamPtr &upstream);
+
+  // Try a TCP connect to every broker each `interval`, on `executor`, and
+  // mark them up or down by the result. Probes in flight keep `dns` alive.
+  void startHealthChecks(const boost::asio::any_io_executor &executor,
+                         std::shared_ptr<DNSCache> dns,
+                         std::chrono::milliseconds interval);
+  void stopHealthChecks();
+
+private:
+  struct Config {
+    std::vector<UpstreamPtr> upstreams;
+    // Points of the hash ring and the upstream each belongs to, sorted
+    std::vector<std::pair<uint64_t, size_t>> ring;
+    BrokerBalance balance = BrokerBalance::RoundRobin;
+  };
+  struct HealthCheck;
+
+  static void markDown(Upstream &upstream, std::chrono::milliseconds time);
+
+  std::shared_ptr<const Config> config() const;
+  // Index of the upstream to use, or -1. Prefers brokers that are up.
+  ptrdiff_t pick(const Config &config, const std::string &clientId,
+                 const std::vector<UpstreamPtr> &tried);
+
+  mutable std::mutex mutex_;
+  std::shared_ptr<const Config> config_;
+  std::atomic<size_t> nextRoundRobin_;
+  std::shared_ptr<HealthCheck> healthCheck_;
+};
+
+}
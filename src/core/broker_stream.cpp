@@ -0,0 +1,30 @@
+#include "broker_stream.hpp"
+#include <openssl/ssl.h>
+
+namespace mitmqtt {
+
+void BrokerStream::startTLS(boost::asio::ssl::context &ctx,
+                            const std::string &host, TLSSessionCache *cache,
+                            const std::string &sessionKey) {
+  tls_ = std::make_unique<TLSStream>(std::move(socket_), ctx);
+  SSL *ssl = tls_->native_handle();
+
+  // SNI must be a host name
+  boost::system::error_code parseError;
+  boost::asio::ip::make_address(host, parseError);
+  if (parseError)
+    SSL_set_tlsext_host_name(ssl, host.c_str());
+
+  if (cache)
+    cache->prepare(ssl, sessionKey);
+}
+
+bool BrokerStream::resumed() const {
+  return tls_ && SSL_session_reused(tls_->native_handle()) == 1;
+}
+
+void BrokerStream::close(boost::system::error_code &ec) {
+  socket().close(ec);
+}
+
+}
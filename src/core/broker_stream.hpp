@@ -0,0 +1,84 @@
+#pragma once
+
+#include "tls_session_cache.hpp"
+#include "websocket_codec.hpp"
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace mitmqtt {
+
+// The proxy's connection to the broker: plain TCP, or TLS once startTLS()
+// has wrapped the connected socket.
+//
+// Reads and writes go to whichever layer is active, so the connection code
+// drives both with the same async_read_some() and async_write() calls.
+// socket() is always the TCP socket underneath, for connecting, closing and
+// endpoint queries. With WebSocket enabled the stream still carries raw
+// bytes; the connection frames and unframes them with webSocket().
+class BrokerStream {
+public:
+  using executor_type = boost::asio::ip::tcp::socket::executor_type;
+  using TLSStream = boost::asio::ssl::stream<boost::asio::ip::tcp::socket>;
+
+  explicit BrokerStream(const executor_type &executor) : socket_(executor) {}
+
+  boost::asio::ip::tcp::socket &socket() {
+    return tls_ ? tls_->next_layer() : socket_;
+  }
+  const boost::asio::ip::tcp::socket &socket() const {
+    return tls_ ? tls_->next_layer() : socket_;
+  }
+  executor_type get_executor() { return socket().get_executor(); }
+
+  // Wrap the connected socket in TLS towards `host`, which is also sent as
+  // SNI unless it is an address. With a cache, a session cached under
+  // `sessionKey` is offered and the broker's new sessions are kept there.
+  void startTLS(boost::asio::ssl::context &ctx, const std::string &host,
+                TLSSessionCache *cache, const std::string &sessionKey);
+
+  bool secure() const { return tls_ != nullptr; }
+
+  // After the handshake: whether it resumed a cached session
+  bool resumed() const;
+
+  // Carry MQTT in WebSocket frames, once the upgrade is done. Enable before
+  // anything is queued for the broker, the frames are encoded when queued.
+  void enableWebSocket() {
+    ws_ = std::make_unique<WebSocketCodec>(WebSocketCodec::Role::Client);
+  }
+  WebSocketCodec *webSocket() { return ws_.get(); }
+
+  template <typename Handler> void async_handshake(Handler &&handler) {
+    tls_->async_handshake(boost::asio::ssl::stream_base::client,
+                          std::forward<Handler>(handler));
+  }
+
+  template <typename Buffers, typename Handler>
+  void async_read_some(const Buffers &buffers, Handler &&handler) {
+    if (tls_)
+      tls_->async_read_some(buffers, std::forward<Handler>(handler));
+    else
+      socket_.async_read_some(buffers, std::forward<Handler>(handler));
+  }
+
+  template <typename Buffers, typename Handler>
+  void async_write_some(const Buffers &buffers, Handler &&handler) {
+    if (tls_)
+      tls_->async_write_some(buffers, std::forward<Handler>(handler));
+    else
+      socket_.async_write_some(buffers, std::forward<Handler>(handler));
+  }
+
+  // Close without a TLS close_notify, the proxy is going away either way
+  void close(boost::system::error_code &ec);
+
+private:
+  boost::asio::ip::tcp::socket socket_;
+  std::unique_ptr<TLSStream> tls_; // Owns the socket once set
+  std::unique_ptr<WebSocketCodec> ws_;
+};
+
+}
@@ -0,0 +1,392 @@
+#include "capture_file.hpp"
+#include "../utils/logger.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace mitmqtt {
+
+namespace {
+// pcapng block types and options
+constexpr uint32_t kSectionHeaderBlock = 0x0A0D0D0A;
+constexpr uint32_t kInterfaceBlock = 0x00000001;
+constexpr uint32_t kEnhancedPacketBlock = 0x00000006;
+constexpr uint32_t kByteOrderMagic = 0x1A2B3C4D;
+constexpr uint16_t kOptEndOfOpt = 0;
+constexpr uint16_t kOptComment = 1;
+constexpr uint16_t kOptEpbFlags = 2;
+constexpr uint16_t kOptIfTsResol = 9;
+
+// Each packet is a Wireshark exported PDU naming the dissector to use
+constexpr uint16_t kLinkTypeUpperPDU = 252;
+constexpr uint16_t kExpPduTagEnd = 0;
+constexpr uint16_t kExpPduTagProtoName = 12;
+constexpr char kProtoName[] = "mqtt";
+
+// epb_flags direction bits
+constexpr uint32_t kFlagInbound = 1;
+constexpr uint32_t kFlagOutbound = 2;
+
+constexpr char kCommentPrefix[] = "connection ";
+
+size_t pad4(size_t n) { return (n + 3) & ~size_t(3); }
+
+// Blocks are written in host byte order, which the section header's magic
+// records for readers
+void put32(uint8_t *out, uint32_t value) { std::memcpy(out, &value, 4); }
+void put16(uint8_t *out, uint16_t value) { std::memcpy(out, &value, 2); }
+void putBE16(uint8_t *out, uint16_t value) {
+  out[0] = static_cast<uint8_t>(value >> 8);
+  out[1] = static_cast<uint8_t>(value);
+}
+
+uint32_t get32(const uint8_t *in) {
+  uint32_t value;
+  std::memcpy(&value, in, 4);
+  return value;
+}
+uint16_t get16(const uint8_t *in) {
+  uint16_t value;
+  std::memcpy(&value, in, 2);
+  return value;
+}
+uint16_t getBE16(const uint8_t *in) {
+  return static_cast<uint16_t>((in[0] << 8) | in[1]);
+}
+
+// Exported PDU tags: protocol name, padded to 4 bytes, then end of tags
+constexpr size_t kPduHeaderSize = 4 + 4 + 4;
+
+void putPduHeader(uint8_t *out) {
+  putBE16(out, kExpPduTagProtoName);
+  putBE16(out + 2, 4);
+  std::memcpy(out + 4, kProtoName, 4);
+  putBE16(out + 8, kExpPduTagEnd);
+  putBE16(out + 10, 0);
+}
+
+std::vector<uint8_t> fileHeader() {
+  std::vector<uint8_t> out(28 + 32);
+
+  // Section header, length of the section unspecified
+  uint8_t *shb = out.data();
+  put32(shb, kSectionHeaderBlock);
+  put32(shb + 4, 28);
+  put32(shb + 8, kByteOrderMagic);
+  put16(shb + 12, 1);
+  put16(shb + 14, 0);
+  std::memset(shb + 16, 0xFF, 8);
+  put32(shb + 24, 28);
+
+  // One interface with nanosecond timestamps
+  uint8_t *idb = shb + 28;
+  put32(idb, kInterfaceBlock);
+  put32(idb + 4, 32);
+  put16(idb + 8, kLinkTypeUpperPDU);
+  put16(idb + 10, 0);
+  put32(idb + 12, 0); // No snap length
+  put16(idb + 16, kOptIfTsResol);
+  put16(idb + 18, 1);
+  idb[20] = 9; // 10^-9, then padding
+  std::memset(idb + 21, 0, 3);
+  put16(idb + 24, kOptEndOfOpt);
+  put16(idb + 26, 0);
+  put32(idb + 28, 32);
+  return out;
+}
+}
+
+// CaptureWriter implementation
+CaptureWriter::CaptureWriter(size_t rotateBytes, size_t batchBytes)
+    : rotateBytes_(rotateBytes), batchBytes_(batchBytes),
+      maxPendingBytes_(batchBytes * 4), active_(false), stopping_(false),
+      fileBytes_(0), fileIndex_(0), packets_(0), bytesWritten_(0),
+      dropped_(0) {}
+
+CaptureWriter::~CaptureWriter() { stop(); }
+
+bool CaptureWriter::start(const std::string &pathPrefix) {
+  if (active_ || writer_.joinable())
+    return false;
+
+  prefix_ = pathPrefix;
+  fileIndex_ = 0;
+  packets_ = 0;
+  bytesWritten_ = 0;
+  dropped_ = 0;
+  if (!openNextFile())
+    return false;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.clear();
+    pending_.reserve(batchBytes_ + batchBytes_ / 4);
+    stopping_ = false;
+  }
+  batch_.reserve(pending_.capacity());
+  active_ = true;
+  writer_ = std::thread([this]() { run(); });
+  return true;
+}
+
+void CaptureWriter::stop() {
+  if (!writer_.joinable())
+    return;
+
+  active_ = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_one();
+  writer_.join();
+  file_.close();
+}
+
+void CaptureWriter::write(uint64_t connectionId, PacketDirection direction,
+                          const uint8_t *data, size_t size) {
+  if (!isActive() || size == 0)
+    return;
+
+  auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  char comment[32];
+  int commentLen =
+      std::snprintf(comment, sizeof(comment), "%s%llu", kCommentPrefix,
+                    static_cast<unsigned long long>(connectionId));
+
+  // Block header, packet with exported PDU header, options, trailing length
+  size_t captured = kPduHeaderSize + size;
+  size_t blockLen = 28 + pad4(captured) + 8 + 4 + pad4(commentLen) + 4 + 4;
+  if (captured > UINT32_MAX)
+    return;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (stopping_)
+    return;
+  if (pending_.size() + blockLen > maxPendingBytes_) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  size_t before = pending_.size();
+  pending_.resize(before + blockLen);
+  uint8_t *out = pending_.data() + before;
+
+  put32(out, kEnhancedPacketBlock);
+  put32(out + 4, static_cast<uint32_t>(blockLen));
+  put32(out + 8, 0); // Interface
+  put32(out + 12, static_cast<uint32_t>(static_cast<uint64_t>(now) >> 32));
+  put32(out + 16, static_cast<uint32_t>(now));
+  put32(out + 20, static_cast<uint32_t>(captured));
+  put32(out + 24, static_cast<uint32_t>(captured));
+  putPduHeader(out + 28);
+  std::memcpy(out + 28 + kPduHeaderSize, data, size);
+  size_t pos = 28 + captured;
+  std::memset(out + pos, 0, pad4(captured) - captured);
+  pos = 28 + pad4(captured);
+
+  put16(out + pos, kOptEpbFlags);
+  put16(out + pos + 2, 4);
+  put32(out + pos + 4, direction == PacketDirection::ClientToBroker
+                           ? kFlagInbound
+                           : kFlagOutbound);
+  pos += 8;
+
+  put16(out + pos, kOptComment);
+  put16(out + pos + 2, static_cast<uint16_t>(commentLen));
+  std::memset(out + pos + 4, 0, pad4(commentLen));
+  std::memcpy(out + pos + 4, comment, commentLen);
+  pos += 4 + pad4(commentLen);
+
+  put16(out + pos, kOptEndOfOpt);
+  put16(out + pos + 2, 0);
+  put32(out + pos + 4, static_cast<uint32_t>(blockLen));
+
+  packets_.fetch_add(1, std::memory_order_relaxed);
+  bool batchFull = before < batchBytes_ && pending_.size() >= batchBytes_;
+  lock.unlock();
+
+  if (batchFull)
+    wake_.notify_one();
+}
+
+void CaptureWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    // Flush at least every 100ms so a quiet capture is still current on disk
+    wake_.wait_for(lock, std::chrono::milliseconds(100), [this]() {
+      return stopping_ || pending_.size() >= batchBytes_;
+    });
+    bool stopping = stopping_;
+    pending_.swap(batch_);
+    lock.unlock();
+
+    if (!batch_.empty())
+      writeBatch(batch_);
+    batch_.clear();
+
+    if (stopping)
+      break;
+    lock.lock();
+  }
+}
+
+void CaptureWriter::writeBatch(const std::vector<uint8_t> &batch) {
+  if (fileBytes_ >= rotateBytes_ && !openNextFile())
+    return;
+
+  if (!file_.write(reinterpret_cast<const char *>(batch.data()),
+                   static_cast<std::streamsize>(batch.size()))) {
+    MITMQTT_LOG_ERROR("Failed to write capture file " << getCurrentFile());
+    return;
+  }
+  file_.flush();
+  fileBytes_ += batch.size();
+  bytesWritten_.fetch_add(batch.size(), std::memory_order_relaxed);
+}
+
+bool CaptureWriter::openNextFile() {
+  if (file_.is_open())
+    file_.close();
+
+  char suffix[16];
+  std::snprintf(suffix, sizeof(suffix), "-%04u.pcapng",
+                static_cast<unsigned>(fileIndex_ + 1));
+  std::string path = prefix_ + suffix;
+
+  file_.open(path, std::ios::binary | std::ios::trunc);
+  if (!file_.is_open()) {
+    MITMQTT_LOG_ERROR("Failed to open capture file " << path);
+    return false;
+  }
+
+  std::vector<uint8_t> header = fileHeader();
+  file_.write(reinterpret_cast<const char *>(header.data()),
+              static_cast<std::streamsize>(header.size()));
+  fileBytes_ = header.size();
+  bytesWritten_.fetch_add(header.size(), std::memory_order_relaxed);
+  ++fileIndex_;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    currentFile_ = path;
+  }
+  MITMQTT_LOG_INFO("Capturing to " << path);
+  return true;
+}
+
+std::string CaptureWriter::getCurrentFile() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return currentFile_;
+}
+
+// CaptureReader implementation
+CaptureReader::CaptureReader() : base_(nullptr), length_(0) {}
+
+CaptureReader::~CaptureReader() { close(); }
+
+bool CaptureReader::open(const std::string &path) {
+  close();
+  try {
+    namespace bip = boost::interprocess;
+    mapping_ = std::make_unique<bip::file_mapping>(path.c_str(),
+                                                   bip::read_only);
+    region_ = std::make_unique<bip::mapped_region>(*mapping_, bip::read_only);
+  } catch (const std::exception &e) {
+    MITMQTT_LOG_ERROR("Failed to map capture file " << path << ": "
+                      << e.what());
+    close();
+    return false;
+  }
+
+  base_ = static_cast<const uint8_t *>(region_->get_address());
+  length_ = region_->get_size();
+  if (length_ < 28 || get32(base_) != kSectionHeaderBlock ||
+      get32(base_ + 8) != kByteOrderMagic) {
+    MITMQTT_LOG_ERROR(path << " is not a capture file");
+    close();
+    return false;
+  }
+
+  // Only block headers are touched; a truncated last block (from a capture
+  // still being written) is ignored
+  size_t offset = 0;
+  while (offset + 12 <= length_) {
+    uint32_t type = get32(base_ + offset);
+    uint32_t blockLen = get32(base_ + offset + 4);
+    if (blockLen < 12 || blockLen % 4 != 0 || blockLen > length_ - offset)
+      break;
+    if (type == kEnhancedPacketBlock && blockLen >= 32)
+      blocks_.push_back(offset);
+    offset += blockLen;
+  }
+  return true;
+}
+
+void CaptureReader::close() {
+  blocks_.clear();
+  region_.reset();
+  mapping_.reset();
+  base_ = nullptr;
+  length_ = 0;
+}
+
+CaptureReader::Packet CaptureReader::packet(size_t index) const {
+  Packet packet;
+  if (index >= blocks_.size())
+    return packet;
+
+  const uint8_t *block = base_ + blocks_[index];
+  uint32_t blockLen = get32(block + 4);
+  uint32_t captured = get32(block + 20);
+  if (28 + pad4(captured) + 4 > blockLen)
+    return packet;
+  packet.timestampNs =
+      (static_cast<uint64_t>(get32(block + 12)) << 32) | get32(block + 16);
+
+  // Skip the exported PDU tags in front of the MQTT bytes
+  const uint8_t *data = block + 28;
+  size_t pos = 0;
+  while (pos + 4 <= captured) {
+    uint16_t tag = getBE16(data + pos);
+    uint16_t tagLen = getBE16(data + pos + 2);
+    pos += 4 + tagLen;
+    if (tag == kExpPduTagEnd)
+      break;
+  }
+  if (pos > captured)
+    return packet;
+  packet.data = data + pos;
+  packet.size = captured - pos;
+
+  // Options up to the trailing block length
+  const uint8_t *options = block + 28 + pad4(captured);
+  const uint8_t *end = block + blockLen - 4;
+  while (options + 4 <= end) {
+    uint16_t code = get16(options);
+    uint16_t optLen = get16(options + 2);
+    if (code == kOptEndOfOpt || options + 4 + optLen > end)
+      break;
+    const uint8_t *value = options + 4;
+    if (code == kOptEpbFlags && optLen == 4) {
+      packet.direction = (get32(value) & 3) == kFlagOutbound
+                             ? PacketDirection::BrokerToClient
+                             : PacketDirection::ClientToBroker;
+    } else if (code == kOptComment &&
+               optLen > sizeof(kCommentPrefix) - 1 &&
+               std::memcmp(value, kCommentPrefix,
+                           sizeof(kCommentPrefix) - 1) == 0) {
+      std::string digits(
+          reinterpret_cast<const char *>(value) + sizeof(kCommentPrefix) - 1,
+          optLen - (sizeof(kCommentPrefix) - 1));
+      packet.connectionId = std::strtoull(digits.c_str(), nullptr, 10);
+    }
+    options += 4 + pad4(optLen);
+  }
+  return packet;
+}
+
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "mqtt_types.hpp"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mitmqtt {
+
+// Continuous capture of raw MQTT packets to pcapng files.
+//
+// Each packet becomes an Enhanced Packet Block carrying the raw frame
+// wrapped in a Wireshark "exported PDU" header tagged as mqtt, a nanosecond
+// wall-clock timestamp, the direction in epb_flags and the connection id in
+// a comment, so captures open directly in Wireshark's MQTT dissector.
+//
+// I/O threads encode blocks straight into a shared batch buffer; a
+// background thread swaps the buffer out and writes it in one sequential
+// write. Files are named <prefix>-NNNN.pcapng and a new one is started once
+// the current one passes the rotation size. When the disk falls behind by
+// more than a few batches, packets are dropped and counted.
+class CaptureWriter {
+public:
+  static constexpr size_t kDefaultRotateBytes = 256 * 1024 * 1024;
+  static constexpr size_t kDefaultBatchBytes = 4 * 1024 * 1024;
+
+  explicit CaptureWriter(size_t rotateBytes = kDefaultRotateBytes,
+                         size_t batchBytes = kDefaultBatchBytes);
+  ~CaptureWriter();
+
+  CaptureWriter(const CaptureWriter &) = delete;
+  CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+  // Open the first file and start the writer thread. Returns false if the
+  // file cannot be created or a capture is already running.
+  bool start(const std::string &pathPrefix);
+
+  // Write out everything buffered and close the current file
+  void stop();
+
+  bool isActive() const { return active_.load(std::memory_order_relaxed); }
+
+  // Append one packet. Safe to call from any thread; a no-op when inactive.
+  void write(uint64_t connectionId, PacketDirection direction,
+             const uint8_t *data, size_t size);
+
+  // File currently (or last) written
+  std::string getCurrentFile() const;
+
+  // Packets accepted since start(), written out or still buffered
+  uint64_t packetsCaptured() const { return packets_; }
+  uint64_t bytesWritten() const { return bytesWritten_; }
+  uint64_t dropped() const { return dropped_; }
+  uint32_t filesWritten() const { return fileIndex_; }
+
+private:
+  void run();
+  bool openNextFile();
+  void writeBatch(const std::vector<uint8_t> &batch);
+
+  const size_t rotateBytes_;
+  const size_t batchBytes_;
+  const size_t maxPendingBytes_;
+
+  std::atomic<bool> active_;
+  std::thread writer_;
+  bool stopping_;
+
+  // Producers append to pending_ under mutex_, the writer swaps it out
+  mutable std::mutex mutex_;
+  std::condition_variable wake_;
+  std::vector<uint8_t> pending_;
+
+  // Writer thread only, except while stopped
+  std::vector<uint8_t> batch_;
+  std::ofstream file_;
+  std::string prefix_;
+  std::string currentFile_; // Guarded by mutex_
+  size_t fileBytes_;
+  std::atomic<uint32_t> fileIndex_;
+
+  std::atomic<uint64_t> packets_;
+  std::atomic<uint64_t> bytesWritten_;
+  std::atomic<uint64_t> dropped_;
+};
+
+// Memory-mapped reader for files written by CaptureWriter.
+//
+// open() maps the file and indexes its packet blocks by walking the block
+// headers only, so reopening a multi-gigabyte capture reads a few bytes per
+// packet; packet data is paged in on access.
+class CaptureReader {
+public:
+  struct Packet {
+    uint64_t timestampNs = 0; // Since the Unix epoch
+    uint64_t connectionId = 0;
+    PacketDirection direction = PacketDirection::ClientToBroker;
+    const uint8_t *data = nullptr; // Raw MQTT packet, valid while open
+    size_t size = 0;
+  };
+
+  CaptureReader();
+  ~CaptureReader();
+
+  CaptureReader(const CaptureReader &) = delete;
+  CaptureReader &operator=(const CaptureReader &) = delete;
+
+  // Returns false if the file cannot be mapped or is not a capture
+  bool open(const std::string &path);
+  void close();
+
+  size_t size() const { return blocks_.size(); }
+
+  // Decode the i-th packet block
+  Packet packet(size_t index) const;
+
+private:
+  std::unique_ptr<boost::interprocess::file_mapping> mapping_;
+  std::unique_ptr<boost::interprocess::mapped_region> region_;
+  const uint8_t *base_;
+  size_t length_;
+  std::vector<size_t> blocks_; // Offsets of Enhanced Packet Blocks
+};
+
+}
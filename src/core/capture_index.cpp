@@ -0,0 +1,276 @@
+#include "capture_index.hpp"
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace mitmqtt {
+
+namespace {
+// Index of the lowest set bit, `value` must not be zero
+int lowestBit(uint64_t value) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, value);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctzll(value);
+#endif
+}
+}
+
+void CaptureIndex::Postings::popFront() {
+  ++head;
+  if (head >= 32 && head * 2 >= rows.size()) {
+    rows.erase(rows.begin(), rows.begin() + head);
+    head = 0;
+  }
+}
+
+void CaptureIndex::add(uint64_t row, uint8_t type, PacketDirection direction,
+                       uint64_t connectionId, std::string_view topic) {
+  if (rows_.empty()) {
+    firstRow_ = row;
+  } else if (row != firstRow_ + rows_.size()) {
+    // Out of sequence, start over rather than corrupt the lists
+    clear();
+    firstRow_ = row;
+  }
+
+  Row info;
+  info.type = type & 0x0F;
+  info.direction = direction;
+  info.topic = topic.empty() ? 0 : internTopic(topic);
+  info.connectionId = connectionId;
+  rows_.push_back(info);
+
+  byType_[info.type].rows.push_back(row);
+  byDirection_[static_cast<size_t>(direction)].rows.push_back(row);
+  byConnection_[connectionId].rows.push_back(row);
+  if (info.topic != 0)
+    byTopic_[info.topic].rows.push_back(row);
+}
+
+uint32_t CaptureIndex::internTopic(std::string_view topic) {
+  auto it = topicIds_.find(std::string(topic));
+  if (it != topicIds_.end())
+    return it->second;
+
+  uint32_t id;
+  if (!freeTopicIds_.empty()) {
+    id = freeTopicIds_.back();
+    freeTopicIds_.pop_back();
+    topicNames_[id] = std::string(topic);
+  } else {
+    id = static_cast<uint32_t>(topicNames_.size());
+    topicNames_.emplace_back(topic);
+    byTopic_.emplace_back();
+  }
+  topicIds_.emplace(topicNames_[id], id);
+  return id;
+}
+
+void CaptureIndex::releaseTopic(uint32_t id) {
+  topicIds_.erase(topicNames_[id]);
+  std::string().swap(topicNames_[id]);
+  byTopic_[id] = Postings();
+  freeTopicIds_.push_back(id);
+}
+
+void CaptureIndex::setClientId(uint64_t connectionId,
+                               const std::string &clientId) {
+  clientIds_[connectionId] = clientId;
+}
+
+std::string CaptureIndex::getClientId(uint64_t connectionId) const {
+  auto it = clientIds_.find(connectionId);
+  return it != clientIds_.end() ? it->second : std::string();
+}
+
+void CaptureIndex::forgetClosedClients(
+    const std::function<bool(uint64_t)> &isOpen) {
+  for (auto it = clientIds_.begin(); it != clientIds_.end();) {
+    if (byConnection_.count(it->first) == 0 && !isOpen(it->first))
+      it = clientIds_.erase(it);
+    else
+      ++it;
+  }
+}
+
+void CaptureIndex::evictBefore(uint64_t row) {
+  while (!rows_.empty() && firstRow_ < row) {
+    const Row &info = rows_.front();
+    byType_[info.type].popFront();
+    byDirection_[static_cast<size_t>(info.direction)].popFront();
+    if (info.topic != 0) {
+      byTopic_[info.topic].popFront();
+      if (byTopic_[info.topic].empty())
+        releaseTopic(info.topic);
+    }
+
+    auto conn = byConnection_.find(info.connectionId);
+    conn->second.popFront();
+    if (conn->second.empty())
+      byConnection_.erase(conn);
+
+    rows_.pop_front();
+    ++firstRow_;
+  }
+}
+
+void CaptureIndex::clear() {
+  rows_.clear();
+  firstRow_ = 0;
+  for (auto &postings : byType_)
+    postings = Postings();
+  for (auto &postings : byDirection_)
+    postings = Postings();
+  topicNames_.assign(1, std::string());
+  byTopic_.assign(1, Postings());
+  topicIds_.clear();
+  freeTopicIds_.clear();
+  // Client ids stay until their connections close
+  byConnection_.clear();
+}
+
+std::vector<uint64_t>
+CaptureIndex::merge(const std::vector<const Postings *> &lists) const {
+  size_t total = 0;
+  for (const Postings *list : lists)
+    total += list->size();
+
+  std::vector<uint64_t> result;
+  result.reserve(total);
+
+  // Few rows: concatenate and sort
+  if (total * 16 < rows_.size()) {
+    for (const Postings *list : lists)
+      result.insert(result.end(), list->begin(), list->end());
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  // Many rows: mark them in a bitmap over the window, which comes out sorted
+  std::vector<uint64_t> bits((rows_.size() + 63) / 64, 0);
+  for (const Postings *list : lists) {
+    for (uint64_t row : *list) {
+      uint64_t bit = row - firstRow_;
+      bits[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+  }
+  for (size_t word = 0; word < bits.size(); ++word) {
+    uint64_t value = bits[word];
+    while (value != 0) {
+      int bit = lowestBit(value);
+      result.push_back(firstRow_ + word * 64 + bit);
+      value &= value - 1;
+    }
+  }
+  return result;
+}
+
+std::vector<uint64_t> CaptureIndex::query(const Filter &filter) const {
+  struct Span {
+    const uint64_t *begin;
+    const uint64_t *end;
+    size_t size() const { return static_cast<size_t>(end - begin); }
+  };
+  std::vector<Span> spans;
+  std::deque<std::vector<uint64_t>> unions; // Backing storage for spans
+
+  auto addList = [&](const Postings &list) {
+    spans.push_back(Span{list.begin(), list.end()});
+  };
+  auto addUnion = [&](const std::vector<const Postings *> &lists) {
+    if (lists.size() == 1) {
+      addList(*lists[0]);
+      return;
+    }
+    unions.push_back(merge(lists));
+    spans.push_back(Span{unions.back().data(),
+                         unions.back().data() + unions.back().size()});
+  };
+
+  if (filter.type)
+    addList(byType_[*filter.type & 0x0F]);
+  if (filter.direction)
+    addList(byDirection_[static_cast<size_t>(*filter.direction)]);
+
+  if (filter.connectionId || !filter.clientId.empty()) {
+    std::vector<const Postings *> lists;
+    for (const auto &entry : byConnection_) {
+      if (filter.connectionId && entry.first != *filter.connectionId)
+        continue;
+      if (!filter.clientId.empty() &&
+          getClientId(entry.first) != filter.clientId)
+        continue;
+      lists.push_back(&entry.second);
+    }
+    if (lists.empty())
+      return {};
+    addUnion(lists);
+  }
+
+  if (!filter.topicFilter.empty()) {
+    // Distinct topics are far fewer than packets; match each one once
+    std::vector<const Postings *> lists;
+    for (size_t id = 1; id < topicNames_.size(); ++id) {
+      if (!byTopic_[id].empty() &&
+          topicMatchesFilter(filter.topicFilter, topicNames_[id]))
+        lists.push_back(&byTopic_[id]);
+    }
+    if (lists.empty())
+      return {};
+    addUnion(lists);
+  }
+
+  std::vector<uint64_t> result;
+  if (spans.empty()) {
+    result.reserve(rows_.size());
+    for (uint64_t row = firstRow_; row < firstRow_ + rows_.size(); ++row)
+      result.push_back(row);
+    return result;
+  }
+
+  // Intersect, starting from the smallest list
+  std::sort(spans.begin(), spans.end(),
+            [](const Span &a, const Span &b) { return a.size() < b.size(); });
+  result.assign(spans[0].begin, spans[0].end);
+  for (size_t i = 1; i < spans.size() && !result.empty(); ++i) {
+    const uint64_t *cursor = spans[i].begin;
+    size_t kept = 0;
+    for (uint64_t row : result) {
+      cursor = std::lower_bound(cursor, spans[i].end, row);
+      if (cursor == spans[i].end)
+        break;
+      if (*cursor == row)
+        result[kept++] = row;
+    }
+    result.resize(kept);
+  }
+  return result;
+}
+
+bool CaptureIndex::matches(const Filter &filter, uint64_t row) const {
+  if (!contains(row))
+    return false;
+
+  const Row &info = rows_[row - firstRow_];
+  if (filter.type && info.type != (*filter.type & 0x0F))
+    return false;
+  if (filter.direction && info.direction != *filter.direction)
+    return false;
+  if (filter.connectionId && info.connectionId != *filter.connectionId)
+    return false;
+  if (!filter.clientId.empty() &&
+      getClientId(info.connectionId) != filter.clientId)
+    return false;
+  if (!filter.topicFilter.empty() &&
+      (info.topic == 0 ||
+       !topicMatchesFilter(filter.topicFilter, topicNames_[info.topic])))
+    return false;
+  return true;
+}
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "mqtt_types.hpp"
+#include "topic_trie.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace mitmqtt {
+
+// Secondary indexes over a window of captured packets.
+//
+// Packets are identified by consecutive row numbers and only ever added at
+// the back and evicted from the front, so every posting list is sorted and
+// eviction pops list heads. Packets are indexed by type, direction,
+// connection and (interned) topic; client ids map to the connections their
+// CONNECT was seen on. A topic or connection is forgotten with its last row,
+// so the index stays bounded by the window. A client id is announced only
+// once, so it is kept while its connection is open, however long that is
+// idle, and forgotten once the connection has closed and has no rows left.
+// A query intersects the relevant lists, smallest first, instead of scanning
+// the window.
+class CaptureIndex {
+public:
+  // Unset fields match everything
+  struct Filter {
+    std::optional<uint8_t> type;
+    std::optional<PacketDirection> direction;
+    std::optional<uint64_t> connectionId;
+    std::string clientId;
+    std::string topicFilter; // MQTT wildcards allowed
+
+    bool empty() const {
+      return !type && !direction && !connectionId && clientId.empty() &&
+             topicFilter.empty();
+    }
+  };
+
+  // Add the next row. Rows must be consecutive; after clear() or on an
+  // empty index any row may start the sequence.
+  void add(uint64_t row, uint8_t type, PacketDirection direction,
+           uint64_t connectionId, std::string_view topic);
+
+  // Remember the client id a connection announced in its CONNECT
+  void setClientId(uint64_t connectionId, const std::string &clientId);
+  std::string getClientId(uint64_t connectionId) const;
+  // Forget the client ids of connections without rows that `isOpen` says
+  // have closed
+  void forgetClosedClients(const std::function<bool(uint64_t)> &isOpen);
+
+  // Drop all rows before `row`
+  void evictBefore(uint64_t row);
+  void clear();
+
+  size_t size() const { return rows_.size(); }
+  bool contains(uint64_t row) const {
+    return row >= firstRow_ && row - firstRow_ < rows_.size();
+  }
+
+  // Matching rows in ascending order
+  std::vector<uint64_t> query(const Filter &filter) const;
+
+  // Whether one indexed row matches, for extending a query result as rows
+  // are added
+  bool matches(const Filter &filter, uint64_t row) const;
+
+private:
+  // Sorted row numbers. Eviction advances `head`; the dead prefix is erased
+  // once it outweighs the live part.
+  struct Postings {
+    std::vector<uint64_t> rows;
+    size_t head = 0;
+
+    size_t size() const { return rows.size() - head; }
+    bool empty() const { return head == rows.size(); }
+    const uint64_t *begin() const { return rows.data() + head; }
+    const uint64_t *end() const { return rows.data() + rows.size(); }
+    void popFront();
+  };
+
+  struct Row {
+    uint8_t type;
+    PacketDirection direction;
+    uint32_t topic; // Interned, 0 for none
+    uint64_t connectionId;
+  };
+
+  uint32_t internTopic(std::string_view topic);
+  // Forget a topic whose last row was evicted, for its id to be reused
+  void releaseTopic(uint32_t id);
+
+  // Union of several posting lists, sorted
+  std::vector<uint64_t> merge(const std::vector<const Postings *> &lists) const;
+
+  std::deque<Row> rows_;
+  uint64_t firstRow_ = 0;
+
+  std::array<Postings, 16> byType_;
+  std::array<Postings, 2> byDirection_;
+  std::unordered_map<uint64_t, Postings> byConnection_;
+
+  // Topic id 0 is "no topic" and has no postings. Released ids have an
+  // empty name and no postings until reused.
+  std::vector<std::string> topicNames_{std::string()};
+  std::vector<Postings> byTopic_{Postings()};
+  std::unordered_map<std::string, uint32_t> topicIds_;
+  std::vector<uint32_t> freeTopicIds_;
+
+  std::unordered_map<uint64_t, std::string> clientIds_;
+};
+
+}
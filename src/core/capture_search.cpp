@@ -0,0 +1,478 @@
+#include "capture_search.hpp"
+#include <boost/asio/post.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MITMQTT_SSE2 1
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MITMQTT_AVX2 1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace mitmqtt {
+
+namespace {
+// Index of the lowest set bit, `value` must not be zero
+int lowestBit(uint32_t value) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, value);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctz(value);
+#endif
+}
+
+uint8_t foldCase(uint8_t c) {
+  return c >= 'A' && c <= 'Z' ? static_cast<uint8_t>(c | 0x20) : c;
+}
+
+// Whether `size` bytes of the haystack equal the needle's
+bool equalBytes(const uint8_t *haystack, const uint8_t *needle, size_t size,
+                bool ignoreCase) {
+  if (!ignoreCase)
+    return std::memcmp(haystack, needle, size) == 0;
+  for (size_t i = 0; i < size; ++i) {
+    if (foldCase(haystack[i]) != needle[i])
+      return false;
+  }
+  return true;
+}
+
+#ifdef MITMQTT_SSE2
+// ASCII upper case letters to lower case, 16 bytes at a time. Adding
+// 128 - 'A' moves 'A'..'Z' to the bottom of the signed range.
+__m128i foldCase16(__m128i bytes) {
+  __m128i shifted =
+      _mm_add_epi8(bytes, _mm_set1_epi8(static_cast<char>(128 - 'A')));
+  __m128i upper =
+      _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(-128 + 26)));
+  return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+#ifdef MITMQTT_AVX2
+__m256i foldCase32(__m256i bytes) {
+  __m256i shifted =
+      _mm256_add_epi8(bytes, _mm256_set1_epi8(static_cast<char>(128 - 'A')));
+  __m256i upper = _mm256_cmpgt_epi8(
+      _mm256_set1_epi8(static_cast<char>(-128 + 26)), shifted);
+  return _mm256_or_si256(bytes,
+                         _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+#endif
+
+// Longest run of plain characters in `pattern` that every match must
+// contain. Characters inside groups and classes, and those a quantifier
+// makes optional, don't count; with alternation nothing does.
+std::string requiredLiteral(const std::string &pattern) {
+  if (pattern.find('|') != std::string::npos)
+    return {};
+
+  std::string best;
+  std::string run;
+  auto endRun = [&]() {
+    if (run.size() > best.size())
+      best = run;
+    run.clear();
+  };
+
+  int depth = 0;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    char c = pattern[i];
+    if (c == '\\') {
+      if (++i == pattern.size())
+        break;
+      c = pattern[i];
+      // \d, \w, \b, \1 and the like are not the character itself, nor
+      // are the hex digits of \x and \u, the letter after \c or the rest
+      // of a backreference
+      if (!std::ispunct(static_cast<unsigned char>(c))) {
+        size_t operand = c == 'x' ? 2 : c == 'u' ? 4 : c == 'c' ? 1 : 0;
+        if (std::isdigit(static_cast<unsigned char>(c))) {
+          while (i + 1 < pattern.size() &&
+                 std::isdigit(static_cast<unsigned char>(pattern[i + 1])))
+            ++i;
+        }
+        i = std::min(i + operand, pattern.size() - 1);
+        endRun();
+        continue;
+      }
+    } else if (c == '[') {
+      endRun();
+      ++i;
+      if (i < pattern.size() && pattern[i] == '^')
+        ++i;
+      if (i < pattern.size() && pattern[i] == ']')
+        ++i;
+      for (; i < pattern.size() && pattern[i] != ']'; ++i) {
+        if (pattern[i] == '\\')
+          ++i;
+      }
+      continue;
+    } else if (c == '(' || c == ')') {
+      endRun();
+      depth += c == '(' ? 1 : -1;
+      continue;
+    } else if (c == '*' || c == '?' || c == '{') {
+      // The atom before may be absent
+      if (!run.empty())
+        run.pop_back();
+      endRun();
+      if (c == '{') {
+        while (i < pattern.size() && pattern[i] != '}')
+          ++i;
+      }
+      continue;
+    } else if (c == '+' || c == '.' || c == '^' || c == '$') {
+      endRun();
+      continue;
+    }
+    if (depth == 0)
+      run += c;
+  }
+  endRun();
+  return best;
+}
+}
+
+size_t findBytes(std::string_view haystack, std::string_view needle,
+                 bool ignoreCase) {
+  size_t size = needle.size();
+  if (size == 0)
+    return 0;
+  if (size > haystack.size())
+    return std::string_view::npos;
+
+  const auto *h = reinterpret_cast<const uint8_t *>(haystack.data());
+  const auto *n = reinterpret_cast<const uint8_t *>(needle.data());
+  size_t starts = haystack.size() - size + 1; // Positions a match can start
+  size_t i = 0;
+
+  // Candidates are positions where the first and the last byte both match;
+  // the bytes in between are compared only there
+#ifdef MITMQTT_AVX2
+  {
+    const __m256i first = _mm256_set1_epi8(static_cast<char>(n[0]));
+    const __m256i last = _mm256_set1_epi8(static_cast<char>(n[size - 1]));
+    for (; i + 32 <= starts; i += 32) {
+      __m256i head =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(h + i));
+      __m256i tail = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(h + i + size - 1));
+      if (ignoreCase) {
+        head = foldCase32(head);
+        tail = foldCase32(tail);
+      }
+      uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+          _mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+                           _mm256_cmpeq_epi8(tail, last))));
+      while (mask != 0) {
+        size_t at = i + lowestBit(mask);
+        if (size <= 2 || equalBytes(h + at + 1, n + 1, size - 2, ignoreCase))
+          return at;
+        mask &= mask - 1;
+      }
+    }
+  }
+#endif
+#ifdef MITMQTT_SSE2
+  {
+    const __m128i first = _mm_set1_epi8(static_cast<char>(n[0]));
+    const __m128i last = _mm_set1_epi8(static_cast<char>(n[size - 1]));
+    for (; i + 16 <= starts; i += 16) {
+      __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i *>(h + i));
+      __m128i tail = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(h + i + size - 1));
+      if (ignoreCase) {
+        head = foldCase16(head);
+        tail = foldCase16(tail);
+      }
+      uint32_t mask = static_cast<uint32_t>(
+          _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+                                          _mm_cmpeq_epi8(tail, last))));
+      while (mask != 0) {
+        size_t at = i + lowestBit(mask);
+        if (size <= 2 || equalBytes(h + at + 1, n + 1, size - 2, ignoreCase))
+          return at;
+        mask &= mask - 1;
+      }
+    }
+  }
+#endif
+  for (; i < starts; ++i) {
+    uint8_t head = ignoreCase ? foldCase(h[i]) : h[i];
+    uint8_t tail = ignoreCase ? foldCase(h[i + size - 1]) : h[i + size - 1];
+    if (head == n[0] && tail == n[size - 1] &&
+        (size <= 2 || equalBytes(h + i + 1, n + 1, size - 2, ignoreCase)))
+      return i;
+  }
+  return std::string_view::npos;
+}
+
+PayloadMatcher::PayloadMatcher(const SearchQuery &query)
+    : ignoreCase_(query.ignoreCase) {
+  if (query.regex) {
+    auto flags = std::regex::ECMAScript | std::regex::optimize;
+    if (query.ignoreCase)
+      flags |= std::regex::icase;
+    regex_.emplace(query.text, flags);
+    literal_ = requiredLiteral(query.text);
+  } else {
+    literal_ = query.text;
+  }
+  if (ignoreCase_) {
+    for (char &c : literal_)
+      c = static_cast<char>(foldCase(static_cast<uint8_t>(c)));
+  }
+}
+
+bool PayloadMatcher::matches(std::string_view payload) const {
+  if (!regex_)
+    return findBytes(payload, literal_, ignoreCase_) != std::string_view::npos;
+
+  payload = payload.substr(0, kRegexScanLimit);
+  if (!literal_.empty() &&
+      findBytes(payload, literal_, ignoreCase_) == std::string_view::npos)
+    return false;
+  return std::regex_search(payload.begin(), payload.end(), *regex_);
+}
+
+CaptureSearch::CaptureSearch(CaptureStore &store, IOContextPool &pool)
+    : store_(store), pool_(pool), indexedSegments_(0) {}
+
+void CaptureSearch::setIndexedSegments(size_t segments) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    indexedSegments_ = segments;
+  }
+  trimIndexes(segments);
+}
+
+void CaptureSearch::trimIndexes(size_t window) {
+  size_t kept = 0;
+  auto segments = store_.segments();
+  for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+    if (!(*it)->index())
+      continue;
+    if (kept < window)
+      ++kept;
+    else
+      (*it)->setIndex(nullptr);
+  }
+}
+
+size_t CaptureSearch::indexedSegments() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return indexedSegments_;
+}
+
+void CaptureSearch::start(const SearchQuery &query) {
+  if (query.text.empty()) {
+    cancel();
+    return;
+  }
+
+  auto run = std::make_shared<Run>();
+  run->matcher = std::make_shared<const PayloadMatcher>(query);
+  auto segments = store_.segments();
+  run->total = segments.size();
+  run->remaining = segments.size();
+
+  size_t window;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (run_)
+      run_->cancelled = true;
+    run_ = run;
+    window = indexedSegments_;
+  }
+
+  // Newest first; the newest sealed segments are the ones worth indexing
+  size_t sealed = 0;
+  for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+    bool index = (*it)->sealed() && sealed < window;
+    if (index)
+      ++sealed;
+    boost::asio::post(pool_.getIOContext(),
+                      [this, run, segment = *it, count = (*it)->count(),
+                       index]() { searchSegment(run, segment, count, index); });
+  }
+}
+
+void CaptureSearch::cancel() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (run_)
+    run_->cancelled = true;
+  run_.reset();
+}
+
+void CaptureSearch::searchSegment(
+    const std::shared_ptr<Run> &run,
+    const std::shared_ptr<CaptureSegment> &segment, size_t count,
+    bool index) {
+  if (!run->cancelled) {
+    const PayloadMatcher &matcher = *run->matcher;
+    std::vector<uint64_t> rows;
+
+    std::shared_ptr<const TrigramIndex> trigrams;
+    if (matcher.literal().size() >= 3)
+      trigrams = segment->index();
+    if (trigrams) {
+      for (uint32_t record : trigrams->candidates(matcher.literal())) {
+        if (record < count && matcher.matches(segment->payload(record)))
+          rows.push_back(segment->record(record).row);
+      }
+    } else {
+      scanSegment(*run, *segment, count, rows);
+    }
+
+    if (!rows.empty() && !run->cancelled) {
+      std::lock_guard<std::mutex> lock(run->mutex);
+      run->found.insert(run->found.end(), rows.begin(), rows.end());
+    }
+  }
+  run->remaining.fetch_sub(1);
+
+  // Index after the scan, behind the scans already queued, so that the
+  // search that asks for it is not held up
+  if (index && !segment->index()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!indexing_.insert(segment.get()).second)
+        return;
+    }
+    boost::asio::post(pool_.getIOContext(),
+                      [this, segment]() { indexSegment(segment); });
+  }
+}
+
+void CaptureSearch::scanSegment(const Run &run, const CaptureSegment &segment,
+                                size_t count,
+                                std::vector<uint64_t> &rows) const {
+  const PayloadMatcher &matcher = *run.matcher;
+  const std::string &literal = matcher.literal();
+
+  if (literal.empty()) {
+    // A regex with no text to look for first
+    for (size_t i = 0; i < count; ++i) {
+      if (i % 1024 == 0 && run.cancelled)
+        return;
+      if (matcher.matches(segment.payload(i)))
+        rows.push_back(segment.record(i).row);
+    }
+    return;
+  }
+
+  // Payloads lie back to back, so the whole segment is scanned in one go
+  // and each hit is mapped to its record. A hit straddling two payloads is
+  // not a match; the scan carries on one byte further.
+  std::string_view bytes(reinterpret_cast<const char *>(segment.bytes()),
+                         segment.end(count));
+  const CaptureSegment::Record *records = &segment.record(0);
+  size_t record = 0;
+  size_t pos = 0;
+  while (pos < bytes.size() && !run.cancelled) {
+    size_t hit = findBytes(bytes.substr(pos), literal, matcher.ignoreCase());
+    if (hit == std::string_view::npos)
+      break;
+    hit += pos;
+
+    record = static_cast<size_t>(
+        std::upper_bound(records + record, records + count, hit,
+                         [](size_t offset, const CaptureSegment::Record &r) {
+                           return offset < size_t(r.offset) + r.size;
+                         }) -
+        records);
+    const CaptureSegment::Record &found = records[record];
+    size_t end = size_t(found.offset) + found.size;
+    if (hit + literal.size() > end) {
+      pos = hit + 1;
+      continue;
+    }
+    if (!matcher.isRegex() || matcher.matches(segment.payload(record)))
+      rows.push_back(found.row);
+    pos = end;
+    ++record;
+  }
+}
+
+void CaptureSearch::indexSegment(
+    const std::shared_ptr<CaptureSegment> &segment) {
+  auto built = std::make_shared<const TrigramIndex>(*segment);
+
+  size_t window;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    indexing_.erase(segment.get());
+    window = indexedSegments_;
+    if (window == 0)
+      return; // Turned off meanwhile
+    segment->setIndex(std::move(built));
+  }
+  trimIndexes(window);
+}
+
+void CaptureSearch::take(std::vector<uint64_t> &rows) {
+  std::shared_ptr<Run> run;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    run = run_;
+  }
+  if (!run)
+    return;
+  std::lock_guard<std::mutex> lock(run->mutex);
+  rows.insert(rows.end(), run->found.begin(), run->found.end());
+  run->found.clear();
+}
+
+void CaptureSearch::searchNew(
+    std::vector<std::pair<uint64_t, std::string>> rows) {
+  std::shared_ptr<Run> run;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    run = run_;
+  }
+  if (!run || rows.empty())
+    return;
+
+  boost::asio::post(pool_.getIOContext(),
+                    [run, rows = std::move(rows)]() {
+    std::vector<uint64_t> found;
+    for (const auto &row : rows) {
+      if (run->cancelled)
+        return;
+      if (run->matcher->matches(row.second))
+        found.push_back(row.first);
+    }
+    if (!found.empty()) {
+      std::lock_guard<std::mutex> lock(run->mutex);
+      run->found.insert(run->found.end(), found.begin(), found.end());
+    }
+  });
+}
+
+bool CaptureSearch::running() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return run_ && run_->remaining > 0;
+}
+
+size_t CaptureSearch::segmentsSearched() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return run_ ? run_->total - run_->remaining : 0;
+}
+
+size_t CaptureSearch::segmentsTotal() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return run_ ? run_->total : 0;
+}
+
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "capture_store.hpp"
+#include "io_context_pool.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace mitmqtt {
+
+struct SearchQuery {
+  std::string text;
+  bool regex = false;     // ECMAScript syntax
+  bool ignoreCase = true; // ASCII letters only
+};
+
+// Offset of `needle` in `haystack`, or npos. Compares the first and last
+// byte of the needle at 16 or 32 positions at once and checks the rest only
+// where both match. With `ignoreCase`, ASCII letters in the haystack match
+// either case and `needle` must be lower case.
+size_t findBytes(std::string_view haystack, std::string_view needle,
+                 bool ignoreCase);
+
+// A compiled query. Plain text is found with findBytes(); a regex is only
+// run on payloads containing the longest piece of text every match of it
+// must contain, when it has one. A regex sees only the first
+// kRegexScanLimit bytes of a payload: std::regex recurses per character and
+// overflows the stack on long input.
+class PayloadMatcher {
+public:
+  static constexpr size_t kRegexScanLimit = 4096;
+
+  // Throws std::regex_error for a bad regex
+  explicit PayloadMatcher(const SearchQuery &query);
+
+  bool matches(std::string_view payload) const;
+
+  // Text every matching payload contains, lower case when ignoring case;
+  // empty for a regex without one
+  const std::string &literal() const { return literal_; }
+  bool ignoreCase() const { return ignoreCase_; }
+  bool isRegex() const { return regex_.has_value(); }
+
+private:
+  std::string literal_;
+  bool ignoreCase_;
+  std::optional<std::regex> regex_;
+};
+
+// Searches the payloads of a CaptureStore on a pool's threads.
+//
+// A search snapshots the store's segments and posts one task per segment,
+// newest first. Each task scans the segment's bytes in one pass, mapping
+// hits back to records, and hands the matching rows over as soon as the
+// segment is done, so results stream in while older segments are still
+// being scanned. With indexing on, the newest sealed segments get a trigram
+// index once a search has scanned them, and later searches for text of
+// three bytes or more only look at the records the index offers.
+//
+// Rows added to the store after start() are not searched; hand them to
+// searchNew(). Safe to use from any thread; stop the pool before destroying
+// the search.
+class CaptureSearch {
+public:
+  CaptureSearch(CaptureStore &store, IOContextPool &pool);
+
+  CaptureSearch(const CaptureSearch &) = delete;
+  CaptureSearch &operator=(const CaptureSearch &) = delete;
+
+  // Index up to `segments` of the newest sealed segments, 0 for none.
+  // Indexes of segments that fall out of the window are dropped.
+  void setIndexedSegments(size_t segments);
+  size_t indexedSegments() const;
+
+  // Search for `query`, cancelling any search still running; empty text
+  // only cancels. Throws std::regex_error for a bad regex.
+  void start(const SearchQuery &query);
+  void cancel();
+
+  // Move rows found since the last call to the end of `rows`. Rows of one
+  // segment come in ascending order, segments newest first.
+  void take(std::vector<uint64_t> &rows);
+
+  // Match rows added to the store since start(), by row and payload, on
+  // the pool; those that match come out of take() like the others.
+  // Ignored when no search is running.
+  void searchNew(std::vector<std::pair<uint64_t, std::string>> rows);
+
+  bool running() const;
+  // Progress of the current search
+  size_t segmentsSearched() const;
+  size_t segmentsTotal() const;
+
+private:
+  struct Run {
+    std::shared_ptr<const PayloadMatcher> matcher;
+    std::atomic<bool> cancelled{false};
+    std::atomic<size_t> remaining{0};
+    size_t total = 0;
+
+    std::mutex mutex;
+    std::vector<uint64_t> found;
+  };
+
+  void searchSegment(const std::shared_ptr<Run> &run,
+                     const std::shared_ptr<CaptureSegment> &segment,
+                     size_t count, bool index);
+  // Rows of records [0, count) matching, by scanning all of them
+  void scanSegment(const Run &run, const CaptureSegment &segment,
+                   size_t count, std::vector<uint64_t> &rows) const;
+  // Build the segment's index, dropping the oldest beyond the window
+  void indexSegment(const std::shared_ptr<CaptureSegment> &segment);
+  // Drop the indexes of all but the newest `window` indexed segments. Goes
+  // by the store's list, as spilling replaces segments and keeps indexes.
+  void trimIndexes(size_t window);
+
+  CaptureStore &store_;
+  IOContextPool &pool_;
+
+  mutable std::mutex mutex_;
+  std::shared_ptr<Run> run_;
+  size_t indexedSegments_;
+  std::unordered_set<const CaptureSegment *> indexing_; // Queued builds
+};
+
+}
@@ -0,0 +1,412 @@
+#include "capture_store.hpp"
+#include "../utils/logger.hpp"
+#include <boost/asio/post.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+namespace mitmqtt {
+
+namespace {
+uint8_t foldCase(uint8_t c) {
+  return c >= 'A' && c <= 'Z' ? static_cast<uint8_t>(c | 0x20) : c;
+}
+
+constexpr size_t kTrigramBuckets = 65536;
+
+uint32_t trigramBucket(uint32_t trigram) {
+  return (trigram * 2654435761u) >> 16;
+}
+
+// Records follow the payloads in a spill file, 8-byte aligned
+size_t recordsOffset(size_t bytes) { return (bytes + 7) & ~size_t(7); }
+
+// Distinct buckets of the trigrams of `text`, sorted
+void bucketsOf(std::string_view text, std::vector<uint32_t> &buckets) {
+  buckets.clear();
+  if (text.size() < 3)
+    return;
+  const auto *p = reinterpret_cast<const uint8_t *>(text.data());
+  uint32_t trigram = (uint32_t(foldCase(p[0])) << 8) | foldCase(p[1]);
+  for (size_t i = 2; i < text.size(); ++i) {
+    trigram = ((trigram << 8) | foldCase(p[i])) & 0xFFFFFF;
+    buckets.push_back(trigramBucket(trigram));
+  }
+  std::sort(buckets.begin(), buckets.end());
+  buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+}
+}
+
+TrigramIndex::TrigramIndex(const CaptureSegment &segment) {
+  size_t count = segment.count();
+
+  // (bucket, record) pairs in record order
+  std::vector<uint32_t> pairs;
+  pairs.reserve(segment.end(count));
+  for (size_t record = 0; record < count; ++record) {
+    std::string_view payload = segment.payload(record);
+    if (payload.size() < 3)
+      continue;
+    const auto *p = reinterpret_cast<const uint8_t *>(payload.data());
+    uint32_t trigram = (uint32_t(foldCase(p[0])) << 8) | foldCase(p[1]);
+    for (size_t i = 2; i < payload.size(); ++i) {
+      trigram = ((trigram << 8) | foldCase(p[i])) & 0xFFFFFF;
+      pairs.push_back((trigramBucket(trigram) << 16) |
+                      static_cast<uint32_t>(record));
+    }
+  }
+
+  // Counting sort by bucket; being stable, it keeps each bucket's records
+  // ascending, with repeats next to each other
+  std::vector<uint32_t> starts(kTrigramBuckets + 1, 0);
+  for (uint32_t pair : pairs)
+    ++starts[(pair >> 16) + 1];
+  for (size_t i = 1; i < starts.size(); ++i)
+    starts[i] += starts[i - 1];
+  std::vector<uint16_t> sorted(pairs.size());
+  for (uint32_t pair : pairs)
+    sorted[starts[pair >> 16]++] = static_cast<uint16_t>(pair & 0xFFFF);
+  pairs = std::vector<uint32_t>();
+
+  // starts[] now holds the bucket ends; drop repeats while compacting
+  starts_.resize(kTrigramBuckets + 1);
+  records_.reserve(sorted.size());
+  size_t begin = 0;
+  for (size_t bucket = 0; bucket < kTrigramBuckets; ++bucket) {
+    starts_[bucket] = static_cast<uint32_t>(records_.size());
+    for (size_t i = begin; i < starts[bucket]; ++i) {
+      if (i == begin || sorted[i] != sorted[i - 1])
+        records_.push_back(sorted[i]);
+    }
+    begin = starts[bucket];
+  }
+  starts_[kTrigramBuckets] = static_cast<uint32_t>(records_.size());
+  records_.shrink_to_fit();
+}
+
+std::vector<uint32_t> TrigramIndex::candidates(std::string_view needle) const {
+  struct Span {
+    const uint16_t *begin;
+    const uint16_t *end;
+    size_t size() const { return static_cast<size_t>(end - begin); }
+  };
+
+  std::vector<uint32_t> buckets;
+  bucketsOf(needle, buckets);
+  std::vector<Span> spans;
+  for (uint32_t bucket : buckets) {
+    if (starts_[bucket] == starts_[bucket + 1])
+      return {};
+    spans.push_back(Span{records_.data() + starts_[bucket],
+                         records_.data() + starts_[bucket + 1]});
+  }
+  if (spans.empty())
+    return {};
+
+  // Intersect, starting from the rarest trigram
+  std::sort(spans.begin(), spans.end(),
+            [](const Span &a, const Span &b) { return a.size() < b.size(); });
+  std::vector<uint32_t> result(spans[0].begin, spans[0].end);
+  for (size_t i = 1; i < spans.size() && !result.empty(); ++i) {
+    const uint16_t *cursor = spans[i].begin;
+    size_t kept = 0;
+    for (uint32_t record : result) {
+      cursor = std::lower_bound(cursor, spans[i].end, record);
+      if (cursor == spans[i].end)
+        break;
+      if (*cursor == record)
+        result[kept++] = record;
+    }
+    result.resize(kept);
+  }
+  return result;
+}
+
+CaptureSegment::CaptureSegment(size_t capacityBytes, size_t maxRecords)
+    : bytes_(nullptr), capacity_(capacityBytes), used_(0), records_(nullptr),
+      maxRecords_(maxRecords), count_(0), sealed_(false),
+      heapBytes_(new uint8_t[capacityBytes]),
+      heapRecords_(new Record[maxRecords]) {
+  bytes_ = heapBytes_.get();
+  records_ = heapRecords_.get();
+}
+
+CaptureSegment::CaptureSegment(const std::string &path, size_t bytes,
+                               size_t count)
+    : bytes_(nullptr), capacity_(bytes), used_(bytes), records_(nullptr),
+      maxRecords_(count), count_(count), sealed_(true), path_(path) {
+  namespace bip = boost::interprocess;
+  mapping_ = std::make_unique<bip::file_mapping>(path.c_str(), bip::read_only);
+  region_ = std::make_unique<bip::mapped_region>(*mapping_, bip::read_only);
+  if (region_->get_size() < recordsOffset(bytes) + count * sizeof(Record))
+    throw std::runtime_error("short spill file");
+  bytes_ = static_cast<uint8_t *>(region_->get_address());
+  records_ = reinterpret_cast<Record *>(bytes_ + recordsOffset(bytes));
+}
+
+CaptureSegment::~CaptureSegment() {
+  if (!region_)
+    return;
+  region_.reset();
+  mapping_.reset();
+  boost::interprocess::file_mapping::remove(path_.c_str());
+}
+
+std::shared_ptr<CaptureSegment>
+CaptureSegment::spill(const std::string &path) const {
+  size_t count = this->count();
+  size_t bytes = end(count);
+  {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    static const char padding[8] = {};
+    file.write(reinterpret_cast<const char *>(bytes_), bytes);
+    file.write(padding, recordsOffset(bytes) - bytes);
+    file.write(reinterpret_cast<const char *>(records_),
+               count * sizeof(Record));
+    file.close();
+    if (!file) {
+      boost::interprocess::file_mapping::remove(path.c_str());
+      return nullptr;
+    }
+  }
+
+  try {
+    return std::shared_ptr<CaptureSegment>(
+        new CaptureSegment(path, bytes, count));
+  } catch (const std::exception &e) {
+    MITMQTT_LOG_WARN("Failed to map " << path << ": " << e.what());
+    boost::interprocess::file_mapping::remove(path.c_str());
+    return nullptr;
+  }
+}
+
+CaptureStore::CaptureStore(size_t segmentBytes)
+    : segmentBytes_(segmentBytes), memoryBytes_(0), diskBytes_(0),
+      droppedBefore_(0), memoryBudget_(0), diskBudget_(0), nextSpill_(0),
+      spillResults_(std::make_shared<SpillResults>()), spillingBytes_(0) {
+  // Several instances may share a spill directory
+  std::random_device random;
+  std::ostringstream prefix;
+  prefix << "mitmqtt-" << std::hex << random() << random() << "-";
+  spillPrefix_ = prefix.str();
+}
+
+void CaptureStore::setBudget(size_t memoryBytes, size_t diskBytes,
+                             const std::string &directory) {
+  memoryBudget_ = memoryBytes;
+  diskBudget_ = diskBytes;
+  spillDirectory_ = directory;
+}
+
+void CaptureStore::add(uint64_t row, std::string_view payload) {
+  if (payload.empty())
+    return;
+  if (spillResults_->ready.load(std::memory_order_acquire))
+    finishSpills();
+
+  CaptureSegment *segment =
+      segments_.empty() ? nullptr : segments_.back().get();
+  if (!segment || segment->sealed() ||
+      segment->used_ + payload.size() > segment->capacity_ ||
+      segment->count_.load(std::memory_order_relaxed) ==
+          segment->maxRecords_) {
+    if (segment)
+      segment->sealed_.store(true, std::memory_order_release);
+
+    std::shared_ptr<CaptureSegment> fresh;
+    if (payload.size() > segmentBytes_)
+      fresh = std::make_shared<CaptureSegment>(payload.size(), 1);
+    else
+      fresh = std::make_shared<CaptureSegment>(segmentBytes_,
+                                               kMaxSegmentRecords);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      segments_.push_back(fresh);
+    }
+    memoryBytes_ += fresh->footprint();
+    segment = fresh.get();
+    enforceBudget();
+  }
+
+  size_t count = segment->count_.load(std::memory_order_relaxed);
+  std::memcpy(segment->bytes_ + segment->used_, payload.data(),
+              payload.size());
+  segment->records_[count] =
+      CaptureSegment::Record{row, static_cast<uint32_t>(segment->used_),
+                             static_cast<uint32_t>(payload.size())};
+  segment->used_ += payload.size();
+  segment->count_.store(count + 1, std::memory_order_release);
+}
+
+std::string_view CaptureStore::find(uint64_t row) const {
+  // Last segment starting at or before `row`
+  auto it = std::upper_bound(
+      segments_.begin(), segments_.end(), row,
+      [](uint64_t row, const std::shared_ptr<CaptureSegment> &segment) {
+        return row < segment->record(0).row;
+      });
+  if (it == segments_.begin())
+    return {};
+  const CaptureSegment &segment = **(--it);
+
+  const CaptureSegment::Record *begin = &segment.record(0);
+  const CaptureSegment::Record *end = begin + segment.count();
+  auto record = std::lower_bound(
+      begin, end, row, [](const CaptureSegment::Record &record,
+                          uint64_t row) { return record.row < row; });
+  if (record == end || record->row != row)
+    return {};
+  return segment.payload(static_cast<size_t>(record - begin));
+}
+
+void CaptureStore::evictBefore(uint64_t row) {
+  while (!segments_.empty()) {
+    const CaptureSegment &segment = *segments_.front();
+    if (segment.record(segment.count() - 1).row >= row)
+      break;
+    dropOldest();
+  }
+}
+
+void CaptureStore::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  segments_.clear();
+  // Spills still running finish into nothing
+  spilling_.clear();
+  spillingBytes_ = 0;
+  memoryBytes_ = 0;
+  diskBytes_ = 0;
+  droppedBefore_ = 0;
+}
+
+size_t CaptureStore::indexBytes() const {
+  size_t bytes = 0;
+  for (const auto &segment : segments_) {
+    if (auto index = segment->index())
+      bytes += index->bytes();
+  }
+  return bytes;
+}
+
+void CaptureStore::enforceBudget() {
+  // Spill the oldest segments still in memory, not counting those already
+  // being spilled; the newest, being written, stays
+  size_t next = 0;
+  while (memoryBudget_ != 0 &&
+         memoryBytes_ - spillingBytes_ + indexBytes() > memoryBudget_) {
+    while (next < segments_.size() &&
+           (segments_[next]->spilled() ||
+            spilling_.count(segments_[next].get()) != 0))
+      ++next;
+    if (next + 1 >= segments_.size())
+      break;
+
+    if (spillDirectory_.empty()) {
+      applySpill(next, nullptr);
+      next = 0;
+      continue;
+    }
+
+    std::shared_ptr<CaptureSegment> segment = segments_[next];
+    std::string path = spillDirectory_ + "/" + spillPrefix_ +
+                       std::to_string(nextSpill_++) + ".spill";
+    if (!spillExecutor_) {
+      applySpill(next, segment->spill(path));
+      next = 0;
+      continue;
+    }
+
+    // Sealed segments don't change, so the file is written off this thread
+    spilling_.insert(segment.get());
+    spillingBytes_ += segment->footprint();
+    boost::asio::post(spillExecutor_,
+                      [results = spillResults_, segment, path]() {
+      auto spilled = segment->spill(path);
+      std::lock_guard<std::mutex> lock(results->mutex);
+      results->done.emplace_back(segment, std::move(spilled));
+      results->ready.store(true, std::memory_order_release);
+    });
+    ++next;
+  }
+
+  // Indexes the spills cannot make room for go, oldest first
+  for (size_t i = 0; memoryBudget_ != 0 && spilling_.empty() &&
+                     i < segments_.size() &&
+                     memoryBytes_ + indexBytes() > memoryBudget_;
+       ++i)
+    segments_[i]->setIndex(nullptr);
+
+  while (diskBudget_ != 0 && diskBytes_ > diskBudget_ &&
+         segments_.front()->spilled()) {
+    const CaptureSegment &oldest = *segments_.front();
+    droppedBefore_ = oldest.record(oldest.count() - 1).row + 1;
+    dropOldest();
+  }
+}
+
+void CaptureStore::applySpill(size_t index,
+                              std::shared_ptr<CaptureSegment> spilled) {
+  if (!spilled) {
+    if (!spillDirectory_.empty()) {
+      MITMQTT_LOG_WARN("Cannot spill captured payloads to "
+                       << spillDirectory_ << ", dropping the oldest instead");
+      spillDirectory_.clear();
+    }
+    // Rows keep their order, so everything older goes as well
+    for (size_t i = 0; i <= index; ++i) {
+      const CaptureSegment &oldest = *segments_.front();
+      droppedBefore_ = oldest.record(oldest.count() - 1).row + 1;
+      dropOldest();
+    }
+    return;
+  }
+
+  CaptureSegment &segment = *segments_[index];
+  spilled->setIndex(segment.index());
+  memoryBytes_ -= segment.footprint();
+  diskBytes_ += spilled->footprint();
+  std::lock_guard<std::mutex> lock(mutex_);
+  segments_[index] = std::move(spilled);
+}
+
+void CaptureStore::finishSpills() {
+  std::vector<std::pair<std::shared_ptr<CaptureSegment>,
+                        std::shared_ptr<CaptureSegment>>>
+      done;
+  {
+    std::lock_guard<std::mutex> lock(spillResults_->mutex);
+    done.swap(spillResults_->done);
+    spillResults_->ready.store(false, std::memory_order_relaxed);
+  }
+
+  for (auto &result : done) {
+    // Segments evicted meanwhile are gone, and their files with the copies
+    if (spilling_.erase(result.first.get()) == 0)
+      continue;
+    spillingBytes_ -= result.first->footprint();
+    auto it = std::find(segments_.begin(), segments_.end(), result.first);
+    applySpill(static_cast<size_t>(it - segments_.begin()),
+               std::move(result.second));
+  }
+  enforceBudget();
+}
+
+void CaptureStore::dropOldest() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const CaptureSegment &segment = *segments_.front();
+  (segment.spilled() ? diskBytes_ : memoryBytes_) -= segment.footprint();
+  if (spilling_.erase(&segment) != 0)
+    spillingBytes_ -= segment.footprint();
+  segments_.pop_front();
+}
+
+std::vector<std::shared_ptr<CaptureSegment>> CaptureStore::segments() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::vector<std::shared_ptr<CaptureSegment>>(segments_.begin(),
+                                                      segments_.end());
+}
+
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace mitmqtt {
+
+class CaptureSegment;
+
+// Which records of a sealed segment contain each trigram, with ASCII letters
+// folded to lower case. Trigrams are hashed into 65536 buckets, each with a
+// sorted run of record numbers, so a lookup is two array reads and a query
+// intersects runs. Bucket collisions only add candidates.
+class TrigramIndex {
+public:
+  explicit TrigramIndex(const CaptureSegment &segment);
+
+  // Records that may contain `needle`, ascending. `needle` must be at least
+  // three bytes; every record that does contain it is among the result.
+  std::vector<uint32_t> candidates(std::string_view needle) const;
+
+  size_t bytes() const {
+    return starts_.size() * sizeof(uint32_t) +
+           records_.size() * sizeof(uint16_t);
+  }
+
+private:
+  std::vector<uint32_t> starts_; // Run of each bucket in records_, plus end
+  std::vector<uint16_t> records_;
+};
+
+// A block of payloads stored back to back, and where each one starts.
+//
+// Storage is allocated once and never moves. The store's writer appends and
+// publishes each record with a release store of the count, so readers on
+// other threads see every record below count() complete, without locking.
+// A sealed segment may be spilled: the store then replaces it with a copy
+// whose payloads and records are in a file, mapped into memory and paged in
+// only while they are read.
+class CaptureSegment {
+public:
+  struct Record {
+    uint64_t row;
+    uint32_t offset; // Into bytes()
+    uint32_t size;
+  };
+
+  CaptureSegment(size_t capacityBytes, size_t maxRecords);
+  // Removes the file of a spilled segment
+  ~CaptureSegment();
+
+  CaptureSegment(const CaptureSegment &) = delete;
+  CaptureSegment &operator=(const CaptureSegment &) = delete;
+
+  // Records published so far
+  size_t count() const { return count_.load(std::memory_order_acquire); }
+  const Record &record(size_t index) const { return records_[index]; }
+  std::string_view payload(size_t index) const {
+    return std::string_view(
+        reinterpret_cast<const char *>(bytes_) + records_[index].offset,
+        records_[index].size);
+  }
+  // Payloads of records [0, count) are the first `end(count)` bytes
+  const uint8_t *bytes() const { return bytes_; }
+  size_t end(size_t count) const {
+    return count == 0 ? 0
+                      : records_[count - 1].offset + records_[count - 1].size;
+  }
+
+  // Full; nothing is added to a sealed segment
+  bool sealed() const { return sealed_.load(std::memory_order_acquire); }
+
+  size_t capacity() const { return capacity_; }
+  size_t maxRecords() const { return maxRecords_; }
+
+  // Whether the segment lives in a file rather than on the heap
+  bool spilled() const { return region_ != nullptr; }
+  // Heap memory, or file size when spilled
+  size_t footprint() const {
+    return capacity_ + maxRecords_ * sizeof(Record);
+  }
+
+  // Trigram index of a sealed segment, built on demand by searches. Safe to
+  // use from any thread.
+  std::shared_ptr<const TrigramIndex> index() const {
+    return std::atomic_load(&index_);
+  }
+  void setIndex(std::shared_ptr<const TrigramIndex> index) {
+    std::atomic_store(&index_, std::move(index));
+  }
+
+private:
+  friend class CaptureStore;
+
+  // Map a file written by spill()
+  CaptureSegment(const std::string &path, size_t bytes, size_t count);
+
+  // Write the records of a sealed segment and its payloads to `path`, and
+  // map them back. Null, with the file removed, on failure.
+  std::shared_ptr<CaptureSegment> spill(const std::string &path) const;
+
+  uint8_t *bytes_;
+  size_t capacity_;
+  size_t used_; // Writer only
+  Record *records_;
+  size_t maxRecords_;
+  std::atomic<size_t> count_;
+  std::atomic<bool> sealed_;
+  std::shared_ptr<const TrigramIndex> index_;
+
+  // Owners of bytes_ and records_, on the heap or mapped from path_
+  std::unique_ptr<uint8_t[]> heapBytes_;
+  std::unique_ptr<Record[]> heapRecords_;
+  std::unique_ptr<boost::interprocess::file_mapping> mapping_;
+  std::unique_ptr<boost::interprocess::mapped_region> region_;
+  std::string path_;
+};
+
+// Payload bytes of captured packets by row, kept for searching.
+//
+// One writer thread adds payloads in row order to the newest segment and
+// starts a new one when it fills up; a payload larger than a segment gets
+// one to itself. Rows without a payload take no space. Readers take a
+// snapshot of the segment list and can search it while the writer carries
+// on; eviction drops whole segments.
+//
+// With a memory budget, the oldest sealed segments beyond it are spilled to
+// files in the spill directory as the writer starts new ones, so a long
+// history costs disk space and page cache rather than heap. Trigram indexes
+// count towards the memory budget and move over to the spilled segment; if
+// they alone exceed it, the oldest are dropped. With a spill executor the
+// files are written there and the writer swaps the segments in once they
+// are done. Beyond the disk budget, or when a spill fails, the oldest
+// segments are dropped instead. Only segments() is safe to call from
+// threads other than the writer's.
+class CaptureStore {
+public:
+  static constexpr size_t kDefaultSegmentBytes = 4 * 1024 * 1024;
+  // Record numbers fit the trigram index's 16 bits
+  static constexpr size_t kMaxSegmentRecords = 65536;
+
+  explicit CaptureStore(size_t segmentBytes = kDefaultSegmentBytes);
+
+  CaptureStore(const CaptureStore &) = delete;
+  CaptureStore &operator=(const CaptureStore &) = delete;
+
+  // Keep at most `memoryBytes` of segments in memory and `diskBytes` in
+  // files under `directory`, 0 for no limit. Without a directory nothing is
+  // spilled. Applies from the next segment on.
+  void setBudget(size_t memoryBytes, size_t diskBytes,
+                 const std::string &directory);
+  // Write spill files on `executor` rather than on the writer's thread; an
+  // empty executor spills inline
+  void setSpillExecutor(const boost::asio::any_io_executor &executor) {
+    spillExecutor_ = executor;
+  }
+
+  // Store the payload of `row`. Rows must increase.
+  void add(uint64_t row, std::string_view payload);
+
+  // Payload of `row`, empty if it has none or it was evicted. The view
+  // stays valid until the row's segment is evicted.
+  std::string_view find(uint64_t row) const;
+
+  // Drop the segments holding only rows before `row`
+  void evictBefore(uint64_t row);
+  void clear();
+
+  // The segments, oldest first. Records published after the call show up
+  // in count() of the last one.
+  std::vector<std::shared_ptr<CaptureSegment>> segments() const;
+
+  // Segment footprints and trigram indexes in memory, segment footprints
+  // in spill files
+  size_t memoryBytes() const { return memoryBytes_ + indexBytes(); }
+  size_t diskBytes() const { return diskBytes_; }
+
+  // Rows before this lost their payloads to the budget
+  uint64_t droppedBefore() const { return droppedBefore_; }
+
+private:
+  // Segments written to a file by the spill executor, or null where that
+  // failed, for the writer to swap in
+  struct SpillResults {
+    std::mutex mutex;
+    std::vector<std::pair<std::shared_ptr<CaptureSegment>,
+                          std::shared_ptr<CaptureSegment>>>
+        done;
+    std::atomic<bool> ready{false};
+  };
+
+  size_t indexBytes() const;
+  // Spill or drop the oldest segments until both budgets are met
+  void enforceBudget();
+  // Replace segments_[index] by its spilled copy, or drop it and everything
+  // older when that is null
+  void applySpill(size_t index, std::shared_ptr<CaptureSegment> spilled);
+  // Apply the spills the executor has finished
+  void finishSpills();
+  void dropOldest();
+
+  size_t segmentBytes_;
+  std::deque<std::shared_ptr<CaptureSegment>> segments_;
+  mutable std::mutex mutex_; // Guards segments_ against segments()
+  size_t memoryBytes_;
+  size_t diskBytes_;
+  uint64_t droppedBefore_;
+
+  size_t memoryBudget_;
+  size_t diskBudget_;
+  std::string spillDirectory_;
+  std::string spillPrefix_; // Unique to this store
+  uint64_t nextSpill_;
+
+  boost::asio::any_io_executor spillExecutor_;
+  std::shared_ptr<SpillResults> spillResults_;
+  std::unordered_set<const CaptureSegment *> spilling_; // In flight
+  size_t spillingBytes_; // Their footprints
+};
+
+}
@@ -0,0 +1,166 @@
+#include "connection_registry.hpp"
+#include <iterator>
+#include <utility>
+
+namespace mitmqtt {
+
+void ConnectionRegistry::add(uint64_t id,
+                             std::shared_ptr<MQTTConnection> conn) {
+  Entry entry;
+  entry.id = id;
+  entry.plain = std::move(conn);
+  insert(std::move(entry));
+}
+
+void ConnectionRegistry::add(uint64_t id,
+                             std::shared_ptr<MQTTTLSConnection> conn) {
+  Entry entry;
+  entry.id = id;
+  entry.tls = std::move(conn);
+  insert(std::move(entry));
+}
+
+void ConnectionRegistry::insert(Entry entry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t id = entry.id;
+  auto existing = byId_.find(id);
+  if (existing != byId_.end()) {
+    unindexLocked(*existing->second);
+    entries_.erase(existing->second);
+  }
+  entries_.push_back(std::move(entry));
+  byId_[id] = std::prev(entries_.end());
+}
+
+bool ConnectionRegistry::remove(uint64_t id) {
+  // The connection may be the last owner of itself, let it go unlocked
+  Entry removed;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = byId_.find(id);
+    if (it == byId_.end())
+      return false;
+    unindexLocked(*it->second);
+    removed = std::move(*it->second);
+    entries_.erase(it->second);
+    byId_.erase(it);
+  }
+  return true;
+}
+
+void ConnectionRegistry::unindexLocked(const Entry &entry) {
+  std::string clientId = entry.session.getClientId();
+  if (!clientId.empty()) {
+    auto it = byClientId_.find(clientId);
+    if (it != byClientId_.end() && it->second == entry.id)
+      byClientId_.erase(it);
+  }
+
+  std::string username = entry.session.getUsername();
+  if (!username.empty()) {
+    auto it = byUsername_.find(username);
+    if (it != byUsername_.end()) {
+      it->second.erase(entry.id);
+      if (it->second.empty())
+        byUsername_.erase(it);
+    }
+  }
+}
+
+void ConnectionRegistry::identify(uint64_t id, const std::string &clientId,
+                                  const std::string &username) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = byId_.find(id);
+  if (it == byId_.end())
+    return;
+
+  Entry &entry = *it->second;
+  unindexLocked(entry);
+  entry.session.setClientId(clientId);
+  entry.session.setUsername(username);
+  entry.session.setAuthenticated(false);
+  if (!clientId.empty())
+    byClientId_[clientId] = id;
+  if (!username.empty())
+    byUsername_[username].insert(id);
+}
+
+void ConnectionRegistry::setAuthenticated(uint64_t id, bool authenticated) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = byId_.find(id);
+  if (it != byId_.end())
+    it->second->session.setAuthenticated(authenticated);
+}
+
+std::optional<ConnectionRegistry::Entry>
+ConnectionRegistry::find(uint64_t id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = byId_.find(id);
+  if (it == byId_.end())
+    return std::nullopt;
+  return *it->second;
+}
+
+bool ConnectionRegistry::contains(uint64_t id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return byId_.count(id) != 0;
+}
+
+std::optional<ConnectionRegistry::Entry>
+ConnectionRegistry::findByClientId(const std::string &clientId) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto name = byClientId_.find(clientId);
+  if (name == byClientId_.end())
+    return std::nullopt;
+  auto it = byId_.find(name->second);
+  if (it == byId_.end())
+    return std::nullopt;
+  return *it->second;
+}
+
+std::vector<ConnectionRegistry::Entry>
+ConnectionRegistry::findByUsername(const std::string &username) const {
+  std::vector<Entry> found;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto name = byUsername_.find(username);
+  if (name == byUsername_.end())
+    return found;
+  found.reserve(name->second.size());
+  for (uint64_t id : name->second) {
+    auto it = byId_.find(id);
+    if (it != byId_.end())
+      found.push_back(*it->second);
+  }
+  return found;
+}
+
+std::optional<ConnectionRegistry::Entry> ConnectionRegistry::oldest() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entries_.empty())
+    return std::nullopt;
+  return entries_.front();
+}
+
+std::vector<ConnectionRegistry::Entry> ConnectionRegistry::takeAll() {
+  List taken;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    taken.swap(entries_);
+    byId_.clear();
+    byClientId_.clear();
+    byUsername_.clear();
+  }
+
+  std::vector<Entry> entries;
+  entries.reserve(taken.size());
+  for (Entry &entry : taken)
+    entries.push_back(std::move(entry));
+  return entries;
+}
+
+size_t ConnectionRegistry::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return byId_.size();
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "session.hpp"
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace mitmqtt {
+
+template <typename ClientStream> class BasicMQTTConnection;
+
+// Connections whose clients speak plain TCP (or WebSocket over it) and TLS
+using SSLStream = boost::asio::ssl::stream<boost::asio::ip::tcp::socket>;
+using MQTTConnection = BasicMQTTConnection<boost::asio::ip::tcp::socket>;
+using MQTTTLSConnection = BasicMQTTConnection<SSLStream>;
+
+// Open connections of a proxy, by connection id and by the client id and
+// username of their CONNECT.
+//
+// Entries live in a list in the order they were added, indexed by hash maps,
+// so adding, removing and every lookup are O(1) on average however many
+// devices are connected. A client id names the newest connection that
+// announced it, as the broker hands the session over to it. Safe to use from
+// any thread.
+class ConnectionRegistry {
+public:
+  // One connection, plain or TLS, and what its CONNECT said
+  struct Entry {
+    uint64_t id = 0;
+    std::shared_ptr<MQTTConnection> plain;
+    std::shared_ptr<MQTTTLSConnection> tls;
+    Session session;
+
+    // Run `fn(conn)` with whichever connection is set
+    template <typename Fn> void visit(Fn &&fn) const {
+      if (plain)
+        fn(plain);
+      else if (tls)
+        fn(tls);
+    }
+  };
+
+  void add(uint64_t id, std::shared_ptr<MQTTConnection> conn);
+  void add(uint64_t id, std::shared_ptr<MQTTTLSConnection> conn);
+
+  // Forget a closed connection. Returns false if it was not registered.
+  bool remove(uint64_t id);
+
+  // Index a connection under the identity from its CONNECT, replacing any
+  // earlier one. Empty names are not indexed.
+  void identify(uint64_t id, const std::string &clientId,
+                const std::string &username);
+  // Whether the broker accepted the CONNECT
+  void setAuthenticated(uint64_t id, bool authenticated);
+
+  std::optional<Entry> find(uint64_t id) const;
+  bool contains(uint64_t id) const;
+  std::optional<Entry> findByClientId(const std::string &clientId) const;
+  std::vector<Entry> findByUsername(const std::string &username) const;
+  // Connection open the longest
+  std::optional<Entry> oldest() const;
+
+  // Run `fn(entry)` for every connection, oldest first, under the lock; it
+  // must not call back into the registry
+  template <typename Fn> void forEach(Fn fn) const;
+
+  // Remove every entry and return them, oldest first
+  std::vector<Entry> takeAll();
+
+  size_t size() const;
+
+private:
+  using List = std::list<Entry>;
+
+  void insert(Entry entry);
+  void unindexLocked(const Entry &entry);
+
+  mutable std::mutex mutex_;
+  List entries_; // Oldest first
+  std::unordered_map<uint64_t, List::iterator> byId_;
+  std::unordered_map<std::string, uint64_t> byClientId_;
+  std::unordered_map<std::string, std::unordered_set<uint64_t>> byUsername_;
+};
+
+template <typename Fn> void ConnectionRegistry::forEach(Fn fn) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const Entry &entry : entries_)
+    fn(entry);
+}
+
+}
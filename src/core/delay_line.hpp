@@ -0,0 +1,85 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace mitmqtt {
+
+// Frames held back by delay rules for one direction of a connection.
+//
+// Release times never decrease, so frames come out in the order they went
+// in even if a later one was given a shorter delay; while the line is not
+// empty, every frame of that direction has to pass through it. The owning
+// connection runs on the timer's executor.
+class DelayLine {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit DelayLine(const boost::asio::any_io_executor &executor)
+      : timer_(executor), armed_(false), bytes_(0) {}
+
+  bool empty() const { return frames_.empty(); }
+  size_t queuedBytes() const { return bytes_; }
+
+  // Copy a frame in, due `delay` from now
+  void push(const uint8_t *data, size_t size, Clock::duration delay) {
+    Clock::time_point release = Clock::now() + delay;
+    if (!frames_.empty() && release < frames_.back().release)
+      release = frames_.back().release;
+    frames_.push_back(Frame{release, std::vector<uint8_t>(data, data + size)});
+    bytes_ += size;
+  }
+
+  // Hand due frames to `deliver(data, size)` and arm the timer for the
+  // rest. The timer keeps `owner` alive.
+  template <typename Owner, typename Deliver>
+  void schedule(std::shared_ptr<Owner> owner, Deliver deliver);
+
+  void clear() {
+    frames_.clear();
+    bytes_ = 0;
+    timer_.cancel();
+  }
+
+private:
+  struct Frame {
+    Clock::time_point release;
+    std::vector<uint8_t> data;
+  };
+
+  std::deque<Frame> frames_;
+  boost::asio::steady_timer timer_;
+  bool armed_;
+  size_t bytes_;
+};
+
+template <typename Owner, typename Deliver>
+void DelayLine::schedule(std::shared_ptr<Owner> owner, Deliver deliver) {
+  Clock::time_point now = Clock::now();
+  while (!frames_.empty() && frames_.front().release <= now) {
+    Frame frame = std::move(frames_.front());
+    frames_.pop_front();
+    bytes_ -= frame.data.size();
+    deliver(frame.data.data(), frame.data.size());
+  }
+  if (frames_.empty() || armed_)
+    return;
+
+  armed_ = true;
+  timer_.expires_at(frames_.front().release);
+  timer_.async_wait([this, owner, deliver](boost::system::error_code ec) {
+    armed_ = false;
+    // Cancelled by clear(), unless frames were queued again since
+    if (ec && frames_.empty())
+      return;
+    schedule(owner, deliver);
+  });
+}
+
+}
@@ -0,0 +1,115 @@
+#include "dns_cache.hpp"
+#include <memory>
+
+namespace mitmqtt {
+
+DNSCache::DNSCache(std::chrono::seconds ttl, std::chrono::seconds negativeTTL)
+    : ttl_(ttl), negativeTTL_(negativeTTL) {}
+
+std::string DNSCache::makeKey(const std::string &host, uint16_t port) {
+  return host + ":" + std::to_string(port);
+}
+
+void DNSCache::asyncResolve(const boost::asio::any_io_executor &executor,
+                            const std::string &host, uint16_t port,
+                            ResolveHandler handler) {
+  // Literal addresses never need DNS
+  boost::system::error_code parseError;
+  auto address = boost::asio::ip::make_address(host, parseError);
+  if (!parseError) {
+    Endpoints endpoints{boost::asio::ip::tcp::endpoint(address, port)};
+    boost::asio::post(executor, [handler = std::move(handler),
+                                 endpoints = std::move(endpoints)]() {
+      handler(boost::system::error_code(), endpoints);
+    });
+    return;
+  }
+
+  std::string key = makeKey(host, port);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &entry = entries_[key];
+
+    if (!entry.resolving &&
+        entry.expires > std::chrono::steady_clock::now()) {
+      boost::asio::post(executor, [handler = std::move(handler),
+                                   error = entry.error,
+                                   endpoints = entry.endpoints]() {
+        handler(error, endpoints);
+      });
+      return;
+    }
+
+    entry.waiters.push_back(Waiter{executor, std::move(handler)});
+    if (entry.resolving)
+      return; // Piggyback on the query already in flight
+    entry.resolving = true;
+  }
+
+  auto resolver = std::make_shared<boost::asio::ip::tcp::resolver>(executor);
+  resolver->async_resolve(
+      host, std::to_string(port),
+      [this, key, resolver](
+          boost::system::error_code ec,
+          boost::asio::ip::tcp::resolver::results_type results) {
+        Endpoints endpoints;
+        for (const auto &result : results) {
+          endpoints.push_back(result.endpoint());
+        }
+        complete(key, ec, std::move(endpoints));
+      });
+}
+
+void DNSCache::complete(const std::string &key, boost::system::error_code ec,
+                        Endpoints endpoints) {
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &entry = entries_[key];
+    entry.resolving = false;
+    entry.error = ec;
+    entry.endpoints = std::move(endpoints);
+    entry.expires =
+        std::chrono::steady_clock::now() + (ec ? negativeTTL_ : ttl_);
+    waiters.swap(entry.waiters);
+
+    for (auto &waiter : waiters) {
+      boost::asio::post(waiter.executor,
+                        [handler = std::move(waiter.handler), error = ec,
+                         endpoints = entry.endpoints]() {
+                          handler(error, endpoints);
+                        });
+    }
+  }
+}
+
+void DNSCache::invalidate(const std::string &host, uint16_t port) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(makeKey(host, port));
+  if (it != entries_.end() && !it->second.resolving) {
+    entries_.erase(it);
+  }
+}
+
+void DNSCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->second.resolving) {
+      ++it;
+    } else {
+      it = entries_.erase(it);
+    }
+  }
+}
+
+void DNSCache::setTTL(std::chrono::seconds ttl) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ttl_ = ttl;
+}
+
+std::chrono::seconds DNSCache::getTTL() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ttl_;
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace mitmqtt {
+
+// Shared cache of resolved broker endpoints.
+//
+// Lookups are asynchronous. A fresh cached result completes without touching
+// DNS, and concurrent lookups for the same host:port share one query, so a
+// reconnect storm after a broker restart costs a single resolution. Failed
+// lookups are cached briefly as well.
+class DNSCache {
+public:
+  using Endpoints = std::vector<boost::asio::ip::tcp::endpoint>;
+  using ResolveHandler =
+      std::function<void(boost::system::error_code, const Endpoints &)>;
+
+  explicit DNSCache(std::chrono::seconds ttl = std::chrono::seconds(60),
+                    std::chrono::seconds negativeTTL = std::chrono::seconds(5));
+
+  // Resolve host:port. The handler is always invoked through `executor`,
+  // never inline.
+  void asyncResolve(const boost::asio::any_io_executor &executor,
+                    const std::string &host, uint16_t port,
+                    ResolveHandler handler);
+
+  // Forget a cached result. Failed connects don't call for it: during a
+  // broker restart every connect fails, and the TTL bounds staleness.
+  void invalidate(const std::string &host, uint16_t port);
+  void clear();
+
+  void setTTL(std::chrono::seconds ttl);
+  std::chrono::seconds getTTL() const;
+
+private:
+  struct Waiter {
+    boost::asio::any_io_executor executor;
+    ResolveHandler handler;
+  };
+
+  struct Entry {
+    Endpoints endpoints;
+    boost::system::error_code error;
+    std::chrono::steady_clock::time_point expires;
+    bool resolving = false;
+    std::vector<Waiter> waiters;
+  };
+
+  static std::string makeKey(const std::string &host, uint16_t port);
+
+  void complete(const std::string &key, boost::system::error_code ec,
+                Endpoints endpoints);
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::chrono::seconds ttl_;
+  std::chrono::seconds negativeTTL_;
+};
+
+}
@@ -0,0 +1,95 @@
+#include "handshake_gate.hpp"
+#include <utility>
+#include <vector>
+
+namespace mitmqtt {
+
+HandshakeGate::HandshakeGate(size_t maxActive, size_t maxQueued)
+    : active_(0), maxActive_(maxActive), maxQueued_(maxQueued), rejected_(0),
+      parked_(false) {}
+
+void HandshakeGate::setLimits(size_t maxActive, size_t maxQueued) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  maxActive_ = maxActive;
+  maxQueued_ = maxQueued;
+}
+
+bool HandshakeGate::fullLocked() const {
+  return maxActive_ != 0 && active_ >= maxActive_ &&
+         queue_.size() >= maxQueued_;
+}
+
+bool HandshakeGate::submit(Task task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (maxActive_ != 0 && active_ >= maxActive_) {
+      if (fullLocked()) {
+        rejected_++;
+        return false;
+      }
+      queue_.push_back(std::move(task));
+      return true;
+    }
+    active_++;
+  }
+  task();
+  return true;
+}
+
+bool HandshakeGate::release() {
+  std::vector<Task> next;
+  bool resume = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_ > 0)
+      active_--;
+
+    // Raised limits may free more than one slot
+    while (!queue_.empty() && (maxActive_ == 0 || active_ < maxActive_)) {
+      next.push_back(std::move(queue_.front()));
+      queue_.pop_front();
+      active_++;
+    }
+    if (parked_ && !fullLocked()) {
+      parked_ = false;
+      resume = true;
+    }
+  }
+  for (Task &task : next)
+    task();
+  return resume;
+}
+
+bool HandshakeGate::parkIfFull() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!fullLocked())
+    return false;
+  parked_ = true;
+  return true;
+}
+
+void HandshakeGate::clear() {
+  std::deque<Task> queue;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue.swap(queue_);
+    parked_ = false;
+  }
+}
+
+size_t HandshakeGate::active() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return active_;
+}
+
+size_t HandshakeGate::queued() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+uint64_t HandshakeGate::rejected() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return rejected_;
+}
+
+}
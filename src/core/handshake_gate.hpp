@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace mitmqtt {
+
+// What the TLS listener does with new clients once the handshake queue is
+// full
+enum class HandshakeOverflow {
+  Pause, // Stop accepting, later clients wait in the kernel's listen backlog
+  Reject // Accept and close them right away
+};
+
+// Limits how many TLS handshakes run at once.
+//
+// Up to maxActive handshakes run, any number if it is 0; later ones wait in a
+// FIFO of at most maxQueued, none if it is 0, and start as running ones
+// finish.
+// Tasks run on the thread that submits or releases, outside the lock, and
+// should only post the actual handshake somewhere. Safe to use from any
+// thread.
+class HandshakeGate {
+public:
+  using Task = std::function<void()>;
+
+  explicit HandshakeGate(size_t maxActive = 0, size_t maxQueued = 0);
+
+  void setLimits(size_t maxActive, size_t maxQueued);
+
+  // Run `task` now if a slot is free, else queue it. Returns false, and
+  // drops the task, when the queue is full.
+  bool submit(Task task);
+
+  // A started task finished, run the queued ones that now have a slot.
+  // Returns true if the caller parked its acceptor with parkIfFull() and
+  // should resume it.
+  bool release();
+
+  // If no further task could be queued, remember that the acceptor is
+  // waiting and return true
+  bool parkIfFull();
+
+  // Drop the queued tasks
+  void clear();
+
+  size_t active() const;
+  size_t queued() const;
+  uint64_t rejected() const;
+
+private:
+  bool fullLocked() const;
+
+  mutable std::mutex mutex_;
+  std::deque<Task> queue_;
+  size_t active_;
+  size_t maxActive_;
+  size_t maxQueued_;
+  uint64_t rejected_;
+  bool parked_;
+};
+
+}
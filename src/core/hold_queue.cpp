@@ -0,0 +1,39 @@
+#include "hold_queue.hpp"
+
+namespace mitmqtt {
+
+void HoldQueue::push(uint64_t id, const uint8_t *data, size_t size,
+                     std::chrono::milliseconds delay) {
+  frames_.push_back(Frame{id, id == 0, false, delay,
+                          std::vector<uint8_t>(data, data + size)});
+  bytes_ += size;
+}
+
+bool HoldQueue::resolve(uint64_t id, bool drop,
+                        std::vector<uint8_t> &&replacement) {
+  for (Frame &frame : frames_) {
+    if (frame.id != id || frame.ready)
+      continue;
+
+    frame.ready = true;
+    frame.drop = drop;
+    if (!drop && !replacement.empty()) {
+      bytes_ = bytes_ - frame.data.size() + replacement.size();
+      frame.data = std::move(replacement);
+    }
+    return true;
+  }
+  return false;
+}
+
+void HoldQueue::releaseAll() {
+  for (Frame &frame : frames_)
+    frame.ready = true;
+}
+
+void HoldQueue::clear() {
+  frames_.clear();
+  bytes_ = 0;
+}
+
+}
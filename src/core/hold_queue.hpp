@@ -0,0 +1,68 @@
+#pragma once
+
+#include "mqtt_framer.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace mitmqtt {
+
+// Frames of one direction of a connection parked by the intercept rules.
+//
+// An intercepted frame waits until it is released (possibly edited) or
+// dropped. Frames arriving behind it wait as well, already released, so the
+// direction is never reordered; flush() hands out the ready frames at the
+// front. Only used on the connection's own thread.
+class HoldQueue {
+public:
+  HoldQueue() : bytes_(0) {}
+
+  // Park a frame. `id` identifies an intercepted frame; 0 queues a frame
+  // that is only waiting behind the ones before it. `delay` is what the
+  // rules asked for once it is sent.
+  void push(uint64_t id, const uint8_t *data, size_t size,
+            std::chrono::milliseconds delay);
+
+  bool empty() const { return frames_.empty(); }
+  size_t queuedBytes() const { return bytes_; }
+
+  // Decide on an intercepted frame: drop it, or release it with its data
+  // replaced by `replacement` unless that is empty. Returns false if `id`
+  // is not held here.
+  bool resolve(uint64_t id, bool drop, std::vector<uint8_t> &&replacement);
+
+  // Release every intercepted frame unchanged
+  void releaseAll();
+
+  // Pass the ready frames at the front to `deliver(frame, delay)`; dropped
+  // frames are skipped
+  template <typename Deliver> void flush(Deliver deliver);
+
+  void clear();
+
+private:
+  struct Frame {
+    uint64_t id;
+    bool ready;
+    bool drop;
+    std::chrono::milliseconds delay;
+    std::vector<uint8_t> data;
+  };
+
+  std::deque<Frame> frames_;
+  size_t bytes_;
+};
+
+template <typename Deliver> void HoldQueue::flush(Deliver deliver) {
+  while (!frames_.empty() && frames_.front().ready) {
+    Frame frame = std::move(frames_.front());
+    frames_.pop_front();
+    bytes_ -= frame.data.size();
+    if (!frame.drop)
+      deliver(FrameView{frame.data.data(), frame.data.size()}, frame.delay);
+  }
+}
+
+}
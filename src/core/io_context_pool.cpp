@@ -0,0 +1,67 @@
+#include "io_context_pool.hpp"
+#include "../utils/logger.hpp"
+#include <algorithm>
+
+namespace mitmqtt {
+
+IOContextPool::IOContextPool(size_t size) : next_(0) {
+  if (size == 0) {
+    size = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  contexts_.reserve(size);
+  workGuards_.reserve(size);
+  for (size_t i = 0; i < size; ++i) {
+    // Each context is only ever run by one thread
+    contexts_.push_back(std::make_unique<boost::asio::io_context>(1));
+    workGuards_.push_back(boost::asio::make_work_guard(*contexts_.back()));
+  }
+}
+
+IOContextPool::~IOContextPool() { stop(); }
+
+void IOContextPool::run() {
+  if (running())
+    return;
+
+  threads_.reserve(contexts_.size());
+  for (auto &ioc : contexts_) {
+    boost::asio::io_context *context = ioc.get();
+    threads_.emplace_back([context]() {
+      try {
+        context->run();
+      } catch (const std::exception &e) {
+        MITMQTT_LOG_ERROR("IO context error: " << e.what());
+      }
+    });
+  }
+}
+
+void IOContextPool::stop() {
+  for (auto &ioc : contexts_) {
+    ioc->stop();
+  }
+  join();
+}
+
+void IOContextPool::join() {
+  for (auto &guard : workGuards_) {
+    guard.reset();
+  }
+  for (auto &thread : threads_) {
+    if (thread.joinable())
+      thread.join();
+  }
+  threads_.clear();
+}
+
+boost::asio::io_context &IOContextPool::getIOContext() {
+  size_t index = next_.fetch_add(1, std::memory_order_relaxed);
+  return *contexts_[index % contexts_.size()];
+}
+
+boost::asio::io_context &IOContextPool::getIOContext(size_t index) {
+  return *contexts_[index % contexts_.size()];
+}
+
+}
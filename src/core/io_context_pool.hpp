@@ -0,0 +1,54 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace mitmqtt {
+
+// Pool of io_contexts, each run by exactly one thread.
+//
+// A connection's sockets are created on one context from the pool and stay
+// there, so all of its handlers run on the same thread without a separate
+// strand. Accepted sockets are spread over the pool round-robin.
+class IOContextPool {
+public:
+  // A size of 0 selects one context per hardware thread
+  explicit IOContextPool(size_t size = 0);
+  ~IOContextPool();
+
+  IOContextPool(const IOContextPool &) = delete;
+  IOContextPool &operator=(const IOContextPool &) = delete;
+
+  // Start one thread per context
+  void run();
+
+  // Stop all contexts and join their threads
+  void stop();
+
+  // Let the contexts run out of work, then join their threads
+  void join();
+
+  // Next context in round-robin order
+  boost::asio::io_context &getIOContext();
+
+  // Context by index, e.g. 0 for acceptors
+  boost::asio::io_context &getIOContext(size_t index);
+
+  size_t size() const { return contexts_.size(); }
+  bool running() const { return !threads_.empty(); }
+
+private:
+  using WorkGuard =
+      boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
+
+  std::vector<std::unique_ptr<boost::asio::io_context>> contexts_;
+  std::vector<WorkGuard> workGuards_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_;
+};
+
+}
@@ -0,0 +1,294 @@
+#include "leaf_certificate_cache.hpp"
+#include "../utils/logger.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+
+namespace mitmqtt {
+
+namespace {
+// Short of the 398 days clients accept at most
+constexpr long kLeafLifetime = 397L * 24 * 60 * 60; // Seconds
+constexpr long kLeafBackdate = 24L * 60 * 60;       // For skewed clocks
+
+// Host names only. The name ends up in a config string for the SAN
+// extension, so anything that could add entries there is refused.
+bool normalizeHostname(const std::string &hostname, std::string &normalized) {
+  if (hostname.empty() || hostname.size() > 253)
+    return false;
+  normalized.clear();
+  normalized.reserve(hostname.size());
+  for (char c : hostname) {
+    unsigned char u = static_cast<unsigned char>(c);
+    if (!std::isalnum(u) && c != '.' && c != '-' && c != '_')
+      return false;
+    normalized.push_back(static_cast<char>(std::tolower(u)));
+  }
+  return true;
+}
+
+bool addExtension(X509 *cert, X509V3_CTX *ctx, int nid,
+                  const std::string &value) {
+  X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, ctx, nid, value.c_str());
+  if (!ext)
+    return false;
+  bool ok = X509_add_ext(cert, ext, -1) == 1;
+  X509_EXTENSION_free(ext);
+  return ok;
+}
+
+X509 *readCertificate(const std::string &file) {
+  BIO *bio = BIO_new_file(file.c_str(), "rb");
+  if (!bio)
+    return nullptr;
+  X509 *cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  return cert;
+}
+
+EVP_PKEY *readPrivateKey(const std::string &file) {
+  BIO *bio = BIO_new_file(file.c_str(), "rb");
+  if (!bio)
+    return nullptr;
+  EVP_PKEY *key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  return key;
+}
+
+// A fresh P-256 key, null on failure. Through EVP_PKEY_CTX rather than
+// EVP_PKEY_Q_keygen, which OpenSSL 1.1 lacks.
+EVP_PKEY *generateKey() {
+  EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  EVP_PKEY *key = nullptr;
+  if (context && EVP_PKEY_keygen_init(context) > 0 &&
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context,
+                                             NID_X9_62_prime256v1) > 0 &&
+      EVP_PKEY_keygen(context, &key) <= 0)
+    key = nullptr;
+  EVP_PKEY_CTX_free(context);
+  return key;
+}
+
+// Mint a leaf for `hostname` (already normalized) and wrap it in a server
+// context. Null on failure.
+SSL_CTX *mintLeaf(const std::string &hostname, X509 *caCert, EVP_PKEY *caKey,
+                  const std::string &sessionIdContext) {
+  EVP_PKEY *key = generateKey();
+  X509 *cert = X509_new();
+  SSL_CTX *context = nullptr;
+  bool ok = key && cert;
+
+  if (ok) {
+    X509_set_version(cert, 2);
+
+    // Random positive serial, so no two leaves share one
+    uint64_t serial = 0;
+    RAND_bytes(reinterpret_cast<unsigned char *>(&serial), sizeof(serial));
+    ASN1_INTEGER_set_uint64(X509_get_serialNumber(cert),
+                            serial & 0x7FFFFFFFFFFFFFFFull);
+
+    X509_gmtime_adj(X509_get_notBefore(cert), -kLeafBackdate);
+    X509_gmtime_adj(X509_get_notAfter(cert), kLeafLifetime);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(
+        name, "CN", MBSTRING_ASC,
+        reinterpret_cast<const unsigned char *>(hostname.c_str()), -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(caCert));
+
+    // Clients check the SAN, not the CN
+    X509V3_CTX ctx;
+    X509V3_set_ctx_nodb(&ctx);
+    X509V3_set_ctx(&ctx, caCert, cert, nullptr, nullptr, 0);
+    ok = addExtension(cert, &ctx, NID_basic_constraints,
+                      "critical,CA:FALSE") &&
+         addExtension(cert, &ctx, NID_key_usage,
+                      "critical,digitalSignature") &&
+         addExtension(cert, &ctx, NID_ext_key_usage, "serverAuth") &&
+         addExtension(cert, &ctx, NID_subject_alt_name, "DNS:" + hostname) &&
+         addExtension(cert, &ctx, NID_subject_key_identifier, "hash") &&
+         addExtension(cert, &ctx, NID_authority_key_identifier, "keyid") &&
+         X509_sign(cert, caKey, EVP_sha256()) != 0;
+  }
+
+  if (ok) {
+    context = SSL_CTX_new(TLS_server_method());
+    ok = context && SSL_CTX_use_certificate(context, cert) == 1 &&
+         SSL_CTX_use_PrivateKey(context, key) == 1 &&
+         SSL_CTX_add1_chain_cert(context, caCert) == 1;
+    if (ok && !sessionIdContext.empty()) {
+      SSL_CTX_set_session_id_context(
+          context,
+          reinterpret_cast<const unsigned char *>(sessionIdContext.data()),
+          static_cast<unsigned int>(sessionIdContext.size()));
+    }
+  }
+
+  if (!ok) {
+    MITMQTT_LOG_ERROR("Failed to mint certificate for "
+                      << hostname << ": "
+                      << ERR_error_string(ERR_get_error(), nullptr));
+    if (context)
+      SSL_CTX_free(context);
+    context = nullptr;
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return context;
+}
+}
+
+LeafCertificateCache::LeafCertificateCache(size_t capacity)
+    : capacity_(capacity), minted_(0), generation_(0), caCert_(nullptr),
+      caKey_(nullptr) {}
+
+LeafCertificateCache::~LeafCertificateCache() {
+  clear();
+  X509_free(caCert_);
+  EVP_PKEY_free(caKey_);
+}
+
+bool LeafCertificateCache::loadCA(const std::string &certFile,
+                                  const std::string &keyFile) {
+  X509 *cert = readCertificate(certFile);
+  EVP_PKEY *key = readPrivateKey(keyFile);
+  if (!cert || !key || X509_check_private_key(cert, key) != 1) {
+    MITMQTT_LOG_ERROR("Failed to load signing CA: " << certFile << ", "
+                                                    << keyFile);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return false;
+  }
+  if (X509_check_ca(cert) == 0) {
+    MITMQTT_LOG_WARN(certFile << " is not a CA certificate, clients will "
+                                 "reject the leaves it signs");
+  }
+
+  clear();
+  std::lock_guard<std::mutex> lock(mutex_);
+  X509_free(caCert_);
+  EVP_PKEY_free(caKey_);
+  caCert_ = cert;
+  caKey_ = key;
+  generation_++;
+  return true;
+}
+
+bool LeafCertificateCache::hasCA() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return caCert_ != nullptr;
+}
+
+void LeafCertificateCache::setSessionIdContext(const unsigned char *context,
+                                               size_t length) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  sessionIdContext_.assign(reinterpret_cast<const char *>(context), length);
+}
+
+SSL_CTX *LeafCertificateCache::contextFor(const std::string &hostname) {
+  std::string key;
+  if (!normalizeHostname(hostname, key))
+    return nullptr;
+
+  X509 *caCert = nullptr;
+  EVP_PKEY *caKey = nullptr;
+  std::string sessionIdContext;
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      order_.splice(order_.end(), order_, it->second.order);
+      SSL_CTX_up_ref(it->second.context);
+      return it->second.context;
+    }
+    if (!caCert_)
+      return nullptr;
+
+    // Keep the CA alive while minting without the lock
+    X509_up_ref(caCert_);
+    EVP_PKEY_up_ref(caKey_);
+    caCert = caCert_;
+    caKey = caKey_;
+    sessionIdContext = sessionIdContext_;
+    generation = generation_;
+  }
+
+  SSL_CTX *context = mintLeaf(key, caCert, caKey, sessionIdContext);
+  X509_free(caCert);
+  EVP_PKEY_free(caKey);
+  if (!context)
+    return nullptr;
+
+  SSL_CTX *evicted = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      // Another thread minted the same name meanwhile
+      evicted = context;
+      context = it->second.context;
+      SSL_CTX_up_ref(context);
+    } else if (generation != generation_) {
+      // The CA changed, serve this handshake but don't keep the leaf
+    } else {
+      if (capacity_ != 0 && entries_.size() >= capacity_) {
+        auto oldest = entries_.find(order_.front());
+        evicted = oldest->second.context;
+        entries_.erase(oldest);
+        order_.pop_front();
+      }
+      order_.push_back(key);
+      entries_[key] = Entry{context, std::prev(order_.end())};
+      SSL_CTX_up_ref(context); // The caller's reference
+      minted_++;
+    }
+  }
+  if (evicted)
+    SSL_CTX_free(evicted);
+  return context;
+}
+
+void LeafCertificateCache::prewarm(const std::vector<std::string> &hostnames) {
+  size_t ready = 0;
+  for (const std::string &hostname : hostnames) {
+    if (SSL_CTX *context = contextFor(hostname)) {
+      SSL_CTX_free(context);
+      ready++;
+    }
+  }
+  MITMQTT_LOG_INFO("Prepared certificates for " << ready << " of "
+                                                << hostnames.size()
+                                                << " host names");
+}
+
+void LeafCertificateCache::clear() {
+  std::unordered_map<std::string, Entry> entries;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries.swap(entries_);
+    order_.clear();
+  }
+  for (auto &entry : entries)
+    SSL_CTX_free(entry.second.context);
+}
+
+size_t LeafCertificateCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+size_t LeafCertificateCache::minted() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return minted_;
+}
+
+}
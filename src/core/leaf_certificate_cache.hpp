@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+namespace mitmqtt {
+
+// Server certificates minted on demand, one per TLS server name (SNI).
+//
+// Each leaf has its own P-256 key and is signed by the loaded CA, so a client
+// that trusts the CA accepts the proxy under whatever host name it dialled.
+// The SSL_CTX holding a leaf is cached, least recently used first out, and
+// switched to from the listener's SNI callback. Safe to use from any thread.
+class LeafCertificateCache {
+public:
+  explicit LeafCertificateCache(size_t capacity = 1024);
+  ~LeafCertificateCache();
+
+  LeafCertificateCache(const LeafCertificateCache &) = delete;
+  LeafCertificateCache &operator=(const LeafCertificateCache &) = delete;
+
+  // Load the signing CA (PEM). Clears the cache; returns false and keeps no
+  // CA if either file cannot be read or the key does not match.
+  bool loadCA(const std::string &certFile, const std::string &keyFile);
+  bool hasCA() const;
+
+  // Context serving the leaf for `hostname`, minted on a miss. The caller
+  // gets its own reference and must SSL_CTX_free() it, so eviction never
+  // pulls a context from under a handshake. Null for names that are not
+  // plain host names, if minting failed or no CA is loaded.
+  SSL_CTX *contextFor(const std::string &hostname);
+
+  // Mint the leaves for `hostnames` ahead of their first handshake
+  void prewarm(const std::vector<std::string> &hostnames);
+
+  // Leaf contexts copy this from the listener's context, so sessions stay
+  // resumable after the switch
+  void setSessionIdContext(const unsigned char *context, size_t length);
+
+  void clear();
+  size_t size() const;
+  size_t minted() const;
+
+private:
+  struct Entry {
+    SSL_CTX *context;
+    std::list<std::string>::iterator order;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::list<std::string> order_; // Least recently used first
+  size_t capacity_;
+  size_t minted_;
+  uint64_t generation_; // Of the CA, leaves of an older one are not kept
+
+  X509 *caCert_;
+  EVP_PKEY *caKey_;
+  std::string sessionIdContext_;
+};
+
+}
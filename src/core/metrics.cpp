@@ -0,0 +1,294 @@
+#include "metrics.hpp"
+#include "mqtt_handler.hpp"
+#include <sstream>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace mitmqtt {
+
+namespace {
+// Index of the highest set bit, `value` must not be 0
+unsigned highestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanReverse64(&index, value);
+  return static_cast<unsigned>(index);
+#else
+  unsigned index = 0;
+  while (value >>= 1)
+    ++index;
+  return index;
+#endif
+}
+
+const char *directionLabel(size_t direction) {
+  return direction == 0 ? "client_to_broker" : "broker_to_client";
+}
+
+void writeSummary(std::ostringstream &out, const char *name,
+                  const char *labels, const LatencyHistogram::Snapshot &s) {
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  std::string prefix = labels[0] ? std::string(labels) + "," : std::string();
+  for (double q : quantiles) {
+    out << name << "{" << prefix << "quantile=\"" << q << "\"} "
+        << double(s.quantile(q)) / 1e9 << "\n";
+  }
+  std::string suffix =
+      labels[0] ? "{" + std::string(labels) + "}" : std::string();
+  out << name << "_sum" << suffix << " " << double(s.sum) / 1e9 << "\n";
+  out << name << "_count" << suffix << " " << s.count << "\n";
+}
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t nanos) {
+  if (nanos < kSubBuckets)
+    return static_cast<size_t>(nanos);
+  unsigned exponent = highestBit(nanos);
+  if (exponent > kMaxExponent)
+    return kBuckets - 1;
+  size_t sub = (nanos >> (exponent - kSubBits)) & (kSubBuckets - 1);
+  return (exponent - kSubBits + 1) * kSubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t bucket) {
+  if (bucket < kSubBuckets)
+    return bucket;
+  unsigned shift = static_cast<unsigned>(bucket / kSubBuckets) - 1;
+  uint64_t lower = (kSubBuckets + bucket % kSubBuckets) << shift;
+  return lower + (uint64_t(1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanos) {
+  counts_[bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(nanos, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+  Snapshot snapshot;
+  snapshot.counts.resize(kBuckets);
+  for (size_t i = 0; i < kBuckets; ++i) {
+    snapshot.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    snapshot.count += snapshot.counts[i];
+  }
+  snapshot.sum = sum_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+uint64_t LatencyHistogram::Snapshot::quantile(double q) const {
+  if (count == 0)
+    return 0;
+  uint64_t rank = static_cast<uint64_t>(q * double(count));
+  if (rank >= count)
+    rank = count - 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    seen += counts[i];
+    if (seen > rank)
+      return bucketUpperBound(i);
+  }
+  return bucketUpperBound(counts.size() - 1);
+}
+
+uint64_t TrafficTotals::packetCount(PacketDirection direction) const {
+  uint64_t total = 0;
+  for (uint64_t count :
+       packets[direction == PacketDirection::ClientToBroker ? 0 : 1])
+    total += count;
+  return total;
+}
+
+void ConnectionStats::addTo(TrafficTotals &totals) const {
+  for (size_t d = 0; d < 2; ++d) {
+    totals.bytes[d] += directions_[d].bytes.load();
+    for (size_t t = 0; t < 16; ++t)
+      totals.packets[d][t] += directions_[d].packets[t].load();
+    totals.queuedBytes[d] += directions_[d].queued.load();
+  }
+  totals.readErrors += readErrors_.load();
+  totals.writeErrors += writeErrors_.load();
+}
+
+TLSHandshakeStats::Snapshot TLSHandshakeStats::snapshot() const {
+  Snapshot snapshot;
+  snapshot.durations = durations_.snapshot();
+  snapshot.failures = failures_.load(std::memory_order_relaxed);
+  snapshot.resumed = resumed_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+void ProxyMetrics::retire(ConnectionStats &stats) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stats.retired_)
+    return;
+  stats.retired_ = true;
+  connectionsRetired_++;
+
+  TrafficTotals totals;
+  stats.addTo(totals);
+  for (size_t d = 0; d < 2; ++d) {
+    retired_.bytes[d] += totals.bytes[d];
+    for (size_t t = 0; t < 16; ++t)
+      retired_.packets[d][t] += totals.packets[d][t];
+  }
+  retired_.readErrors += totals.readErrors;
+  retired_.writeErrors += totals.writeErrors;
+}
+
+MetricsSnapshot
+ProxyMetrics::snapshot(const std::vector<const ConnectionStats *> &live) {
+  MetricsSnapshot snapshot;
+  snapshot.connectionsOpened =
+      connectionsOpened_.load(std::memory_order_relaxed);
+  snapshot.connectTimeouts = connectTimeouts_.load(std::memory_order_relaxed);
+  snapshot.idleTimeouts = idleTimeouts_.load(std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    snapshot.traffic = retired_;
+    for (const ConnectionStats *stats : live) {
+      if (!stats->retired_)
+        stats->addTo(snapshot.traffic);
+    }
+    snapshot.connectionsActive =
+        snapshot.connectionsOpened > connectionsRetired_
+            ? snapshot.connectionsOpened - connectionsRetired_
+            : 0;
+  }
+  for (size_t d = 0; d < 2; ++d)
+    snapshot.proxyLatency[d] = proxyLatency_[d].snapshot();
+  snapshot.clientTLS = clientTLS_.snapshot();
+  snapshot.brokerTLS = brokerTLS_.snapshot();
+  return snapshot;
+}
+
+std::string formatPrometheus(const MetricsSnapshot &snapshot) {
+  std::ostringstream out;
+  const TrafficTotals &traffic = snapshot.traffic;
+
+  out << "# HELP mitmqtt_connections_opened_total Client connections "
+         "accepted.\n"
+         "# TYPE mitmqtt_connections_opened_total counter\n"
+      << "mitmqtt_connections_opened_total " << snapshot.connectionsOpened
+      << "\n";
+  out << "# HELP mitmqtt_connections_active Client connections open.\n"
+         "# TYPE mitmqtt_connections_active gauge\n"
+      << "mitmqtt_connections_active " << snapshot.connectionsActive << "\n";
+  out << "# HELP mitmqtt_timeouts_total Client connections closed for not "
+         "sending CONNECT in time, or for going silent.\n"
+         "# TYPE mitmqtt_timeouts_total counter\n"
+      << "mitmqtt_timeouts_total{reason=\"connect\"} "
+      << snapshot.connectTimeouts << "\n"
+      << "mitmqtt_timeouts_total{reason=\"idle\"} " << snapshot.idleTimeouts
+      << "\n";
+
+  out << "# HELP mitmqtt_bytes_total Bytes read, by direction.\n"
+         "# TYPE mitmqtt_bytes_total counter\n";
+  for (size_t d = 0; d < 2; ++d) {
+    out << "mitmqtt_bytes_total{direction=\"" << directionLabel(d) << "\"} "
+        << traffic.bytes[d] << "\n";
+  }
+
+  out << "# HELP mitmqtt_packets_total Packets read, by direction and "
+         "type.\n"
+         "# TYPE mitmqtt_packets_total counter\n";
+  for (size_t d = 0; d < 2; ++d) {
+    for (uint8_t t = 1; t < 16; ++t) {
+      out << "mitmqtt_packets_total{direction=\"" << directionLabel(d)
+          << "\",type=\"" << packetTypeToString(t) << "\"} "
+          << traffic.packets[d][t] << "\n";
+    }
+  }
+
+  out << "# HELP mitmqtt_queued_bytes Bytes waiting to be written.\n"
+         "# TYPE mitmqtt_queued_bytes gauge\n";
+  for (size_t d = 0; d < 2; ++d) {
+    out << "mitmqtt_queued_bytes{direction=\"" << directionLabel(d) << "\"} "
+        << traffic.queuedBytes[d] << "\n";
+  }
+
+  out << "# HELP mitmqtt_read_errors_total Failed socket reads.\n"
+         "# TYPE mitmqtt_read_errors_total counter\n"
+      << "mitmqtt_read_errors_total " << traffic.readErrors << "\n";
+  out << "# HELP mitmqtt_write_errors_total Failed socket writes.\n"
+         "# TYPE mitmqtt_write_errors_total counter\n"
+      << "mitmqtt_write_errors_total " << traffic.writeErrors << "\n";
+
+  out << "# HELP mitmqtt_proxy_latency_seconds Read completion to write "
+         "completion.\n"
+         "# TYPE mitmqtt_proxy_latency_seconds summary\n";
+  for (size_t d = 0; d < 2; ++d) {
+    std::string labels =
+        std::string("direction=\"") + directionLabel(d) + "\"";
+    writeSummary(out, "mitmqtt_proxy_latency_seconds", labels.c_str(),
+                 snapshot.proxyLatency[d]);
+  }
+
+  const std::pair<const char *, const TLSHandshakeStats::Snapshot *> sides[] =
+      {{"side=\"client\"", &snapshot.clientTLS},
+       {"side=\"broker\"", &snapshot.brokerTLS}};
+  out << "# HELP mitmqtt_tls_handshake_seconds Successful TLS handshakes, "
+         "with clients and with the broker.\n"
+         "# TYPE mitmqtt_tls_handshake_seconds summary\n";
+  for (const auto &side : sides)
+    writeSummary(out, "mitmqtt_tls_handshake_seconds", side.first,
+                 side.second->durations);
+  out << "# HELP mitmqtt_tls_handshake_failures_total Failed TLS "
+         "handshakes.\n"
+         "# TYPE mitmqtt_tls_handshake_failures_total counter\n";
+  for (const auto &side : sides) {
+    out << "mitmqtt_tls_handshake_failures_total{" << side.first << "} "
+        << side.second->failures << "\n";
+  }
+  out << "# HELP mitmqtt_tls_resumed_total TLS handshakes that resumed a "
+         "session.\n"
+         "# TYPE mitmqtt_tls_resumed_total counter\n";
+  for (const auto &side : sides) {
+    out << "mitmqtt_tls_resumed_total{" << side.first << "} "
+        << side.second->resumed << "\n";
+  }
+
+  out << "# HELP mitmqtt_tls_handshakes_active Client TLS handshakes in "
+         "progress.\n"
+         "# TYPE mitmqtt_tls_handshakes_active gauge\n"
+      << "mitmqtt_tls_handshakes_active " << snapshot.handshakesActive << "\n";
+  out << "# HELP mitmqtt_tls_handshakes_queued Client TLS handshakes waiting "
+         "for a slot.\n"
+         "# TYPE mitmqtt_tls_handshakes_queued gauge\n"
+      << "mitmqtt_tls_handshakes_queued " << snapshot.handshakesQueued << "\n";
+  out << "# HELP mitmqtt_tls_handshakes_rejected_total Clients dropped "
+         "because the handshake queue was full.\n"
+         "# TYPE mitmqtt_tls_handshakes_rejected_total counter\n"
+      << "mitmqtt_tls_handshakes_rejected_total "
+      << snapshot.handshakesRejected << "\n";
+
+  out << "# HELP mitmqtt_broker_up Whether an upstream broker is taking "
+         "connections.\n"
+         "# TYPE mitmqtt_broker_up gauge\n";
+  for (const BrokerMetrics &broker : snapshot.brokers) {
+    out << "mitmqtt_broker_up{broker=\"" << broker.name << "\"} "
+        << (broker.up ? 1 : 0) << "\n";
+  }
+  out << "# HELP mitmqtt_broker_connections Proxied connections to an "
+         "upstream broker, open or connecting.\n"
+         "# TYPE mitmqtt_broker_connections gauge\n";
+  for (const BrokerMetrics &broker : snapshot.brokers) {
+    out << "mitmqtt_broker_connections{broker=\"" << broker.name << "\"} "
+        << broker.connections << "\n";
+  }
+  out << "# HELP mitmqtt_broker_failures_total Failed connects and health "
+         "checks of an upstream broker.\n"
+         "# TYPE mitmqtt_broker_failures_total counter\n";
+  for (const BrokerMetrics &broker : snapshot.brokers) {
+    out << "mitmqtt_broker_failures_total{broker=\"" << broker.name << "\"} "
+        << broker.failures << "\n";
+  }
+
+  return out.str();
+}
+
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "mqtt_types.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mitmqtt {
+
+// Counter with a single writer, such as a connection's I/O thread, and any
+// number of readers. add() is a plain load and store, no locked instruction.
+class Counter {
+public:
+  void add(uint64_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+  void set(uint64_t value) { value_.store(value, std::memory_order_relaxed); }
+  uint64_t load() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value_{0};
+};
+
+// Log-linear (HDR-style) histogram of nanosecond durations.
+//
+// Each power of two is split into 16 buckets, so a recorded value is off by
+// at most 1/16 of itself, from 16 ns up to about 18 minutes; longer values
+// land in the last bucket. record() is one relaxed increment and may be
+// called from any thread.
+class LatencyHistogram {
+public:
+  static constexpr unsigned kSubBits = 4;
+  static constexpr size_t kSubBuckets = size_t(1) << kSubBits;
+  static constexpr unsigned kMaxExponent = 40;
+  static constexpr size_t kBuckets =
+      (kMaxExponent - kSubBits + 2) * kSubBuckets;
+
+  // Counts at one point in time
+  struct Snapshot {
+    std::vector<uint64_t> counts; // kBuckets entries, empty when never taken
+    uint64_t count = 0;
+    uint64_t sum = 0; // Nanoseconds
+
+    // Upper bound of the bucket holding quantile `q` (0..1), 0 when empty
+    uint64_t quantile(double q) const;
+    double mean() const { return count ? double(sum) / double(count) : 0; }
+  };
+
+  void record(uint64_t nanos);
+  void record(std::chrono::steady_clock::duration duration) {
+    auto nanos =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    record(nanos > 0 ? static_cast<uint64_t>(nanos) : 0);
+  }
+
+  Snapshot snapshot() const;
+
+  static size_t bucketOf(uint64_t nanos);
+  static uint64_t bucketUpperBound(size_t bucket);
+
+private:
+  std::array<std::atomic<uint64_t>, kBuckets> counts_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+};
+
+// Traffic of one or more connections, as plain numbers
+struct TrafficTotals {
+  // By PacketDirection
+  std::array<uint64_t, 2> bytes{};
+  std::array<std::array<uint64_t, 16>, 2> packets{}; // By type nibble
+  std::array<uint64_t, 2> queuedBytes{}; // Waiting to be written
+
+  uint64_t readErrors = 0;
+  uint64_t writeErrors = 0;
+
+  uint64_t packetCount(PacketDirection direction) const;
+};
+
+// Counters of one connection, written only on the connection's I/O thread
+class ConnectionStats {
+public:
+  void addBytes(PacketDirection direction, size_t bytes) {
+    directions_[index(direction)].bytes.add(bytes);
+  }
+  void addPacket(PacketDirection direction, uint8_t type) {
+    directions_[index(direction)].packets[type & 0x0F].add();
+  }
+  // Current depth of the outbound queue in `direction`
+  void setQueued(PacketDirection direction, size_t bytes) {
+    directions_[index(direction)].queued.set(bytes);
+  }
+  void addReadError() { readErrors_.add(); }
+  size_t queued(PacketDirection direction) const {
+    return directions_[index(direction)].queued.load();
+  }
+  void addWriteError() { writeErrors_.add(); }
+
+  // Add to `totals`, from any thread
+  void addTo(TrafficTotals &totals) const;
+
+private:
+  static size_t index(PacketDirection direction) {
+    return direction == PacketDirection::ClientToBroker ? 0 : 1;
+  }
+
+  struct Direction {
+    Counter bytes;
+    std::array<Counter, 16> packets;
+    Counter queued;
+  };
+
+  std::array<Direction, 2> directions_;
+  Counter readErrors_;
+  Counter writeErrors_;
+
+  // Folded into ProxyMetrics, guarded by its mutex
+  bool retired_ = false;
+  friend class ProxyMetrics;
+};
+
+// TLS handshakes on one side of the proxy
+class TLSHandshakeStats {
+public:
+  struct Snapshot {
+    LatencyHistogram::Snapshot durations; // Successful handshakes
+    uint64_t failures = 0;
+    uint64_t resumed = 0; // Successful and resumed a session
+  };
+
+  void record(std::chrono::steady_clock::duration duration, bool succeeded,
+              bool resumed) {
+    if (!succeeded) {
+      failures_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    durations_.record(duration);
+    if (resumed)
+      resumed_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const;
+
+private:
+  LatencyHistogram durations_;
+  std::atomic<uint64_t> failures_{0};
+  std::atomic<uint64_t> resumed_{0};
+};
+
+// One upstream broker of the pool
+struct BrokerMetrics {
+  std::string name; // host:port
+  bool up = true;
+  uint64_t connections = 0; // Open or connecting
+  uint64_t failures = 0;    // Failed connects and health checks
+};
+
+struct MetricsSnapshot {
+  uint64_t connectionsOpened = 0;
+  uint64_t connectionsActive = 0;
+  TrafficTotals traffic;
+
+  // Read completion to write completion, by direction
+  std::array<LatencyHistogram::Snapshot, 2> proxyLatency;
+
+  TLSHandshakeStats::Snapshot clientTLS; // Accepting clients
+  TLSHandshakeStats::Snapshot brokerTLS; // Connecting to the broker
+
+  // Client handshakes running, waiting for a slot, and turned away
+  uint64_t handshakesActive = 0;
+  uint64_t handshakesQueued = 0;
+  uint64_t handshakesRejected = 0;
+
+  // Clients dropped for not sending CONNECT in time, or for going silent
+  uint64_t connectTimeouts = 0;
+  uint64_t idleTimeouts = 0;
+
+  std::vector<BrokerMetrics> brokers;
+};
+
+// Process-level metrics of a proxy: histograms shared by all connections,
+// and the totals of connections that have closed.
+class ProxyMetrics {
+public:
+  void connectionOpened() {
+    connectionsOpened_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void connectTimedOut() {
+    connectTimeouts_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void idleTimedOut() { idleTimeouts_.fetch_add(1, std::memory_order_relaxed); }
+
+  // Fold a closing connection's counters into the totals. Its queues have
+  // been cleared; their depth is not carried over.
+  void retire(ConnectionStats &stats);
+
+  void recordProxyLatency(PacketDirection direction,
+                          std::chrono::steady_clock::duration latency) {
+    proxyLatency_[direction == PacketDirection::ClientToBroker ? 0 : 1]
+        .record(latency);
+  }
+
+  void recordClientTLSHandshake(std::chrono::steady_clock::duration duration,
+                                bool succeeded, bool resumed) {
+    clientTLS_.record(duration, succeeded, resumed);
+  }
+  void recordBrokerTLSHandshake(std::chrono::steady_clock::duration duration,
+                                bool succeeded, bool resumed) {
+    brokerTLS_.record(duration, succeeded, resumed);
+  }
+
+  // Totals including the connections in `live` that have not retired
+  MetricsSnapshot snapshot(const std::vector<const ConnectionStats *> &live);
+
+private:
+  std::atomic<uint64_t> connectionsOpened_{0};
+  std::atomic<uint64_t> connectTimeouts_{0};
+  std::atomic<uint64_t> idleTimeouts_{0};
+  std::array<LatencyHistogram, 2> proxyLatency_;
+  TLSHandshakeStats clientTLS_;
+  TLSHandshakeStats brokerTLS_;
+
+  std::mutex mutex_;
+  TrafficTotals retired_;
+  uint64_t connectionsRetired_ = 0;
+};
+
+// Prometheus text exposition format (version 0.0.4)
+std::string formatPrometheus(const MetricsSnapshot &snapshot);
+
+}
@@ -0,0 +1,135 @@
+#include "metrics_server.hpp"
+#include "../utils/logger.hpp"
+#include <chrono>
+#include <istream>
+
+namespace mitmqtt {
+
+class MetricsServer::Session : public std::enable_shared_from_this<Session> {
+public:
+  Session(boost::asio::ip::tcp::socket socket, Render render)
+      : socket_(std::move(socket)), timer_(socket_.get_executor()),
+        request_(8192), render_(std::move(render)) {}
+
+  void start() {
+    auto self = shared_from_this();
+    timer_.expires_after(std::chrono::seconds(5));
+    timer_.async_wait([this, self](const boost::system::error_code &ec) {
+      if (!ec) {
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+      }
+    });
+
+    boost::asio::async_read_until(
+        socket_, request_, "\r\n\r\n",
+        [this, self](const boost::system::error_code &ec, size_t) {
+          if (ec) {
+            timer_.cancel();
+            return;
+          }
+          respond();
+        });
+  }
+
+private:
+  void respond() {
+    std::istream stream(&request_);
+    std::string method, target;
+    stream >> method >> target;
+
+    std::string status = "200 OK";
+    std::string body;
+    if (method != "GET") {
+      status = "405 Method Not Allowed";
+    } else if (target == "/metrics" || target.rfind("/metrics?", 0) == 0) {
+      body = render_();
+    } else {
+      status = "404 Not Found";
+    }
+
+    response_ = "HTTP/1.1 " + status +
+                "\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " +
+                std::to_string(body.size()) +
+                "\r\nConnection: close\r\n\r\n" + body;
+
+    auto self = shared_from_this();
+    boost::asio::async_write(
+        socket_, boost::asio::buffer(response_),
+        [this, self](const boost::system::error_code &, size_t) {
+          timer_.cancel();
+          boost::system::error_code ignored;
+          socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both,
+                           ignored);
+          socket_.close(ignored);
+        });
+  }
+
+  boost::asio::ip::tcp::socket socket_;
+  boost::asio::steady_timer timer_;
+  boost::asio::streambuf request_;
+  std::string response_;
+  Render render_;
+};
+
+struct MetricsServer::Listener : std::enable_shared_from_this<Listener> {
+  Listener(boost::asio::io_context &ioc, Render render)
+      : acceptor(ioc), render(std::move(render)) {}
+
+  void accept() {
+    auto self = shared_from_this();
+    acceptor.async_accept([this, self](boost::system::error_code ec,
+                                       boost::asio::ip::tcp::socket socket) {
+      if (ec) {
+        if (ec != boost::asio::error::operation_aborted)
+          MITMQTT_LOG_WARN("Metrics accept error: " << ec.message());
+        return;
+      }
+      std::make_shared<Session>(std::move(socket), render)->start();
+      accept();
+    });
+  }
+
+  boost::asio::ip::tcp::acceptor acceptor;
+  Render render;
+};
+
+MetricsServer::MetricsServer(boost::asio::io_context &ioc, Render render)
+    : ioc_(ioc), render_(std::move(render)), port_(0) {}
+
+MetricsServer::~MetricsServer() { stop(); }
+
+void MetricsServer::start(const std::string &address, uint16_t port) {
+  stop();
+
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::make_address(address), port);
+  auto listener = std::make_shared<Listener>(ioc_, render_);
+  listener->acceptor.open(endpoint.protocol());
+  listener->acceptor.set_option(
+      boost::asio::socket_base::reuse_address(true));
+  listener->acceptor.bind(endpoint);
+  listener->acceptor.listen();
+  port_ = listener->acceptor.local_endpoint().port();
+
+  MITMQTT_LOG_INFO("Metrics on http://" << address << ":" << port_
+                                        << "/metrics");
+  listener->accept();
+  listener_ = std::move(listener);
+}
+
+void MetricsServer::stop() {
+  if (!listener_)
+    return;
+
+  // Close on the acceptor's own thread
+  boost::asio::post(ioc_, [listener = std::move(listener_)]() {
+    boost::system::error_code ec;
+    listener->acceptor.close(ec);
+  });
+  listener_.reset();
+  port_ = 0;
+}
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace mitmqtt {
+
+// Minimal HTTP endpoint for Prometheus scrapes.
+//
+// Answers GET /metrics with whatever `render` returns and closes the
+// connection; every other request gets 404. Runs on the io_context it was
+// created on. A scraper that does not send its request within a few
+// seconds is disconnected.
+class MetricsServer {
+public:
+  using Render = std::function<std::string()>;
+
+  MetricsServer(boost::asio::io_context &ioc, Render render);
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer &) = delete;
+  MetricsServer &operator=(const MetricsServer &) = delete;
+
+  // Throws if the address cannot be bound
+  void start(const std::string &address, uint16_t port);
+  void stop();
+
+  bool running() const { return listener_ != nullptr; }
+  uint16_t port() const { return port_; }
+
+private:
+  // Owned by its pending accept as well, so it outlives stop()
+  struct Listener;
+  class Session;
+
+  boost::asio::io_context &ioc_;
+  Render render_;
+  std::shared_ptr<Listener> listener_;
+  uint16_t port_;
+};
+
+}
@@ -0,0 +1,425 @@
+#include "mqtt_decoder.hpp"
+
+namespace mitmqtt {
+
+namespace {
+std::string_view view(const uint8_t *data, size_t size) {
+  return std::string_view(reinterpret_cast<const char *>(data), size);
+}
+
+// Bounds-checked reads over part of a frame
+struct Reader {
+  const uint8_t *at;
+  const uint8_t *end;
+
+  size_t left() const { return static_cast<size_t>(end - at); }
+  bool done() const { return at == end; }
+
+  bool byte(uint8_t &value) {
+    if (at == end)
+      return false;
+    value = *at++;
+    return true;
+  }
+  bool u16(uint16_t &value) {
+    if (left() < 2)
+      return false;
+    value = static_cast<uint16_t>((at[0] << 8) | at[1]);
+    at += 2;
+    return true;
+  }
+  bool u32(uint32_t &value) {
+    if (left() < 4)
+      return false;
+    value = (uint32_t(at[0]) << 24) | (uint32_t(at[1]) << 16) |
+            (uint32_t(at[2]) << 8) | uint32_t(at[3]);
+    at += 4;
+    return true;
+  }
+  bool varint(uint32_t &value) {
+    size_t used = decodeRemainingLength(at, left(), value);
+    at += used;
+    return used != 0;
+  }
+  // Two-byte length prefixed string or binary data
+  bool string(std::string_view &value) {
+    uint16_t length;
+    if (!u16(length) || length > left())
+      return false;
+    value = view(at, length);
+    at += length;
+    return true;
+  }
+  // MQTT 5 property block, length prefix included
+  bool properties(std::string_view &value) {
+    const uint8_t *start = at;
+    uint32_t length;
+    if (!varint(length) || length > left())
+      return false;
+    at += length;
+    value = view(start, static_cast<size_t>(at - start));
+    return true;
+  }
+  std::string_view rest() {
+    std::string_view value = view(at, left());
+    at = end;
+    return value;
+  }
+};
+
+// Each decoder reads the body after the fixed header, which the caller has
+// bounded to the remaining length and whose flags it has checked
+using Decoder = bool (*)(Reader &body, PacketView &packet);
+
+bool decodeConnect(Reader &body, PacketView &packet) {
+  std::string_view protocol, skipped;
+  if (!body.string(protocol) || !body.byte(packet.protocolLevel) ||
+      !body.byte(packet.flags) || !body.u16(packet.keepAlive))
+    return false;
+  // Bit 0 of the connect flags is reserved
+  if ((packet.flags & 0x01) != 0)
+    return false;
+  if (packet.protocolLevel >= 5 && !body.properties(packet.properties))
+    return false;
+
+  if (!body.string(packet.clientId))
+    return false;
+  if ((packet.flags & 0x04) != 0) {
+    // Will properties, topic and payload
+    if (packet.protocolLevel >= 5 && !body.properties(skipped))
+      return false;
+    if (!body.string(skipped) || !body.string(skipped))
+      return false;
+  }
+  if ((packet.flags & 0x80) != 0 && !body.string(packet.username))
+    return false;
+  if ((packet.flags & 0x40) != 0 && !body.string(skipped))
+    return false;
+  return body.done();
+}
+
+bool decodeConnack(Reader &body, PacketView &packet) {
+  if (!body.byte(packet.flags) || !body.byte(packet.reasonCode))
+    return false;
+  // Only session present is defined
+  if ((packet.flags & 0xFE) != 0)
+    return false;
+  if (packet.protocolLevel >= 5 && !body.properties(packet.properties))
+    return false;
+  return body.done();
+}
+
+bool decodePublish(Reader &body, PacketView &packet) {
+  if (!body.string(packet.topic))
+    return false;
+  if (packet.qos() > 0 &&
+      (!body.u16(packet.packetId) || packet.packetId == 0))
+    return false;
+  if (packet.protocolLevel >= 5 && !body.properties(packet.properties))
+    return false;
+  packet.payload = body.rest();
+  return true;
+}
+
+// MQTT 5 lets a packet end before its reason code (success) or before its
+// properties (none)
+bool decodeReasonTail(Reader &body, PacketView &packet) {
+  if (packet.protocolLevel < 5 || body.done())
+    return body.done();
+  if (!body.byte(packet.reasonCode))
+    return false;
+  if (!body.done() && !body.properties(packet.properties))
+    return false;
+  return body.done();
+}
+
+// PUBACK, PUBREC, PUBREL and PUBCOMP
+bool decodeAck(Reader &body, PacketView &packet) {
+  return body.u16(packet.packetId) && decodeReasonTail(body, packet);
+}
+
+// Packet id and, for MQTT 5, properties, ahead of the payload
+bool decodeIdentified(Reader &body, PacketView &packet) {
+  if (!body.u16(packet.packetId) || packet.packetId == 0)
+    return false;
+  if (packet.protocolLevel >= 5 && !body.properties(packet.properties))
+    return false;
+  packet.payload = body.rest();
+  return true;
+}
+
+bool decodeSubscribe(Reader &body, PacketView &packet) {
+  if (!decodeIdentified(body, packet) || packet.payload.empty())
+    return false;
+
+  // Check every filter now so TopicFilterReader never meets a bad one
+  auto data = reinterpret_cast<const uint8_t *>(packet.payload.data());
+  Reader filters{data, data + packet.payload.size()};
+  uint8_t reserved = packet.protocolLevel >= 5 ? 0xC0 : 0xFC;
+  while (!filters.done()) {
+    std::string_view filter;
+    uint8_t options;
+    if (!filters.string(filter) || !filters.byte(options))
+      return false;
+    // QoS 3 and, in MQTT 5, retain handling 3 are reserved
+    if ((options & reserved) != 0 || (options & 0x03) == 3 ||
+        ((options >> 4) & 0x03) == 3)
+      return false;
+  }
+  return true;
+}
+
+bool decodeUnsubscribe(Reader &body, PacketView &packet) {
+  if (!decodeIdentified(body, packet) || packet.payload.empty())
+    return false;
+
+  auto data = reinterpret_cast<const uint8_t *>(packet.payload.data());
+  Reader filters{data, data + packet.payload.size()};
+  while (!filters.done()) {
+    std::string_view filter;
+    if (!filters.string(filter))
+      return false;
+  }
+  return true;
+}
+
+// SUBACK and UNSUBACK, whose payload is a reason code per filter; an MQTT
+// 3.1.1 UNSUBACK has none
+bool decodeSuback(Reader &body, PacketView &packet) {
+  if (!decodeIdentified(body, packet))
+    return false;
+  bool codes = packet.protocolLevel >= 5 || packet.type() == 9;
+  return codes != packet.payload.empty();
+}
+
+bool decodeEmpty(Reader &body, PacketView &) { return body.done(); }
+
+bool decodeDisconnect(Reader &body, PacketView &packet) {
+  return decodeReasonTail(body, packet);
+}
+
+bool decodeAuth(Reader &body, PacketView &packet) {
+  return packet.protocolLevel >= 5 && decodeReasonTail(body, packet);
+}
+
+struct PacketTypeInfo {
+  std::string_view name;
+  uint8_t flags; // Required fixed header flags, kAnyFlags for PUBLISH
+  Decoder decode; // Null for reserved types
+};
+
+constexpr uint8_t kAnyFlags = 0xFF;
+
+constexpr PacketTypeInfo kPacketTypes[16] = {
+    {"OTHER", 0x0, nullptr},
+    {"CONNECT", 0x0, decodeConnect},
+    {"CONNACK", 0x0, decodeConnack},
+    {"PUBLISH", kAnyFlags, decodePublish},
+    {"PUBACK", 0x0, decodeAck},
+    {"PUBREC", 0x0, decodeAck},
+    {"PUBREL", 0x2, decodeAck},
+    {"PUBCOMP", 0x0, decodeAck},
+    {"SUBSCRIBE", 0x2, decodeSubscribe},
+    {"SUBACK", 0x0, decodeSuback},
+    {"UNSUBSCRIBE", 0x2, decodeUnsubscribe},
+    {"UNSUBACK", 0x0, decodeSuback},
+    {"PINGREQ", 0x0, decodeEmpty},
+    {"PINGRESP", 0x0, decodeEmpty},
+    {"DISCONNECT", 0x0, decodeDisconnect},
+    {"AUTH", 0x0, decodeAuth},
+};
+
+static_assert(kPacketTypes[static_cast<uint8_t>(PacketType::AUTH)].name ==
+                  "AUTH",
+              "packet type table out of order");
+
+enum class PropertyKind : uint8_t {
+  None,
+  Byte,
+  TwoByte,
+  FourByte,
+  Varint,
+  Binary, // Also UTF-8 strings
+  Pair
+};
+
+constexpr PropertyKind propertyKind(uint32_t id) {
+  switch (static_cast<PropertyId>(id)) {
+  case PropertyId::PayloadFormat:
+  case PropertyId::RequestProblemInfo:
+  case PropertyId::RequestResponseInfo:
+  case PropertyId::MaximumQoS:
+  case PropertyId::RetainAvailable:
+  case PropertyId::WildcardSubscriptions:
+  case PropertyId::SubscriptionIds:
+  case PropertyId::SharedSubscriptions:
+    return PropertyKind::Byte;
+  case PropertyId::ServerKeepAlive:
+  case PropertyId::ReceiveMaximum:
+  case PropertyId::TopicAliasMaximum:
+  case PropertyId::TopicAlias:
+    return PropertyKind::TwoByte;
+  case PropertyId::MessageExpiry:
+  case PropertyId::SessionExpiry:
+  case PropertyId::WillDelay:
+  case PropertyId::MaximumPacketSize:
+    return PropertyKind::FourByte;
+  case PropertyId::SubscriptionId:
+    return PropertyKind::Varint;
+  case PropertyId::ContentType:
+  case PropertyId::ResponseTopic:
+  case PropertyId::CorrelationData:
+  case PropertyId::AssignedClientId:
+  case PropertyId::AuthMethod:
+  case PropertyId::AuthData:
+  case PropertyId::ResponseInfo:
+  case PropertyId::ServerReference:
+  case PropertyId::ReasonString:
+    return PropertyKind::Binary;
+  case PropertyId::UserProperty:
+    return PropertyKind::Pair;
+  }
+  return PropertyKind::None;
+}
+
+// Property kinds by id, so reading one is a table lookup
+constexpr auto kPropertyKinds = [] {
+  struct Table {
+    PropertyKind kinds[0x2B] = {};
+  } table;
+  for (uint32_t id = 0; id < 0x2B; ++id)
+    table.kinds[id] = propertyKind(id);
+  return table;
+}();
+}
+
+std::string_view packetTypeName(uint8_t type) {
+  return kPacketTypes[type & 0x0F].name;
+}
+
+const char *packetTypeToString(uint8_t type) {
+  // The names are literals, so NUL terminated
+  return packetTypeName(type).data();
+}
+
+bool validFixedHeaderFlags(uint8_t header) {
+  const PacketTypeInfo &info = kPacketTypes[(header >> 4) & 0x0F];
+  if (!info.decode)
+    return false;
+  if (info.flags != kAnyFlags)
+    return (header & 0x0F) == info.flags;
+
+  uint8_t qos = (header >> 1) & 0x03;
+  return qos != 3 && (qos != 0 || (header & 0x08) == 0);
+}
+
+bool decodePacket(const FrameView &frame, uint8_t protocolLevel,
+                  PacketView &packet) {
+  packet = PacketView();
+  packet.protocolLevel = protocolLevel;
+  if (frame.empty())
+    return false;
+  packet.header = frame.firstByte();
+
+  const PacketTypeInfo &info = kPacketTypes[packet.type()];
+  if (!validFixedHeaderFlags(packet.header))
+    return false;
+
+  uint32_t remainingLength = 0;
+  size_t used =
+      decodeRemainingLength(frame.data + 1, frame.size - 1, remainingLength);
+  if (used == 0 || remainingLength > frame.size - 1 - used)
+    return false;
+  const uint8_t *body = frame.data + 1 + used;
+  Reader reader{body, body + remainingLength};
+  return info.decode(reader, packet);
+}
+
+PropertyReader::PropertyReader(std::string_view properties)
+    : cursor_(reinterpret_cast<const uint8_t *>(properties.data())),
+      end_(cursor_), malformed_(false) {
+  if (properties.empty())
+    return;
+  Reader reader{cursor_, cursor_ + properties.size()};
+  uint32_t length;
+  if (!reader.varint(length) || length > reader.left()) {
+    malformed_ = true;
+    return;
+  }
+  cursor_ = reader.at;
+  end_ = reader.at + length;
+}
+
+bool PropertyReader::next(Property &property) {
+  if (malformed_ || cursor_ == end_)
+    return false;
+
+  Reader reader{cursor_, end_};
+  uint32_t id;
+  property = Property();
+  bool ok = reader.varint(id);
+  PropertyKind kind = ok && id < sizeof(kPropertyKinds.kinds)
+                          ? kPropertyKinds.kinds[id]
+                          : PropertyKind::None;
+  property.id = static_cast<PropertyId>(id);
+
+  uint8_t byte = 0;
+  uint16_t twoBytes = 0;
+  switch (kind) {
+  case PropertyKind::Byte:
+    ok = reader.byte(byte);
+    property.number = byte;
+    break;
+  case PropertyKind::TwoByte:
+    ok = reader.u16(twoBytes);
+    property.number = twoBytes;
+    break;
+  case PropertyKind::FourByte:
+    ok = reader.u32(property.number);
+    break;
+  case PropertyKind::Varint:
+    ok = reader.varint(property.number);
+    break;
+  case PropertyKind::Binary:
+    ok = reader.string(property.value);
+    break;
+  case PropertyKind::Pair:
+    ok = reader.string(property.value) && reader.string(property.pairValue);
+    break;
+  case PropertyKind::None:
+    ok = false;
+    break;
+  }
+
+  if (!ok) {
+    malformed_ = true;
+    return false;
+  }
+  cursor_ = reader.at;
+  return true;
+}
+
+bool PropertyReader::find(std::string_view properties, PropertyId id,
+                          Property &property) {
+  PropertyReader reader(properties);
+  while (reader.next(property)) {
+    if (property.id == id)
+      return true;
+  }
+  return false;
+}
+
+TopicFilterReader::TopicFilterReader(const PacketView &packet)
+    : cursor_(reinterpret_cast<const uint8_t *>(packet.payload.data())),
+      end_(cursor_ + packet.payload.size()), options_(packet.type() == 8) {}
+
+bool TopicFilterReader::next(std::string_view &filter, uint8_t &options) {
+  Reader reader{cursor_, end_};
+  options = 0;
+  if (!reader.string(filter) || (options_ && !reader.byte(options)))
+    return false;
+  cursor_ = reader.at;
+  return true;
+}
+
+}
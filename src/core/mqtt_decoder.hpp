@@ -0,0 +1,125 @@
+#pragma once
+
+#include "mqtt_framer.hpp"
+#include "mqtt_types.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace mitmqtt {
+
+// Name of an MQTT control packet type nibble, "OTHER" for reserved values
+std::string_view packetTypeName(uint8_t type);
+const char *packetTypeToString(uint8_t type);
+
+// True if the fixed header flags are the ones the type requires: 0010 for
+// PUBREL, SUBSCRIBE and UNSUBSCRIBE, 0000 for the others, and for PUBLISH a
+// QoS below 3 and DUP only with QoS 1 or 2
+bool validFixedHeaderFlags(uint8_t header);
+
+// MQTT 5 property identifiers
+enum class PropertyId : uint8_t {
+  PayloadFormat = 0x01,
+  MessageExpiry = 0x02,
+  ContentType = 0x03,
+  ResponseTopic = 0x08,
+  CorrelationData = 0x09,
+  SubscriptionId = 0x0B,
+  SessionExpiry = 0x11,
+  AssignedClientId = 0x12,
+  ServerKeepAlive = 0x13,
+  AuthMethod = 0x15,
+  AuthData = 0x16,
+  RequestProblemInfo = 0x17,
+  WillDelay = 0x18,
+  RequestResponseInfo = 0x19,
+  ResponseInfo = 0x1A,
+  ServerReference = 0x1C,
+  ReasonString = 0x1F,
+  ReceiveMaximum = 0x21,
+  TopicAliasMaximum = 0x22,
+  TopicAlias = 0x23,
+  MaximumQoS = 0x24,
+  RetainAvailable = 0x25,
+  UserProperty = 0x26,
+  MaximumPacketSize = 0x27,
+  WildcardSubscriptions = 0x28,
+  SubscriptionIds = 0x29,
+  SharedSubscriptions = 0x2A
+};
+
+// One MQTT 5 property, as views into its packet
+struct Property {
+  PropertyId id = PropertyId::PayloadFormat;
+  uint32_t number = 0;        // Byte, two and four byte and varint values
+  std::string_view value;     // Strings and binary data, a user property's name
+  std::string_view pairValue; // A user property's value
+};
+
+// Walks a property block one property at a time. Decoding a packet only
+// finds where its properties are; they are parsed when read here.
+class PropertyReader {
+public:
+  // `properties` as in PacketView, length prefix included; empty for none
+  explicit PropertyReader(std::string_view properties);
+
+  // The next property, false at the end or at a malformed one
+  bool next(Property &property);
+  bool malformed() const { return malformed_; }
+
+  // The first property `id`, false if there is none
+  static bool find(std::string_view properties, PropertyId id,
+                   Property &property);
+
+private:
+  const uint8_t *cursor_;
+  const uint8_t *end_;
+  bool malformed_;
+};
+
+// Fields of one control packet, as views into its frame. Which ones are set
+// depends on the type; see decodePacket().
+struct PacketView {
+  uint8_t header = 0;
+  uint8_t protocolLevel = 0; // Decoded for; CONNECT's own level
+  uint16_t packetId = 0;
+  uint8_t flags = 0;      // CONNECT flags, CONNACK acknowledge flags
+  uint8_t reasonCode = 0; // CONNACK return code, MQTT 5 reason codes
+  uint16_t keepAlive = 0; // CONNECT
+  std::string_view clientId; // CONNECT
+  std::string_view username; // CONNECT, if the flags say so
+  std::string_view topic;    // PUBLISH
+  // MQTT 5, length prefix included; empty for none
+  std::string_view properties;
+  // PUBLISH payload, the topic filters of SUBSCRIBE and UNSUBSCRIBE, the
+  // reason codes of SUBACK and UNSUBACK
+  std::string_view payload;
+
+  uint8_t type() const { return (header >> 4) & 0x0F; }
+  uint8_t qos() const { return (header >> 1) & 0x03; }
+};
+
+// Decode a complete frame from a connection speaking MQTT `protocolLevel`
+// (4 for 3.1.1, 5) with the decoder the type's table entry names, checking
+// its fixed header flags. Nothing is copied or allocated. Returns false if
+// the packet is malformed; the fields read before the fault stay set.
+bool decodePacket(const FrameView &frame, uint8_t protocolLevel,
+                  PacketView &packet);
+
+// Walks the topic filters of a decoded SUBSCRIBE or UNSUBSCRIBE, which
+// decodePacket() has already checked
+class TopicFilterReader {
+public:
+  explicit TopicFilterReader(const PacketView &packet);
+
+  // The next filter and, for SUBSCRIBE, its options byte (0 otherwise);
+  // false at the end
+  bool next(std::string_view &filter, uint8_t &options);
+
+private:
+  const uint8_t *cursor_;
+  const uint8_t *end_;
+  bool options_;
+};
+
+}
@@ -0,0 +1,188 @@
+#include "mqtt_framer.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace mitmqtt {
+
+MQTTFramer::MQTTFramer(size_t capacity, size_t maxFrameSize)
+    : buffer_(std::max<size_t>(capacity, 16)), readPos_(0), writePos_(0),
+      state_(State::FixedHeader), headerLength_(0), remainingLength_(0),
+      multiplier_(1), maxFrameSize_(maxFrameSize), oversizeTotal_(0),
+      oversizeFilled_(0), oversizeActive_(false), oversizeDelivered_(false),
+      malformed_(false) {}
+
+uint8_t *MQTTFramer::prepare(size_t &writable) {
+  if (oversizeActive_) {
+    if (!oversizeDelivered_) {
+      // Grow only by what a peer has actually sent, doubling, so a
+      // declared length costs nothing until its bytes arrive
+      if (oversizeFilled_ == oversize_.size()) {
+        size_t step = std::max(oversizeFilled_, buffer_.size());
+        oversize_.resize(std::min(oversizeTotal_, oversizeFilled_ + step));
+      }
+      // Read straight into the assembly buffer, never past the frame end
+      writable = oversize_.size() - oversizeFilled_;
+      return oversize_.data() + oversizeFilled_;
+    }
+
+    // The large frame has been handed out, give its memory back
+    std::vector<uint8_t>().swap(oversize_);
+    oversizeTotal_ = 0;
+    oversizeFilled_ = 0;
+    oversizeActive_ = false;
+    oversizeDelivered_ = false;
+  }
+
+  if (readPos_ == writePos_) {
+    readPos_ = 0;
+    writePos_ = 0;
+  } else if (readPos_ > 0 && buffer_.size() - writePos_ < buffer_.size() / 2) {
+    // Only a partial frame is left, move it to the front
+    size_t pending = writePos_ - readPos_;
+    std::memmove(buffer_.data(), buffer_.data() + readPos_, pending);
+    readPos_ = 0;
+    writePos_ = pending;
+  }
+
+  writable = buffer_.size() - writePos_;
+  return buffer_.data() + writePos_;
+}
+
+void MQTTFramer::commit(size_t length) {
+  if (oversizeActive_) {
+    oversizeFilled_ = std::min(oversizeFilled_ + length, oversize_.size());
+  } else {
+    writePos_ = std::min(writePos_ + length, buffer_.size());
+  }
+}
+
+bool MQTTFramer::parseHeader() {
+  if (state_ == State::FixedHeader) {
+    if (readPos_ == writePos_)
+      return false;
+    headerLength_ = 1;
+    remainingLength_ = 0;
+    multiplier_ = 1;
+    state_ = State::RemainingLength;
+  }
+
+  if (state_ == State::RemainingLength) {
+    // Resume where the previous read left off
+    while (readPos_ + headerLength_ < writePos_) {
+      uint8_t encodedByte = buffer_[readPos_ + headerLength_];
+      headerLength_++;
+      remainingLength_ += (encodedByte & 0x7F) * multiplier_;
+
+      if ((encodedByte & 0x80) == 0) {
+        state_ = State::Body;
+        return true;
+      }
+
+      // At most four remaining length bytes
+      if (headerLength_ == 5) {
+        malformed_ = true;
+        return false;
+      }
+      multiplier_ *= 128;
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool MQTTFramer::next(FrameView &frame) {
+  if (malformed_)
+    return false;
+
+  if (oversizeActive_) {
+    if (oversizeDelivered_ || oversizeFilled_ < oversizeTotal_)
+      return false;
+
+    frame.data = oversize_.data();
+    frame.size = oversize_.size();
+    oversizeDelivered_ = true;
+    state_ = State::FixedHeader;
+    return true;
+  }
+
+  if (!parseHeader())
+    return false;
+
+  size_t total = headerLength_ + remainingLength_;
+  size_t available = writePos_ - readPos_;
+
+  if (total > maxFrameSize_) {
+    malformed_ = true;
+    return false;
+  }
+
+  if (total > buffer_.size()) {
+    // Everything buffered belongs to this frame; continue in a buffer that
+    // grows until it holds it whole
+    oversize_.resize(available);
+    std::memcpy(oversize_.data(), buffer_.data() + readPos_, available);
+    oversizeTotal_ = total;
+    oversizeFilled_ = available;
+    oversizeActive_ = true;
+    oversizeDelivered_ = false;
+    readPos_ = 0;
+    writePos_ = 0;
+    return false;
+  }
+
+  if (available < total)
+    return false;
+
+  frame.data = buffer_.data() + readPos_;
+  frame.size = total;
+  readPos_ += total;
+  state_ = State::FixedHeader;
+  return true;
+}
+
+size_t MQTTFramer::buffered() const {
+  if (oversizeActive_)
+    return oversizeDelivered_ ? 0 : oversizeFilled_;
+  return writePos_ - readPos_;
+}
+
+void MQTTFramer::reset() {
+  std::vector<uint8_t>().swap(oversize_);
+  oversizeTotal_ = 0;
+  oversizeFilled_ = 0;
+  oversizeActive_ = false;
+  oversizeDelivered_ = false;
+  readPos_ = 0;
+  writePos_ = 0;
+  state_ = State::FixedHeader;
+  malformed_ = false;
+}
+
+size_t encodeRemainingLength(size_t length, std::vector<uint8_t> &out) {
+  size_t written = 0;
+  do {
+    uint8_t encodedByte = length % 128;
+    length /= 128;
+    if (length > 0)
+      encodedByte |= 0x80;
+    out.push_back(encodedByte);
+    ++written;
+  } while (length > 0);
+  return written;
+}
+
+size_t decodeRemainingLength(const uint8_t *data, size_t size,
+                             uint32_t &length) {
+  length = 0;
+  uint32_t multiplier = 1;
+  for (size_t i = 0; i < 4 && i < size; ++i) {
+    length += (data[i] & 0x7F) * multiplier;
+    multiplier *= 128;
+    if ((data[i] & 0x80) == 0)
+      return i + 1;
+  }
+  return 0;
+}
+
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mitmqtt {
+
+// Non-owning view of one complete MQTT control packet (fixed header included)
+struct FrameView {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+
+  bool empty() const { return size == 0; }
+  uint8_t firstByte() const { return data[0]; }
+  uint8_t typeNibble() const { return (data[0] >> 4) & 0x0F; }
+};
+
+// Incremental MQTT stream framer.
+//
+// Socket reads land directly in a per-connection receive buffer via
+// prepare()/commit(). next() then carves complete packets out of it as
+// zero-copy views, so one read can yield many frames and a frame can span many
+// reads. The fixed header/remaining-length decoder is resumable: a header split
+// across reads is not re-parsed. Frames larger than the buffer are assembled in
+// a dedicated buffer that grows as their bytes arrive, which is the only case
+// that copies. Frames larger than the maximum frame size make the stream
+// malformed, whatever remaining length they declare.
+//
+// Views returned by next() stay valid until the following prepare() call.
+class MQTTFramer {
+public:
+  // Largest remaining length allowed by the MQTT spec (256 MB)
+  static constexpr size_t kMaxRemainingLength = 268435455;
+  // Largest frame accepted by default, fixed header included
+  static constexpr size_t kDefaultMaxFrameSize = 4 * 1024 * 1024;
+
+  explicit MQTTFramer(size_t capacity = 8192,
+                      size_t maxFrameSize = kDefaultMaxFrameSize);
+
+  // Frames declaring more bytes than this are malformed
+  void setMaxFrameSize(size_t maxFrameSize) { maxFrameSize_ = maxFrameSize; }
+  size_t maxFrameSize() const { return maxFrameSize_; }
+
+  // Writable region for the next read. Compacts consumed bytes out of the
+  // buffer, so it invalidates any views handed out by next().
+  uint8_t *prepare(size_t &writable);
+
+  // Mark `length` bytes of the region returned by prepare() as received
+  void commit(size_t length);
+
+  // Extract the next complete frame. Returns false once more data is needed
+  // or the stream turned out to be malformed.
+  bool next(FrameView &frame);
+
+  // True once the stream contained an invalid remaining length, or a frame
+  // larger than the maximum frame size
+  bool malformed() const { return malformed_; }
+
+  // Bytes received but not yet returned as part of a frame
+  size_t buffered() const;
+
+  // Drop all buffered data and reset the decoder state
+  void reset();
+
+private:
+  enum class State { FixedHeader, RemainingLength, Body };
+
+  // Advance the header state machine over buffered bytes. Returns false if the
+  // header is still incomplete or malformed.
+  bool parseHeader();
+
+  std::vector<uint8_t> buffer_;
+  size_t readPos_;  // Start of the frame currently being decoded
+  size_t writePos_; // End of received data
+
+  State state_;
+  size_t headerLength_;     // Fixed header bytes consumed so far
+  uint32_t remainingLength_;
+  uint32_t multiplier_;
+
+  size_t maxFrameSize_;
+
+  // Assembly buffer for frames that do not fit into buffer_, grown towards
+  // oversizeTotal_ as bytes arrive
+  std::vector<uint8_t> oversize_;
+  size_t oversizeTotal_;
+  size_t oversizeFilled_;
+  bool oversizeActive_;
+  bool oversizeDelivered_;
+
+  bool malformed_;
+};
+
+// Append the variable-length encoding of a remaining length (at most
+// MQTTFramer::kMaxRemainingLength) to `out`. Returns the bytes appended.
+size_t encodeRemainingLength(size_t length, std::vector<uint8_t> &out);
+
+// Decode a variable-length remaining length from the start of `data`.
+// Returns the bytes it occupies, 0 if it is truncated or longer than four
+// bytes.
+size_t decodeRemainingLength(const uint8_t *data, size_t size,
+                             uint32_t &length);
+
+}
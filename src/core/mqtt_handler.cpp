@@ -1,8 +1,9 @@
 #include "mqtt_handler.hpp"
+#include "../utils/logger.hpp"
+#include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <iomanip>
-#include <iostream>
 #include <sstream>
 
 namespace mitmqtt {
@@ -19,74 +20,138 @@ const char *directionToString(PacketDirection direction) {
 }
 
 // MQTT Packet implementation
-MQTTPacket MQTTPacket::fromRawData(const std::vector<uint8_t> &raw) {
+MQTTPacket MQTTPacket::fromRawData(const std::vector<uint8_t> &raw,
+                                   uint8_t protocolLevel) {
+  return fromRawData(raw.data(), raw.size(), protocolLevel);
+}
+
+MQTTPacket MQTTPacket::fromFixedHeader(const uint8_t *raw, size_t size) {
   MQTTPacket packet;
-  if (raw.empty())
+  if (size == 0)
     return packet;
 
-  packet.data = raw;
+  packet.data.assign(raw, raw + size);
   uint8_t firstByte = raw[0];
   packet.type = static_cast<PacketType>((firstByte >> 4) & 0x0F);
   packet.dup = (firstByte & 0x08) != 0;
   packet.qos = (firstByte >> 1) & 0x03;
   packet.retain = (firstByte & 0x01) != 0;
+  return packet;
+}
 
-  // Parse PUBLISH packet for topic and payload
-  if (packet.type == PacketType::PUBLISH && raw.size() > 2) {
-    size_t offset = 1;
-
-    // Decode remaining length (variable length encoding per MQTT spec)
-    uint32_t remainingLength = 0;
-    uint32_t multiplier = 1;
-    uint8_t encodedByte;
-    do {
-      if (offset >= raw.size())
-        return packet; // Malformed packet
-      encodedByte = raw[offset++];
-      remainingLength += (encodedByte & 0x7F) * multiplier;
-      multiplier *= 128;
-      if (multiplier > 128 * 128 * 128)
-        return packet; // Malformed
-    } while ((encodedByte & 0x80) != 0);
-
-    // Read topic length
-    if (offset + 2 <= raw.size()) {
-      uint16_t topicLen = (raw[offset] << 8) | raw[offset + 1];
-      offset += 2;
-
-      // Read topic
-      if (offset + topicLen <= raw.size()) {
-        packet.topic =
-            std::string(reinterpret_cast<const char *>(&raw[offset]), topicLen);
-        offset += topicLen;
-
-        // Skip packet ID for QoS > 0
-        if (packet.qos > 0 && offset + 2 <= raw.size()) {
-          offset += 2;
-        }
+MQTTPacket MQTTPacket::fromRawData(const uint8_t *raw, size_t size,
+                                   uint8_t protocolLevel) {
+  MQTTPacket packet = fromFixedHeader(raw, size);
+  if (packet.type != PacketType::PUBLISH)
+    return packet;
 
-        // Read payload
-        if (offset < raw.size()) {
-          packet.payload =
-              std::string(reinterpret_cast<const char *>(&raw[offset]),
-                          raw.size() - offset);
-        }
-      }
-    }
+  PacketView publish;
+  if (decodePacket(FrameView{raw, size}, protocolLevel, publish)) {
+    packet.topic = std::string(publish.topic);
+    packet.payload = std::string(publish.payload);
   }
-
   return packet;
 }
 
 std::vector<uint8_t> MQTTPacket::toRawData() const { return data; }
 
+std::vector<uint8_t> MQTTPacket::buildPublish(const std::string &topic,
+                                              const std::string &payload) {
+  std::vector<uint8_t> packet;
+  uint16_t topicLen = static_cast<uint16_t>(topic.length());
+  size_t remainingLength = 2 + topicLen + payload.length();
+  packet.reserve(1 + 4 + remainingLength);
+
+  // Fixed header: PUBLISH (0x30)
+  packet.push_back(0x30);
+
+  // Encode remaining length (variable length encoding)
+  encodeRemainingLength(remainingLength, packet);
+
+  // Topic length (MSB, LSB)
+  packet.push_back(static_cast<uint8_t>(topicLen >> 8));
+  packet.push_back(static_cast<uint8_t>(topicLen & 0xFF));
+
+  // Topic
+  packet.insert(packet.end(), topic.begin(), topic.end());
+
+  // Payload
+  packet.insert(packet.end(), payload.begin(), payload.end());
+  return packet;
+}
+
+namespace {
+// Client sessions the TLS listener keeps for resumption, and for how long.
+// Tickets carry their own state and are not limited by the cache size.
+constexpr long kTLSSessionCacheSize = 20480;
+constexpr long kTLSSessionLifetime = 2 * 60 * 60; // Seconds
+
+// Clients get this long to finish the TLS handshake by default
+constexpr int64_t kHandshakeTimeoutMs = 10000;
+// and this long from being accepted to sending CONNECT
+constexpr int64_t kConnectTimeoutMs = 10000;
+
+// A broker that has not accepted the TCP connect in this long is failed
+// over, rather than waiting out the kernel's SYN retries
+constexpr std::chrono::seconds kBrokerConnectTimeout(5);
+
+// Clients are dropped after one and a half keep alive intervals without a
+// packet, as the MQTT specification has brokers do
+constexpr int64_t kKeepAliveGracePermille = 1500;
+
+// Shared by the listener's context and the minted leaf contexts
+const unsigned char kSessionIdContext[] = "mitmqtt";
+constexpr size_t kSessionIdContextLength = sizeof(kSessionIdContext) - 1;
+
+// Send to the connection behind a registry entry, plain or TLS
+void sendThrough(const ConnectionRegistry::Entry &entry, bool toClient,
+                 const std::vector<uint8_t> &data) {
+  entry.visit([&](const auto &conn) {
+    if (toClient)
+      conn->sendToClient(data);
+    else
+      conn->sendToBroker(data);
+  });
+}
+}
+
 // MQTTHandler implementation
+MQTTHandler::MQTTHandler(IOContextPool &pool)
+    : MQTTHandler(pool.getIOContext(0)) {
+  ioPool_ = &pool;
+
+  timerWheels_.clear();
+  for (size_t i = 0; i < pool.size(); ++i) {
+    boost::asio::io_context &context = pool.getIOContext(i);
+    timerWheels_.emplace_back(
+        &context, std::make_unique<TimerWheel>(context.get_executor()));
+  }
+}
+
 MQTTHandler::MQTTHandler(boost::asio::io_context &ioc)
-    : ioc_(ioc), acceptor_(ioc), running_(false),
-      brokerHost_("test.mosquitto.org"), brokerPort_(1883), tlsEnabled_(false),
-      brokerTLSEnabled_(false),
+    : ioc_(ioc), ioPool_(nullptr), acceptor_(ioc), running_(false),
+      captureLevel_(InspectionLevel::None),
+      callbackLevel_(InspectionLevel::None), storeEnabled_(true),
+      zeroCopyEnabled_(false), nextConnectionId_(1), nextReplayId_(1),
+      rulesGeneration_(0),
+      rulesActive_(false), interceptActive_(false), nextHoldId_(1),
+      heldVersion_(0), holdLimit_(1024 * 1024),
+      dnsCache_(std::make_shared<DNSCache>()), brokerHealthCheckMs_(0),
+      brokerWebSocket_(false),
+      brokerWebSocketPath_("/mqtt"),
+      tlsEnabled_(false), brokerTLSEnabled_(false),
+      sniCertificates_(false),
       serverSSLContext_(boost::asio::ssl::context::tls_server),
-      clientSSLContext_(boost::asio::ssl::context::tls_client) {
+      clientSSLContext_(boost::asio::ssl::context::tls_client),
+      handshakePool_(nullptr), handshakeOverflow_(HandshakeOverflow::Pause),
+      handshakeTimeoutMs_(kHandshakeTimeoutMs),
+      connectTimeoutMs_(kConnectTimeoutMs), idleTimeoutMs_(0),
+      maxPacketSize_(MQTTFramer::kDefaultMaxFrameSize) {
+  timerWheels_.emplace_back(&ioc_,
+                            std::make_unique<TimerWheel>(ioc_.get_executor()));
+  brokerPool_.configure({{"test.mosquitto.org", 1883}},
+                        BrokerBalance::RoundRobin);
+
   // Set default SSL options
   serverSSLContext_.set_options(boost::asio::ssl::context::default_workarounds |
                                 boost::asio::ssl::context::no_sslv2 |
@@ -98,6 +163,25 @@ MQTTHandler::MQTTHandler(boost::asio::io_context &ioc)
 
   // For client context, we might want to skip verification for testing
   clientSSLContext_.set_verify_mode(boost::asio::ssl::verify_none);
+
+  // Let reconnecting clients resume instead of doing a full handshake:
+  // session IDs from the server cache for TLS 1.2, tickets for both
+  SSL_CTX *server = serverSSLContext_.native_handle();
+  SSL_CTX_set_session_id_context(server, kSessionIdContext,
+                                 kSessionIdContextLength);
+  SSL_CTX_set_session_cache_mode(server, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(server, kTLSSessionCacheSize);
+  SSL_CTX_set_timeout(server, kTLSSessionLifetime);
+  SSL_CTX_clear_options(server, SSL_OP_NO_TICKET);
+
+  // Leaf certificates per server name, once enabled
+  leafCertificates_.setSessionIdContext(kSessionIdContext,
+                                        kSessionIdContextLength);
+  SSL_CTX_set_tlsext_servername_callback(server,
+                                         &MQTTHandler::selectCertificate);
+  SSL_CTX_set_tlsext_servername_arg(server, this);
+
+  brokerSessions_.attach(clientSSLContext_);
 }
 
 MQTTHandler::~MQTTHandler() { stop(); }
@@ -114,14 +198,19 @@ void MQTTHandler::start(const std::string &address, uint16_t port) {
 
     running_ = true;
 
-    std::cout << "MQTT Proxy started on " << address << ":" << port
-              << std::endl;
-    std::cout << "Will forward to broker: " << brokerHost_ << ":" << brokerPort_
-              << std::endl;
+    MITMQTT_LOG_INFO("MQTT Proxy started on " << address << ":" << port);
+    for (const auto &upstream : brokerPool_.upstreams())
+      MITMQTT_LOG_INFO("Will forward to broker: " << upstream->name());
+    if (brokerPool_.upstreams().size() > 1)
+      MITMQTT_LOG_INFO("Balancing brokers by "
+                       << brokerBalanceName(brokerPool_.balance()));
+    brokerPool_.startHealthChecks(
+        ioc_.get_executor(), dnsCache_,
+        std::chrono::milliseconds(brokerHealthCheckMs_.load()));
 
     doAccept();
   } catch (const std::exception &e) {
-    std::cerr << "Failed to start MQTT handler: " << e.what() << std::endl;
+    MITMQTT_LOG_ERROR("Failed to start MQTT handler: " << e.what());
     throw;
   }
 }
@@ -134,19 +223,202 @@ void MQTTHandler::stop() {
 
   boost::system::error_code ec;
   acceptor_.close(ec);
-
-  // Stop all active connections
-  for (auto &conn : connections_) {
-    if (conn)
-      conn->stop();
+  if (tlsAcceptor_)
+    tlsAcceptor_->close(ec);
+  if (wsAcceptor_)
+    wsAcceptor_->close(ec);
+  handshakeGate_.clear();
+  brokerPool_.stopHealthChecks();
+
+  std::map<uint64_t, std::shared_ptr<ReplayRun>> replays;
+  {
+    std::lock_guard<std::mutex> lock(replaysMutex_);
+    replays.swap(replays_);
   }
-  connections_.clear();
+  for (auto &replay : replays)
+    replay.second->stop(false);
+
+  // Stop all active connections, each on its own I/O thread
+  for (const auto &entry : connections_.takeAll())
+    entry.visit([](const auto &conn) { conn->stop(); });
 
-  std::cout << "MQTT Proxy stopped" << std::endl;
+  MITMQTT_LOG_INFO("MQTT Proxy stopped");
 }
 
-void MQTTHandler::setPacketCallback(PacketCallback callback) {
+void MQTTHandler::setPacketCallback(PacketCallback callback,
+                                    InspectionLevel level) {
   packetCallback_ = std::move(callback);
+  callbackLevel_ = packetCallback_ ? level : InspectionLevel::None;
+}
+
+void MQTTHandler::setCaptureQueue(std::shared_ptr<CaptureQueue> queue,
+                                  InspectionLevel level) {
+  captureQueue_ = std::move(queue);
+  captureLevel_ = captureQueue_ ? level : InspectionLevel::None;
+}
+
+void MQTTHandler::capturePacket(uint64_t connectionId,
+                                PacketDirection direction,
+                                const FrameView &frame, uint64_t sequence,
+                                uint8_t protocolLevel) {
+  captureWriter_.write(connectionId, direction, frame.data, frame.size);
+
+  CaptureQueue *queue = captureQueue_.get();
+  if (!queue || frame.empty() || captureLevel_ == InspectionLevel::None)
+    return;
+
+  CaptureRecord record;
+  record.timestamp =
+      std::chrono::steady_clock::now().time_since_epoch().count();
+  record.connectionId = connectionId;
+  record.sequence = sequence;
+  record.size = static_cast<uint32_t>(frame.size);
+  record.header = frame.firstByte();
+  record.direction = direction;
+
+  uint8_t type = frame.typeNibble();
+  PacketView packet;
+  if (captureLevel_ == InspectionLevel::Full && (type == 3 || type == 1) &&
+      decodePacket(frame, protocolLevel, packet)) {
+    record.topic = std::string(packet.topic);
+    record.payload = std::string(packet.payload);
+    record.clientId = std::string(packet.clientId);
+  }
+
+  // Never block the I/O thread, a full queue counts the drop
+  queue->tryPush(std::move(record));
+}
+
+bool MQTTHandler::canBypassInspection() const {
+  return zeroCopyEnabled_ && SplicePump::isSupported() && !storeEnabled_ &&
+         !captureQueue_ && !captureWriter_.isActive() && !rulesActive_ &&
+         !interceptActive_ &&
+         callbackLevel_ == InspectionLevel::None;
+}
+
+void MQTTHandler::setRules(std::vector<Rule> rules) {
+  std::shared_ptr<const RuleEngine> engine;
+  if (!rules.empty())
+    engine = std::make_shared<const RuleEngine>(std::move(rules));
+
+  std::lock_guard<std::mutex> lock(rulesMutex_);
+  rules_ = std::move(engine);
+  rulesActive_ = rules_ != nullptr;
+  rulesGeneration_.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const RuleEngine> MQTTHandler::getRules() const {
+  std::lock_guard<std::mutex> lock(rulesMutex_);
+  return rules_;
+}
+
+void MQTTHandler::setInterceptRules(std::vector<Rule> rules) {
+  // Only the conditions matter
+  for (Rule &rule : rules)
+    rule.action = RuleAction();
+
+  std::shared_ptr<const RuleEngine> engine;
+  if (!rules.empty())
+    engine = std::make_shared<const RuleEngine>(std::move(rules));
+
+  {
+    std::lock_guard<std::mutex> lock(rulesMutex_);
+    intercept_ = std::move(engine);
+    interceptActive_ = intercept_ != nullptr;
+    rulesGeneration_.fetch_add(1, std::memory_order_release);
+  }
+
+  if (!interceptActive_)
+    releaseAllHeld();
+}
+
+void MQTTHandler::fetchRules(std::shared_ptr<const RuleEngine> &rules,
+                             std::shared_ptr<const RuleEngine> &intercept,
+                             uint64_t &generation) const {
+  std::lock_guard<std::mutex> lock(rulesMutex_);
+  rules = rules_;
+  intercept = intercept_;
+  generation = rulesGeneration_.load(std::memory_order_relaxed);
+}
+
+uint64_t MQTTHandler::registerHeld(uint64_t connectionId,
+                                   PacketDirection direction,
+                                   uint8_t protocolLevel,
+                                   const FrameView &frame) {
+  HeldPacket packet;
+  packet.connectionId = connectionId;
+  packet.direction = direction;
+  packet.protocolLevel = protocolLevel;
+  packet.timestamp =
+      std::chrono::steady_clock::now().time_since_epoch().count();
+  packet.data.assign(frame.data, frame.data + frame.size);
+
+  std::lock_guard<std::mutex> lock(heldMutex_);
+  packet.id = nextHoldId_++;
+  uint64_t id = packet.id;
+  held_.emplace(id, std::move(packet));
+  ++heldVersion_;
+  return id;
+}
+
+void MQTTHandler::forgetHeld(uint64_t connectionId) {
+  std::lock_guard<std::mutex> lock(heldMutex_);
+  for (auto it = held_.begin(); it != held_.end();) {
+    if (it->second.connectionId == connectionId)
+      it = held_.erase(it);
+    else
+      ++it;
+  }
+  ++heldVersion_;
+}
+
+std::vector<HeldPacket> MQTTHandler::getHeldPackets() const {
+  std::lock_guard<std::mutex> lock(heldMutex_);
+  std::vector<HeldPacket> packets;
+  packets.reserve(held_.size());
+  for (const auto &entry : held_)
+    packets.push_back(entry.second);
+  return packets;
+}
+
+void MQTTHandler::releaseHeld(uint64_t id, std::vector<uint8_t> replacement) {
+  resolveHeld(id, false, std::move(replacement));
+}
+
+void MQTTHandler::dropHeld(uint64_t id) { resolveHeld(id, true, {}); }
+
+void MQTTHandler::releaseAllHeld() {
+  std::vector<uint64_t> ids;
+  {
+    std::lock_guard<std::mutex> lock(heldMutex_);
+    for (const auto &entry : held_)
+      ids.push_back(entry.first);
+  }
+  for (uint64_t id : ids)
+    resolveHeld(id, false, {});
+}
+
+void MQTTHandler::resolveHeld(uint64_t id, bool drop,
+                              std::vector<uint8_t> replacement) {
+  uint64_t connectionId;
+  PacketDirection direction;
+  {
+    std::lock_guard<std::mutex> lock(heldMutex_);
+    auto it = held_.find(id);
+    if (it == held_.end())
+      return;
+    connectionId = it->second.connectionId;
+    direction = it->second.direction;
+    held_.erase(it);
+    ++heldVersion_;
+  }
+
+  auto entry = connections_.find(connectionId);
+  if (!entry)
+    return;
+  entry->visit([&](const auto &conn) {
+    conn->resolveHeld(id, direction, drop, std::move(replacement));
+  });
 }
 
 void MQTTHandler::setConnectionCallback(ConnectionCallback callback) {
@@ -154,8 +426,12 @@ void MQTTHandler::setConnectionCallback(ConnectionCallback callback) {
 }
 
 void MQTTHandler::setBrokerConfig(const std::string &host, uint16_t port) {
-  brokerHost_ = host;
-  brokerPort_ = port;
+  brokerPool_.configure({{host, port}}, BrokerBalance::RoundRobin);
+}
+
+void MQTTHandler::setBrokerPool(std::vector<BrokerAddress> brokers,
+                                BrokerBalance balance) {
+  brokerPool_.configure(std::move(brokers), balance);
 }
 
 void MQTTHandler::setTLSCertificate(const std::string &certFile,
@@ -170,24 +446,170 @@ void MQTTHandler::setTLSCertificate(const std::string &certFile,
     serverSSLContext_.use_private_key_file(keyFile,
                                            boost::asio::ssl::context::pem);
 
-    std::cout << "TLS certificate loaded: " << certFile << std::endl;
-    std::cout << "TLS private key loaded: " << keyFile << std::endl;
+    MITMQTT_LOG_INFO("TLS certificate loaded: " << certFile);
+    MITMQTT_LOG_INFO("TLS private key loaded: " << keyFile);
+
+    // Leaves minted so far were signed by the previous CA
+    if (sniCertificates_ && !leafCertificates_.loadCA(certFile, keyFile))
+      sniCertificates_ = false;
   } catch (const std::exception &e) {
-    std::cerr << "Failed to load TLS certificate/key: " << e.what()
-              << std::endl;
+    MITMQTT_LOG_ERROR("Failed to load TLS certificate/key: " << e.what());
     throw;
   }
 }
 
+bool MQTTHandler::enableSNICertificates(
+    const std::vector<std::string> &prewarm) {
+  if (certFile_.empty() || !leafCertificates_.loadCA(certFile_, keyFile_))
+    return false;
+  leafCertificates_.prewarm(prewarm);
+  sniCertificates_ = true;
+  MITMQTT_LOG_INFO("Minting certificates per server name, signed by "
+                   << certFile_);
+  return true;
+}
+
+int MQTTHandler::selectCertificate(SSL *ssl, int * /*alert*/, void *arg) {
+  auto *handler = static_cast<MQTTHandler *>(arg);
+  const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (!handler->sniCertificates_ || !name)
+    return SSL_TLSEXT_ERR_OK;
+
+  // Unusable names keep the default certificate
+  SSL_CTX *leaf = handler->leafCertificates_.contextFor(name);
+  if (leaf) {
+    SSL_set_SSL_CTX(ssl, leaf);
+    SSL_CTX_free(leaf);
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+void MQTTHandler::secureBrokerStream(
+    BrokerStream &stream, const std::string &host, uint16_t port,
+    std::function<void(boost::system::error_code)> done) {
+  // The WebSocket upgrade goes over TLS, if there is any
+  auto upgrade = [this, &stream, host, port, done = std::move(done)](
+                     boost::system::error_code ec) {
+    if (ec || !stream.webSocket()) {
+      done(ec);
+      return;
+    }
+    asyncConnectWebSocket(
+        stream, host + ":" + std::to_string(port), brokerWebSocketPath_,
+        [&stream, done](boost::system::error_code ec) {
+          if (ec && stream.socket().is_open())
+            MITMQTT_LOG_ERROR("WebSocket upgrade with broker failed: "
+                              << ec.message());
+          done(ec);
+        });
+  };
+
+  if (!brokerTLSEnabled_) {
+    upgrade(boost::system::error_code());
+    return;
+  }
+
+  std::string key = host + ":" + std::to_string(port);
+  stream.startTLS(clientSSLContext_, host, &brokerSessions_, key);
+
+  auto started = std::chrono::steady_clock::now();
+  stream.async_handshake([this, &stream, key, started,
+                          upgrade = std::move(upgrade)](
+                             boost::system::error_code ec) {
+    // The connection closed the stream itself, nothing failed
+    if (ec && !stream.socket().is_open()) {
+      upgrade(ec);
+      return;
+    }
+
+    bool resumed = !ec && stream.resumed();
+    metrics_.recordBrokerTLSHandshake(
+        std::chrono::steady_clock::now() - started, !ec, resumed);
+    if (ec) {
+      MITMQTT_LOG_ERROR("TLS handshake with broker failed: " << ec.message());
+      // A stale session may be the cause, don't offer it again
+      brokerSessions_.remove(key);
+    } else {
+      MITMQTT_LOG_DEBUG("TLS handshake with broker "
+                        << key << (resumed ? " resumed" : " completed"));
+    }
+    upgrade(ec);
+  });
+}
+
+MetricsSnapshot MQTTHandler::snapshotMetrics() {
+  // Hold the connections while their counters are read
+  std::vector<std::shared_ptr<const void>> holders;
+  std::vector<const ConnectionStats *> live;
+  connections_.forEach([&](const ConnectionRegistry::Entry &entry) {
+    entry.visit([&](const auto &conn) {
+      holders.push_back(conn);
+      live.push_back(&conn->getStats());
+    });
+  });
+
+  MetricsSnapshot snapshot = metrics_.snapshot(live);
+  snapshot.handshakesActive = handshakeGate_.active();
+  snapshot.handshakesQueued = handshakeGate_.queued();
+  snapshot.handshakesRejected = handshakeGate_.rejected();
+  for (const auto &upstream : brokerPool_.upstreams()) {
+    snapshot.brokers.push_back(BrokerMetrics{
+        upstream->name(), upstream->up(), upstream->connections(),
+        upstream->failures()});
+  }
+  return snapshot;
+}
+
+void MQTTHandler::startMetrics(const std::string &address, uint16_t port) {
+  stopMetrics();
+  auto server = std::make_unique<MetricsServer>(
+      ioc_, [this]() { return formatPrometheus(snapshotMetrics()); });
+  server->start(address, port);
+  metricsServer_ = std::move(server);
+}
+
+void MQTTHandler::stopMetrics() {
+  if (metricsServer_) {
+    metricsServer_->stop();
+    metricsServer_.reset();
+  }
+}
+
+bool MQTTHandler::isMetricsRunning() const {
+  return metricsServer_ && metricsServer_->running();
+}
+
+uint16_t MQTTHandler::getMetricsPort() const {
+  return metricsServer_ ? metricsServer_->port() : 0;
+}
+
+TimerWheel &
+MQTTHandler::timerWheel(const boost::asio::any_io_executor &executor) {
+  boost::asio::execution_context *context =
+      &boost::asio::query(executor, boost::asio::execution::context);
+  for (auto &wheel : timerWheels_) {
+    if (wheel.first == context)
+      return *wheel.second;
+  }
+  // Not reached, connections only run on nextIOContext()'s contexts
+  return *timerWheels_.front().second;
+}
+
+boost::asio::io_context &MQTTHandler::nextIOContext() {
+  return ioPool_ ? ioPool_->getIOContext() : ioc_;
+}
+
 void MQTTHandler::doAccept() {
-  acceptor_.async_accept([this](boost::system::error_code ec,
-                                boost::asio::ip::tcp::socket socket) {
+  // The accepted socket is bound to the next pool context
+  acceptor_.async_accept(
+      nextIOContext(), [this](boost::system::error_code ec,
+                              boost::asio::ip::tcp::socket socket) {
     if (!ec) {
-      std::cout << "New client connection from " << socket.remote_endpoint()
-                << std::endl;
+      MITMQTT_LOG_INFO("New client connection from "
+                       << socket.remote_endpoint());
       handleConnection(std::move(socket));
     } else {
-      std::cerr << "Accept error: " << ec.message() << std::endl;
+      MITMQTT_LOG_WARN("Accept error: " << ec.message());
     }
 
     if (running_) {
@@ -196,14 +618,21 @@ void MQTTHandler::doAccept() {
   });
 }
 
-void MQTTHandler::handleConnection(boost::asio::ip::tcp::socket socket) {
-  auto conn = std::make_shared<MQTTConnection>(std::move(socket), *this);
-  connections_.push_back(conn);
+void MQTTHandler::handleConnection(boost::asio::ip::tcp::socket socket,
+                                   bool webSocket) {
+  auto conn =
+      std::make_shared<MQTTConnection>(std::move(socket), *this, webSocket);
+  metrics_.connectionOpened();
+  connections_.add(conn->getId(), conn);
 
   if (connectionCallback_) {
-    connectionCallback_(conn);
+    ConnectionRegistry::Entry entry;
+    entry.id = conn->getId();
+    entry.plain = conn;
+    connectionCallback_(entry);
   }
 
+  conn->startConnectTimeout();
   conn->start();
 }
 
@@ -220,12 +649,11 @@ void MQTTHandler::startTLS(const std::string &address, uint16_t port) {
 
     tlsEnabled_ = true;
 
-    std::cout << "MQTTS (TLS) Proxy started on " << address << ":" << port
-              << std::endl;
+    MITMQTT_LOG_INFO("MQTTS (TLS) Proxy started on " << address << ":" << port);
 
     doAcceptTLS();
   } catch (const std::exception &e) {
-    std::cerr << "Failed to start TLS listener: " << e.what() << std::endl;
+    MITMQTT_LOG_ERROR("Failed to start TLS listener: " << e.what());
     throw;
   }
 }
@@ -234,37 +662,147 @@ void MQTTHandler::doAcceptTLS() {
   if (!tlsAcceptor_)
     return;
 
-  tlsAcceptor_->async_accept([this](boost::system::error_code ec,
-                                    boost::asio::ip::tcp::socket socket) {
+  tlsAcceptor_->async_accept(
+      nextIOContext(), [this](boost::system::error_code ec,
+                              boost::asio::ip::tcp::socket socket) {
     if (!ec) {
-      std::cout << "[TLS] New client connection from "
-                << socket.remote_endpoint() << std::endl;
+      MITMQTT_LOG_INFO("[TLS] New client connection from "
+                       << socket.remote_endpoint());
       handleTLSConnection(std::move(socket));
     } else {
-      std::cerr << "[TLS] Accept error: " << ec.message() << std::endl;
+      MITMQTT_LOG_WARN("[TLS] Accept error: " << ec.message());
     }
 
     if (running_ && tlsEnabled_) {
+      // Leave further clients in the listen backlog until a slot frees up
+      if (handshakeOverflow_ == HandshakeOverflow::Pause &&
+          handshakeGate_.parkIfFull())
+        return;
       doAcceptTLS();
     }
   });
 }
 
-void MQTTHandler::handleTLSConnection(boost::asio::ip::tcp::socket socket) {
-  auto conn = std::make_shared<MQTTTLSConnection>(
-      std::move(socket), serverSSLContext_, clientSSLContext_, *this);
-  tlsConnections_.push_back(conn);
-  conn->start();
+void MQTTHandler::startWebSocket(const std::string &address, uint16_t port) {
+  try {
+    boost::asio::ip::tcp::endpoint endpoint(
+        boost::asio::ip::make_address(address), port);
+
+    wsAcceptor_ = std::make_unique<boost::asio::ip::tcp::acceptor>(ioc_);
+    wsAcceptor_->open(endpoint.protocol());
+    wsAcceptor_->set_option(boost::asio::socket_base::reuse_address(true));
+    wsAcceptor_->bind(endpoint);
+    wsAcceptor_->listen();
+
+    running_ = true;
+
+    MITMQTT_LOG_INFO("MQTT over WebSocket Proxy started on " << address << ":"
+                                                             << port);
+
+    doAcceptWebSocket();
+  } catch (const std::exception &e) {
+    MITMQTT_LOG_ERROR("Failed to start WebSocket listener: " << e.what());
+    throw;
+  }
+}
+
+void MQTTHandler::doAcceptWebSocket() {
+  if (!wsAcceptor_)
+    return;
+
+  wsAcceptor_->async_accept(
+      nextIOContext(), [this](boost::system::error_code ec,
+                              boost::asio::ip::tcp::socket socket) {
+    if (!ec) {
+      MITMQTT_LOG_INFO("[WS] New client connection from "
+                       << socket.remote_endpoint());
+      handleConnection(std::move(socket), true);
+    } else {
+      MITMQTT_LOG_WARN("[WS] Accept error: " << ec.message());
+    }
+
+    if (running_)
+      doAcceptWebSocket();
+  });
+}
+
+void MQTTHandler::setBrokerWebSocket(bool enabled, const std::string &path) {
+  brokerWebSocketPath_ = path.empty() ? "/" : path;
+  brokerWebSocket_ = enabled;
+}
+
+void MQTTHandler::setHandshakeLimits(size_t maxActive, size_t maxQueued,
+                                     HandshakeOverflow overflow) {
+  handshakeGate_.setLimits(maxActive, maxQueued);
+  handshakeOverflow_ = overflow;
+}
+
+boost::asio::any_io_executor
+MQTTHandler::handshakeExecutor(const boost::asio::any_io_executor &own) {
+  if (handshakePool_ && handshakePool_->running())
+    return handshakePool_->getIOContext().get_executor();
+  return own;
 }
 
-void MQTTHandler::storePacket(const MQTTPacket &packet) {
-  storedPackets_.push_back(packet);
-  // Limit storage to prevent memory issues
-  if (storedPackets_.size() > 1000) {
-    storedPackets_.erase(storedPackets_.begin());
+void MQTTHandler::handshakeFinished() {
+  if (handshakeGate_.release()) {
+    boost::asio::post(ioc_, [this]() {
+      if (running_ && tlsEnabled_)
+        doAcceptTLS();
+    });
   }
 }
 
+void MQTTHandler::handleTLSConnection(boost::asio::ip::tcp::socket socket) {
+  auto conn = std::make_shared<MQTTTLSConnection>(std::move(socket), *this);
+  metrics_.connectionOpened();
+  connections_.add(conn->getId(), conn);
+
+  if (connectionCallback_) {
+    ConnectionRegistry::Entry entry;
+    entry.id = conn->getId();
+    entry.tls = conn;
+    connectionCallback_(entry);
+  }
+
+  // The handshake starts once the gate has a slot for it
+  conn->startConnectTimeout();
+  if (!handshakeGate_.submit([conn]() { conn->start(); })) {
+    MITMQTT_LOG_WARN("[TLS] Too many handshakes pending, dropping client");
+    conn->stop();
+  }
+}
+
+uint64_t MQTTHandler::storePacket(uint64_t connectionId,
+                                  PacketDirection direction,
+                                  const FrameView &frame,
+                                  uint8_t protocolLevel) {
+  if (!storeEnabled_ || frame.empty())
+    return 0;
+
+  auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+  std::lock_guard<std::mutex> lock(storeMutex_);
+  return packetStore_.store(frame.data, frame.size, connectionId, direction,
+                            protocolLevel, now);
+}
+
+uint64_t MQTTHandler::storePacket(const MQTTPacket &packet,
+                                  uint8_t protocolLevel) {
+  return storePacket(0, PacketDirection::ClientToBroker,
+                     FrameView{packet.data.data(), packet.data.size()},
+                     protocolLevel);
+}
+
+void MQTTHandler::setReplayStoreBudget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(storeMutex_);
+  packetStore_.resize(bytes);
+}
+
+size_t MQTTHandler::getReplayStoreBudget() {
+  std::lock_guard<std::mutex> lock(storeMutex_);
+  return packetStore_.budgetBytes();
+}
+
 void MQTTHandler::modifyPacket(const std::string &packetType,
                                const std::string &payload) {
   // For backward compatibility, inject to client with default topic test!!!
@@ -272,560 +810,1098 @@ void MQTTHandler::modifyPacket(const std::string &packetType,
 }
 
 void MQTTHandler::injectPacket(const std::string &topic,
-                               const std::string &payload, bool toClient) {
-  // Check if we have any connections (plain or TLS)
-  bool hasPlainConn = !connections_.empty();
-  bool hasTLSConn = !tlsConnections_.empty();
-
-  if (!hasPlainConn && !hasTLSConn) {
-    std::cerr << "No active connections to send packet to" << std::endl;
+                               const std::string &payload, bool toClient,
+                               uint64_t connectionId) {
+  auto entry = connectionId != 0 ? connections_.find(connectionId)
+                                 : connections_.oldest();
+  if (!entry) {
+    MITMQTT_LOG_WARN("No active connection to send packet to");
     return;
   }
 
-  // Create a PUBLISH packet
-  std::vector<uint8_t> packet;
-
-  // Fixed header: PUBLISH (0x30)
-  packet.push_back(0x30);
-
-  // Calculate remaining length
-  uint16_t topicLen = static_cast<uint16_t>(topic.length());
-  size_t remainingLength = 2 + topicLen + payload.length();
+  std::vector<uint8_t> packet = MQTTPacket::buildPublish(topic, payload);
+  sendThrough(*entry, toClient, packet);
+  MITMQTT_LOG_INFO((entry->tls ? "[TLS] " : "")
+                   << "Injected to " << (toClient ? "CLIENT" : "BROKER")
+                   << " of connection " << entry->id << " - Topic: " << topic
+                   << " (" << payload.size() << " bytes)");
+}
 
-  // Encode remaining length (variable length encoding)
-  do {
-    uint8_t encodedByte = remainingLength % 128;
-    remainingLength /= 128;
-    if (remainingLength > 0) {
-      encodedByte |= 0x80;
+void MQTTHandler::replayPacket(uint64_t sequence) {
+  std::vector<uint8_t> raw;
+  uint64_t connectionId;
+  PacketDirection direction;
+  {
+    std::lock_guard<std::mutex> lock(storeMutex_);
+    auto stored = packetStore_.find(sequence);
+    if (!stored) {
+      MITMQTT_LOG_WARN("Packet " << sequence << " is no longer stored");
+      return;
     }
-    packet.push_back(encodedByte);
-  } while (remainingLength > 0);
+    raw.assign(stored->data, stored->data + stored->size);
+    connectionId = stored->connectionId;
+    direction = stored->direction;
+  }
 
-  // Topic length (MSB, LSB)
-  packet.push_back(static_cast<uint8_t>(topicLen >> 8));
-  packet.push_back(static_cast<uint8_t>(topicLen & 0xFF));
+  auto entry = connections_.find(connectionId);
+  if (!entry)
+    entry = connections_.oldest();
+  if (!entry) {
+    MITMQTT_LOG_WARN("No active connections to replay packet to");
+    return;
+  }
 
-  // Topic
-  packet.insert(packet.end(), topic.begin(), topic.end());
+  sendThrough(*entry, direction == PacketDirection::BrokerToClient, raw);
 
-  // Payload
-  packet.insert(packet.end(), payload.begin(), payload.end());
+  MITMQTT_LOG_INFO("Replayed packet " << sequence << " on connection "
+                   << entry->id);
+}
 
-  // Send to client or broker - prefer TLS connection if available
-  if (hasTLSConn) {
-    if (toClient) {
-      tlsConnections_[0]->sendToClient(packet);
-      std::cout << "[TLS] Injected to CLIENT - Topic: " << topic
-                << ", Payload: " << payload << std::endl;
-    } else {
-      tlsConnections_[0]->sendToBroker(packet);
-      std::cout << "[TLS] Injected to BROKER - Topic: " << topic
-                << ", Payload: " << payload << std::endl;
-    }
-  } else if (hasPlainConn) {
-    if (toClient) {
-      connections_[0]->sendToClient(packet);
-      std::cout << "Injected to CLIENT - Topic: " << topic
-                << ", Payload: " << payload << std::endl;
-    } else {
-      connections_[0]->sendToBroker(packet);
-      std::cout << "Injected to BROKER - Topic: " << topic
-                << ", Payload: " << payload << std::endl;
+uint64_t MQTTHandler::startReplay(uint64_t firstSequence,
+                                  uint64_t lastSequence,
+                                  ReplayOptions options) {
+  // Copy the range out of the store in one piece
+  auto plan = std::make_shared<ReplayPlan>();
+  {
+    std::lock_guard<std::mutex> lock(storeMutex_);
+    firstSequence = std::max(firstSequence, packetStore_.firstSequence());
+    lastSequence = std::min(lastSequence, packetStore_.lastSequence());
+    for (uint64_t sequence = firstSequence;
+         sequence != 0 && sequence <= lastSequence; ++sequence) {
+      auto stored = packetStore_.find(sequence);
+      if (!stored || stored->size == 0 ||
+          (options.connectionId != 0 &&
+           stored->connectionId != options.connectionId) ||
+          !(options.packetTypes & (1u << (stored->data[0] >> 4))))
+        continue;
+      plan->add(stored->data, stored->size, stored->connectionId,
+                stored->direction, stored->timestamp);
     }
   }
+  if (plan->empty()) {
+    MITMQTT_LOG_WARN("No stored packets to replay in " << firstSequence
+                     << ".." << lastSequence);
+    return 0;
+  }
+
+  auto send = [this](uint64_t connectionId, PacketDirection direction,
+                     const std::shared_ptr<const std::vector<uint8_t>> &buffer,
+                     size_t offset, size_t size) {
+    auto entry = connections_.find(connectionId);
+    if (!entry)
+      return false;
+    entry->visit([&](const auto &conn) {
+      conn->sendShared(direction, buffer, offset, size);
+    });
+    return true;
+  };
+  auto backlog = [this](uint64_t connectionId) -> size_t {
+    auto entry = connections_.find(connectionId);
+    if (!entry)
+      return 0;
+    size_t queued = 0;
+    entry->visit([&](const auto &conn) {
+      const ConnectionStats &stats = conn->getStats();
+      queued = stats.queued(PacketDirection::ClientToBroker) +
+               stats.queued(PacketDirection::BrokerToClient);
+    });
+    return queued;
+  };
+
+  size_t frames = plan->frames.size();
+  double speed = options.speed;
+  auto replay = std::make_shared<ReplayRun>(
+      ioc_.get_executor(), std::move(plan), std::move(options),
+      std::move(send), std::move(backlog));
+
+  uint64_t id;
+  {
+    std::lock_guard<std::mutex> lock(replaysMutex_);
+    id = nextReplayId_++;
+    replays_.emplace(id, replay);
+  }
+  replay->start([this, id]() {
+    std::lock_guard<std::mutex> lock(replaysMutex_);
+    replays_.erase(id);
+  });
+
+  if (speed > 0)
+    MITMQTT_LOG_INFO("Replaying " << frames << " packets at " << speed << "x");
+  else
+    MITMQTT_LOG_INFO("Replaying " << frames << " packets at full speed");
+  return id;
 }
 
-void MQTTHandler::replayPacket(int packetIndex) {
-  if (packetIndex < 0 ||
-      packetIndex >= static_cast<int>(storedPackets_.size())) {
-    std::cerr << "Invalid packet index: " << packetIndex << std::endl;
-    return;
+void MQTTHandler::stopReplay(uint64_t id) {
+  std::shared_ptr<ReplayRun> replay;
+  {
+    std::lock_guard<std::mutex> lock(replaysMutex_);
+    auto it = replays_.find(id);
+    if (it == replays_.end())
+      return;
+    replay = it->second;
   }
+  replay->stop();
+}
 
-  if (connections_.empty()) {
-    std::cerr << "No active connections to replay packet to" << std::endl;
-    return;
+std::vector<MQTTHandler::ReplayStatus> MQTTHandler::getReplays() const {
+  std::vector<ReplayStatus> statuses;
+  std::lock_guard<std::mutex> lock(replaysMutex_);
+  statuses.reserve(replays_.size());
+  for (const auto &entry : replays_) {
+    ReplayStatus status;
+    status.id = entry.first;
+    status.frames = entry.second->frameCount();
+    status.sent = entry.second->framesSent();
+    status.speed = entry.second->options().speed;
+    statuses.push_back(status);
   }
+  return statuses;
+}
 
-  const auto &packet = storedPackets_[packetIndex];
-  connections_[0]->sendToClient(packet.toRawData());
+uint64_t MQTTHandler::getLastStoredSequence() {
+  std::lock_guard<std::mutex> lock(storeMutex_);
+  return packetStore_.lastSequence();
+}
 
-  std::cout << "Replayed packet " << packetIndex << std::endl;
+uint64_t MQTTHandler::findConnection(const std::string &clientId) const {
+  auto entry = connections_.findByClientId(clientId);
+  return entry ? entry->id : 0;
 }
 
-// MQTTConnection implementation
-MQTTConnection::MQTTConnection(boost::asio::ip::tcp::socket socket,
-                               MQTTHandler &handler)
-    : clientSocket_(std::move(socket)),
-      brokerSocket_(clientSocket_.get_executor()), handler_(handler),
-      connected_(false), brokerConnected_(false) {
-  clientReadBuffer_.resize(8192);
-  brokerReadBuffer_.resize(8192);
+void MQTTHandler::identifyConnection(uint64_t id, const std::string &clientId,
+                                     const std::string &username) {
+  connections_.identify(id, clientId, username);
 }
 
-void MQTTConnection::start() {
-  connected_ = true;
-  // Don't connect to broker yet - wait for CONNECT packet
-  doReadFromClient();
+void MQTTHandler::connectionAccepted(uint64_t id, bool accepted) {
+  connections_.setAuthenticated(id, accepted);
 }
 
-void MQTTConnection::stop() {
-  if (!connected_)
-    return;
+void MQTTHandler::connectionClosed(uint64_t id) { connections_.remove(id); }
 
-  connected_ = false;
-  brokerConnected_ = false;
+// BasicMQTTConnection implementation
+template <typename ClientStream>
+ClientStream BasicMQTTConnection<ClientStream>::makeClientStream(
+    boost::asio::ip::tcp::socket socket, MQTTHandler &handler) {
+  if constexpr (kTLS)
+    return ClientStream(std::move(socket), handler.getServerSSLContext());
+  else
+    return socket;
+}
 
-  boost::system::error_code ec;
-  clientSocket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-  brokerSocket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+template <typename ClientStream>
+BasicMQTTConnection<ClientStream>::BasicMQTTConnection(
+    boost::asio::ip::tcp::socket socket, MQTTHandler &handler,
+    bool webSocket)
+    : clientStream_(makeClientStream(std::move(socket), handler)),
+      brokerStream_(clientStream_.get_executor()), handler_(handler),
+      id_(handler.nextConnectionId()), handshaking_(false), stopped_(false),
+      readTime_(0),
+      timerWheel_(handler.timerWheel(clientStream_.get_executor())),
+      timeout_([this]() { onTimeout(); }),
+      brokerConnectTimeout_([this]() { onBrokerConnectTimeout(); }),
+      connectSeen_(false),
+      idleLimit_(0), lastClientRead_(0),
+      clientFramer_(8192, handler.getMaxPacketSize()),
+      brokerFramer_(8192, handler.getMaxPacketSize()),
+      toBrokerDelay_(clientStream_.get_executor()),
+      toClientDelay_(clientStream_.get_executor()), rulesGeneration_(0),
+      protocolLevel_(4), connected_(false), brokerConnected_(false),
+      brokerConnecting_(false), clientReadPaused_(false),
+      clientReadHeld_(false), brokerReadHeld_(false),
+      clientSplicePending_(false), brokerSplicePending_(false),
+      splicedFromClient_(0) {
+  if (webSocket)
+    clientWS_ =
+        std::make_unique<WebSocketCodec>(WebSocketCodec::Role::Server);
+}
 
-  clientSocket_.close(ec);
-  brokerSocket_.close(ec);
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::start() {
+  auto self = this->shared_from_this();
+  boost::asio::dispatch(clientStream_.get_executor(),
+                        [this, self]() { doStart(); });
+}
 
-  std::cout << "Connection closed" << std::endl;
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::stop() {
+  auto self = this->shared_from_this();
+  boost::asio::dispatch(clientStream_.get_executor(),
+                        [this, self]() { doStop(); });
 }
 
-void MQTTConnection::connectToBroker(const std::string &host, uint16_t port) {
-  if (brokerConnected_)
-    return;
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::startConnectTimeout() {
+  // The handshake and WebSocket upgrade count towards the deadline too
+  auto self = this->shared_from_this();
+  boost::asio::dispatch(clientStream_.get_executor(), [this, self]() {
+    if (!stopped_ && !connectSeen_ && handler_.getConnectTimeout().count() > 0)
+      timerWheel_.schedule(timeout_, handler_.getConnectTimeout());
+  });
+}
 
-  try {
-    boost::asio::ip::tcp::resolver resolver(brokerSocket_.get_executor());
-    auto endpoints = resolver.resolve(host, std::to_string(port));
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::doStart() {
+  if (stopped_) {
+    // Stopped while waiting for a handshake slot
+    if constexpr (kTLS)
+      handler_.handshakeFinished();
+    return;
+  }
 
-    boost::asio::connect(brokerSocket_, endpoints);
-    brokerConnected_ = true;
+  // Don't connect to the broker yet, wait for the CONNECT packet
+  if constexpr (kTLS)
+    doHandshakeWithClient();
+  else
+    onClientReady();
+}
 
-    std::cout << "Connected to broker: " << host << ":" << port << std::endl;
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::doHandshakeWithClient() {
+  // Only SSL streams have a handshake
+  if constexpr (kTLS) {
+    handshaking_ = true;
+    handshakeExecutor_ =
+        handler_.handshakeExecutor(clientStream_.get_executor());
+    auto self = this->shared_from_this();
+
+    // Every step of the handshake completes on handshakeExecutor_, since the
+    // SSL stream's intermediate handlers use the executor of the final one;
+    // the socket itself stays on this connection's context
+    boost::asio::dispatch(handshakeExecutor_, [this, self]() {
+      auto started = std::chrono::steady_clock::now();
+      auto timer = std::make_shared<boost::asio::steady_timer>(
+          handshakeExecutor_, handler_.getHandshakeTimeout());
+      timer->async_wait([this, self](boost::system::error_code ec) {
+        if (ec)
+          return;
+        MITMQTT_LOG_WARN("TLS handshake with client timed out");
+        clientStream_.lowest_layer().close(ec);
+      });
 
-    // Start reading from broker
-    doReadFromBroker();
-  } catch (const std::exception &e) {
-    std::cerr << "Failed to connect to broker: " << e.what() << std::endl;
-    stop();
+      clientStream_.async_handshake(
+          boost::asio::ssl::stream_base::server,
+          boost::asio::bind_executor(
+              handshakeExecutor_,
+              [this, self, started, timer](boost::system::error_code ec) {
+                timer->cancel();
+                auto duration = std::chrono::steady_clock::now() - started;
+                boost::asio::post(clientStream_.get_executor(),
+                                  [this, self, ec, duration]() {
+                                    onClientHandshake(ec, duration);
+                                  });
+              }));
+    });
   }
 }
 
-void MQTTConnection::handlePacket(const std::vector<uint8_t> &data,
-                                  PacketDirection direction) {
-  if (data.empty())
-    return;
-
-  MQTTPacket packet = MQTTPacket::fromRawData(data);
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::onClientHandshake(
+    const boost::system::error_code &ec,
+    std::chrono::steady_clock::duration duration) {
+  handshaking_ = false;
+  handler_.handshakeFinished();
 
-  // Store packet for replay
-  handler_.storePacket(packet);
-
-  uint8_t packetType = (data[0] >> 4) & 0x0F;
-  std::string packetTypeStr;
-  std::string payload = packet.payload;
-
-  switch (packetType) {
-  case 1:
-    packetTypeStr = "CONNECT";
-    break;
-  case 2:
-    packetTypeStr = "CONNACK";
-    break;
-  case 3:
-    packetTypeStr = "PUBLISH";
-    payload = "Topic: " + packet.topic + ", Payload: " + packet.payload;
-    break;
-  case 4:
-    packetTypeStr = "PUBACK";
-    break;
-  case 8:
-    packetTypeStr = "SUBSCRIBE";
-    break;
-  case 9:
-    packetTypeStr = "SUBACK";
-    break;
-  case 10:
-    packetTypeStr = "UNSUBSCRIBE";
-    break;
-  case 11:
-    packetTypeStr = "UNSUBACK";
-    break;
-  case 12:
-    packetTypeStr = "PINGREQ";
-    break;
-  case 13:
-    packetTypeStr = "PINGRESP";
-    break;
-  case 14:
-    packetTypeStr = "DISCONNECT";
-    break;
-  default:
-    packetTypeStr = "OTHER (" + std::to_string(packetType) + ")";
+  if (stopped_) {
+    closeClient();
+    return;
   }
 
-  std::cout << directionToString(direction) << " - " << packetTypeStr
-            << std::endl;
-
-  // Call callback
-  if (handler_.packetCallback_) {
-    handler_.packetCallback_(direction, packetTypeStr, payload);
+  bool resumed = false;
+  if constexpr (kTLS)
+    resumed = !ec && SSL_session_reused(clientStream_.native_handle()) == 1;
+  handler_.getMetrics().recordClientTLSHandshake(duration, !ec, resumed);
+  if (ec) {
+    MITMQTT_LOG_WARN("TLS handshake with client failed: " << ec.message());
+    stop();
+    return;
   }
+
+  MITMQTT_LOG_INFO("TLS handshake with client successful");
+  onClientReady();
 }
 
-void MQTTConnection::doReadFromClient() {
-  if (!connected_)
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::onClientReady() {
+  connected_ = true;
+  if (!clientWS_) {
+    doReadFromClient();
     return;
+  }
 
-  auto self = shared_from_this();
-  clientSocket_.async_read_some(
-      boost::asio::buffer(clientReadBuffer_),
-      [this, self](boost::system::error_code ec, std::size_t length) {
-        if (ec) {
-          std::cerr << "Client read error: " << ec.message() << std::endl;
-          stop();
-          return;
-        }
+  auto self = this->shared_from_this();
+  asyncAcceptWebSocket(clientStream_,
+                       [this, self](boost::system::error_code ec) {
+    if (!connected_)
+      return;
+    if (ec) {
+      MITMQTT_LOG_WARN(kTag << "WebSocket upgrade failed: " << ec.message());
+      stop();
+      return;
+    }
+    doReadFromClient();
+  });
+}
 
-        std::vector<uint8_t> data(clientReadBuffer_.begin(),
-                                  clientReadBuffer_.begin() + length);
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::closeClient() {
+  boost::system::error_code ec;
+  if constexpr (kTLS) {
+    clientStream_.lowest_layer().close(ec);
+  } else {
+    clientStream_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    clientStream_.close(ec);
+  }
+}
 
-        // Handle packet
-        handlePacket(data, PacketDirection::ClientToBroker);
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::doStop() {
+  if (stopped_)
+    return;
 
-        // Check if this is a CONNECT packet and we need to connect to broker
-        if (!brokerConnected_ && data.size() > 0 &&
-            ((data[0] >> 4) & 0x0F) == 1) {
-          // This is a CONNECT packet, now connect to broker
-          connectToBroker(handler_.getBrokerHost(), handler_.getBrokerPort());
-        }
+  stopped_ = true;
+  connected_ = false;
+  brokerConnected_ = false;
+  timerWheel_.cancel(timeout_);
+  timerWheel_.cancel(brokerConnectTimeout_);
 
-        // Forward to broker if connected
-        if (brokerConnected_) {
-          sendToBroker(data);
-        }
+  boost::system::error_code ec;
+  if (handshaking_) {
+    // Abort the handshake where it runs; onClientHandshake() closes up
+    auto self = this->shared_from_this();
+    boost::asio::post(handshakeExecutor_, [this, self]() { closeClient(); });
+  } else {
+    // No close_notify: a synchronous SSL shutdown waits for the peer's reply
+    // on the I/O thread, and silent or timed out clients never send one
+    closeClient();
+  }
+  brokerStream_.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both,
+                                  ec);
+  brokerStream_.close(ec);
+
+  // Outstanding writes fail with operation_aborted and release their batch
+  clientWriteQueue_.clear();
+  brokerWriteQueue_.clear();
+  toBrokerDelay_.clear();
+  toClientDelay_.clear();
+  toBrokerHeld_.clear();
+  toClientHeld_.clear();
+  handler_.forgetHeld(id_);
+  upstream_.release();
+
+  // Spliced bytes never passed through the read loops
+  if (clientToBrokerPump_)
+    stats_.addBytes(PacketDirection::ClientToBroker,
+                    clientToBrokerPump_->bytesForwarded());
+  if (brokerToClientPump_)
+    stats_.addBytes(PacketDirection::BrokerToClient,
+                    brokerToClientPump_->bytesForwarded());
+  handler_.getMetrics().retire(stats_);
+  handler_.connectionClosed(id_);
+
+  MITMQTT_LOG_INFO(kTag << "Connection closed");
+}
 
-        // Continue reading
-        doReadFromClient();
-      });
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::startKeepAlive(uint16_t keepAlive) {
+  connectSeen_ = true;
+  idleLimit_ = keepAlive != 0
+                   ? std::chrono::milliseconds(keepAlive *
+                                               kKeepAliveGracePermille)
+                   : handler_.getIdleTimeout();
+  if (idleLimit_.count() > 0)
+    timerWheel_.schedule(timeout_, idleLimit_);
+  else
+    timerWheel_.cancel(timeout_);
 }
 
-void MQTTConnection::doReadFromBroker() {
-  if (!brokerConnected_)
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::onTimeout() {
+  if (stopped_)
     return;
 
-  auto self = shared_from_this();
-  brokerSocket_.async_read_some(
-      boost::asio::buffer(brokerReadBuffer_),
-      [this, self](boost::system::error_code ec, std::size_t length) {
-        if (ec) {
-          std::cerr << "Broker read error: " << ec.message() << std::endl;
-          stop();
-          return;
-        }
+  // Still handshaking or waiting for CONNECT
+  if (!connectSeen_) {
+    MITMQTT_LOG_WARN(kTag << "No CONNECT from " << getClientAddress()
+                     << " within " << handler_.getConnectTimeout().count()
+                     << " ms");
+    handler_.getMetrics().connectTimedOut();
+    stop();
+    return;
+  }
 
-        std::vector<uint8_t> data(brokerReadBuffer_.begin(),
-                                  brokerReadBuffer_.begin() + length);
+  int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+  // Spliced bytes never pass through the read loop
+  if (clientToBrokerPump_ &&
+      clientToBrokerPump_->bytesForwarded() != splicedFromClient_) {
+    splicedFromClient_ = clientToBrokerPump_->bytesForwarded();
+    lastClientRead_ = now;
+  }
+  // Neither does the silence of a client we stopped reading from
+  if (clientReadPaused_ || clientReadHeld_ || clientSplicePending_)
+    lastClientRead_ = now;
 
-        // Handle packet
-        handlePacket(data, PacketDirection::BrokerToClient);
+  auto idle = std::chrono::steady_clock::duration(now - lastClientRead_);
+  if (idle < idleLimit_) {
+    timerWheel_.schedule(timeout_, idleLimit_ - idle);
+    return;
+  }
+  MITMQTT_LOG_WARN(kTag << "Client " << clientId_ << " sent nothing for "
+                   << idleLimit_.count() << " ms");
+  handler_.getMetrics().idleTimedOut();
+  stop();
+}
 
-        // Forward to client
-        sendToClient(data);
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::connectToBroker() {
+  if (brokerConnected_ || brokerConnecting_)
+    return;
 
-        // Continue reading
-        doReadFromBroker();
-      });
+  // Client data keeps arriving and is buffered until the connect completes
+  brokerConnecting_ = true;
+  if (handler_.isBrokerWebSocketEnabled())
+    brokerStream_.enableWebSocket();
+  connectToUpstream();
 }
 
-void MQTTConnection::sendToClient(const std::vector<uint8_t> &data) {
-  if (!connected_)
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::connectToUpstream() {
+  upstream_ = handler_.getBrokerPool().select(clientId_, triedUpstreams_);
+  if (!upstream_) {
+    MITMQTT_LOG_ERROR(kTag << "No broker left to connect to");
+    stop();
     return;
+  }
+
+  BrokerPool::UpstreamPtr upstream = upstream_.get();
+  auto self = this->shared_from_this();
+  handler_.getDNSCache().asyncResolve(
+      brokerStream_.get_executor(), upstream->host(), upstream->port(),
+      [this, self, upstream](boost::system::error_code ec,
+                             const DNSCache::Endpoints &endpoints) {
+        if (!connected_)
+          return;
 
-  auto self = shared_from_this();
-  boost::asio::async_write(
-      clientSocket_, boost::asio::buffer(data),
-      [this, self](boost::system::error_code ec, std::size_t /*length*/) {
         if (ec) {
-          std::cerr << "Client write error: " << ec.message() << std::endl;
-          stop();
+          MITMQTT_LOG_ERROR("Failed to resolve broker " << upstream->host()
+                            << ": " << ec.message());
+          failOver();
+          return;
         }
+
+        timerWheel_.schedule(brokerConnectTimeout_, kBrokerConnectTimeout);
+        boost::asio::async_connect(
+            brokerStream_.socket(), endpoints,
+            [this, self, upstream](boost::system::error_code ec,
+                                   const boost::asio::ip::tcp::endpoint &) {
+              if (!connected_)
+                return;
+              timerWheel_.cancel(brokerConnectTimeout_);
+
+              if (ec) {
+                // Timeouts were logged by onBrokerConnectTimeout()
+                if (ec != boost::asio::error::operation_aborted) {
+                  MITMQTT_LOG_ERROR("Failed to connect to broker "
+                                    << upstream->name() << ": "
+                                    << ec.message());
+                }
+                // A refused connect says nothing about the address; a
+                // moved broker is picked up when the entry expires
+                failOver();
+                return;
+              }
+
+              MITMQTT_LOG_INFO("Connected to broker: " << upstream->name());
+              handler_.getBrokerPool().reportSuccess(upstream);
+              handler_.secureBrokerStream(
+                  brokerStream_, upstream->host(), upstream->port(),
+                  [this, self](boost::system::error_code ec) {
+                    if (!connected_)
+                      return;
+                    if (ec)
+                      stop();
+                    else
+                      onBrokerConnected();
+                  });
+            });
       });
 }
 
-void MQTTConnection::sendToBroker(const std::vector<uint8_t> &data) {
-  if (!brokerConnected_)
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::onBrokerConnectTimeout() {
+  if (!connected_ || brokerConnected_ || !upstream_)
     return;
 
-  auto self = shared_from_this();
-  boost::asio::async_write(
-      brokerSocket_, boost::asio::buffer(data),
-      [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-        if (ec) {
-          std::cerr << "Broker write error: " << ec.message() << std::endl;
-          stop();
-        }
-      });
+  MITMQTT_LOG_ERROR("Timed out connecting to broker "
+                    << upstream_.get()->name());
+  // The pending connect completes with operation_aborted and fails over
+  boost::system::error_code ec;
+  brokerStream_.socket().close(ec);
 }
 
-std::string MQTTConnection::getClientId() const { return clientId_; }
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::failOver() {
+  // Nothing has been written yet, the buffered CONNECT goes to the next one
+  handler_.getBrokerPool().reportFailure(upstream_.get());
+  triedUpstreams_.push_back(upstream_.get());
+  upstream_.release();
+  connectToUpstream();
+}
 
-std::string MQTTConnection::getClientAddress() const {
-  try {
-    return clientSocket_.remote_endpoint().address().to_string();
-  } catch (...) {
-    return "unknown";
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::onBrokerConnected() {
+  brokerConnecting_ = false;
+  brokerConnected_ = true;
+
+  // Flush whatever the client sent while we were connecting
+  if (brokerWriteQueue_.hasPending())
+    doWriteToBroker();
+
+  // Start reading from broker
+  doReadFromBroker();
+
+  if (clientReadPaused_) {
+    clientReadPaused_ = false;
+    if (!clientReadHeld_)
+      doReadFromClient();
   }
 }
 
-std::string MQTTConnection::getBrokerAddress() const {
-  try {
-    if (brokerConnected_) {
-      return brokerSocket_.remote_endpoint().address().to_string();
+template <typename ClientStream>
+bool BasicMQTTConnection<ClientStream>::maybeSplice(
+    PacketDirection direction) {
+  // splice() needs both ends to be plain sockets
+  if constexpr (kTLS) {
+    return false;
+  } else {
+    if (!brokerConnected_ || !handler_.canBypassInspection() ||
+        brokerStream_.secure() || clientWS_ || brokerStream_.webSocket())
+      return false;
+
+    bool clientToBroker = direction == PacketDirection::ClientToBroker;
+    const MQTTFramer &framer = clientToBroker ? clientFramer_ : brokerFramer_;
+    const WriteQueue &queue =
+        clientToBroker ? brokerWriteQueue_ : clientWriteQueue_;
+
+    // Switch only on a frame boundary, a partial packet would be lost, and
+    // not while delayed frames are still to be sent
+    const DelayLine &delayed =
+        clientToBroker ? toBrokerDelay_ : toClientDelay_;
+    const HoldQueue &held = clientToBroker ? toBrokerHeld_ : toClientHeld_;
+    if (framer.buffered() != 0 || !delayed.empty() || !held.empty())
+      return false;
+
+    if (queue.writing() || queue.hasPending()) {
+      // Finish the queued writes first so bytes stay in order
+      (clientToBroker ? clientSplicePending_ : brokerSplicePending_) = true;
+      return true;
     }
-    return "not connected";
-  } catch (...) {
-    return "unknown";
+
+    startSplice(direction);
+    return true;
   }
 }
 
-// ============================================================================
-// MQTTTLSConnection Implementation
-// ============================================================================
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::startSplice(
+    PacketDirection direction) {
+  if constexpr (!kTLS) {
+    bool clientToBroker = direction == PacketDirection::ClientToBroker;
+    auto &pump = clientToBroker ? clientToBrokerPump_ : brokerToClientPump_;
+    if (!pump) {
+      pump = clientToBroker
+                 ? std::make_unique<SplicePump>(clientStream_,
+                                                  brokerStream_.socket())
+                 : std::make_unique<SplicePump>(brokerStream_.socket(),
+                                                  clientStream_);
+    }
+
+    auto self = this->shared_from_this();
+    bool started =
+        pump->start(self, [this, self](boost::system::error_code ec) {
+          if (ec && ec != boost::asio::error::eof &&
+              ec != boost::asio::error::operation_aborted) {
+            MITMQTT_LOG_WARN("Splice error: " << ec.message());
+          }
+          stop();
+        });
 
-MQTTTLSConnection::MQTTTLSConnection(boost::asio::ip::tcp::socket socket,
-                                     boost::asio::ssl::context &serverCtx,
-                                     boost::asio::ssl::context & /*clientCtx*/,
-                                     MQTTHandler &handler)
-    : clientStream_(std::move(socket), serverCtx),
-      brokerSocket_(clientStream_.get_executor()), handler_(handler),
-      clientReadBuffer_(8192), brokerReadBuffer_(8192), connected_(false),
-      brokerConnected_(false) {
-  std::cout << "TLS connection created (TLS termination mode)" << std::endl;
+    if (!started) {
+      // Fall back to the user-space read loop
+      if (clientToBroker)
+        doReadFromClient();
+      else
+        doReadFromBroker();
+    }
+  }
 }
 
-void MQTTTLSConnection::start() { doHandshakeWithClient(); }
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::forwardPacket(
+    const FrameView &frame, PacketDirection direction) {
+  stats_.addPacket(direction, frame.typeNibble());
+
+  bool toBroker = direction == PacketDirection::ClientToBroker;
+  if (toBroker && frame.typeNibble() == 1) {
+    // A malformed CONNECT leaves the fields past the fault empty
+    PacketView connect;
+    decodePacket(frame, 0, connect);
+    clientId_ = std::string(connect.clientId);
+    protocolLevel_ = connect.protocolLevel;
+    handler_.identifyConnection(id_, clientId_, std::string(connect.username));
+    startKeepAlive(connect.keepAlive);
+    // After the client id is known, it may pick the broker
+    connectToBroker();
+  } else if (!toBroker && frame.typeNibble() == 2) {
+    // CONNACK return code (reason code in MQTT 5), 0 is success
+    PacketView connack;
+    if (decodePacket(frame, protocolLevel_, connack))
+      handler_.connectionAccepted(id_, connack.reasonCode == 0);
+  }
 
-void MQTTTLSConnection::stop() {
-  connected_ = false;
-  brokerConnected_ = false;
+  FrameView forwarded = frame;
+  std::chrono::milliseconds delay(0);
+
+  handler_.refreshRules(rules_, intercept_, rulesGeneration_);
+  if (rules_) {
+    RuleResult result = rules_->apply(direction, frame, clientId_,
+                                      protocolLevel_, rewriteBuffer_);
+    if (result.drop) {
+      MITMQTT_LOG_DEBUG("Rule " << result.rule << " dropped a "
+                        << packetTypeToString(frame.typeNibble()));
+      return;
+    }
+    if (result.rewritten)
+      forwarded = FrameView{rewriteBuffer_.data(), rewriteBuffer_.size()};
+    delay = result.delay;
+  }
 
-  boost::system::error_code ec;
+  // Intercepted frames wait for the GUI, later ones wait behind them
+  HoldQueue &held = toBroker ? toBrokerHeld_ : toClientHeld_;
+  bool intercepted =
+      intercept_ &&
+      intercept_->matches(direction, forwarded, clientId_, protocolLevel_);
+  if (intercepted || !held.empty()) {
+    uint64_t holdId =
+        intercepted
+            ? handler_.registerHeld(id_, direction, protocolLevel_, forwarded)
+            : 0;
+    held.push(holdId, forwarded.data, forwarded.size, delay);
+    return;
+  }
+
+  sendFrame(forwarded, direction, delay);
+}
+
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::sendFrame(
+    const FrameView &frame, PacketDirection direction,
+    std::chrono::milliseconds delay) {
+  // Once anything is delayed, later frames queue up behind it
+  bool toBroker = direction == PacketDirection::ClientToBroker;
+  DelayLine &delayed = toBroker ? toBrokerDelay_ : toClientDelay_;
+  if (delay.count() > 0 || !delayed.empty()) {
+    delayed.push(frame.data, frame.size, delay);
+    scheduleDelayed(direction);
+  } else if (toBroker) {
+    queueToBroker(frame.data, frame.size);
+  } else {
+    queueToClient(frame.data, frame.size);
+  }
 
-  // Shutdown SSL gracefully for client
-  clientStream_.shutdown(ec);
+  handlePacket(frame, direction);
+}
 
-  // Close sockets
-  clientStream_.lowest_layer().close(ec);
-  brokerSocket_.close(ec);
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::resolveHeld(
+    uint64_t id, PacketDirection direction, bool drop,
+    std::vector<uint8_t> replacement) {
+  auto self = this->shared_from_this();
+  auto resolve = [this, self, id, direction, drop,
+                  replacement = std::move(replacement)]() mutable {
+    HoldQueue &held = direction == PacketDirection::ClientToBroker
+                          ? toBrokerHeld_
+                          : toClientHeld_;
+    if (held.resolve(id, drop, std::move(replacement)))
+      flushHeld(direction);
+  };
+  boost::asio::dispatch(clientStream_.get_executor(), std::move(resolve));
 }
 
-void MQTTTLSConnection::doHandshakeWithClient() {
-  auto self = shared_from_this();
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::flushHeld(PacketDirection direction) {
+  bool toBroker = direction == PacketDirection::ClientToBroker;
+  HoldQueue &held = toBroker ? toBrokerHeld_ : toClientHeld_;
+  held.flush([this, direction](const FrameView &frame,
+                               std::chrono::milliseconds delay) {
+    sendFrame(frame, direction, delay);
+  });
 
-  clientStream_.async_handshake(
-      boost::asio::ssl::stream_base::server,
-      [this, self](boost::system::error_code ec) {
-        if (!ec) {
-          std::cout << "TLS handshake with client successful" << std::endl;
-          connected_ = true;
-          doConnectToBroker();
-        } else {
-          std::cerr << "TLS handshake with client failed: " << ec.message()
-                    << std::endl;
-          stop();
-        }
-      });
+  // Resume a side whose reads were stopped by its hold queue
+  if (held.queuedBytes() > handler_.getHoldLimit())
+    return;
+  if (toBroker && clientReadHeld_) {
+    clientReadHeld_ = false;
+    if (!clientReadPaused_)
+      doReadFromClient();
+  } else if (!toBroker && brokerReadHeld_) {
+    brokerReadHeld_ = false;
+    doReadFromBroker();
+  }
 }
 
-void MQTTTLSConnection::doConnectToBroker() {
-  auto self = shared_from_this();
-
-  boost::asio::ip::tcp::resolver resolver(clientStream_.get_executor());
-  auto endpoints = resolver.resolve(handler_.getBrokerHost(),
-                                    std::to_string(handler_.getBrokerPort()));
-
-  boost::asio::async_connect(
-      brokerSocket_, endpoints,
-      [this, self](boost::system::error_code ec,
-                   const boost::asio::ip::tcp::endpoint &endpoint) {
-        if (!ec) {
-          std::cout << "Connected to broker (plain TCP): " << endpoint
-                    << std::endl;
-          brokerConnected_ = true;
-
-          // Start reading from both sides immediately (no TLS handshake needed)
-          doReadFromClient();
-          doReadFromBroker();
-        } else {
-          std::cerr << "Failed to connect to broker: " << ec.message()
-                    << std::endl;
-          stop();
-        }
-      });
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::scheduleDelayed(
+    PacketDirection direction) {
+  auto self = this->shared_from_this();
+  if (direction == PacketDirection::ClientToBroker) {
+    toBrokerDelay_.schedule(self, [this](const uint8_t *data, size_t size) {
+      queueToBroker(data, size);
+    });
+  } else {
+    toClientDelay_.schedule(self, [this](const uint8_t *data, size_t size) {
+      queueToClient(data, size);
+    });
+  }
 }
 
-void MQTTTLSConnection::doReadFromClient() {
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::handlePacket(
+    const FrameView &frame, PacketDirection direction) {
+  if (frame.empty())
+    return;
+
+  // Store packet for replay
+  uint64_t sequence =
+      handler_.storePacket(id_, direction, frame, protocolLevel_);
+
+  // Compact record for the GUI
+  handler_.capturePacket(id_, direction, frame, sequence,
+                         protocolLevel_);
+
+  std::string_view typeName = packetTypeName(frame.typeNibble());
+  MITMQTT_LOG_PACKET(directionToString(direction) << " - " << typeName);
+
+  // Only decode as much as the packet callback asks for
+  InspectionLevel level = handler_.getCallbackLevel();
+  if (level == InspectionLevel::None)
+    return;
+
+  // Topic and payload are only decoded when someone wants them
+  std::string summary;
+  PacketView packet;
+  if (level == InspectionLevel::Full && frame.typeNibble() == 3 &&
+      decodePacket(frame, protocolLevel_, packet)) {
+    summary = "Topic: " + std::string(packet.topic) +
+              ", Payload: " + std::string(packet.payload);
+  }
+
+  handler_.packetCallback_(direction, typeName, summary);
+}
+
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::doReadFromClient() {
   if (!connected_)
     return;
 
-  auto self = shared_from_this();
+  size_t writable = 0;
+  uint8_t *buffer = clientFramer_.prepare(writable);
+
+  auto self = this->shared_from_this();
   clientStream_.async_read_some(
-      boost::asio::buffer(clientReadBuffer_),
-      [this, self](boost::system::error_code ec,
-                   std::size_t bytes_transferred) {
-        if (!ec && bytes_transferred > 0) {
-          std::vector<uint8_t> data(clientReadBuffer_.begin(),
-                                    clientReadBuffer_.begin() +
-                                        bytes_transferred);
-
-          // Process and log the packet
-          handlePacket(data, PacketDirection::ClientToBroker);
-
-          // Forward to broker
-          sendToBroker(data);
-
-          // Continue reading
-          doReadFromClient();
-        } else if (ec) {
-          std::cerr << "TLS Client read error: " << ec.message() << std::endl;
+      boost::asio::buffer(buffer, writable),
+      [this, self, buffer](boost::system::error_code ec, std::size_t length) {
+        if (ec) {
+          if (ec != boost::asio::error::eof &&
+              ec != boost::asio::ssl::error::stream_truncated &&
+              ec != boost::asio::error::operation_aborted)
+            stats_.addReadError();
+          MITMQTT_LOG_WARN(kTag << "Client read error: " << ec.message());
           stop();
+          return;
+        }
+
+        stats_.addBytes(PacketDirection::ClientToBroker, length);
+        if (clientWS_) {
+          // Leaves only MQTT bytes in the framer's buffer
+          length = clientWS_->decode(buffer, length);
+          if (clientWS_->flushControl(clientWriteQueue_) &&
+              !clientWriteQueue_.writing())
+            doWriteToClient();
+        }
+        clientFramer_.commit(length);
+        readTime_ = std::chrono::steady_clock::now().time_since_epoch().count();
+        lastClientRead_ = readTime_;
+
+        // A single read may carry several packets, or only part of one
+        FrameView frame;
+        while (clientFramer_.next(frame)) {
+          // Forward first (buffered until the broker connect that CONNECT
+          // starts completes), then inspect; the queue holds its own copy
+          forwardPacket(frame, PacketDirection::ClientToBroker);
+        }
+        readTime_ = 0;
+
+        if (clientFramer_.malformed()) {
+          MITMQTT_LOG_WARN(kTag << "Malformed MQTT stream from client");
+          stop();
+          return;
+        }
+
+        if (clientWS_ && (clientWS_->closed() || clientWS_->failed())) {
+          if (clientWS_->failed())
+            MITMQTT_LOG_WARN("Malformed WebSocket stream from client");
+          stop();
+          return;
+        }
+
+        // Stop reading if the broker is slow to accept the connection
+        if (brokerConnecting_ && brokerWriteQueue_.aboveHighWater()) {
+          clientReadPaused_ = true;
+          return;
         }
+
+        // or while too much is held back from the broker
+        if (toBrokerHeld_.queuedBytes() > handler_.getHoldLimit()) {
+          clientReadHeld_ = true;
+          return;
+        }
+
+        if (maybeSplice(PacketDirection::ClientToBroker))
+          return;
+
+        // Continue reading
+        doReadFromClient();
       });
 }
 
-void MQTTTLSConnection::doReadFromBroker() {
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::doReadFromBroker() {
   if (!brokerConnected_)
     return;
 
-  auto self = shared_from_this();
-  brokerSocket_.async_read_some(
-      boost::asio::buffer(brokerReadBuffer_),
-      [this, self](boost::system::error_code ec,
-                   std::size_t bytes_transferred) {
-        if (!ec && bytes_transferred > 0) {
-          std::vector<uint8_t> data(brokerReadBuffer_.begin(),
-                                    brokerReadBuffer_.begin() +
-                                        bytes_transferred);
-
-          // Process and log the packet
-          handlePacket(data, PacketDirection::BrokerToClient);
-
-          // Forward to client
-          sendToClient(data);
-
-          // Continue reading
-          doReadFromBroker();
-        } else if (ec) {
-          std::cerr << "TLS Broker read error: " << ec.message() << std::endl;
+  size_t writable = 0;
+  uint8_t *buffer = brokerFramer_.prepare(writable);
+
+  auto self = this->shared_from_this();
+  brokerStream_.async_read_some(
+      boost::asio::buffer(buffer, writable),
+      [this, self, buffer](boost::system::error_code ec, std::size_t length) {
+        if (ec) {
+          if (ec != boost::asio::error::eof &&
+              ec != boost::asio::ssl::error::stream_truncated &&
+              ec != boost::asio::error::operation_aborted)
+            stats_.addReadError();
+          MITMQTT_LOG_WARN(kTag << "Broker read error: " << ec.message());
+          stop();
+          return;
+        }
+
+        stats_.addBytes(PacketDirection::BrokerToClient, length);
+        if (WebSocketCodec *ws = brokerStream_.webSocket()) {
+          length = ws->decode(buffer, length);
+          if (ws->flushControl(brokerWriteQueue_) &&
+              !brokerWriteQueue_.writing())
+            doWriteToBroker();
+        }
+        brokerFramer_.commit(length);
+        readTime_ = std::chrono::steady_clock::now().time_since_epoch().count();
+
+        FrameView frame;
+        while (brokerFramer_.next(frame)) {
+          // Forward to client, then inspect
+          forwardPacket(frame, PacketDirection::BrokerToClient);
+        }
+        readTime_ = 0;
+
+        if (brokerFramer_.malformed()) {
+          MITMQTT_LOG_WARN(kTag << "Malformed MQTT stream from broker");
           stop();
+          return;
+        }
+
+        if (WebSocketCodec *ws = brokerStream_.webSocket()) {
+          if (ws->closed() || ws->failed()) {
+            if (ws->failed())
+              MITMQTT_LOG_WARN("Malformed WebSocket stream from broker");
+            stop();
+            return;
+          }
         }
+
+        // Stop reading while too much is held back from the client
+        if (toClientHeld_.queuedBytes() > handler_.getHoldLimit()) {
+          brokerReadHeld_ = true;
+          return;
+        }
+
+        if (maybeSplice(PacketDirection::BrokerToClient))
+          return;
+
+        // Continue reading
+        doReadFromBroker();
       });
 }
 
-void MQTTTLSConnection::handlePacket(const std::vector<uint8_t> &data,
-                                     PacketDirection direction) {
-  MQTTPacket packet = MQTTPacket::fromRawData(data);
-
-  // Store the packet
-  handler_.storePacket(packet);
-
-  // Get packet type string
-  std::string packetType;
-  switch (packet.type) {
-  case PacketType::CONNECT:
-    packetType = "CONNECT";
-    break;
-  case PacketType::CONNACK:
-    packetType = "CONNACK";
-    break;
-  case PacketType::PUBLISH:
-    packetType = "PUBLISH";
-    break;
-  case PacketType::PUBACK:
-    packetType = "PUBACK";
-    break;
-  case PacketType::PUBREC:
-    packetType = "PUBREC";
-    break;
-  case PacketType::PUBREL:
-    packetType = "PUBREL";
-    break;
-  case PacketType::PUBCOMP:
-    packetType = "PUBCOMP";
-    break;
-  case PacketType::SUBSCRIBE:
-    packetType = "SUBSCRIBE";
-    break;
-  case PacketType::SUBACK:
-    packetType = "SUBACK";
-    break;
-  case PacketType::UNSUBSCRIBE:
-    packetType = "UNSUBSCRIBE";
-    break;
-  case PacketType::UNSUBACK:
-    packetType = "UNSUBACK";
-    break;
-  case PacketType::PINGREQ:
-    packetType = "PINGREQ";
-    break;
-  case PacketType::PINGRESP:
-    packetType = "PINGRESP";
-    break;
-  case PacketType::DISCONNECT:
-    packetType = "DISCONNECT";
-    break;
-  default:
-    packetType =
-        "OTHER (" + std::to_string(static_cast<int>(packet.type)) + ")";
-    break;
-  }
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::sendToClient(
+    const std::vector<uint8_t> &data) {
+  auto self = this->shared_from_this();
+  boost::asio::dispatch(clientStream_.get_executor(), [this, self, data]() {
+    queueToClient(data.data(), data.size());
+  });
+}
 
-  std::cout << "[TLS] " << directionToString(direction) << " - " << packetType
-            << std::endl;
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::sendToBroker(
+    const std::vector<uint8_t> &data) {
+  auto self = this->shared_from_this();
+  boost::asio::dispatch(clientStream_.get_executor(), [this, self, data]() {
+    queueToBroker(data.data(), data.size());
+  });
+}
 
-  // Build payload string for display
-  std::string payloadStr;
-  if (packet.type == PacketType::PUBLISH) {
-    payloadStr = "Topic: " + packet.topic + ", Payload: " + packet.payload;
-  }
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::sendShared(
+    PacketDirection direction,
+    std::shared_ptr<const std::vector<uint8_t>> buffer, size_t offset,
+    size_t size) {
+  auto self = this->shared_from_this();
+  boost::asio::dispatch(clientStream_.get_executor(), [this, self, direction,
+                                             buffer = std::move(buffer),
+                                             offset, size]() {
+    const uint8_t *data = buffer->data() + offset;
+    if (direction == PacketDirection::ClientToBroker)
+      queueToBroker(data, size, buffer);
+    else
+      queueToClient(data, size, buffer);
+  });
+}
 
-  // Call packet callback if set
-  if (handler_.packetCallback_) {
-    handler_.packetCallback_(direction, packetType, payloadStr);
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::queueToClient(
+    const uint8_t *data, size_t size, std::shared_ptr<const void> owner) {
+  if (!connected_)
+    return;
+
+  if (brokerToClientPump_ && brokerToClientPump_->active()) {
+    MITMQTT_LOG_WARN("Connection is spliced, dropping injected data");
+    return;
   }
+
+  if (clientWS_)
+    clientWS_->encode(data, size, clientWriteQueue_, std::move(owner));
+  else if (owner)
+    clientWriteQueue_.push(data, size, std::move(owner));
+  else
+    clientWriteQueue_.push(data, size);
+  if (readTime_)
+    clientWriteQueue_.stamp(readTime_);
+  stats_.setQueued(PacketDirection::BrokerToClient,
+                   clientWriteQueue_.queuedBytes());
+  if (!clientWriteQueue_.writing())
+    doWriteToClient();
 }
 
-void MQTTTLSConnection::sendToClient(const std::vector<uint8_t> &data) {
-  if (!connected_)
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::queueToBroker(
+    const uint8_t *data, size_t size, std::shared_ptr<const void> owner) {
+  if (!brokerConnected_ && !brokerConnecting_)
     return;
 
-  auto self = shared_from_this();
+  if (clientToBrokerPump_ && clientToBrokerPump_->active()) {
+    MITMQTT_LOG_WARN("Connection is spliced, dropping injected data");
+    return;
+  }
+
+  if (WebSocketCodec *ws = brokerStream_.webSocket())
+    ws->encode(data, size, brokerWriteQueue_, std::move(owner));
+  else if (owner)
+    brokerWriteQueue_.push(data, size, std::move(owner));
+  else
+    brokerWriteQueue_.push(data, size);
+  if (readTime_)
+    brokerWriteQueue_.stamp(readTime_);
+  stats_.setQueued(PacketDirection::ClientToBroker,
+                   brokerWriteQueue_.queuedBytes());
+  if (brokerConnected_ && !brokerWriteQueue_.writing())
+    doWriteToBroker();
+}
+
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::doWriteToClient() {
+  auto self = this->shared_from_this();
   boost::asio::async_write(
-      clientStream_, boost::asio::buffer(data),
+      clientStream_, clientWriteQueue_.beginBatch(),
       [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+        int64_t stamp = clientWriteQueue_.batchStamp();
+        clientWriteQueue_.completeBatch();
+        noteWritten(PacketDirection::BrokerToClient, clientWriteQueue_, stamp,
+                    ec);
         if (ec) {
-          std::cerr << "TLS Client write error: " << ec.message() << std::endl;
+          MITMQTT_LOG_WARN(kTag << "Client write error: " << ec.message());
           stop();
+          return;
+        }
+
+        // Everything queued during the write goes out as the next batch
+        if (connected_ && clientWriteQueue_.hasPending()) {
+          doWriteToClient();
+        } else if (brokerSplicePending_) {
+          brokerSplicePending_ = false;
+          startSplice(PacketDirection::BrokerToClient);
         }
       });
 }
 
-void MQTTTLSConnection::sendToBroker(const std::vector<uint8_t> &data) {
-  if (!brokerConnected_)
-    return;
-
-  auto self = shared_from_this();
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::doWriteToBroker() {
+  auto self = this->shared_from_this();
   boost::asio::async_write(
-      brokerSocket_, boost::asio::buffer(data),
+      brokerStream_, brokerWriteQueue_.beginBatch(),
       [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+        int64_t stamp = brokerWriteQueue_.batchStamp();
+        brokerWriteQueue_.completeBatch();
+        noteWritten(PacketDirection::ClientToBroker, brokerWriteQueue_, stamp,
+                    ec);
         if (ec) {
-          std::cerr << "TLS Broker write error: " << ec.message() << std::endl;
+          MITMQTT_LOG_WARN(kTag << "Broker write error: " << ec.message());
           stop();
+          return;
+        }
+
+        if (brokerConnected_ && brokerWriteQueue_.hasPending()) {
+          doWriteToBroker();
+        } else if (clientSplicePending_) {
+          clientSplicePending_ = false;
+          startSplice(PacketDirection::ClientToBroker);
         }
       });
 }
 
-std::string MQTTTLSConnection::getClientId() const { return clientId_; }
+template <typename ClientStream>
+void BasicMQTTConnection<ClientStream>::noteWritten(
+    PacketDirection direction, const WriteQueue &queue, int64_t stamp,
+    const boost::system::error_code &ec) {
+  if (ec) {
+    if (ec != boost::asio::error::operation_aborted)
+      stats_.addWriteError();
+  } else if (stamp != 0) {
+    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    handler_.getMetrics().recordProxyLatency(
+        direction, std::chrono::steady_clock::duration(now - stamp));
+  }
+  stats_.setQueued(direction, queue.queuedBytes());
+}
+
+template <typename ClientStream>
+std::string BasicMQTTConnection<ClientStream>::getClientId() const {
+  return clientId_;
+}
 
-std::string MQTTTLSConnection::getClientAddress() const {
+template <typename ClientStream>
+std::string BasicMQTTConnection<ClientStream>::getClientAddress() const {
   try {
     return clientStream_.lowest_layer().remote_endpoint().address().to_string();
   } catch (...) {
@@ -833,10 +1909,11 @@ std::string MQTTTLSConnection::getClientAddress() const {
   }
 }
 
-std::string MQTTTLSConnection::getBrokerAddress() const {
+template <typename ClientStream>
+std::string BasicMQTTConnection<ClientStream>::getBrokerAddress() const {
   try {
     if (brokerConnected_) {
-      return brokerSocket_.remote_endpoint().address().to_string();
+      return brokerStream_.socket().remote_endpoint().address().to_string();
     }
     return "not connected";
   } catch (...) {
@@ -844,4 +1921,7 @@ std::string MQTTTLSConnection::getBrokerAddress() const {
   }
 }
 
-} 
\ No newline at end of file
+template class BasicMQTTConnection<boost::asio::ip::tcp::socket>;
+template class BasicMQTTConnection<SSLStream>;
+
+}
@@ -2,49 +2,66 @@
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
-#include <boost/beast/core.hpp>
-#include <boost/beast/websocket.hpp>
+#include "broker_pool.hpp"
+#include "broker_stream.hpp"
+#include "capture_file.hpp"
+#include "connection_registry.hpp"
+#include "delay_line.hpp"
+#include "dns_cache.hpp"
+#include "handshake_gate.hpp"
+#include "hold_queue.hpp"
+#include "io_context_pool.hpp"
+#include "leaf_certificate_cache.hpp"
+#include "metrics.hpp"
+#include "metrics_server.hpp"
+#include "mqtt_decoder.hpp"
+#include "mqtt_framer.hpp"
+#include "mqtt_types.hpp"
+#include "packet_store.hpp"
+#include "replay_engine.hpp"
+#include "rule_engine.hpp"
+#include "splice_pump.hpp"
+#include "timer_wheel.hpp"
+#include "tls_session_cache.hpp"
+#include "websocket_codec.hpp"
+#include "write_queue.hpp"
+#include "../utils/mpsc_ring.hpp"
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 namespace mitmqtt {
 
 // Forward declarations
 class MQTTPacket;
-class MQTTConnection;
-class MQTTTLSConnection;
 
-enum class PacketDirection { ClientToBroker, BrokerToClient };
+// How much of each forwarded packet has to be decoded
+enum class InspectionLevel : uint8_t {
+  None,   // Forward only
+  Header, // Packet type and flags
+  Full    // Topic and payload as well
+};
 
 const char *directionToString(PacketDirection direction);
 
-// Callback types
-using PacketCallback = std::function<void(PacketDirection, const std::string &,
+// Callback types. Both may be invoked concurrently from any I/O thread.
+// A packet callback gets the type name and, for PUBLISH, a summary of the
+// topic and payload. A connection callback gets each new connection, plain
+// or TLS, before it starts.
+using PacketCallback = std::function<void(PacketDirection, std::string_view,
                                           const std::string &)>;
-using ConnectionCallback = std::function<void(std::shared_ptr<MQTTConnection>)>;
-
-// MQTT packet types
-enum class PacketType : uint8_t {
-  CONNECT = 1,
-  CONNACK = 2,
-  PUBLISH = 3,
-  PUBACK = 4,
-  PUBREC = 5,
-  PUBREL = 6,
-  PUBCOMP = 7,
-  SUBSCRIBE = 8,
-  SUBACK = 9,
-  UNSUBSCRIBE = 10,
-  UNSUBACK = 11,
-  PINGREQ = 12,
-  PINGRESP = 13,
-  DISCONNECT = 14
-};
+using ConnectionCallback =
+    std::function<void(const ConnectionRegistry::Entry &)>;
 
 // Simple MQTT Packet structure
 class MQTTPacket {
@@ -59,16 +76,60 @@ public:
 
   MQTTPacket() : type(PacketType::CONNECT), qos(0), retain(false), dup(false) {}
 
-  // Construct from raw data
-  static MQTTPacket fromRawData(const std::vector<uint8_t> &raw);
+  // Construct from raw data sent over MQTT `protocolLevel`, decoding the
+  // topic and payload of a PUBLISH
+  static MQTTPacket fromRawData(const std::vector<uint8_t> &raw,
+                                uint8_t protocolLevel = 4);
+  static MQTTPacket fromRawData(const uint8_t *raw, size_t size,
+                                uint8_t protocolLevel = 4);
+
+  // Copy the raw bytes and decode only the fixed header flags
+  static MQTTPacket fromFixedHeader(const uint8_t *raw, size_t size);
 
   // Convert to raw data
   std::vector<uint8_t> toRawData() const;
+
+  // Build a QoS 0 PUBLISH packet, as sent by MQTTHandler::injectPacket
+  static std::vector<uint8_t> buildPublish(const std::string &topic,
+                                           const std::string &payload);
+};
+
+// Compact record of one forwarded packet, passed from the I/O threads to the
+// GUI through a CaptureQueue
+struct CaptureRecord {
+  std::chrono::steady_clock::rep timestamp = 0; // Raw steady_clock ticks
+  uint64_t connectionId = 0;
+  uint64_t sequence = 0; // In the replay store, 0 if not stored
+  uint32_t size = 0;     // Whole packet including fixed header
+  uint8_t header = 0;    // First fixed header byte (type and flags)
+  PacketDirection direction = PacketDirection::ClientToBroker;
+  std::string topic;     // PUBLISH only, with InspectionLevel::Full
+  std::string payload;
+  std::string clientId;  // CONNECT only, with InspectionLevel::Full
+
+  uint8_t type() const { return (header >> 4) & 0x0F; }
+};
+
+using CaptureQueue = utils::MPSCRing<CaptureRecord>;
+
+// A packet held by the intercept rules, as listed for the GUI
+struct HeldPacket {
+  uint64_t id = 0;
+  uint64_t connectionId = 0;
+  PacketDirection direction = PacketDirection::ClientToBroker;
+  uint8_t protocolLevel = 4; // Of the connection, for editing the packet
+  std::chrono::steady_clock::rep timestamp = 0;
+  std::vector<uint8_t> data;
 };
 
 class MQTTHandler {
 public:
+  // Single-threaded: listeners and connections all run on `ioc`
   MQTTHandler(boost::asio::io_context &ioc);
+
+  // Multi-threaded: listeners run on the pool's first context, accepted
+  // connections are distributed over the pool round-robin
+  MQTTHandler(IOContextPool &pool);
   ~MQTTHandler();
 
   // Start listening for MQTT connections
@@ -77,38 +138,277 @@ public:
   // Start TLS listener on specified port (usually 8883)
   void startTLS(const std::string &address, uint16_t port);
 
+  // Start a listener for MQTT over WebSocket (usually 8080). Clients
+  // upgrade on any path; their traffic then goes through the same rules,
+  // capture and replay store as the other listeners.
+  void startWebSocket(const std::string &address, uint16_t port);
+
   // Stop the handler
   void stop();
 
-  // Set callbacks
-  void setPacketCallback(PacketCallback callback);
+  // Set callbacks. `level` is how much of each packet the packet callback
+  // needs; with InspectionLevel::Header it receives an empty payload.
+  void setPacketCallback(PacketCallback callback,
+                         InspectionLevel level = InspectionLevel::Full);
   void setConnectionCallback(ConnectionCallback callback);
 
-  // Set broker configuration
+  // Keep raw packets for replay (on by default)
+  void setReplayStoreEnabled(bool enabled) { storeEnabled_ = enabled; }
+  bool isReplayStoreEnabled() const { return storeEnabled_; }
+
+  // Let plain TCP connections that nothing inspects be forwarded by the
+  // kernel with splice(2). Linux only, off by default.
+  void setZeroCopyEnabled(bool enabled) { zeroCopyEnabled_ = enabled; }
+  bool isZeroCopyEnabled() const { return zeroCopyEnabled_; }
+
+  // Capture records for a consumer such as the GUI. Records are dropped (and
+  // counted by the queue) rather than blocking when it falls behind. Set
+  // before start().
+  void setCaptureQueue(std::shared_ptr<CaptureQueue> queue,
+                       InspectionLevel level = InspectionLevel::Full);
+
+  // Record a forwarded frame for the capture queue and the capture file, if
+  // either is active. `sequence` is the frame's replay store sequence, if it
+  // was stored; `protocolLevel` is the connection's MQTT version.
+  void capturePacket(uint64_t connectionId, PacketDirection direction,
+                     const FrameView &frame, uint64_t sequence,
+                     uint8_t protocolLevel);
+
+  // Match-and-rewrite rules applied to every forwarded packet, replacing
+  // the current set. Safe to call from any thread; connections pick the new
+  // rules up with their next packet. Connections already spliced are not
+  // affected.
+  void setRules(std::vector<Rule> rules);
+  std::shared_ptr<const RuleEngine> getRules() const;
+
+  // Intercept: packets matching any of these rules (whose actions are
+  // ignored) are held by their connection until released or dropped, and
+  // later packets in the same direction queue up behind them. Passing no
+  // rules turns interception off and releases everything held.
+  void setInterceptRules(std::vector<Rule> rules);
+  bool isIntercepting() const { return interceptActive_; }
+
+  // Update a connection's copy of the rules and intercept rules if they
+  // changed since `generation`. A single atomic load when they have not.
+  void refreshRules(std::shared_ptr<const RuleEngine> &rules,
+                    std::shared_ptr<const RuleEngine> &intercept,
+                    uint64_t &generation) const {
+    if (generation != rulesGeneration_.load(std::memory_order_acquire))
+      fetchRules(rules, intercept, generation);
+  }
+
+  // Packets currently held, oldest first. The version changes whenever the
+  // set of held packets does.
+  std::vector<HeldPacket> getHeldPackets() const;
+  uint64_t getHeldVersion() const { return heldVersion_; }
+
+  // Forward a held packet, replaced by `replacement` unless that is empty,
+  // or drop it. Safe to call from any thread.
+  void releaseHeld(uint64_t id, std::vector<uint8_t> replacement = {});
+  void dropHeld(uint64_t id);
+  void releaseAllHeld();
+
+  // Bytes a connection may hold for one direction before it stops reading
+  // from that side
+  void setHoldLimit(size_t bytes) { holdLimit_ = bytes; }
+  size_t getHoldLimit() const { return holdLimit_; }
+
+  // For connections: list a frame they hold, returns its id
+  uint64_t registerHeld(uint64_t connectionId, PacketDirection direction,
+                        uint8_t protocolLevel, const FrameView &frame);
+  // For connections: forget what a closing connection held
+  void forgetHeld(uint64_t connectionId);
+
+  // Decoding the packet callback needs on the forwarding path
+  InspectionLevel getCallbackLevel() const { return callbackLevel_; }
+
+  // True when new traffic needs no inspection at all and may be spliced
+  bool canBypassInspection() const;
+
+  // Unique id for each accepted connection
+  uint64_t nextConnectionId() { return nextConnectionId_++; }
+
+  // Forward to one broker, or spread clients over a pool of them by
+  // `balance`. Applies to connections that have not sent CONNECT yet.
   void setBrokerConfig(const std::string &host, uint16_t port);
+  void setBrokerPool(std::vector<BrokerAddress> brokers,
+                     BrokerBalance balance);
+  BrokerPool &getBrokerPool() { return brokerPool_; }
+
+  // Check that every broker of the pool accepts a TCP connect each
+  // `interval` while the proxy runs, 0 for never. Brokers that fail a
+  // connect are passed over for a while either way. Set before start().
+  void setBrokerHealthCheck(std::chrono::milliseconds interval) {
+    brokerHealthCheckMs_ = interval.count();
+  }
 
   // Public for callback access
   PacketCallback packetCallback_;
 
-  // Manual packet modification/injection
+  // Manual packet modification/injection (safe to call from any thread).
+  // `connectionId` picks the connection, 0 the one open the longest.
   void modifyPacket(const std::string &packetType, const std::string &payload);
   void injectPacket(const std::string &topic, const std::string &payload,
-                    bool toClient);
-  void replayPacket(int packetIndex);
-
-  // Store packets for replay
-  void storePacket(const MQTTPacket &packet);
-
-  // Broker config accessors
-  const std::string &getBrokerHost() const { return brokerHost_; }
-  uint16_t getBrokerPort() const { return brokerPort_; }
+                    bool toClient, uint64_t connectionId = 0);
+  // Resend a stored packet, identified by the sequence number it was stored
+  // under (see CaptureRecord::sequence), in its original direction on the
+  // connection it came from, or on the one open the longest if that closed
+  void replayPacket(uint64_t sequence);
+
+  // Replay the stored packets with sequences [first, last] as captured,
+  // paced and routed by `options`, on the listeners' io_context. Returns the
+  // replay's id, 0 if none of those packets is stored.
+  uint64_t startReplay(uint64_t firstSequence, uint64_t lastSequence,
+                       ReplayOptions options);
+  void stopReplay(uint64_t id);
+
+  struct ReplayStatus {
+    uint64_t id = 0;
+    size_t frames = 0;
+    size_t sent = 0;
+    double speed = 1.0;
+  };
+  // Replays still running, oldest first
+  std::vector<ReplayStatus> getReplays() const;
+
+  // Newest sequence in the replay store, 0 when it is empty
+  uint64_t getLastStoredSequence();
+
+  // Open connections, by id, client id and username
+  const ConnectionRegistry &getConnections() const { return connections_; }
+  // Id of the newest connection whose CONNECT carried `clientId`, 0 if none
+  // is open
+  uint64_t findConnection(const std::string &clientId) const;
+
+  // For connections: the identity from a client's CONNECT, whether the
+  // broker's CONNACK accepted it, and the connection's end
+  void identifyConnection(uint64_t id, const std::string &clientId,
+                          const std::string &username);
+  void connectionAccepted(uint64_t id, bool accepted);
+  void connectionClosed(uint64_t id);
+
+  // Store packets for replay, sent over MQTT `protocolLevel`. Returns the
+  // packet's sequence number, or 0 if the store is disabled or the packet
+  // is larger than the whole store.
+  uint64_t storePacket(const MQTTPacket &packet, uint8_t protocolLevel = 4);
+  uint64_t storePacket(uint64_t connectionId, PacketDirection direction,
+                       const FrameView &frame, uint8_t protocolLevel);
+
+  // Resize the replay store to `bytes` of memory, dropping its contents
+  void setReplayStoreBudget(size_t bytes);
+  size_t getReplayStoreBudget();
+
+  // Continuous capture of raw packets to disk, started and stopped at any
+  // time. Connections already spliced are not captured.
+  CaptureWriter &getCaptureWriter() { return captureWriter_; }
+
+  // Counters and latency histograms, recorded by the connections
+  ProxyMetrics &getMetrics() { return metrics_; }
+
+  // Totals over all connections, open and closed
+  MetricsSnapshot snapshotMetrics();
+
+  // Serve snapshotMetrics() in Prometheus text format at /metrics, on the
+  // listeners' io_context. A port of 0 picks a free one.
+  void startMetrics(const std::string &address, uint16_t port);
+  void stopMetrics();
+  bool isMetricsRunning() const;
+  uint16_t getMetricsPort() const;
+
+  // Resolved broker endpoints shared by all connections
+  DNSCache &getDNSCache() { return *dnsCache_; }
+  void setDNSCacheTTL(std::chrono::seconds ttl) { dnsCache_->setTTL(ttl); }
 
   // TLS configuration
   void setTLSEnabled(bool enabled) { tlsEnabled_ = enabled; }
   bool isTLSEnabled() const { return tlsEnabled_; }
   void setTLSCertificate(const std::string &certFile,
                          const std::string &keyFile);
+
+  // Serve every TLS client a leaf certificate minted for the server name it
+  // sent (SNI), signed by the certificate given to setTLSCertificate(),
+  // which must then be a CA. Clients that send no name get the CA itself.
+  // `prewarm` names are minted right away. Returns false if the CA could
+  // not be loaded.
+  bool enableSNICertificates(const std::vector<std::string> &prewarm = {});
+  void disableSNICertificates() { sniCertificates_ = false; }
+  bool isSNICertificatesEnabled() const { return sniCertificates_; }
+  LeafCertificateCache &getLeafCertificates() { return leafCertificates_; }
+
+  // Where TLS handshakes with clients run. With a pool, each handshake's
+  // steps, crypto included, run on one of its contexts, and the connection
+  // carries on on its own context once established, so a reconnect storm
+  // does not delay forwarding. Without one they run on the connection's
+  // context. Set before startTLS().
+  void setHandshakePool(IOContextPool *pool) { handshakePool_ = pool; }
+
+  // At most `maxActive` client handshakes at once, up to `maxQueued` more
+  // waiting for a slot; `overflow` decides about clients beyond that. 0 is
+  // no limit.
+  void setHandshakeLimits(size_t maxActive, size_t maxQueued,
+                          HandshakeOverflow overflow);
+  // Clients that take longer to complete the handshake are dropped
+  void setHandshakeTimeout(std::chrono::milliseconds timeout) {
+    handshakeTimeoutMs_ = timeout.count();
+  }
+  std::chrono::milliseconds getHandshakeTimeout() const {
+    return std::chrono::milliseconds(handshakeTimeoutMs_.load());
+  }
+
+  // Clients that have not sent CONNECT this long after being accepted are
+  // dropped, however long they waited for a TLS handshake slot; 0 waits
+  // forever
+  void setConnectTimeout(std::chrono::milliseconds timeout) {
+    connectTimeoutMs_ = timeout.count();
+  }
+  std::chrono::milliseconds getConnectTimeout() const {
+    return std::chrono::milliseconds(connectTimeoutMs_.load());
+  }
+  // Clients that send nothing for one and a half times their keep alive
+  // interval are dropped, as a broker would. Those that set no keep alive
+  // are dropped after `timeout` of silence instead, 0 to keep them.
+  void setIdleTimeout(std::chrono::milliseconds timeout) {
+    idleTimeoutMs_ = timeout.count();
+  }
+  std::chrono::milliseconds getIdleTimeout() const {
+    return std::chrono::milliseconds(idleTimeoutMs_.load());
+  }
+
+  // Peers that send a packet larger than `bytes`, fixed header included,
+  // are dropped as malformed. Applies to connections accepted afterwards.
+  void setMaxPacketSize(size_t bytes) { maxPacketSize_ = bytes; }
+  size_t getMaxPacketSize() const { return maxPacketSize_.load(); }
+
+  // For connections: the timer wheel of the I/O context behind `executor`,
+  // which the connection's timeouts go on
+  TimerWheel &timerWheel(const boost::asio::any_io_executor &executor);
+
+  // For connections: executor to run a handshake on, `own` without a pool,
+  // and the end of a handshake the gate admitted
+  boost::asio::any_io_executor
+  handshakeExecutor(const boost::asio::any_io_executor &own);
+  void handshakeFinished();
+  // TLS towards the broker, for new connections. The broker's sessions are
+  // cached so reconnects resume.
   void setBrokerTLSEnabled(bool enabled) { brokerTLSEnabled_ = enabled; }
+  bool isBrokerTLSEnabled() const { return brokerTLSEnabled_; }
+  TLSSessionCache &getBrokerSessionCache() { return brokerSessions_; }
+
+  // MQTT over WebSocket towards the broker at `path`, for new connections,
+  // over TLS too if broker TLS is on. Set before start().
+  void setBrokerWebSocket(bool enabled, const std::string &path = "/mqtt");
+  bool isBrokerWebSocketEnabled() const { return brokerWebSocket_; }
+  const std::string &getBrokerWebSocketPath() const {
+    return brokerWebSocketPath_;
+  }
+
+  // Called by connections once their broker socket is connected: does the
+  // TLS handshake when broker TLS is on and the WebSocket upgrade when
+  // broker WebSocket is, then runs `done`, right away for plain TCP.
+  // `stream` must stay alive until then.
+  void secureBrokerStream(BrokerStream &stream, const std::string &host,
+                          uint16_t port,
+                          std::function<void(boost::system::error_code)> done);
 
   // Get SSL contexts
   boost::asio::ssl::context &getServerSSLContext() { return serverSSLContext_; }
@@ -118,117 +418,302 @@ private:
   // Internal methods
   void doAccept();
   void doAcceptTLS();
-  void handleConnection(boost::asio::ip::tcp::socket socket);
+  void doAcceptWebSocket();
+  void handleConnection(boost::asio::ip::tcp::socket socket,
+                        bool webSocket = false);
   void handleTLSConnection(boost::asio::ip::tcp::socket socket);
 
+  // SNI callback of serverSSLContext_, switches to the minted leaf
+  static int selectCertificate(SSL *ssl, int *alert, void *arg);
+
+  // Context for the next accepted connection
+  boost::asio::io_context &nextIOContext();
+
+  void fetchRules(std::shared_ptr<const RuleEngine> &rules,
+                  std::shared_ptr<const RuleEngine> &intercept,
+                  uint64_t &generation) const;
+
+  // Take a held packet off the list and tell its connection
+  void resolveHeld(uint64_t id, bool drop, std::vector<uint8_t> replacement);
+
   // Member variables
   boost::asio::io_context &ioc_;
+  IOContextPool *ioPool_; // Optional, connections use ioc_ without it
   boost::asio::ip::tcp::acceptor acceptor_;
   std::unique_ptr<boost::asio::ip::tcp::acceptor>
       tlsAcceptor_; // For TLS connections
-  bool running_;
+  std::unique_ptr<boost::asio::ip::tcp::acceptor>
+      wsAcceptor_; // For WebSocket connections
+  std::atomic<bool> running_;
 
   ConnectionCallback connectionCallback_;
 
-  std::vector<std::shared_ptr<MQTTConnection>> connections_;
-  std::vector<std::shared_ptr<MQTTTLSConnection>>
-      tlsConnections_; // TLS connections
-  std::vector<MQTTPacket> storedPackets_;
+  // Inspection configuration, read on every forwarded packet
+  std::shared_ptr<CaptureQueue> captureQueue_;
+  InspectionLevel captureLevel_;
+  std::atomic<InspectionLevel> callbackLevel_;
+  std::atomic<bool> storeEnabled_;
+  std::atomic<bool> zeroCopyEnabled_;
+  std::atomic<uint64_t> nextConnectionId_;
+
+  // Shared between I/O threads and the GUI, entries are removed as
+  // connections close
+  ConnectionRegistry connections_;
+
+  std::mutex storeMutex_;
+  PacketStore packetStore_;
+
+  // Replays in progress, by id
+  mutable std::mutex replaysMutex_;
+  std::map<uint64_t, std::shared_ptr<ReplayRun>> replays_;
+  uint64_t nextReplayId_;
+
+  CaptureWriter captureWriter_;
+
+  ProxyMetrics metrics_;
+  std::unique_ptr<MetricsServer> metricsServer_;
+
+  // Current rules and intercept rules, null when there are none. The
+  // generation changes with every update so connections notice without
+  // taking the mutex.
+  mutable std::mutex rulesMutex_;
+  std::shared_ptr<const RuleEngine> rules_;
+  std::shared_ptr<const RuleEngine> intercept_;
+  std::atomic<uint64_t> rulesGeneration_;
+  std::atomic<bool> rulesActive_;
+  std::atomic<bool> interceptActive_;
+
+  // Packets held by connections, by id
+  mutable std::mutex heldMutex_;
+  std::map<uint64_t, HeldPacket> held_;
+  uint64_t nextHoldId_;
+  std::atomic<uint64_t> heldVersion_;
+  std::atomic<size_t> holdLimit_;
 
   // Broker configuration
-  std::string brokerHost_;
-  uint16_t brokerPort_;
+  // Shared with the health checks, whose probes may outlive the handler
+  std::shared_ptr<DNSCache> dnsCache_;
+  BrokerPool brokerPool_;
+  std::atomic<int64_t> brokerHealthCheckMs_;
+  std::atomic<bool> brokerWebSocket_;
+  std::string brokerWebSocketPath_;
 
   // TLS configuration
   bool tlsEnabled_;
-  bool brokerTLSEnabled_;
+  std::atomic<bool> brokerTLSEnabled_;
   std::string certFile_;
   std::string keyFile_;
+  LeafCertificateCache leafCertificates_;
+  std::atomic<bool> sniCertificates_;
+
+  // Filled by clientSSLContext_, so declared before it
+  TLSSessionCache brokerSessions_;
 
   // SSL contexts
   boost::asio::ssl::context
       serverSSLContext_; // For accepting client connections
   boost::asio::ssl::context clientSSLContext_; // For connecting to broker
+
+  // Client handshakes
+  IOContextPool *handshakePool_;
+  HandshakeGate handshakeGate_;
+  HandshakeOverflow handshakeOverflow_;
+  std::atomic<int64_t> handshakeTimeoutMs_;
+
+  // Connection timeouts, one wheel per I/O context
+  std::vector<std::pair<boost::asio::execution_context *,
+                        std::unique_ptr<TimerWheel>>>
+      timerWheels_;
+  std::atomic<int64_t> connectTimeoutMs_;
+  std::atomic<int64_t> idleTimeoutMs_;
+  std::atomic<size_t> maxPacketSize_;
 };
 
-// Class to manage individual MQTT connections
-class MQTTConnection : public std::enable_shared_from_this<MQTTConnection> {
+// One proxied client and its broker connection.
+//
+// The client side is a `ClientStream`: a TCP socket, whose clients may also
+// speak WebSocket, or an SSL stream over one, which first does the TLS
+// handshake. Everything past that (framing, batching, rules, intercept,
+// capture, timeouts and metrics) is shared, and each stream type gets its
+// own compiled read and write paths with no virtual calls. The broker side
+// is a BrokerStream, whichever the client side. Defined in mqtt_handler.cpp
+// for MQTTConnection and MQTTTLSConnection.
+template <typename ClientStream>
+class BasicMQTTConnection
+    : public std::enable_shared_from_this<BasicMQTTConnection<ClientStream>> {
 public:
-  MQTTConnection(boost::asio::ip::tcp::socket socket, MQTTHandler &handler);
+  // With `webSocket`, the client first upgrades from HTTP and then speaks
+  // MQTT over WebSocket
+  BasicMQTTConnection(boost::asio::ip::tcp::socket socket,
+                      MQTTHandler &handler, bool webSocket = false);
 
+  // Start/stop run on the connection's own I/O thread, whichever thread
+  // they are called from
   void start();
   void stop();
+  // Start the CONNECT deadline. Called at accept time, so that it covers
+  // the wait for a handshake slot.
+  void startConnectTimeout();
 
-  // Send a packet to either client or broker
+  // Send a packet to either client or broker. Safe to call from any thread;
+  // the data is copied and owned by the connection until written.
   void sendToClient(const std::vector<uint8_t> &data);
   void sendToBroker(const std::vector<uint8_t> &data);
+  // Send `size` bytes of a shared buffer at `offset` in `direction`, from
+  // any thread. The write queue keeps the buffer alive instead of copying
+  // the bytes.
+  void sendShared(PacketDirection direction,
+                  std::shared_ptr<const std::vector<uint8_t>> buffer,
+                  size_t offset, size_t size);
 
   // Get connection info
+  uint64_t getId() const { return id_; }
   std::string getClientId() const;
   std::string getClientAddress() const;
   std::string getBrokerAddress() const;
 
-private:
-  void doReadFromClient();
-  void doReadFromBroker();
-  void connectToBroker(const std::string &host, uint16_t port);
-  void handlePacket(const std::vector<uint8_t> &data,
-                    PacketDirection direction);
+  // Outbound queues, for queue depth and high-water marks
+  const WriteQueue &getClientWriteQueue() const { return clientWriteQueue_; }
+  const WriteQueue &getBrokerWriteQueue() const { return brokerWriteQueue_; }
 
-  boost::asio::ip::tcp::socket clientSocket_;
-  boost::asio::ip::tcp::socket brokerSocket_;
-  MQTTHandler &handler_;
+  // Traffic counters, readable from any thread
+  const ConnectionStats &getStats() const { return stats_; }
 
-  std::vector<uint8_t> clientReadBuffer_;
-  std::vector<uint8_t> brokerReadBuffer_;
-
-  std::string clientId_;
-  bool connected_;
-  bool brokerConnected_;
-};
-
-// Type alias for SSL stream
-using SSLStream = boost::asio::ssl::stream<boost::asio::ip::tcp::socket>;
-
-// Class to manage individual MQTT connections over TLS
-class MQTTTLSConnection
-    : public std::enable_shared_from_this<MQTTTLSConnection> {
-public:
-  MQTTTLSConnection(boost::asio::ip::tcp::socket socket,
-                    boost::asio::ssl::context &serverCtx,
-                    boost::asio::ssl::context &clientCtx, MQTTHandler &handler);
-
-  void start();
-  void stop();
+  // Release (possibly edited) or drop a frame this connection holds. Safe
+  // to call from any thread; see MQTTHandler::releaseHeld().
+  void resolveHeld(uint64_t id, PacketDirection direction, bool drop,
+                   std::vector<uint8_t> replacement);
 
-  // Send a packet to either client or broker
-  void sendToClient(const std::vector<uint8_t> &data);
-  void sendToBroker(const std::vector<uint8_t> &data);
+private:
+  static constexpr bool kTLS = std::is_same<ClientStream, SSLStream>::value;
+  // Prefix of the connection's log lines
+  static constexpr const char *kTag = kTLS ? "[TLS] " : "";
 
-  // Get connection info
-  std::string getClientId() const;
-  std::string getClientAddress() const;
-  std::string getBrokerAddress() const;
+  static ClientStream makeClientStream(boost::asio::ip::tcp::socket socket,
+                                       MQTTHandler &handler);
 
-private:
+  // TLS handshake, when the stream has one, then the WebSocket upgrade,
+  // when the client speaks WebSocket, then reading
+  void doStart();
   void doHandshakeWithClient();
-  void doConnectToBroker();
+  // Back on the connection's own context
+  void onClientHandshake(const boost::system::error_code &ec,
+                         std::chrono::steady_clock::duration duration);
+  void onClientReady();
+  void closeClient();
+
   void doReadFromClient();
   void doReadFromBroker();
-  void handlePacket(const std::vector<uint8_t> &data,
-                    PacketDirection direction);
-
-  SSLStream clientStream_; // TLS connection to client
-  boost::asio::ip::tcp::socket
-      brokerSocket_; // Plain TCP to broker (TLS termination)
+  // Connect once the client's CONNECT has arrived, to the broker the pool
+  // picks, and to the next one if that fails
+  void connectToBroker();
+  void connectToUpstream();
+  // Give up on a broker that has not accepted the TCP connect in time
+  void onBrokerConnectTimeout();
+  void failOver();
+  void onBrokerConnected();
+
+  // Hand a direction over to a SplicePump when nothing inspects it. Returns
+  // true if the read loop for that direction must not continue. Plain TCP
+  // clients only.
+  bool maybeSplice(PacketDirection direction);
+  void startSplice(PacketDirection direction);
+  // Apply the rules to a frame, then hold or send it
+  void forwardPacket(const FrameView &frame, PacketDirection direction);
+  // Queue a frame for writing, after `delay`, and inspect it
+  void sendFrame(const FrameView &frame, PacketDirection direction,
+                 std::chrono::milliseconds delay);
+  void scheduleDelayed(PacketDirection direction);
+  // Send what is ready at the front of a hold queue
+  void flushHeld(PacketDirection direction);
+  void handlePacket(const FrameView &frame, PacketDirection direction);
+  // Replace the CONNECT deadline with the keep alive check
+  void startKeepAlive(uint16_t keepAlive);
+  void onTimeout();
+  void doStop();
+
+  // Queue data on the connection's own thread
+  // With an `owner` keeping the data alive it is queued without a copy
+  void queueToClient(const uint8_t *data, size_t size,
+                     std::shared_ptr<const void> owner = nullptr);
+  void queueToBroker(const uint8_t *data, size_t size,
+                     std::shared_ptr<const void> owner = nullptr);
+  void doWriteToClient();
+  void doWriteToBroker();
+  // Record a completed batch's latency and queue depth
+  void noteWritten(PacketDirection direction, const WriteQueue &queue,
+                   int64_t stamp, const boost::system::error_code &ec);
+
+  ClientStream clientStream_;
+  BrokerStream brokerStream_; // Never spliced once it is TLS or WebSocket
+  BrokerPool::Lease upstream_;  // The broker brokerStream_ goes to
+  std::vector<BrokerPool::UpstreamPtr> triedUpstreams_; // Failed to connect
+  std::unique_ptr<WebSocketCodec> clientWS_; // WebSocket clients only
   MQTTHandler &handler_;
-
-  std::vector<uint8_t> clientReadBuffer_;
-  std::vector<uint8_t> brokerReadBuffer_;
-
+  uint64_t id_;
+
+  // While handshaking_, the TLS handshake's steps run on
+  // handshakeExecutor_ and only they may touch clientStream_
+  boost::asio::any_io_executor handshakeExecutor_;
+  bool handshaking_;
+  bool stopped_;
+
+  ConnectionStats stats_;
+  // Completion time of the read being processed, 0 outside the read
+  // handlers; frames queued meanwhile stamp their write queue with it
+  int64_t readTime_;
+
+  // The CONNECT deadline until the client's CONNECT, then the keep alive
+  // check, which runs every idleLimit_ and compares with the last read
+  TimerWheel &timerWheel_;
+  TimerWheel::Entry timeout_;
+  TimerWheel::Entry brokerConnectTimeout_; // Each broker connect attempt
+  bool connectSeen_;
+  std::chrono::milliseconds idleLimit_; // 0 for none
+  int64_t lastClientRead_;              // Raw steady_clock ticks
+
+  // Per-direction stream framers, reads land directly in their buffers
+  MQTTFramer clientFramer_;
+  MQTTFramer brokerFramer_;
+
+  // Per-direction outbound queues, flushed with one gather write at a time
+  WriteQueue clientWriteQueue_;
+  WriteQueue brokerWriteQueue_;
+
+  // Frames held back by delay rules, per destination
+  DelayLine toBrokerDelay_;
+  DelayLine toClientDelay_;
+
+  // Frames held by the intercept rules, per destination
+  HoldQueue toBrokerHeld_;
+  HoldQueue toClientHeld_;
+
+  // The handler's rules as of rulesGeneration_
+  std::shared_ptr<const RuleEngine> rules_;
+  std::shared_ptr<const RuleEngine> intercept_;
+  uint64_t rulesGeneration_;
+  std::vector<uint8_t> rewriteBuffer_;
+
+  // From the client's CONNECT, written on the connection's thread
   std::string clientId_;
-  bool connected_;
-  bool brokerConnected_;
+  uint8_t protocolLevel_;
+  std::atomic<bool> connected_;
+  std::atomic<bool> brokerConnected_;
+
+  // Broker connect in progress; client data is buffered in brokerWriteQueue_
+  bool brokerConnecting_;
+  bool clientReadPaused_;
+
+  // Reading stopped because too much is held for the other side
+  bool clientReadHeld_;
+  bool brokerReadHeld_;
+
+  // Zero-copy forwarding, started once a direction's queue has drained
+  std::unique_ptr<SplicePump> clientToBrokerPump_;
+  std::unique_ptr<SplicePump> brokerToClientPump_;
+  bool clientSplicePending_;
+  bool brokerSplicePending_;
+  size_t splicedFromClient_; // As of the last keep alive check
 };
 
-} 
\ No newline at end of file
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+namespace mitmqtt {
+
+enum class PacketDirection { ClientToBroker, BrokerToClient };
+
+// MQTT packet types
+enum class PacketType : uint8_t {
+  CONNECT = 1,
+  CONNACK = 2,
+  PUBLISH = 3,
+  PUBACK = 4,
+  PUBREC = 5,
+  PUBREL = 6,
+  PUBCOMP = 7,
+  SUBSCRIBE = 8,
+  SUBACK = 9,
+  UNSUBSCRIBE = 10,
+  UNSUBACK = 11,
+  PINGREQ = 12,
+  PINGRESP = 13,
+  DISCONNECT = 14,
+  AUTH = 15 // MQTT 5
+};
+
+}
@@ -0,0 +1,138 @@
+#include "packet_store.hpp"
+#include "mqtt_decoder.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace mitmqtt {
+
+PacketStore::PacketStore(size_t budgetBytes)
+    : arenaSize_(0), writePos_(0), head_(0), count_(0), nextSequence_(1),
+      evicted_(0) {
+  resize(budgetBytes);
+}
+
+uint64_t PacketStore::store(const uint8_t *data, size_t size,
+                            uint64_t connectionId, PacketDirection direction,
+                            uint8_t protocolLevel,
+                            std::chrono::steady_clock::rep timestamp) {
+  if (entries_.empty() || size > arenaSize_ || size > UINT32_MAX)
+    return 0;
+
+  if (count_ == entries_.size())
+    evictOldest();
+
+  size_t offset = reserve(size);
+  std::memcpy(arena_.get() + offset, data, size);
+  writePos_ = offset + size;
+
+  Entry &entry = entries_[(head_ + count_) % entries_.size()];
+  entry.sequence = nextSequence_++;
+  entry.timestamp = timestamp;
+  entry.connectionId = connectionId;
+  entry.offset = offset;
+  entry.size = static_cast<uint32_t>(size);
+  entry.direction = direction;
+  indexPublish(data, size, protocolLevel, entry);
+  ++count_;
+  return entry.sequence;
+}
+
+size_t PacketStore::reserve(size_t size) {
+  if (count_ == 0) {
+    writePos_ = 0;
+    return 0;
+  }
+
+  size_t pos = writePos_;
+  if (pos + size > arenaSize_) {
+    // Wrap around. Packets between the write position and the end of the
+    // arena are older than everything before it, so they go first.
+    while (count_ > 0 && oldest().offset >= writePos_)
+      evictOldest();
+    pos = 0;
+  }
+
+  // Packets ahead of the write position are laid out oldest first
+  while (count_ > 0 && oldest().offset >= pos && oldest().offset < pos + size)
+    evictOldest();
+  return pos;
+}
+
+void PacketStore::evictOldest() {
+  head_ = (head_ + 1) % entries_.size();
+  --count_;
+  ++evicted_;
+}
+
+void PacketStore::indexPublish(const uint8_t *data, size_t size,
+                               uint8_t protocolLevel, Entry &entry) {
+  entry.topicOffset = entry.topicSize = 0;
+  entry.payloadOffset = entry.payloadSize = 0;
+  FrameView frame{data, size};
+  PacketView packet;
+  if (size < 2 || frame.typeNibble() != 3 ||
+      !decodePacket(frame, protocolLevel, packet))
+    return;
+
+  // The views point into `data`, so they map to offsets within the packet
+  auto offsetOf = [data](std::string_view view) {
+    return static_cast<uint32_t>(
+        reinterpret_cast<const uint8_t *>(view.data()) - data);
+  };
+  entry.topicOffset = offsetOf(packet.topic);
+  entry.topicSize = static_cast<uint32_t>(packet.topic.size());
+  if (!packet.payload.empty()) {
+    entry.payloadOffset = offsetOf(packet.payload);
+    entry.payloadSize = static_cast<uint32_t>(packet.payload.size());
+  }
+}
+
+std::optional<StoredPacket> PacketStore::find(uint64_t sequence) const {
+  if (count_ == 0 || sequence < firstSequence() || sequence > lastSequence())
+    return std::nullopt;
+
+  const Entry &entry =
+      entries_[(head_ + (sequence - firstSequence())) % entries_.size()];
+  const uint8_t *data = arena_.get() + entry.offset;
+  const char *chars = reinterpret_cast<const char *>(data);
+
+  StoredPacket packet;
+  packet.sequence = entry.sequence;
+  packet.timestamp = entry.timestamp;
+  packet.connectionId = entry.connectionId;
+  packet.direction = entry.direction;
+  packet.data = data;
+  packet.size = entry.size;
+  packet.topic = std::string_view(chars + entry.topicOffset, entry.topicSize);
+  packet.payload =
+      std::string_view(chars + entry.payloadOffset, entry.payloadSize);
+  return packet;
+}
+
+uint64_t PacketStore::firstSequence() const {
+  return count_ == 0 ? 0 : oldest().sequence;
+}
+
+uint64_t PacketStore::lastSequence() const {
+  return count_ == 0 ? 0 : oldest().sequence + count_ - 1;
+}
+
+void PacketStore::clear() {
+  head_ = 0;
+  count_ = 0;
+  writePos_ = 0;
+}
+
+void PacketStore::resize(size_t budgetBytes) {
+  clear();
+  size_t maxPackets = budgetBytes / kBytesPerEntry;
+  size_t arenaBytes = budgetBytes - maxPackets * sizeof(Entry);
+  entries_.assign(maxPackets, Entry{});
+  entries_.shrink_to_fit();
+  if (arenaBytes != arenaSize_) {
+    arena_.reset(arenaBytes > 0 ? new uint8_t[arenaBytes] : nullptr);
+    arenaSize_ = arenaBytes;
+  }
+}
+
+}
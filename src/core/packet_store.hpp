@@ -0,0 +1,114 @@
+#pragma once
+
+#include "mqtt_types.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace mitmqtt {
+
+// View of one stored packet. The pointers refer into the store's arena and
+// stay valid only until the next store(), clear() or resize().
+struct StoredPacket {
+  uint64_t sequence = 0;
+  std::chrono::steady_clock::rep timestamp = 0; // Raw steady_clock ticks
+  uint64_t connectionId = 0;
+  PacketDirection direction = PacketDirection::ClientToBroker;
+  const uint8_t *data = nullptr; // Whole packet including fixed header
+  size_t size = 0;
+  std::string_view topic; // PUBLISH only, empty otherwise
+  std::string_view payload;
+};
+
+// Store of recent raw packets for replay, within a fixed memory budget.
+//
+// Packet bytes are copied into one preallocated circular arena and their
+// metadata into a fixed ring of entries, so storing never allocates and
+// evicting the oldest packet is O(1). The budget pays for both, one entry
+// per kBytesPerEntry of it: large packets are evicted when the arena fills,
+// small ones when the ring does. Every stored packet gets the next sequence
+// number; sequences stay valid across eviction and find() maps one back to
+// its packet in constant time. Not thread-safe, callers lock.
+class PacketStore {
+public:
+  static constexpr size_t kDefaultBudgetBytes = 16 * 1024 * 1024;
+  static constexpr size_t kBytesPerEntry = 512;
+
+  explicit PacketStore(size_t budgetBytes = kDefaultBudgetBytes);
+
+  PacketStore(const PacketStore &) = delete;
+  PacketStore &operator=(const PacketStore &) = delete;
+
+  // Copy a packet in, evicting the oldest ones as needed. `protocolLevel`
+  // is the MQTT version of its connection. Returns its sequence number, or
+  // 0 if the packet is larger than the whole arena.
+  uint64_t store(const uint8_t *data, size_t size, uint64_t connectionId,
+                 PacketDirection direction, uint8_t protocolLevel,
+                 std::chrono::steady_clock::rep timestamp);
+
+  // Packet with the given sequence, if it has not been evicted yet
+  std::optional<StoredPacket> find(uint64_t sequence) const;
+
+  // Drop everything. Sequence numbers keep counting up.
+  void clear();
+
+  // Drop everything and reallocate within a new budget
+  void resize(size_t budgetBytes);
+
+  size_t size() const { return count_; }
+  bool empty() const { return count_ == 0; }
+  size_t maxPackets() const { return entries_.size(); }
+  size_t arenaBytes() const { return arenaSize_; }
+  size_t budgetBytes() const {
+    return arenaSize_ + entries_.size() * sizeof(Entry);
+  }
+
+  // Oldest and newest sequence still stored, 0 when empty
+  uint64_t firstSequence() const;
+  uint64_t lastSequence() const;
+
+  // Packets pushed out to make room, over the store's lifetime
+  uint64_t evicted() const { return evicted_; }
+
+private:
+  struct Entry {
+    uint64_t sequence;
+    std::chrono::steady_clock::rep timestamp;
+    uint64_t connectionId;
+    size_t offset; // Into the arena
+    uint32_t size;
+    uint32_t topicOffset; // Relative to the packet start
+    uint32_t topicSize;
+    uint32_t payloadOffset;
+    uint32_t payloadSize;
+    PacketDirection direction;
+  };
+
+  const Entry &oldest() const { return entries_[head_]; }
+  void evictOldest();
+
+  // Free [offset, offset + size) of the arena, evicting what overlaps it
+  size_t reserve(size_t size);
+
+  // Locate topic and payload of a PUBLISH packet, past any MQTT 5
+  // properties
+  static void indexPublish(const uint8_t *data, size_t size,
+                           uint8_t protocolLevel, Entry &entry);
+
+  std::unique_ptr<uint8_t[]> arena_;
+  size_t arenaSize_;
+  size_t writePos_; // End of the newest packet in the arena
+
+  std::vector<Entry> entries_; // Ring, oldest at head_
+  size_t head_;
+  size_t count_;
+
+  uint64_t nextSequence_;
+  uint64_t evicted_;
+};
+
+}
@@ -0,0 +1,568 @@
+#include "payload_decoder.hpp"
+#include <boost/asio/post.hpp>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MITMQTT_SSE2 1
+#endif
+
+namespace mitmqtt {
+
+namespace {
+constexpr size_t kSummaryLength = 100;
+constexpr int kMaxProtobufDepth = 8;
+// JSON and CBOR nested deeper than this are not parsed: the parser and
+// dump() recurse once per level
+constexpr size_t kMaxNestingDepth = 64;
+
+enum class TextScan { Printable, UTF8, Invalid };
+
+bool isControl(uint8_t c) {
+  return (c < 0x20 && c != '\t' && c != '\n' && c != '\r') || c == 0x7F;
+}
+
+// Length of the UTF-8 sequence at `p`, 0 if it is not a valid one
+size_t sequenceLength(const uint8_t *p, size_t left) {
+  uint8_t c = p[0];
+  auto continuation = [&](size_t i) {
+    return i < left && (p[i] & 0xC0) == 0x80;
+  };
+
+  if (c >= 0xC2 && c <= 0xDF)
+    return continuation(1) ? 2 : 0;
+  if (c >= 0xE0 && c <= 0xEF) {
+    if (left < 3 || !continuation(2))
+      return 0;
+    // No overlong forms, no surrogates
+    uint8_t low = c == 0xE0 ? 0xA0 : 0x80;
+    uint8_t high = c == 0xED ? 0x9F : 0xBF;
+    return p[1] >= low && p[1] <= high ? 3 : 0;
+  }
+  if (c >= 0xF0 && c <= 0xF4) {
+    if (left < 4 || !continuation(2) || !continuation(3))
+      return 0;
+    // Nothing overlong or above U+10FFFF
+    uint8_t low = c == 0xF0 ? 0x90 : 0x80;
+    uint8_t high = c == 0xF4 ? 0x8F : 0xBF;
+    return p[1] >= low && p[1] <= high ? 4 : 0;
+  }
+  return 0;
+}
+
+TextScan scanText(const uint8_t *data, size_t size) {
+  bool control = false;
+  size_t i = 0;
+#ifdef MITMQTT_SSE2
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7F);
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+#endif
+  while (i < size) {
+#ifdef MITMQTT_SSE2
+    // Skip ASCII a block at a time, noting control characters on the way
+    while (i + 16 <= size) {
+      __m128i block =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+      int high = _mm_movemask_epi8(block);
+      // Signed compare: bytes from 0x80 up count as below 0x20 too
+      int low = _mm_movemask_epi8(_mm_cmplt_epi8(block, space)) & ~high;
+      int allowed = _mm_movemask_epi8(
+          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, tab),
+                                    _mm_cmpeq_epi8(block, lf)),
+                       _mm_cmpeq_epi8(block, cr)));
+      int controls = (low & ~allowed) |
+                     _mm_movemask_epi8(_mm_cmpeq_epi8(block, del));
+      if (high) {
+        // Only the ASCII before the first multi-byte sequence counts here
+        int before = (high & -high) - 1;
+        control |= (controls & before) != 0;
+        int skip = 0;
+        while (!(high & (1 << skip)))
+          ++skip;
+        i += skip;
+        break;
+      }
+      control |= controls != 0;
+      i += 16;
+    }
+    if (i >= size)
+      break;
+#endif
+    uint8_t c = data[i];
+    if (c < 0x80) {
+      control |= isControl(c);
+      ++i;
+      continue;
+    }
+    size_t length = sequenceLength(data + i, size - i);
+    if (length == 0)
+      return TextScan::Invalid;
+    i += length;
+  }
+  return control ? TextScan::UTF8 : TextScan::Printable;
+}
+
+std::string hexDump(const uint8_t *data, size_t size) {
+  size_t shown = std::min(size, kMaxHexDumpBytes);
+  std::string out;
+  out.reserve((shown / 16 + 2) * 78);
+  char line[96];
+  for (size_t offset = 0; offset < shown; offset += 16) {
+    int pos = std::snprintf(line, sizeof(line), "%08zx ", offset);
+    for (size_t i = 0; i < 16; ++i) {
+      if (i == 8)
+        line[pos++] = ' ';
+      if (offset + i < shown)
+        pos += std::snprintf(line + pos, sizeof(line) - pos, " %02x",
+                             data[offset + i]);
+      else
+        pos += std::snprintf(line + pos, sizeof(line) - pos, "   ");
+    }
+    pos += std::snprintf(line + pos, sizeof(line) - pos, "  |");
+    for (size_t i = 0; i < 16 && offset + i < shown; ++i) {
+      uint8_t c = data[offset + i];
+      line[pos++] = c >= 0x20 && c < 0x7F ? static_cast<char>(c) : '.';
+    }
+    line[pos++] = '|';
+    line[pos++] = '\n';
+    out.append(line, pos);
+  }
+  if (shown < size)
+    out += "... " + std::to_string(size - shown) + " more bytes\n";
+  return out;
+}
+
+bool readVarint(const uint8_t *data, size_t size, size_t &pos,
+                uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64 && pos < size; shift += 7) {
+    uint8_t byte = data[pos++];
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// True if the JSON text nests arrays and objects deeper than `limit`
+bool jsonTooDeep(const std::string &text, size_t limit) {
+  size_t depth = 0;
+  bool inString = false;
+  bool escaped = false;
+  for (char c : text) {
+    if (inString) {
+      if (escaped)
+        escaped = false;
+      else if (c == '\\')
+        escaped = true;
+      else if (c == '"')
+        inString = false;
+    } else if (c == '"') {
+      inString = true;
+    } else if (c == '{' || c == '[') {
+      if (++depth > limit)
+        return true;
+    } else if ((c == '}' || c == ']') && depth > 0) {
+      --depth;
+    }
+  }
+  return false;
+}
+
+// True if the CBOR item at `data` nests arrays, maps, tags or indefinite
+// strings deeper than `limit`. Walks only the item headers; malformed
+// input is left for the parser to reject.
+bool cborTooDeep(const uint8_t *data, size_t size, size_t limit) {
+  constexpr uint64_t kIndefinite = UINT64_MAX;
+  // Items left in each open container
+  std::vector<uint64_t> open;
+  auto itemDone = [&open]() {
+    // A container that receives its last item is itself an item
+    while (!open.empty() && open.back() != kIndefinite) {
+      if (--open.back() > 0)
+        break;
+      open.pop_back();
+    }
+  };
+
+  size_t pos = 0;
+  while (pos < size) {
+    uint8_t initial = data[pos++];
+    if (initial == 0xFF) {
+      if (open.empty() || open.back() != kIndefinite)
+        return false;
+      open.pop_back();
+      itemDone();
+    } else {
+      uint8_t major = initial >> 5;
+      uint8_t info = initial & 0x1F;
+      uint64_t argument = info;
+      bool indefinite = info == 31;
+      if (info >= 24 && info <= 27) {
+        size_t bytes = size_t(1) << (info - 24);
+        if (size - pos < bytes)
+          return false;
+        argument = 0;
+        for (size_t i = 0; i < bytes; ++i)
+          argument = (argument << 8) | data[pos++];
+      } else if (info > 27 && !indefinite) {
+        return false;
+      }
+
+      uint64_t items = 0;
+      if (major == 2 || major == 3) {
+        if (indefinite)
+          items = kIndefinite;
+        else if (argument > size - pos)
+          return false;
+        else
+          pos += static_cast<size_t>(argument);
+      } else if (major == 4 || major == 5) {
+        // Every item takes at least a byte
+        if (!indefinite && argument > size - pos)
+          return false;
+        items = indefinite ? kIndefinite
+                           : argument * (major == 5 ? 2 : 1);
+      } else if (major == 6) {
+        items = 1;
+      }
+
+      if (items == 0) {
+        itemDone();
+      } else {
+        open.push_back(items);
+        if (open.size() > limit)
+          return true;
+      }
+    }
+    if (open.empty())
+      return false;
+  }
+  return false;
+}
+
+// Walk protobuf wire format, rendering the fields into `out` unless it is
+// null. False unless every byte belongs to a field.
+bool walkProtobuf(const uint8_t *data, size_t size, int depth,
+                  std::string *out) {
+  if (size == 0 || depth > kMaxProtobufDepth)
+    return false;
+
+  std::string indent(static_cast<size_t>(depth) * 2, ' ');
+  size_t pos = 0;
+  while (pos < size) {
+    uint64_t tag = 0;
+    if (!readVarint(data, size, pos, tag))
+      return false;
+    uint64_t field = tag >> 3;
+    if (field == 0 || field > 0x1FFFFFFF)
+      return false;
+
+    std::string line;
+    switch (tag & 7) {
+    case 0: {
+      uint64_t value = 0;
+      if (!readVarint(data, size, pos, value))
+        return false;
+      line = std::to_string(value);
+      break;
+    }
+    case 1: {
+      if (size - pos < 8)
+        return false;
+      uint64_t value = 0;
+      for (int i = 7; i >= 0; --i)
+        value = (value << 8) | data[pos + i];
+      pos += 8;
+      char text[32];
+      std::snprintf(text, sizeof(text), "0x%016llx",
+                    static_cast<unsigned long long>(value));
+      line = text;
+      break;
+    }
+    case 2: {
+      uint64_t length = 0;
+      if (!readVarint(data, size, pos, length) || length > size - pos)
+        return false;
+      const uint8_t *bytes = data + pos;
+      size_t count = static_cast<size_t>(length);
+      pos += count;
+      if (!out)
+        break;
+      if (isPrintableText(bytes, count)) {
+        line = "\"" + std::string(bytes, bytes + count) + "\"";
+      } else if (walkProtobuf(bytes, count, depth + 1, nullptr)) {
+        *out += indent + std::to_string(field) + " {\n";
+        walkProtobuf(bytes, count, depth + 1, out);
+        *out += indent + "}\n";
+        continue;
+      } else {
+        size_t shown = std::min<size_t>(count, 32);
+        line = "<" + toHexBytes(bytes, shown) + (shown < count ? " ...>" : ">");
+      }
+      break;
+    }
+    case 5: {
+      if (size - pos < 4)
+        return false;
+      uint32_t value = 0;
+      for (int i = 3; i >= 0; --i)
+        value = (value << 8) | data[pos + i];
+      pos += 4;
+      char text[16];
+      std::snprintf(text, sizeof(text), "0x%08x", value);
+      line = text;
+      break;
+    }
+    default:
+      return false;
+    }
+    if (out)
+      *out += indent + std::to_string(field) + ": " + line + "\n";
+  }
+  return true;
+}
+
+// First kSummaryLength characters on one line, cut on a UTF-8 boundary
+std::string summarize(const std::string &text) {
+  std::string line;
+  line.reserve(std::min(text.size(), kSummaryLength + 3));
+  bool space = false;
+  for (char c : text) {
+    if (c == '\n' || c == '\r' || c == '\t' || c == ' ') {
+      space = !line.empty();
+      continue;
+    }
+    if (space) {
+      line += ' ';
+      space = false;
+    }
+    line += c;
+    if (line.size() >= kSummaryLength)
+      break;
+  }
+  if (line.size() >= kSummaryLength) {
+    size_t cut = kSummaryLength - 3;
+    while (cut > 0 && (static_cast<uint8_t>(line[cut]) & 0xC0) == 0x80)
+      --cut;
+    line.resize(cut);
+    line += "...";
+  }
+  return line;
+}
+}
+
+const char *payloadFormatToString(PayloadFormat format) {
+  switch (format) {
+  case PayloadFormat::Empty:
+    return "Empty";
+  case PayloadFormat::Text:
+    return "Text";
+  case PayloadFormat::JSON:
+    return "JSON";
+  case PayloadFormat::CBOR:
+    return "CBOR";
+  case PayloadFormat::Protobuf:
+    return "Protobuf";
+  case PayloadFormat::Binary:
+    return "Binary";
+  }
+  return "Binary";
+}
+
+std::string toHexBytes(const uint8_t *data, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  out.reserve(size * 3);
+  for (size_t i = 0; i < size; ++i) {
+    if (i)
+      out += ' ';
+    out += digits[data[i] >> 4];
+    out += digits[data[i] & 0x0F];
+  }
+  return out;
+}
+
+bool parseHexBytes(const std::string &text, std::string &bytes) {
+  auto digit = [](char c) {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  };
+
+  std::string parsed;
+  parsed.reserve(text.size() / 2);
+  int high = -1;
+  for (char c : text) {
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+      continue;
+    int value = digit(c);
+    if (value < 0)
+      return false;
+    if (high < 0) {
+      high = value;
+    } else {
+      parsed += static_cast<char>((high << 4) | value);
+      high = -1;
+    }
+  }
+  if (high >= 0)
+    return false;
+  bytes = std::move(parsed);
+  return true;
+}
+
+bool isValidUTF8(const uint8_t *data, size_t size) {
+  return scanText(data, size) != TextScan::Invalid;
+}
+
+bool isPrintableText(const uint8_t *data, size_t size) {
+  return scanText(data, size) == TextScan::Printable;
+}
+
+DecodedPayload decodePayload(const uint8_t *data, size_t size) {
+  using nlohmann::json;
+  DecodedPayload decoded;
+  decoded.size = size;
+  if (size == 0)
+    return decoded;
+
+  decoded.hexDump = hexDump(data, size);
+
+  if (isPrintableText(data, size)) {
+    std::string text(data, data + size);
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first != std::string::npos &&
+        (text[first] == '{' || text[first] == '[') &&
+        !jsonTooDeep(text, kMaxNestingDepth)) {
+      json document = json::parse(text, nullptr, false);
+      if (!document.is_discarded()) {
+        decoded.format = PayloadFormat::JSON;
+        decoded.view = document.dump(2);
+        decoded.summary = summarize(document.dump());
+        return decoded;
+      }
+    }
+    decoded.format = PayloadFormat::Text;
+    decoded.summary = summarize(text);
+    decoded.view = std::move(text);
+    return decoded;
+  }
+
+  // Maps, arrays and tags only; nearly any byte is some CBOR scalar
+  uint8_t major = data[0] >> 5;
+  if (major >= 4 && major <= 6 &&
+      !cborTooDeep(data, size, kMaxNestingDepth)) {
+    json document = json::from_cbor(data, data + size, true, false);
+    if (!document.is_discarded()) {
+      decoded.format = PayloadFormat::CBOR;
+      decoded.view =
+          document.dump(2, ' ', false, json::error_handler_t::replace);
+      decoded.summary = summarize(
+          document.dump(-1, ' ', false, json::error_handler_t::replace));
+      return decoded;
+    }
+  }
+
+  if (walkProtobuf(data, size, 0, nullptr)) {
+    decoded.format = PayloadFormat::Protobuf;
+    walkProtobuf(data, size, 0, &decoded.view);
+    decoded.summary = summarize(decoded.view);
+    return decoded;
+  }
+
+  decoded.format = PayloadFormat::Binary;
+  decoded.view = decoded.hexDump;
+  decoded.summary = std::to_string(size) + " bytes: " +
+                    toHexBytes(data, std::min<size_t>(size, 24)) +
+                    (size > 24 ? " ..." : "");
+  return decoded;
+}
+
+PayloadDecodeCache::PayloadDecodeCache(IOContextPool &pool, size_t budgetBytes)
+    : pool_(pool), budget_(budgetBytes), bytes_(0), generation_(0) {}
+
+std::shared_ptr<const DecodedPayload>
+PayloadDecodeCache::get(uint64_t sequence, std::string_view payload) {
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(sequence);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.position);
+      return it->second.decoded;
+    }
+    if (!pending_.insert(sequence).second)
+      return nullptr;
+    generation = generation_;
+  }
+
+  boost::asio::post(pool_.getIOContext(), [this, sequence, generation,
+                                           payload = std::string(payload)]() {
+    auto decoded = std::make_shared<DecodedPayload>(decodePayload(
+        reinterpret_cast<const uint8_t *>(payload.data()), payload.size()));
+    insert(sequence, generation, std::move(decoded));
+  });
+  return nullptr;
+}
+
+std::shared_ptr<const DecodedPayload>
+PayloadDecodeCache::find(uint64_t sequence) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(sequence);
+  if (it == entries_.end())
+    return nullptr;
+  lru_.splice(lru_.begin(), lru_, it->second.position);
+  return it->second.decoded;
+}
+
+void PayloadDecodeCache::insert(uint64_t sequence, uint64_t generation,
+                                std::shared_ptr<const DecodedPayload> decoded) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (generation != generation_)
+    return;
+  pending_.erase(sequence);
+
+  bytes_ += decoded->footprint();
+  lru_.push_front(sequence);
+  entries_[sequence] = Entry{std::move(decoded), lru_.begin()};
+
+  // The newest entry stays even if it alone is over budget
+  while (bytes_ > budget_ && entries_.size() > 1) {
+    auto oldest = entries_.find(lru_.back());
+    bytes_ -= oldest->second.decoded->footprint();
+    entries_.erase(oldest);
+    lru_.pop_back();
+  }
+}
+
+void PayloadDecodeCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  pending_.clear();
+  lru_.clear();
+  bytes_ = 0;
+  ++generation_;
+}
+
+size_t PayloadDecodeCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+size_t PayloadDecodeCache::bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
+}
+
+}
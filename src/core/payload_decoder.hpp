@@ -0,0 +1,103 @@
+#pragma once
+
+#include "io_context_pool.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace mitmqtt {
+
+// What a PUBLISH payload looks like
+enum class PayloadFormat : uint8_t {
+  Empty,
+  Text,     // Printable UTF-8
+  JSON,     // Text that parses as a JSON object or array
+  CBOR,     // A single well-formed CBOR item
+  Protobuf, // Parses as protobuf wire format to the last byte
+  Binary    // None of the above
+};
+
+const char *payloadFormatToString(PayloadFormat format);
+
+// Whether `size` bytes are valid UTF-8, and printable: no control
+// characters except tab, carriage return and line feed. Runs of ASCII are
+// checked 16 bytes at a time.
+bool isValidUTF8(const uint8_t *data, size_t size);
+bool isPrintableText(const uint8_t *data, size_t size);
+
+// Bytes as space separated hex pairs, e.g. "0a ff", and back. Parsing
+// ignores whitespace and fails on anything else or an odd digit count.
+std::string toHexBytes(const uint8_t *data, size_t size);
+bool parseHexBytes(const std::string &text, std::string &bytes);
+
+// A payload decoded for display
+struct DecodedPayload {
+  PayloadFormat format = PayloadFormat::Empty;
+  size_t size = 0;     // Of the payload
+  std::string view;    // Pretty-printed JSON (CBOR too), text, protobuf
+                       // fields, or the hex dump for binary
+  std::string hexDump; // Offsets, hex and ASCII columns
+  std::string summary; // One line for tables
+
+  // Bytes held, for the cache's budget
+  size_t footprint() const {
+    return sizeof(*this) + view.size() + hexDump.size() + summary.size();
+  }
+};
+
+// Detect the format of a payload and render it. Hex dumps stop after
+// kMaxHexDumpBytes.
+DecodedPayload decodePayload(const uint8_t *data, size_t size);
+constexpr size_t kMaxHexDumpBytes = 64 * 1024;
+
+// Decoded payloads by packet sequence number, decoded on a worker pool so
+// that the thread asking, e.g. the GUI's, never does. Least recently used
+// entries are dropped beyond a byte budget. Safe to use from any thread;
+// stop the pool before destroying the cache.
+class PayloadDecodeCache {
+public:
+  explicit PayloadDecodeCache(IOContextPool &pool,
+                              size_t budgetBytes = 64 * 1024 * 1024);
+
+  // The decoded payload of `sequence`, or null while it is being decoded.
+  // The first miss queues a copy of `payload` for decoding.
+  std::shared_ptr<const DecodedPayload> get(uint64_t sequence,
+                                            std::string_view payload);
+  // Lookup only
+  std::shared_ptr<const DecodedPayload> find(uint64_t sequence);
+
+  // Forget everything; decodes still running are discarded
+  void clear();
+
+  size_t size() const;
+  size_t bytes() const;
+
+private:
+  using LRU = std::list<uint64_t>; // Most recently used first
+
+  struct Entry {
+    std::shared_ptr<const DecodedPayload> decoded;
+    LRU::iterator position;
+  };
+
+  void insert(uint64_t sequence, uint64_t generation,
+              std::shared_ptr<const DecodedPayload> decoded);
+
+  IOContextPool &pool_;
+  size_t budget_;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<uint64_t, Entry> entries_;
+  std::unordered_set<uint64_t> pending_;
+  LRU lru_;
+  size_t bytes_;
+  uint64_t generation_; // Changed by clear()
+};
+
+}
@@ -0,0 +1,418 @@
+#include "proxy_config.hpp"
+#include <nlohmann/json.hpp>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+namespace mitmqtt {
+
+namespace {
+bool parseLogLevel(const std::string &name, utils::LogLevel &level) {
+  static const char *const names[] = {"debug", "info", "warn", "error", "off"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    if (name == names[i]) {
+      level = static_cast<utils::LogLevel>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parsePort(const std::string &text, uint16_t &port) {
+  try {
+    size_t used = 0;
+    unsigned long value = std::stoul(text, &used);
+    if (used != text.size() || value == 0 || value > 65535)
+      return false;
+    port = static_cast<uint16_t>(value);
+    return true;
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+template <typename T> bool parseCount(const std::string &text, T &count) {
+  try {
+    size_t used = 0;
+    unsigned long long value = std::stoull(text, &used);
+    if (used != text.size() || value > std::numeric_limits<T>::max())
+      return false;
+    count = static_cast<T>(value);
+    return true;
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+bool parseOverflow(const std::string &name, HandshakeOverflow &overflow) {
+  if (name == "pause")
+    overflow = HandshakeOverflow::Pause;
+  else if (name == "reject")
+    overflow = HandshakeOverflow::Reject;
+  else
+    return false;
+  return true;
+}
+
+// HOST or HOST:PORT
+bool parseHostPort(const std::string &text, std::string &host,
+                   uint16_t &port) {
+  size_t colon = text.rfind(':');
+  if (colon == std::string::npos) {
+    host = text;
+    return !host.empty();
+  }
+  host = text.substr(0, colon);
+  return !host.empty() && parsePort(text.substr(colon + 1), port);
+}
+
+// HOST[:PORT] entries, port 1883 when left out
+bool parseBrokers(const std::vector<std::string> &entries,
+                  std::vector<BrokerAddress> &brokers) {
+  std::vector<BrokerAddress> parsed;
+  for (const std::string &entry : entries) {
+    BrokerAddress broker;
+    if (!parseHostPort(entry, broker.host, broker.port))
+      return false;
+    parsed.push_back(std::move(broker));
+  }
+  if (parsed.empty())
+    return false;
+  brokers = std::move(parsed);
+  return true;
+}
+
+// The whole number at `key` into `number`, if the document has the key.
+// False if it is not a whole number from `low` to `high`.
+template <typename T>
+bool readNumber(const nlohmann::json &document, const char *key, uint64_t low,
+                uint64_t high, T &number) {
+  auto it = document.find(key);
+  if (it == document.end())
+    return true;
+  if (!it->is_number_unsigned())
+    return false;
+  uint64_t value = it->get<uint64_t>();
+  if (value < low || value > high)
+    return false;
+  number = static_cast<T>(value);
+  return true;
+}
+
+std::vector<std::string> splitList(const std::string &text) {
+  std::vector<std::string> items;
+  std::istringstream list(text);
+  std::string item;
+  while (std::getline(list, item, ',')) {
+    if (!item.empty())
+      items.push_back(item);
+  }
+  return items;
+}
+}
+
+bool loadProxyConfig(const std::string &path, ProxyConfig &config,
+                     std::string &error) {
+  std::ifstream file(path);
+  if (!file) {
+    error = "cannot open " + path;
+    return false;
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+
+  try {
+    nlohmann::json document = nlohmann::json::parse(contents.str());
+    if (!document.is_object()) {
+      error = path + ": expected an object";
+      return false;
+    }
+
+    ProxyConfig parsed = config;
+    // Checked like their command line options, not truncated or zero
+    auto port = [&](const char *key, uint16_t &number, uint64_t low = 1) {
+      if (readNumber(document, key, low, 65535, number))
+        return true;
+      error = path + ": " + key + " must be a port number";
+      return false;
+    };
+    auto positive = [&](const char *key, size_t &number) {
+      if (readNumber(document, key, 1, std::numeric_limits<size_t>::max(),
+                     number))
+        return true;
+      error = path + ": " + key + " must be a positive whole number";
+      return false;
+    };
+    if (!port("listen_port", parsed.listenPort) ||
+        !port("tls_port", parsed.tlsListenPort) ||
+        !port("ws_port", parsed.wsListenPort) ||
+        !port("metrics_port", parsed.metricsPort, 0) ||
+        !positive("max_packet_kb", parsed.maxPacketSizeKB) ||
+        !positive("replay_store_mb", parsed.replayStoreMB))
+      return false;
+
+    parsed.listenAddress =
+        document.value("listen_address", parsed.listenAddress);
+    parsed.tlsEnabled = document.value("tls", parsed.tlsEnabled);
+    parsed.certFile = document.value("cert", parsed.certFile);
+    parsed.keyFile = document.value("key", parsed.keyFile);
+    parsed.sniCertificates =
+        document.value("sni_certs", parsed.sniCertificates);
+    parsed.sniPrewarm = document.value("sni_prewarm", parsed.sniPrewarm);
+    parsed.handshakeThreads =
+        document.value("handshake_threads", parsed.handshakeThreads);
+    parsed.maxHandshakes =
+        document.value("max_handshakes", parsed.maxHandshakes);
+    parsed.handshakeQueue =
+        document.value("handshake_queue", parsed.handshakeQueue);
+    parsed.handshakeTimeoutMs =
+        document.value("handshake_timeout_ms", parsed.handshakeTimeoutMs);
+    parsed.connectTimeoutMs =
+        document.value("connect_timeout_ms", parsed.connectTimeoutMs);
+    parsed.idleTimeoutS = document.value("idle_timeout_s", parsed.idleTimeoutS);
+    parsed.wsEnabled = document.value("ws", parsed.wsEnabled);
+    if (document.contains("handshake_overflow") &&
+        !parseOverflow(document["handshake_overflow"].get<std::string>(),
+                       parsed.handshakeOverflow)) {
+      error = path + ": handshake_overflow must be pause or reject";
+      return false;
+    }
+    if (document.contains("brokers")) {
+      if (!parseBrokers(document["brokers"].get<std::vector<std::string>>(),
+                        parsed.brokers)) {
+        error = path + ": brokers must list HOST[:PORT] entries";
+        return false;
+      }
+    } else if (document.contains("broker_host") ||
+               document.contains("broker_port")) {
+      BrokerAddress broker = parsed.brokers.front();
+      broker.host = document.value("broker_host", broker.host);
+      if (!port("broker_port", broker.port))
+        return false;
+      parsed.brokers = {broker};
+    }
+    if (document.contains("broker_balance") &&
+        !parseBrokerBalance(document["broker_balance"].get<std::string>(),
+                            parsed.brokerBalance)) {
+      error = path + ": broker_balance must be round-robin, "
+                     "least-connections or client-hash";
+      return false;
+    }
+    parsed.brokerHealthCheckMs =
+        document.value("broker_health_check_ms", parsed.brokerHealthCheckMs);
+    parsed.brokerTLS = document.value("broker_tls", parsed.brokerTLS);
+    parsed.brokerWebSocket =
+        document.value("broker_ws", parsed.brokerWebSocket);
+    parsed.brokerWebSocketPath =
+        document.value("broker_ws_path", parsed.brokerWebSocketPath);
+    parsed.rulesFile = document.value("rules", parsed.rulesFile);
+    parsed.capturePrefix = document.value("capture", parsed.capturePrefix);
+    parsed.threads = document.value("threads", parsed.threads);
+    parsed.replayStore = document.value("replay_store", parsed.replayStore);
+    parsed.zeroCopy = document.value("zero_copy", parsed.zeroCopy);
+    parsed.logPackets = document.value("log_packets", parsed.logPackets);
+    if (document.contains("log_level") &&
+        !parseLogLevel(document["log_level"].get<std::string>(),
+                       parsed.logLevel)) {
+      error = path + ": unknown log level";
+      return false;
+    }
+
+    config = std::move(parsed);
+    return true;
+  } catch (const std::exception &e) {
+    error = path + ": " + e.what();
+    return false;
+  }
+}
+
+bool parseProxyArgs(int argc, char **argv, ProxyConfig &config, bool &help,
+                    std::string &error) {
+  help = false;
+  std::vector<std::string> args(argv + 1, argv + argc);
+
+  // The config file is the base the other options override
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (args[i] == "--config") {
+      if (i + 1 == args.size()) {
+        error = "--config needs a file";
+        return false;
+      }
+      if (!loadProxyConfig(args[i + 1], config, error))
+        return false;
+    }
+  }
+
+  for (size_t i = 0; i < args.size(); ++i) {
+    const std::string &option = args[i];
+
+    // Flags
+    if (option == "--help" || option == "-h") {
+      help = true;
+      return true;
+    }
+    if (option == "--tls") {
+      config.tlsEnabled = true;
+      continue;
+    }
+    if (option == "--sni-certs") {
+      config.sniCertificates = true;
+      continue;
+    }
+    if (option == "--broker-tls") {
+      config.brokerTLS = true;
+      continue;
+    }
+    if (option == "--ws") {
+      config.wsEnabled = true;
+      continue;
+    }
+    if (option == "--broker-ws") {
+      config.brokerWebSocket = true;
+      continue;
+    }
+    if (option == "--log-packets") {
+      config.logPackets = true;
+      continue;
+    }
+    if (option == "--replay-store") {
+      config.replayStore = true;
+      continue;
+    }
+    if (option == "--no-zero-copy") {
+      config.zeroCopy = false;
+      continue;
+    }
+
+    // Options with a value
+    if (i + 1 == args.size()) {
+      error = "unknown option or missing value: " + option;
+      return false;
+    }
+    const std::string &value = args[++i];
+    bool ok = true;
+    if (option == "--config") {
+      // Already read
+    } else if (option == "--listen") {
+      ok = parseHostPort(value, config.listenAddress, config.listenPort);
+    } else if (option == "--broker") {
+      ok = parseBrokers(splitList(value), config.brokers);
+    } else if (option == "--broker-balance") {
+      ok = parseBrokerBalance(value, config.brokerBalance);
+    } else if (option == "--broker-health-check") {
+      ok = parseCount(value, config.brokerHealthCheckMs);
+    } else if (option == "--tls-port") {
+      config.tlsEnabled = true;
+      ok = parsePort(value, config.tlsListenPort);
+    } else if (option == "--ws-port") {
+      config.wsEnabled = true;
+      ok = parsePort(value, config.wsListenPort);
+    } else if (option == "--broker-ws-path") {
+      config.brokerWebSocket = true;
+      config.brokerWebSocketPath = value;
+    } else if (option == "--cert") {
+      config.certFile = value;
+    } else if (option == "--key") {
+      config.keyFile = value;
+    } else if (option == "--sni-prewarm") {
+      config.sniCertificates = true;
+      for (std::string &name : splitList(value))
+        config.sniPrewarm.push_back(std::move(name));
+    } else if (option == "--handshake-threads") {
+      ok = parseCount(value, config.handshakeThreads);
+    } else if (option == "--max-handshakes") {
+      ok = parseCount(value, config.maxHandshakes);
+    } else if (option == "--handshake-queue") {
+      ok = parseCount(value, config.handshakeQueue);
+    } else if (option == "--handshake-overflow") {
+      ok = parseOverflow(value, config.handshakeOverflow);
+    } else if (option == "--handshake-timeout") {
+      ok = parseCount(value, config.handshakeTimeoutMs) &&
+           config.handshakeTimeoutMs != 0;
+    } else if (option == "--connect-timeout") {
+      ok = parseCount(value, config.connectTimeoutMs);
+    } else if (option == "--idle-timeout") {
+      ok = parseCount(value, config.idleTimeoutS);
+    } else if (option == "--max-packet-kb") {
+      ok = parseCount(value, config.maxPacketSizeKB) &&
+           config.maxPacketSizeKB != 0;
+    } else if (option == "--replay-store-mb") {
+      config.replayStore = true;
+      ok = parseCount(value, config.replayStoreMB) &&
+           config.replayStoreMB != 0;
+    } else if (option == "--rules") {
+      config.rulesFile = value;
+    } else if (option == "--capture") {
+      config.capturePrefix = value;
+    } else if (option == "--metrics-port") {
+      ok = parsePort(value, config.metricsPort);
+    } else if (option == "--threads") {
+      ok = parseCount(value, config.threads);
+    } else if (option == "--log-level") {
+      ok = parseLogLevel(value, config.logLevel);
+    } else {
+      error = "unknown option: " + option;
+      return false;
+    }
+
+    if (!ok) {
+      error = "invalid value for " + option + ": " + value;
+      return false;
+    }
+  }
+  return true;
+}
+
+const char *proxyUsage() {
+  return "Usage: MITMqtt_headless [options]\n"
+         "\n"
+         "  --config FILE        Read settings from a JSON file first\n"
+         "  --listen ADDR[:PORT] Plain MQTT listener (default 0.0.0.0:1883)\n"
+         "  --broker HOST[:PORT] Upstream broker, or a comma-separated pool\n"
+         "  --broker-balance round-robin|least-connections|client-hash\n"
+         "                       How clients are spread over the pool\n"
+         "                       (default round-robin)\n"
+         "  --broker-health-check MS  Probe the brokers every MS, 0 for\n"
+         "                       never (0)\n"
+         "  --broker-tls         Connect to the broker over TLS\n"
+         "  --broker-ws          Connect to the broker over WebSocket\n"
+         "  --broker-ws-path PATH  WebSocket path on the broker (/mqtt)\n"
+         "  --tls                Also accept MQTTS\n"
+         "  --tls-port PORT      MQTTS listener port (default 8883)\n"
+         "  --ws                 Also accept MQTT over WebSocket\n"
+         "  --ws-port PORT       WebSocket listener port (default 8080)\n"
+         "  --cert FILE          TLS certificate (PEM)\n"
+         "  --key FILE           TLS private key (PEM)\n"
+         "  --sni-certs          Serve a leaf per server name, signed by the\n"
+         "                       --cert CA\n"
+         "  --sni-prewarm NAMES  Comma-separated names to mint at startup\n"
+         "  --handshake-threads N  Threads for TLS handshakes, 0 to use the\n"
+         "                       I/O threads\n"
+         "  --max-handshakes N   Concurrent TLS handshakes, 0 for no limit\n"
+         "  --handshake-queue N  Handshakes waiting for a slot, 0 for none\n"
+         "                       (default 1024)\n"
+         "  --handshake-overflow pause|reject\n"
+         "                       When the queue is full, stop accepting or\n"
+         "                       close new clients (default pause)\n"
+         "  --handshake-timeout MS  Drop clients that take longer (10000)\n"
+         "  --connect-timeout MS Drop clients that send no CONNECT within\n"
+         "                       MS of connecting, 0 to wait (10000)\n"
+         "  --idle-timeout S     Drop clients without keep alive after S\n"
+         "                       seconds of silence, 0 to keep them (0)\n"
+         "  --max-packet-kb N    Drop peers that send a larger packet (4096)\n"
+         "  --rules FILE         Match-and-rewrite rules (JSON)\n"
+         "  --capture PREFIX     Capture packets to PREFIX-NNNN.pcapng\n"
+         "  --metrics-port PORT  Serve Prometheus metrics at /metrics\n"
+         "  --threads N          I/O threads, 0 for one per core\n"
+         "  --replay-store       Keep recent packets for replay\n"
+         "  --replay-store-mb N  Memory for them in MB (default 16)\n"
+         "  --no-zero-copy       Never splice uninspected traffic\n"
+         "  --log-level LEVEL    debug, info, warn, error or off\n"
+         "  --log-packets        Log a line per forwarded packet\n"
+         "  --help               Show this help\n"
+         "\n"
+         "SIGINT and SIGTERM shut down cleanly, SIGHUP reloads the rules.\n";
+}
+
+}
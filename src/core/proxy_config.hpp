@@ -0,0 +1,76 @@
+#pragma once
+
+#include "../utils/logger.hpp"
+#include "broker_pool.hpp"
+#include "handshake_gate.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mitmqtt {
+
+// Settings for running the proxy without the GUI, read from a JSON config
+// file and/or the command line
+struct ProxyConfig {
+  std::string listenAddress = "0.0.0.0";
+  uint16_t listenPort = 1883;
+
+  bool tlsEnabled = false;
+  uint16_t tlsListenPort = 8883;
+  std::string certFile = "mitmqtt_ca.crt";
+  std::string keyFile = "mitmqtt_ca.key";
+  bool sniCertificates = false;        // Mint a leaf per server name
+  std::vector<std::string> sniPrewarm; // Names to mint at startup
+
+  size_t handshakeThreads = 0;  // 0 to run handshakes on the I/O threads
+  size_t maxHandshakes = 0;     // Concurrent handshakes, 0 for no limit
+  size_t handshakeQueue = 1024; // Waiting handshakes, 0 for none
+  HandshakeOverflow handshakeOverflow = HandshakeOverflow::Pause;
+  uint32_t handshakeTimeoutMs = 10000;
+
+  uint32_t connectTimeoutMs = 10000; // Until CONNECT, 0 to wait forever
+  uint32_t idleTimeoutS = 0; // Clients without keep alive, 0 to keep them
+  size_t maxPacketSizeKB = 4096; // Larger packets drop the connection
+
+  bool wsEnabled = false;       // Also accept MQTT over WebSocket
+  uint16_t wsListenPort = 8080;
+
+  // Upstream brokers, clients are spread over them by brokerBalance
+  std::vector<BrokerAddress> brokers{{"test.mosquitto.org", 1883}};
+  BrokerBalance brokerBalance = BrokerBalance::RoundRobin;
+  uint32_t brokerHealthCheckMs = 0; // 0 for no health checks
+  bool brokerTLS = false; // Connect to the broker over TLS
+  bool brokerWebSocket = false; // and/or over WebSocket
+  std::string brokerWebSocketPath = "/mqtt";
+
+  std::string rulesFile;     // Empty for no rules
+  std::string capturePrefix; // Empty for no capture files
+  uint16_t metricsPort = 0;  // Prometheus endpoint, 0 for none
+
+  size_t threads = 0;        // 0 for one per hardware thread
+  bool replayStore = false;  // Nothing replays without the GUI
+  size_t replayStoreMB = 16; // Memory it may use
+  bool zeroCopy = true;      // Splice traffic nothing inspects
+
+  utils::LogLevel logLevel = utils::LogLevel::Info;
+  bool logPackets = false;
+};
+
+// Read a JSON config file, e.g.
+//   {"listen_port": 1883, "broker_host": "10.0.0.5", "broker_port": 1883,
+//    "tls": true, "cert": "ca.crt", "key": "ca.key", "rules": "rules.json"}
+// or, for a pool of brokers, "brokers": ["10.0.0.5:1883", "10.0.0.6:1883"].
+// Keys that are missing keep their current value.
+bool loadProxyConfig(const std::string &path, ProxyConfig &config,
+                     std::string &error);
+
+// Apply command line options to `config`. A --config file is read first, so
+// the other options override it. Sets `help` for --help.
+bool parseProxyArgs(int argc, char **argv, ProxyConfig &config, bool &help,
+                    std::string &error);
+
+// Option summary for --help
+const char *proxyUsage();
+
+}
@@ -0,0 +1,183 @@
+#include "replay_engine.hpp"
+#include <boost/asio/post.hpp>
+#include <algorithm>
+#include <utility>
+
+namespace mitmqtt {
+
+void ReplayPlan::add(const uint8_t *data, size_t size, uint64_t connectionId,
+                     PacketDirection direction,
+                     std::chrono::steady_clock::rep timestamp) {
+  if (frames.empty())
+    first_ = timestamp;
+
+  Frame frame;
+  frame.offset = bytes.size();
+  frame.size = size;
+  frame.connectionId = connectionId;
+  frame.direction = direction;
+  // Timestamps of a connection never go backwards, but frames of several
+  // connections may be stored slightly out of order
+  frame.at = std::chrono::steady_clock::duration(
+      std::max<std::chrono::steady_clock::rep>(timestamp - first_, 0));
+  if (!frames.empty() && frame.at < frames.back().at)
+    frame.at = frames.back().at;
+
+  bytes.insert(bytes.end(), data, data + size);
+  frames.push_back(frame);
+}
+
+ReplayRun::ReplayRun(const boost::asio::any_io_executor &executor,
+                     std::shared_ptr<const ReplayPlan> plan,
+                     ReplayOptions options, Sender send, Backlog backlog)
+    : timer_(executor), plan_(std::move(plan)),
+      buffer_(plan_, &plan_->bytes), options_(std::move(options)),
+      send_(std::move(send)), backlog_(std::move(backlog)), next_(0),
+      sent_(0), stopped_(false), finished_(false), notify_(true) {
+  if (options_.targets.empty()) {
+    for (const ReplayPlan::Frame &frame : plan_->frames)
+      watched_.push_back(frame.connectionId);
+    std::sort(watched_.begin(), watched_.end());
+    watched_.erase(std::unique(watched_.begin(), watched_.end()),
+                   watched_.end());
+  }
+}
+
+void ReplayRun::start(std::function<void()> done) {
+  done_ = std::move(done);
+  auto self = shared_from_this();
+  boost::asio::post(timer_.get_executor(), [this, self]() {
+    started_ = Clock::now();
+    run();
+  });
+}
+
+void ReplayRun::stop(bool notify) {
+  if (!notify)
+    notify_ = false;
+  stopped_ = true;
+  auto self = shared_from_this();
+  boost::asio::post(timer_.get_executor(), [this, self]() {
+    timer_.cancel();
+    finish();
+  });
+}
+
+ReplayRun::Clock::time_point ReplayRun::due(size_t frame) const {
+  auto at = plan_->frames[frame].at;
+  if (options_.speed == 1.0)
+    return started_ + at;
+  return started_ + std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::duration<double, Clock::period>(
+                            static_cast<double>(at.count()) / options_.speed));
+}
+
+PacketDirection ReplayRun::destination(const ReplayPlan::Frame &frame) const {
+  switch (options_.direction) {
+  case ReplayDirection::ToClient:
+    return PacketDirection::BrokerToClient;
+  case ReplayDirection::ToBroker:
+    return PacketDirection::ClientToBroker;
+  default:
+    return frame.direction;
+  }
+}
+
+bool ReplayRun::backlogged() const {
+  const std::vector<uint64_t> &targets =
+      options_.targets.empty() ? watched_ : options_.targets;
+  for (uint64_t id : targets) {
+    if (backlog_(id) > kBacklogLimit)
+      return true;
+  }
+  return false;
+}
+
+void ReplayRun::run() {
+  if (stopped_ || finished_)
+    return;
+
+  const auto &frames = plan_->frames;
+  bool fast = options_.speed <= 0;
+  auto self = shared_from_this();
+
+  // Wait for the sockets to catch up
+  if (backlogged()) {
+    timer_.expires_after(std::chrono::milliseconds(1));
+    timer_.async_wait([this, self](boost::system::error_code ec) {
+      if (!ec)
+        run();
+    });
+    return;
+  }
+
+  // Everything due, up to one batch
+  Clock::time_point now = Clock::now();
+  size_t first = next_;
+  size_t bytes = 0;
+  while (next_ < frames.size() && bytes < kBatchBytes &&
+         (fast || due(next_) <= now)) {
+    bytes += frames[next_].size;
+    ++next_;
+  }
+  send(first, next_);
+
+  if (next_ == frames.size()) {
+    finish();
+    return;
+  }
+
+  // Let the connections on this thread have their turn between batches
+  if (fast || due(next_) <= now) {
+    boost::asio::post(timer_.get_executor(), [this, self]() { run(); });
+    return;
+  }
+
+  timer_.expires_at(due(next_));
+  timer_.async_wait([this, self](boost::system::error_code ec) {
+    if (!ec)
+      run();
+  });
+}
+
+void ReplayRun::send(size_t first, size_t last) {
+  const auto &frames = plan_->frames;
+  bool own = options_.targets.empty();
+
+  while (first < last) {
+    // Extend the run while the destination stays the same
+    const ReplayPlan::Frame &head = frames[first];
+    PacketDirection direction = destination(head);
+    size_t end = first + 1;
+    while (end < last && destination(frames[end]) == direction &&
+           (!own || frames[end].connectionId == head.connectionId))
+      ++end;
+
+    size_t offset = head.offset;
+    size_t size = frames[end - 1].offset + frames[end - 1].size - offset;
+    bool queued = false;
+    if (own) {
+      queued = send_(head.connectionId, direction, buffer_, offset, size);
+    } else {
+      for (uint64_t id : options_.targets)
+        queued = send_(id, direction, buffer_, offset, size) || queued;
+    }
+
+    // Frames for connections that have gone are skipped, not sent
+    if (queued)
+      sent_ += end - first;
+    first = end;
+  }
+}
+
+void ReplayRun::finish() {
+  if (finished_)
+    return;
+  finished_ = true;
+  if (done_ && notify_) {
+    auto done = std::move(done_);
+    done();
+  }
+}
+
+}
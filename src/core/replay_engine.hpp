@@ -0,0 +1,134 @@
+#pragma once
+
+#include "mqtt_types.hpp"
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace mitmqtt {
+
+// Captured frames to replay, encoded back to back in one buffer so that a
+// run of consecutive frames goes out as a single contiguous slice
+struct ReplayPlan {
+  struct Frame {
+    size_t offset; // Into bytes
+    size_t size;
+    uint64_t connectionId; // Captured on
+    PacketDirection direction;
+    std::chrono::steady_clock::duration at; // After the first frame
+  };
+
+  std::vector<uint8_t> bytes;
+  std::vector<Frame> frames;
+
+  // Append a frame captured at `timestamp` (raw steady_clock ticks)
+  void add(const uint8_t *data, size_t size, uint64_t connectionId,
+           PacketDirection direction,
+           std::chrono::steady_clock::rep timestamp);
+
+  bool empty() const { return frames.empty(); }
+
+private:
+  std::chrono::steady_clock::rep first_ = 0;
+};
+
+// Where replayed frames are sent
+enum class ReplayDirection {
+  Original, // The way each frame was captured
+  ToClient, // Everything toward the clients, as if from the broker
+  ToBroker  // Everything toward the broker, as if from the clients
+};
+
+struct ReplayOptions {
+  // Multiple of the captured pace, 10 replays ten times faster; 0 sends as
+  // fast as the connections take it
+  double speed = 1.0;
+  ReplayDirection direction = ReplayDirection::Original;
+  // Connections every frame is sent to; empty sends each frame on the
+  // connection it was captured on
+  std::vector<uint64_t> targets;
+  // Only replay frames captured on this connection, 0 for all of them
+  uint64_t connectionId = 0;
+  // Bit n set replays packets of type n. PUBLISH only by default: a
+  // replayed CONNECT, ack or ping does not belong to the live session.
+  uint16_t packetTypes = 1u << 3;
+  static constexpr uint16_t kAllPacketTypes = 0xFFFF;
+};
+
+// One replay in progress, driven by a timer on its executor.
+//
+// Frames that are due go out in batches: consecutive frames for the same
+// destination become one slice of the plan's buffer, handed to every target
+// at once. Sending stops for a while whenever a target's outbound queue is
+// above the backlog limit, so "as fast as possible" still runs at the pace
+// the sockets drain. Only the progress counters may be read from other
+// threads.
+class ReplayRun : public std::enable_shared_from_this<ReplayRun> {
+public:
+  // Queue `size` bytes of `buffer` at `offset` on a connection. Returns false
+  // if the connection is gone.
+  using Sender = std::function<bool(
+      uint64_t connectionId, PacketDirection direction,
+      const std::shared_ptr<const std::vector<uint8_t>> &buffer,
+      size_t offset, size_t size)>;
+  // Bytes queued for writing on a connection
+  using Backlog = std::function<size_t(uint64_t connectionId)>;
+
+  ReplayRun(const boost::asio::any_io_executor &executor,
+            std::shared_ptr<const ReplayPlan> plan, ReplayOptions options,
+            Sender send, Backlog backlog);
+
+  // Begin sending; `done` runs on the executor once all frames are sent or
+  // the replay is stopped
+  void start(std::function<void()> done);
+  // Stop early, from any thread. Without `notify`, `done` is not run, for
+  // an owner that is going away.
+  void stop(bool notify = true);
+
+  size_t frameCount() const { return plan_->frames.size(); }
+  // Frames queued on at least one connection
+  size_t framesSent() const { return sent_; }
+  bool finished() const { return finished_; }
+  const ReplayOptions &options() const { return options_; }
+
+  // Bytes per batch, and the queue depth at which a target holds the replay
+  static constexpr size_t kBatchBytes = 256 * 1024;
+  static constexpr size_t kBacklogLimit = 4 * 1024 * 1024;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  void run();
+  void finish();
+  bool backlogged() const;
+  Clock::time_point due(size_t frame) const;
+  PacketDirection destination(const ReplayPlan::Frame &frame) const;
+  // Send frames [first, last) as contiguous runs
+  void send(size_t first, size_t last);
+
+  boost::asio::steady_timer timer_;
+  std::shared_ptr<const ReplayPlan> plan_;
+  std::shared_ptr<const std::vector<uint8_t>> buffer_; // Aliases plan_
+  ReplayOptions options_;
+  Sender send_;
+  Backlog backlog_;
+  std::function<void()> done_;
+
+  // Targets when options_.targets is empty: every captured connection
+  std::vector<uint64_t> watched_;
+
+  Clock::time_point started_;
+  size_t next_;
+  std::atomic<size_t> sent_;
+  std::atomic<bool> stopped_;
+  std::atomic<bool> finished_;
+  std::atomic<bool> notify_;
+};
+
+}
@@ -0,0 +1,348 @@
+#include "rule_engine.hpp"
+#include "mqtt_decoder.hpp"
+#include "mqtt_handler.hpp"
+#include "../utils/logger.hpp"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+namespace mitmqtt {
+
+namespace {
+bool parseType(const nlohmann::json &value, uint8_t &type) {
+  if (value.is_number_unsigned()) {
+    unsigned number = value.get<unsigned>();
+    if (number > 15)
+      return false;
+    type = static_cast<uint8_t>(number);
+    return true;
+  }
+  if (!value.is_string())
+    return false;
+
+  std::string name = value.get<std::string>();
+  std::transform(name.begin(), name.end(), name.begin(),
+                 [](unsigned char c) { return std::toupper(c); });
+  for (uint8_t t = 1; t < 16; ++t) {
+    if (name == packetTypeToString(t)) {
+      type = t;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseRule(const nlohmann::json &object, Rule &rule, std::string &error) {
+  if (!object.is_object()) {
+    error = "expected an object";
+    return false;
+  }
+
+  rule.name = object.value("name", std::string());
+  rule.enabled = object.value("enabled", true);
+
+  if (object.contains("direction")) {
+    std::string direction = object["direction"].get<std::string>();
+    if (direction == "client_to_broker") {
+      rule.direction = PacketDirection::ClientToBroker;
+    } else if (direction == "broker_to_client") {
+      rule.direction = PacketDirection::BrokerToClient;
+    } else if (direction != "any") {
+      error = "unknown direction \"" + direction + "\"";
+      return false;
+    }
+  }
+  if (object.contains("type")) {
+    uint8_t type = 0;
+    if (!parseType(object["type"], type)) {
+      error = "unknown packet type " + object["type"].dump();
+      return false;
+    }
+    rule.type = type;
+  }
+  rule.topicFilter = object.value("topic", std::string());
+  rule.clientId = object.value("client_id", std::string());
+  rule.payloadContains = object.value("payload_contains", std::string());
+
+  RuleAction &action = rule.action;
+  action.drop = object.value("drop", false);
+  action.delay = std::chrono::milliseconds(object.value("delay_ms", 0));
+  if (object.contains("set_topic"))
+    action.topic = object["set_topic"].get<std::string>();
+  if (object.contains("set_payload"))
+    action.payload = object["set_payload"].get<std::string>();
+  if (object.contains("set_qos")) {
+    unsigned qos = object["set_qos"].get<unsigned>();
+    if (qos > 2) {
+      error = "QoS must be 0, 1 or 2";
+      return false;
+    }
+    action.qos = static_cast<uint8_t>(qos);
+  }
+  if (object.contains("set_retain"))
+    action.retain = object["set_retain"].get<bool>();
+
+  error = validateRule(rule);
+  return error.empty();
+}
+}
+
+std::string validateRule(const Rule &rule) {
+  if (rule.type && *rule.type > 15)
+    return "packet type out of range";
+
+  bool publishOnly = !rule.topicFilter.empty() ||
+                     !rule.payloadContains.empty() || rule.action.rewrites();
+  if (publishOnly && rule.type && *rule.type != 3)
+    return "topic, payload and rewrites apply to PUBLISH only";
+
+  if (!rule.topicFilter.empty() && !isValidTopicFilter(rule.topicFilter))
+    return "invalid topic filter \"" + rule.topicFilter + "\"";
+
+  const RuleAction &action = rule.action;
+  if (action.delay.count() < 0)
+    return "negative delay";
+  if (action.qos && *action.qos > 2)
+    return "QoS must be 0, 1 or 2";
+  // Changing the QoS would need the proxy to allocate packet ids per
+  // connection and to answer and absorb the acknowledgements itself
+  if (action.qos)
+    return "set_qos is not supported";
+  if (action.topic) {
+    if (action.topic->empty() || action.topic->size() > 65535 ||
+        action.topic->find_first_of("+#") != std::string::npos)
+      return "invalid replacement topic \"" + *action.topic + "\"";
+  }
+  return std::string();
+}
+
+bool parseRules(const std::string &json, std::vector<Rule> &rules,
+                std::string &error) {
+  nlohmann::json document;
+  try {
+    document = nlohmann::json::parse(json);
+  } catch (const std::exception &e) {
+    error = e.what();
+    return false;
+  }
+
+  if (document.is_object() && document.contains("rules"))
+    document = document["rules"];
+  if (!document.is_array()) {
+    error = "expected an array of rules";
+    return false;
+  }
+
+  std::vector<Rule> parsed;
+  for (size_t i = 0; i < document.size(); ++i) {
+    Rule rule;
+    std::string reason;
+    try {
+      if (!parseRule(document[i], rule, reason)) {
+        error = "rule " + std::to_string(i) + ": " + reason;
+        return false;
+      }
+    } catch (const std::exception &e) {
+      // Wrongly typed values
+      error = "rule " + std::to_string(i) + ": " + e.what();
+      return false;
+    }
+    parsed.push_back(std::move(rule));
+  }
+
+  rules = std::move(parsed);
+  return true;
+}
+
+bool loadRules(const std::string &path, std::vector<Rule> &rules,
+               std::string &error) {
+  std::ifstream file(path);
+  if (!file) {
+    error = "cannot open " + path;
+    return false;
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return parseRules(contents.str(), rules, error);
+}
+
+RuleEngine::RuleEngine(std::vector<Rule> rules)
+    : rules_(std::move(rules)),
+      hits_(std::make_unique<std::atomic<uint64_t>[]>(rules_.size())) {
+  for (size_t i = 0; i < rules_.size(); ++i) {
+    hits_[i] = 0;
+
+    const Rule &rule = rules_[i];
+    if (!rule.enabled)
+      continue;
+    std::string reason = validateRule(rule);
+    if (!reason.empty()) {
+      MITMQTT_LOG_WARN("Ignoring rule " << i << " (" << rule.name
+                       << "): " << reason);
+      continue;
+    }
+
+    bool needsPublish = !rule.topicFilter.empty() ||
+                        !rule.payloadContains.empty() ||
+                        rule.action.rewrites();
+    uint16_t types = rule.type ? uint16_t(1u << *rule.type)
+                    : needsPublish ? uint16_t(1u << 3)
+                                   : uint16_t(0xFFFF);
+
+    for (size_t d = 0; d < 2; ++d) {
+      if (rule.direction && static_cast<size_t>(*rule.direction) != d)
+        continue;
+
+      typeMask_[d] |= types;
+      needsPublish_[d] = needsPublish_[d] || needsPublish;
+
+      uint32_t id = static_cast<uint32_t>(i);
+      if (!rule.topicFilter.empty()) {
+        topics_[d].insert(rule.topicFilter, id);
+        continue;
+      }
+      for (size_t t = 0; t < 16; ++t) {
+        if (types & (1u << t))
+          buckets_[d * 16 + t].push_back(id);
+      }
+    }
+  }
+}
+
+uint32_t RuleEngine::findRule(PacketDirection direction, const FrameView &frame,
+                              std::string_view clientId,
+                              uint8_t protocolLevel, PublishView &publish,
+                              bool &decoded) const {
+  decoded = false;
+  if (frame.empty())
+    return kNone;
+
+  size_t d = static_cast<size_t>(direction);
+  uint8_t type = frame.typeNibble();
+  if ((typeMask_[d] & (1u << type)) == 0)
+    return kNone;
+
+  if (type == 3 && needsPublish_[d])
+    decoded = decodePublish(frame, protocolLevel, publish);
+  const PublishView *view = decoded ? &publish : nullptr;
+
+  uint32_t best = kNone;
+  for (uint32_t id : buckets_[d * 16 + type]) {
+    if (matchesRest(id, clientId, view)) {
+      best = id;
+      break;
+    }
+  }
+
+  if (view && !topics_[d].empty()) {
+    // Per thread, so matching does not allocate once warmed up
+    thread_local std::vector<uint32_t> candidates;
+    candidates.clear();
+    topics_[d].match(view->topic, candidates);
+    std::sort(candidates.begin(), candidates.end());
+    for (uint32_t id : candidates) {
+      if (id >= best)
+        break;
+      if (matchesRest(id, clientId, view)) {
+        best = id;
+        break;
+      }
+    }
+  }
+
+  if (best != kNone)
+    hits_[best].fetch_add(1, std::memory_order_relaxed);
+  return best;
+}
+
+RuleResult RuleEngine::apply(PacketDirection direction, const FrameView &frame,
+                             std::string_view clientId, uint8_t protocolLevel,
+                             std::vector<uint8_t> &out) const {
+  RuleResult result;
+  PublishView publish;
+  bool decoded;
+  uint32_t best =
+      findRule(direction, frame, clientId, protocolLevel, publish, decoded);
+  if (best == kNone)
+    return result;
+
+  const RuleAction &action = rules_[best].action;
+  result.rule = static_cast<int>(best);
+  result.drop = action.drop;
+  result.delay = action.delay;
+  if (!action.drop && action.rewrites() && decoded)
+    result.rewritten = encodePublish(publish, action, out);
+  return result;
+}
+
+bool RuleEngine::matches(PacketDirection direction, const FrameView &frame,
+                         std::string_view clientId,
+                         uint8_t protocolLevel) const {
+  PublishView publish;
+  bool decoded;
+  return findRule(direction, frame, clientId, protocolLevel, publish,
+                  decoded) != kNone;
+}
+
+bool RuleEngine::matchesRest(uint32_t rule, std::string_view clientId,
+                             const PublishView *publish) const {
+  const Rule &r = rules_[rule];
+  if (!r.clientId.empty() && r.clientId != clientId)
+    return false;
+  if (!r.payloadContains.empty() &&
+      (!publish ||
+       publish->payload.find(r.payloadContains) == std::string_view::npos))
+    return false;
+  return true;
+}
+
+bool decodePublish(const FrameView &frame, uint8_t protocolLevel,
+                   PublishView &publish) {
+  PacketView packet;
+  if (frame.typeNibble() != 3 || !decodePacket(frame, protocolLevel, packet))
+    return false;
+  publish.header = packet.header;
+  publish.topic = packet.topic;
+  publish.packetId = packet.packetId;
+  publish.properties = packet.properties;
+  publish.payload = packet.payload;
+  return true;
+}
+
+bool encodePublish(const PublishView &publish, const RuleAction &action,
+                   std::vector<uint8_t> &out) {
+  std::string_view topic = action.topic ? *action.topic : publish.topic;
+  std::string_view payload =
+      action.payload ? std::string_view(*action.payload) : publish.payload;
+  // The QoS, and with it the packet id, stays as the sender chose it
+  uint8_t qos = (publish.header >> 1) & 0x03;
+  bool retain = action.retain ? *action.retain : (publish.header & 0x01) != 0;
+  uint16_t packetId = publish.packetId;
+
+  size_t remainingLength = 2 + topic.size() + (qos > 0 ? 2 : 0) +
+                           publish.properties.size() + payload.size();
+  if (remainingLength > MQTTFramer::kMaxRemainingLength)
+    return false;
+
+  out.clear();
+  out.reserve(1 + 4 + remainingLength);
+
+  uint8_t header = (publish.header & 0xFE) | (retain ? 0x01 : 0x00);
+  out.push_back(header);
+  encodeRemainingLength(remainingLength, out);
+
+  out.push_back(static_cast<uint8_t>(topic.size() >> 8));
+  out.push_back(static_cast<uint8_t>(topic.size() & 0xFF));
+  out.insert(out.end(), topic.begin(), topic.end());
+  if (qos > 0) {
+    out.push_back(static_cast<uint8_t>(packetId >> 8));
+    out.push_back(static_cast<uint8_t>(packetId & 0xFF));
+  }
+  out.insert(out.end(), publish.properties.begin(), publish.properties.end());
+  out.insert(out.end(), payload.begin(), payload.end());
+  return true;
+}
+
+}
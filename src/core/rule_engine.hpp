@@ -0,0 +1,157 @@
+#pragma once
+
+#include "mqtt_framer.hpp"
+#include "mqtt_types.hpp"
+#include "topic_trie.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mitmqtt {
+
+// What a rule does with the packets it matches. Rewrites apply to PUBLISH
+// packets only.
+struct RuleAction {
+  bool drop = false;
+  std::chrono::milliseconds delay{0};
+  std::optional<std::string> topic;
+  std::optional<std::string> payload;
+  std::optional<uint8_t> qos; // Rejected by validateRule()
+  std::optional<bool> retain;
+
+  bool rewrites() const { return topic || payload || qos || retain; }
+};
+
+// Declarative match-and-rewrite rule. Unset match fields match everything;
+// a topic filter, payload pattern or rewrite implies PUBLISH.
+struct Rule {
+  std::string name;
+  bool enabled = true;
+
+  std::optional<PacketDirection> direction;
+  std::optional<uint8_t> type;  // Control packet type nibble
+  std::string topicFilter;      // MQTT wildcards allowed
+  std::string clientId;         // As announced in CONNECT
+  std::string payloadContains;  // Byte substring of the PUBLISH payload
+
+  RuleAction action;
+};
+
+// Parse rules from JSON: an array of objects (or {"rules": [...]}) with the
+// Rule fields as keys, e.g.
+//   {"name": "mute", "direction": "broker_to_client", "topic": "sensors/#",
+//    "drop": true}
+// Match keys are "direction", "type", "topic", "client_id" and
+// "payload_contains"; actions are "drop", "delay_ms", "set_topic",
+// "set_payload" and "set_retain"; "set_qos" is parsed but rejected.
+// Returns false and sets `error` if the document or a rule is invalid.
+bool parseRules(const std::string &json, std::vector<Rule> &rules,
+                std::string &error);
+bool loadRules(const std::string &path, std::vector<Rule> &rules,
+               std::string &error);
+
+// Empty if the rule is well-formed, otherwise the reason it is not
+std::string validateRule(const Rule &rule);
+
+// Fields of a PUBLISH packet, as views into its frame
+struct PublishView {
+  uint8_t header = 0;
+  std::string_view topic;
+  uint16_t packetId = 0;
+  std::string_view properties; // MQTT 5, length prefix included
+  std::string_view payload;
+};
+
+// Split a PUBLISH frame from a connection speaking MQTT `protocolLevel`.
+// Returns false if the packet is malformed.
+bool decodePublish(const FrameView &frame, uint8_t protocolLevel,
+                   PublishView &publish);
+
+// Encode `publish` with the rewrites of `action` applied into `out`, with a
+// re-encoded remaining length. Returns false if the result would exceed the
+// largest remaining length.
+bool encodePublish(const PublishView &publish, const RuleAction &action,
+                   std::vector<uint8_t> &out);
+
+// How the rules treat one packet
+struct RuleResult {
+  int rule = -1;           // Index of the first matching rule, -1 for none
+  bool drop = false;
+  bool rewritten = false;  // The replacement frame is in the output buffer
+  std::chrono::milliseconds delay{0};
+
+  bool matched() const { return rule >= 0; }
+};
+
+// A compiled, immutable rule set.
+//
+// Rules are bucketed by direction and packet type; PUBLISH rules with a
+// topic filter additionally go into a per-direction TopicTrie. Applying the
+// rules to a packet of a type no rule mentions costs one bit test, and a
+// PUBLISH is only decoded when some rule needs its topic or payload. The
+// first enabled rule (in order) whose conditions all hold wins.
+//
+// apply() may be called from any number of threads at once.
+class RuleEngine {
+public:
+  explicit RuleEngine(std::vector<Rule> rules);
+
+  RuleEngine(const RuleEngine &) = delete;
+  RuleEngine &operator=(const RuleEngine &) = delete;
+
+  // Match one frame. A rewritten frame, fixed header and re-encoded
+  // remaining length included, replaces the contents of `out`.
+  // `protocolLevel` is the connection's MQTT version (4 for 3.1.1, 5).
+  RuleResult apply(PacketDirection direction, const FrameView &frame,
+                   std::string_view clientId, uint8_t protocolLevel,
+                   std::vector<uint8_t> &out) const;
+
+  // Whether any rule matches, without applying its action
+  bool matches(PacketDirection direction, const FrameView &frame,
+               std::string_view clientId, uint8_t protocolLevel) const;
+
+  const std::vector<Rule> &rules() const { return rules_; }
+  bool empty() const { return rules_.empty(); }
+
+  // Packets matched by each rule so far
+  uint64_t hits(size_t rule) const {
+    return hits_[rule].load(std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr uint32_t kNone = UINT32_MAX;
+
+  // Index of the first matching rule (its hit counted), kNone for none.
+  // `decoded` tells whether `publish` was filled in.
+  uint32_t findRule(PacketDirection direction, const FrameView &frame,
+                    std::string_view clientId, uint8_t protocolLevel,
+                    PublishView &publish, bool &decoded) const;
+
+  // Conditions a bucket or the trie have not already established
+  bool matchesRest(uint32_t rule, std::string_view clientId,
+                   const PublishView *publish) const;
+
+  std::vector<Rule> rules_;
+  std::unique_ptr<std::atomic<uint64_t>[]> hits_;
+
+  // Bit t of typeMask_[d]: some rule may match type t in direction d
+  std::array<uint16_t, 2> typeMask_{};
+
+  // Rules without a topic filter by direction * 16 + type, in rule order
+  std::array<std::vector<uint32_t>, 32> buckets_;
+
+  // PUBLISH rules with a topic filter, per direction
+  std::array<TopicTrie, 2> topics_;
+
+  // Some candidate in this direction needs the PUBLISH decoded
+  std::array<bool, 2> needsPublish_{};
+};
+
+}
@@ -2,32 +2,25 @@
 
 namespace mitmqtt {
 
-Session::Session(const std::string& clientId)
-    : clientId_(clientId)
-    , authenticated_(false) {
-}
+Session::Session(const std::string &clientId)
+    : clientId_(clientId), authenticated_(false) {}
 
-Session::~Session() {
-}
+std::string Session::getClientId() const { return clientId_; }
 
-std::string Session::getClientId() const {
-    return clientId_;
+void Session::setClientId(const std::string &clientId) {
+  clientId_ = clientId;
 }
 
-void Session::setUsername(const std::string& username) {
-    username_ = username;
+void Session::setUsername(const std::string &username) {
+  username_ = username;
 }
 
-std::string Session::getUsername() const {
-    return username_;
-}
+std::string Session::getUsername() const { return username_; }
 
-bool Session::isAuthenticated() const {
-    return authenticated_;
-}
+bool Session::isAuthenticated() const { return authenticated_; }
 
 void Session::setAuthenticated(bool authenticated) {
-    authenticated_ = authenticated;
+  authenticated_ = authenticated;
 }
 
-}  
+}
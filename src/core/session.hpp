@@ -1,28 +1,29 @@
-  
 #pragma once
 
-#include <string>
 #include <cstdint>
+#include <string>
 
 namespace mitmqtt {
 
-
+// Identity of the device behind a connection, as announced by its CONNECT
+// and confirmed by the broker's CONNACK
 class Session {
 public:
-    Session(const std::string& clientId);
-    ~Session();
+  explicit Session(const std::string &clientId = std::string());
+
+  std::string getClientId() const;
+  void setClientId(const std::string &clientId);
+  void setUsername(const std::string &username);
+  std::string getUsername() const;
 
-    std::string getClientId() const;
-    void setUsername(const std::string& username);
-    std::string getUsername() const;
-    
-    bool isAuthenticated() const;
-    void setAuthenticated(bool authenticated);
+  // The broker accepted the CONNECT
+  bool isAuthenticated() const;
+  void setAuthenticated(bool authenticated);
 
 private:
-    std::string clientId_;
-    std::string username_;
-    bool authenticated_;
+  std::string clientId_;
+  std::string username_;
+  bool authenticated_;
 };
 
-} 
\ No newline at end of file
+}
@@ -0,0 +1,139 @@
+#include "splice_pump.hpp"
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace mitmqtt {
+
+namespace {
+// Bytes moved per splice call and chunks per turn before yielding the thread
+constexpr size_t kSpliceChunk = 64 * 1024;
+constexpr int kChunksPerTurn = 16;
+}
+
+SplicePump::SplicePump(boost::asio::ip::tcp::socket &from,
+                       boost::asio::ip::tcp::socket &to)
+    : from_(from), to_(to), pipe_{-1, -1}, inPipe_(0), bytesForwarded_(0),
+      active_(false) {}
+
+SplicePump::~SplicePump() {
+#ifdef __linux__
+  if (pipe_[0] >= 0)
+    ::close(pipe_[0]);
+  if (pipe_[1] >= 0)
+    ::close(pipe_[1]);
+#endif
+}
+
+bool SplicePump::isSupported() {
+#ifdef __linux__
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool SplicePump::start(std::shared_ptr<void> keepAlive, DoneHandler done) {
+#ifdef __linux__
+  if (active_)
+    return true;
+
+  if (::pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) != 0)
+    return false;
+
+  // splice() needs the descriptors themselves in non-blocking mode
+  boost::system::error_code ec;
+  from_.non_blocking(true, ec);
+  to_.non_blocking(true, ec);
+  if (ec)
+    return false;
+
+  keepAlive_ = std::move(keepAlive);
+  done_ = std::move(done);
+  active_ = true;
+  pump();
+  return true;
+#else
+  (void)keepAlive;
+  (void)done;
+  return false;
+#endif
+}
+
+void SplicePump::pump() {
+#ifdef __linux__
+  if (!active_)
+    return;
+
+  for (int chunk = 0; chunk < kChunksPerTurn; ++chunk) {
+    if (inPipe_ == 0) {
+      ssize_t n = ::splice(from_.native_handle(), nullptr, pipe_[1], nullptr,
+                           kSpliceChunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == 0) {
+        finish(boost::asio::error::eof);
+        return;
+      }
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          auto keepAlive = keepAlive_;
+          from_.async_wait(boost::asio::socket_base::wait_read,
+                           [this, keepAlive](boost::system::error_code ec) {
+                             if (ec) {
+                               finish(ec);
+                               return;
+                             }
+                             pump();
+                           });
+          return;
+        }
+        finish(boost::system::error_code(errno,
+                                         boost::system::system_category()));
+        return;
+      }
+      inPipe_ = static_cast<size_t>(n);
+    }
+
+    ssize_t n = ::splice(pipe_[0], nullptr, to_.native_handle(), nullptr,
+                         inPipe_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        auto keepAlive = keepAlive_;
+        to_.async_wait(boost::asio::socket_base::wait_write,
+                       [this, keepAlive](boost::system::error_code ec) {
+                         if (ec) {
+                           finish(ec);
+                           return;
+                         }
+                         pump();
+                       });
+        return;
+      }
+      finish(
+          boost::system::error_code(errno, boost::system::system_category()));
+      return;
+    }
+    inPipe_ -= static_cast<size_t>(n);
+    bytesForwarded_ += static_cast<size_t>(n);
+  }
+
+  // Let other connections on this thread run before continuing
+  auto keepAlive = keepAlive_;
+  boost::asio::post(from_.get_executor(), [this, keepAlive]() { pump(); });
+#endif
+}
+
+void SplicePump::finish(boost::system::error_code ec) {
+  if (!active_)
+    return;
+
+  active_ = false;
+  DoneHandler done = std::move(done_);
+  keepAlive_.reset();
+  if (done)
+    done(ec);
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+namespace mitmqtt {
+
+// Kernel-side forwarding of one direction of a plain TCP connection.
+//
+// Bytes move from one socket to the other through a pipe with splice(2), so
+// they are never copied into user space. This bypasses framing and
+// inspection entirely and is only used for connections nobody is watching.
+// Available on Linux only; isSupported() reports false elsewhere.
+class SplicePump {
+public:
+  using DoneHandler = std::function<void(boost::system::error_code)>;
+
+  SplicePump(boost::asio::ip::tcp::socket &from,
+             boost::asio::ip::tcp::socket &to);
+  ~SplicePump();
+
+  SplicePump(const SplicePump &) = delete;
+  SplicePump &operator=(const SplicePump &) = delete;
+
+  static bool isSupported();
+
+  // Start pumping. `keepAlive` is held by every pending wait so the owner of
+  // the sockets outlives the pump's handlers. `done` runs once on EOF or
+  // error. Returns false if the pipe could not be created.
+  bool start(std::shared_ptr<void> keepAlive, DoneHandler done);
+
+  bool active() const { return active_; }
+
+  // Bytes moved so far
+  size_t bytesForwarded() const { return bytesForwarded_; }
+
+private:
+  void pump();
+  void finish(boost::system::error_code ec);
+
+  boost::asio::ip::tcp::socket &from_;
+  boost::asio::ip::tcp::socket &to_;
+  std::shared_ptr<void> keepAlive_;
+  DoneHandler done_;
+
+  int pipe_[2];
+  size_t inPipe_; // Bytes read from `from_` but not yet written to `to_`
+  size_t bytesForwarded_;
+  bool active_;
+};
+
+}
@@ -0,0 +1,146 @@
+#include "timer_wheel.hpp"
+#include <algorithm>
+
+namespace mitmqtt {
+
+TimerWheel::TimerWheel(const boost::asio::any_io_executor &executor)
+    : timer_(executor), armed_(false), origin_(Clock::now()), now_(0),
+      size_(0) {
+  for (Link &slot : slots_)
+    slot.prev = slot.next = &slot;
+}
+
+TimerWheel::~TimerWheel() {
+  // Leave the entries unscheduled, their owners may outlive the wheel
+  for (Link &slot : slots_) {
+    while (slot.next != &slot) {
+      Entry &entry = static_cast<Entry &>(*slot.next);
+      unlink(entry);
+      entry.wheel_ = nullptr;
+    }
+  }
+}
+
+uint64_t TimerWheel::elapsed() const {
+  return static_cast<uint64_t>((Clock::now() - origin_) / kTick);
+}
+
+void TimerWheel::schedule(Entry &entry, Clock::duration delay) {
+  cancel(entry);
+
+  // Nothing is due while the wheel is empty, skip the idle ticks
+  Clock::duration since = Clock::now() - origin_;
+  uint64_t current = static_cast<uint64_t>(since / kTick);
+  if (size_ == 0)
+    now_ = std::max(now_, current);
+
+  // The first tick boundary at or after the deadline, so never early
+  uint64_t expiry = std::max(now_, current) + 1;
+  if (delay > Clock::duration::zero()) {
+    Clock::duration due = since + delay;
+    expiry = std::max(expiry, static_cast<uint64_t>(
+                                  (due + kTick - Clock::duration(1)) / kTick));
+  }
+  entry.expiry_ = std::min(expiry, now_ + kMaxDelta);
+  entry.wheel_ = this;
+  insert(entry);
+  ++size_;
+  arm();
+}
+
+void TimerWheel::cancel(Entry &entry) {
+  if (entry.wheel_ != this)
+    return;
+  unlink(entry);
+  entry.wheel_ = nullptr;
+  --size_;
+}
+
+void TimerWheel::insert(Entry &entry) {
+  // The lowest level whose slots reach the expiry; an entry due now goes in
+  // the level 0 slot being fired
+  uint64_t delta = entry.expiry_ > now_ ? entry.expiry_ - now_ : 0;
+  int level = 0;
+  while (level + 1 < kLevels &&
+         delta >= (uint64_t(1) << ((level + 1) * kSlotBits)))
+    ++level;
+  uint64_t expiry = std::max(entry.expiry_, now_);
+  Link &slot =
+      slots_[(level << kSlotBits) | ((expiry >> (level * kSlotBits)) &
+                                     kSlotMask)];
+
+  entry.prev = slot.prev;
+  entry.next = &slot;
+  slot.prev->next = &entry;
+  slot.prev = &entry;
+}
+
+void TimerWheel::take(Link &slot, Link &list) {
+  if (slot.next == &slot) {
+    list.prev = list.next = &list;
+    return;
+  }
+  list.next = slot.next;
+  list.prev = slot.prev;
+  list.next->prev = &list;
+  list.prev->next = &list;
+  slot.prev = slot.next = &slot;
+}
+
+void TimerWheel::unlink(Link &link) {
+  link.prev->next = link.next;
+  link.next->prev = link.prev;
+  link.prev = link.next = nullptr;
+}
+
+void TimerWheel::tick() {
+  ++now_;
+
+  // A level's slot comes due each time the levels below it wrap around;
+  // its entries are spread over the levels below
+  for (int level = 1; level < kLevels; ++level) {
+    int shift = level * kSlotBits;
+    if ((now_ & ((uint64_t(1) << shift) - 1)) != 0)
+      break;
+    Link pending;
+    take(slots_[(level << kSlotBits) | ((now_ >> shift) & kSlotMask)],
+         pending);
+    while (pending.next != &pending) {
+      Entry &entry = static_cast<Entry &>(*pending.next);
+      unlink(entry);
+      insert(entry);
+    }
+  }
+
+  // Everything in the level 0 slot is due now. A callback may cancel or
+  // reschedule other entries still on the list.
+  Link due;
+  take(slots_[now_ & kSlotMask], due);
+  while (due.next != &due) {
+    Entry &entry = static_cast<Entry &>(*due.next);
+    unlink(entry);
+    entry.wheel_ = nullptr;
+    --size_;
+    entry.onExpiry_();
+  }
+}
+
+void TimerWheel::arm() {
+  if (armed_ || size_ == 0)
+    return;
+
+  armed_ = true;
+  timer_.expires_at(origin_ + kTick * static_cast<Clock::rep>(now_ + 1));
+  timer_.async_wait([this](boost::system::error_code ec) {
+    // Only cancelled by the destructor
+    if (ec)
+      return;
+    uint64_t current = elapsed();
+    while (now_ < current && size_ != 0)
+      tick();
+    armed_ = false;
+    arm();
+  });
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace mitmqtt {
+
+// Timeouts of many connections on one steady_timer.
+//
+// A hierarchical timing wheel: four levels of 64 slots, a slot of level 0
+// spanning one tick and each level above 64 times as long. An entry sits in
+// the lowest level its expiry falls within and moves down as the wheel turns,
+// so scheduling, cancelling and firing are constant time however many
+// entries there are, and about 19 days can be scheduled ahead. Entries are
+// embedded in their owners, nothing is allocated per schedule, and the timer
+// only ticks while something is scheduled.
+//
+// Used only on its executor's thread. Destroy it on that thread or once the
+// executor's context has stopped.
+class TimerWheel {
+public:
+  using Clock = std::chrono::steady_clock;
+  static constexpr Clock::duration kTick = std::chrono::milliseconds(100);
+
+  class Entry;
+
+  explicit TimerWheel(const boost::asio::any_io_executor &executor);
+  ~TimerWheel();
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  // Fire `entry` on the first tick after `delay` has passed, replacing any
+  // earlier schedule. Its callback runs on the wheel's executor.
+  void schedule(Entry &entry, Clock::duration delay);
+  void cancel(Entry &entry);
+
+  // Entries scheduled
+  size_t size() const { return size_; }
+
+private:
+  struct Link {
+    Link *prev = nullptr;
+    Link *next = nullptr;
+  };
+
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 6;
+  static constexpr uint64_t kSlotMask = (uint64_t(1) << kSlotBits) - 1;
+  static constexpr uint64_t kMaxDelta =
+      (uint64_t(1) << (kLevels * kSlotBits)) - 1;
+
+  // Ticks from origin_ to now
+  uint64_t elapsed() const;
+  void insert(Entry &entry);
+  // Move a slot's entries onto `list`, leaving the slot empty
+  static void take(Link &slot, Link &list);
+  static void unlink(Link &link);
+  // Advance now_ by one tick, moving entries down and firing those due
+  void tick();
+  void arm();
+
+  boost::asio::steady_timer timer_;
+  bool armed_;
+  Clock::time_point origin_;
+  uint64_t now_; // Last tick processed
+  size_t size_;
+  std::array<Link, kLevels << kSlotBits> slots_; // List heads
+};
+
+// A timeout embedded in its owner, on at most one wheel at a time.
+// Destroying it cancels it.
+class TimerWheel::Entry : private TimerWheel::Link {
+public:
+  explicit Entry(std::function<void()> onExpiry)
+      : wheel_(nullptr), expiry_(0), onExpiry_(std::move(onExpiry)) {}
+  ~Entry() {
+    if (wheel_)
+      wheel_->cancel(*this);
+  }
+
+  Entry(const Entry &) = delete;
+  Entry &operator=(const Entry &) = delete;
+
+  bool scheduled() const { return wheel_ != nullptr; }
+
+private:
+  friend class TimerWheel;
+
+  TimerWheel *wheel_;
+  uint64_t expiry_; // Tick
+  std::function<void()> onExpiry_;
+};
+
+}
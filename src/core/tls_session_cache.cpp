@@ -0,0 +1,115 @@
+#include "tls_session_cache.hpp"
+#include <openssl/ssl.h>
+
+namespace mitmqtt {
+
+namespace {
+void freeKey(void * /*parent*/, void *ptr, CRYPTO_EX_DATA * /*ad*/,
+             int /*idx*/, long /*argl*/, void * /*argp*/) {
+  delete static_cast<std::string *>(ptr);
+}
+
+// The cache of an SSL_CTX, and the key of an SSL
+int contextIndex() {
+  static const int index =
+      SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+int keyIndex() {
+  static const int index =
+      SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, freeKey);
+  return index;
+}
+}
+
+TLSSessionCache::TLSSessionCache(size_t capacity) : capacity_(capacity) {}
+
+TLSSessionCache::~TLSSessionCache() { clear(); }
+
+void TLSSessionCache::attach(boost::asio::ssl::context &ctx) {
+  SSL_CTX *handle = ctx.native_handle();
+  SSL_CTX_set_ex_data(handle, contextIndex(), this);
+  SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_CLIENT |
+                                             SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(handle, &TLSSessionCache::onNewSession);
+}
+
+void TLSSessionCache::prepare(SSL *ssl, const std::string &key) {
+  SSL_set_ex_data(ssl, keyIndex(), new std::string(key));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it != entries_.end())
+    SSL_set_session(ssl, it->second.session);
+}
+
+int TLSSessionCache::onNewSession(SSL *ssl, SSL_SESSION *session) {
+  auto *cache = static_cast<TLSSessionCache *>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), contextIndex()));
+  auto *key = static_cast<std::string *>(SSL_get_ex_data(ssl, keyIndex()));
+  if (!cache || !key || !SSL_SESSION_is_resumable(session))
+    return 0;
+
+  // Returning 1 keeps the reference OpenSSL passed in
+  cache->store(*key, session);
+  return 1;
+}
+
+void TLSSessionCache::store(const std::string &key, SSL_SESSION *session) {
+  SSL_SESSION *replaced = nullptr;
+  SSL_SESSION *evicted = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      replaced = it->second.session;
+      order_.erase(it->second.order);
+      entries_.erase(it);
+    } else if (capacity_ != 0 && entries_.size() >= capacity_) {
+      auto oldest = entries_.find(order_.front());
+      evicted = oldest->second.session;
+      entries_.erase(oldest);
+      order_.pop_front();
+    }
+    order_.push_back(key);
+    entries_[key] = Entry{session, std::prev(order_.end())};
+  }
+
+  if (replaced)
+    SSL_SESSION_free(replaced);
+  if (evicted)
+    SSL_SESSION_free(evicted);
+}
+
+void TLSSessionCache::remove(const std::string &key) {
+  SSL_SESSION *session = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+      return;
+    session = it->second.session;
+    order_.erase(it->second.order);
+    entries_.erase(it);
+  }
+  SSL_SESSION_free(session);
+}
+
+void TLSSessionCache::clear() {
+  std::unordered_map<std::string, Entry> entries;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries.swap(entries_);
+    order_.clear();
+  }
+  for (auto &entry : entries)
+    SSL_SESSION_free(entry.second.session);
+}
+
+size_t TLSSessionCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+}
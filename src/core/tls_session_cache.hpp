@@ -0,0 +1,58 @@
+#pragma once
+
+#include <boost/asio/ssl.hpp>
+#include <cstddef>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace mitmqtt {
+
+// Client-side TLS session cache for connections to the broker.
+//
+// OpenSSL keeps no client sessions by itself. Once attached to a client
+// context, every session (or TLS 1.3 ticket) the broker hands out is stored
+// under the connection's key, usually host:port, and offered again by the
+// next connection with that key, so a reconnect wave resumes instead of
+// doing full handshakes. Holds at most `capacity` keys, least recently
+// stored go first. Safe to use from any thread.
+class TLSSessionCache {
+public:
+  explicit TLSSessionCache(size_t capacity = 1024);
+  ~TLSSessionCache();
+
+  TLSSessionCache(const TLSSessionCache &) = delete;
+  TLSSessionCache &operator=(const TLSSessionCache &) = delete;
+
+  // Collect new sessions from connections made with `ctx`. The cache must
+  // outlive the context.
+  void attach(boost::asio::ssl::context &ctx);
+
+  // Before the handshake: offer the session cached for `key`, if any, and
+  // file the sessions this connection receives under it
+  void prepare(SSL *ssl, const std::string &key);
+
+  // Drop the session for `key`, e.g. after a failed handshake
+  void remove(const std::string &key);
+  void clear();
+
+  size_t size() const;
+
+private:
+  struct Entry {
+    SSL_SESSION *session;
+    std::list<std::string>::iterator order;
+  };
+
+  static int onNewSession(SSL *ssl, SSL_SESSION *session);
+  void store(const std::string &key, SSL_SESSION *session);
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::list<std::string> order_; // Oldest first
+  size_t capacity_;
+};
+
+}
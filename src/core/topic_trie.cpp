@@ -0,0 +1,235 @@
+#include "topic_trie.hpp"
+
+namespace mitmqtt {
+
+bool topicMatchesFilter(std::string_view filter, std::string_view topic) {
+  if (filter.empty())
+    return false;
+
+  // Wildcards at the first level never match $SYS-style topics
+  if (!topic.empty() && topic[0] == '$' &&
+      (filter[0] == '+' || filter[0] == '#'))
+    return false;
+
+  size_t f = 0;
+  size_t t = 0;
+  bool topicDone = false;
+  for (;;) {
+    size_t fe = filter.find('/', f);
+    bool filterLast = fe == std::string_view::npos;
+    if (filterLast)
+      fe = filter.size();
+    std::string_view level = filter.substr(f, fe - f);
+
+    // '#' also matches the parent level, "a/#" matches "a"
+    if (level == "#")
+      return true;
+    if (topicDone)
+      return false;
+
+    size_t te = topic.find('/', t);
+    bool topicLast = te == std::string_view::npos;
+    if (topicLast)
+      te = topic.size();
+    if (level != "+" && level != topic.substr(t, te - t))
+      return false;
+
+    if (filterLast)
+      return topicLast;
+    f = fe + 1;
+    t = te + 1;
+    topicDone = topicLast;
+  }
+}
+
+bool isValidTopicFilter(std::string_view filter) {
+  if (filter.empty())
+    return false;
+
+  size_t pos = 0;
+  for (;;) {
+    size_t end = filter.find('/', pos);
+    bool last = end == std::string_view::npos;
+    if (last)
+      end = filter.size();
+    std::string_view level = filter.substr(pos, end - pos);
+
+    // Wildcards must fill a whole level, '#' only the last one
+    if (level.size() > 1 && level.find_first_of("+#") != std::string_view::npos)
+      return false;
+    if (level == "#" && !last)
+      return false;
+
+    if (last)
+      return true;
+    pos = end + 1;
+  }
+}
+
+TopicTrie::TopicTrie() : nodes_(1), ruleCount_(0) {}
+
+uint32_t TopicTrie::findLevel(std::string_view level) const {
+  auto it = levelIds_.find(level);
+  return it != levelIds_.end() ? it->second : kNone;
+}
+
+uint32_t TopicTrie::internLevel(std::string_view level) {
+  uint32_t id = findLevel(level);
+  if (id != kNone)
+    return id;
+
+  id = static_cast<uint32_t>(levelStorage_.size());
+  levelStorage_.emplace_back(level);
+  levelIds_.emplace(levelStorage_.back(), id);
+  return id;
+}
+
+uint32_t TopicTrie::child(uint32_t node, uint32_t level) const {
+  auto it = edges_.find((static_cast<uint64_t>(node) << 32) | level);
+  return it != edges_.end() ? it->second : kNone;
+}
+
+uint32_t TopicTrie::walk(std::string_view filter, bool create, bool &hash) {
+  hash = false;
+  uint32_t node = 0;
+  size_t pos = 0;
+  for (;;) {
+    size_t end = filter.find('/', pos);
+    bool last = end == std::string_view::npos;
+    if (last)
+      end = filter.size();
+    std::string_view level = filter.substr(pos, end - pos);
+
+    if (level == "#") {
+      hash = true;
+      return node;
+    }
+
+    uint32_t next;
+    if (level == "+") {
+      next = nodes_[node].plus;
+      if (next == kNone && create) {
+        next = static_cast<uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+        nodes_[node].plus = next;
+      }
+    } else {
+      uint32_t levelId = create ? internLevel(level) : findLevel(level);
+      next = levelId == kNone ? kNone : child(node, levelId);
+      if (next == kNone && create) {
+        next = static_cast<uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+        edges_.emplace((static_cast<uint64_t>(node) << 32) | levelId, next);
+      }
+    }
+
+    if (next == kNone)
+      return kNone;
+    node = next;
+    if (last)
+      return node;
+    pos = end + 1;
+  }
+}
+
+bool TopicTrie::insert(std::string_view filter, uint32_t ruleId) {
+  if (!isValidTopicFilter(filter))
+    return false;
+
+  bool hash;
+  uint32_t node = walk(filter, true, hash);
+  Node &target = nodes_[node];
+  (hash ? target.hashRules : target.rules).push_back(ruleId);
+  ++ruleCount_;
+  return true;
+}
+
+bool TopicTrie::erase(std::string_view filter, uint32_t ruleId) {
+  if (!isValidTopicFilter(filter))
+    return false;
+
+  bool hash;
+  uint32_t node = walk(filter, false, hash);
+  if (node == kNone)
+    return false;
+
+  // Nodes are kept; an empty branch only costs a failed lookup
+  std::vector<uint32_t> &rules =
+      hash ? nodes_[node].hashRules : nodes_[node].rules;
+  for (auto it = rules.begin(); it != rules.end(); ++it) {
+    if (*it == ruleId) {
+      rules.erase(it);
+      --ruleCount_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TopicTrie::clear() {
+  nodes_.assign(1, Node());
+  edges_.clear();
+  levelIds_.clear();
+  levelStorage_.clear();
+  ruleCount_ = 0;
+}
+
+template <typename Fn>
+bool TopicTrie::visit(uint32_t nodeIndex, std::string_view topic, size_t pos,
+                      bool done, Fn &fn) const {
+  const Node &node = nodes_[nodeIndex];
+
+  // Wildcards at the first level never match $SYS-style topics
+  bool wildcards = nodeIndex != 0 || topic.empty() || topic[0] != '$';
+
+  if (wildcards) {
+    for (uint32_t id : node.hashRules) {
+      if (!fn(id))
+        return false;
+    }
+  }
+  if (done) {
+    for (uint32_t id : node.rules) {
+      if (!fn(id))
+        return false;
+    }
+    return true;
+  }
+
+  size_t end = topic.find('/', pos);
+  bool last = end == std::string_view::npos;
+  if (last)
+    end = topic.size();
+
+  uint32_t levelId = findLevel(topic.substr(pos, end - pos));
+  if (levelId != kNone) {
+    uint32_t next = child(nodeIndex, levelId);
+    if (next != kNone && !visit(next, topic, end + 1, last, fn))
+      return false;
+  }
+  if (wildcards && node.plus != kNone &&
+      !visit(node.plus, topic, end + 1, last, fn))
+    return false;
+  return true;
+}
+
+void TopicTrie::match(std::string_view topic,
+                      std::vector<uint32_t> &out) const {
+  auto collect = [&out](uint32_t id) {
+    out.push_back(id);
+    return true;
+  };
+  visit(0, topic, 0, false, collect);
+}
+
+bool TopicTrie::matchesAny(std::string_view topic) const {
+  bool found = false;
+  auto stop = [&found](uint32_t) {
+    found = true;
+    return false;
+  };
+  visit(0, topic, 0, false, stop);
+  return found;
+}
+
+}
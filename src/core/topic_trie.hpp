@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace mitmqtt {
+
+// True if `topic` matches the MQTT topic filter `filter` ('+' matches one
+// level, a trailing '#' any number of levels)
+bool topicMatchesFilter(std::string_view filter, std::string_view topic);
+
+// True if `filter` is a valid MQTT topic filter
+bool isValidTopicFilter(std::string_view filter);
+
+// Matches a topic against many MQTT topic filters at once.
+//
+// Filters are split into levels and stored as a trie whose level strings
+// are interned, so each distinct level is kept once and looking a topic
+// level up never allocates. Matching walks the topic's levels, following
+// the literal child, the '+' child and collecting '#' rules on the way, so
+// its cost depends on the topic depth, not on the number of filters.
+//
+// Build the trie on one thread; once built, match() may be called from any
+// number of threads concurrently.
+class TopicTrie {
+public:
+  TopicTrie();
+
+  // Register `ruleId` for a filter. Returns false for invalid filters.
+  bool insert(std::string_view filter, uint32_t ruleId);
+
+  // Unregister `ruleId` from a filter. Returns false if it was not there.
+  bool erase(std::string_view filter, uint32_t ruleId);
+
+  void clear();
+
+  // Number of (filter, rule) registrations
+  size_t size() const { return ruleCount_; }
+  bool empty() const { return ruleCount_ == 0; }
+
+  // Append the ids of all rules whose filter matches `topic` to `out`. A
+  // rule registered under several matching filters is reported once for
+  // each. Allocation-free as long as `out` has room.
+  void match(std::string_view topic, std::vector<uint32_t> &out) const;
+
+  // True if any filter matches `topic`, stops at the first match
+  bool matchesAny(std::string_view topic) const;
+
+private:
+  static constexpr uint32_t kNone = UINT32_MAX;
+
+  struct Node {
+    uint32_t plus = kNone;           // Child for a '+' level
+    std::vector<uint32_t> rules;     // Filters ending at this node
+    std::vector<uint32_t> hashRules; // Filters ending in '#' below this node
+  };
+
+  // Interned id of a level, kNone if no filter uses it
+  uint32_t findLevel(std::string_view level) const;
+  uint32_t internLevel(std::string_view level);
+
+  uint32_t child(uint32_t node, uint32_t level) const;
+
+  // Node reached by a filter, creating nodes when `create` is set. `hash`
+  // reports whether the filter ends in '#'.
+  uint32_t walk(std::string_view filter, bool create, bool &hash);
+
+  // Visit matching rules from `node` for the levels of `topic` starting at
+  // `pos`; `fn` returns false to stop. Returns false once stopped.
+  template <typename Fn>
+  bool visit(uint32_t node, std::string_view topic, size_t pos, bool done,
+             Fn &fn) const;
+
+  std::vector<Node> nodes_; // nodes_[0] is the root
+
+  // Literal children, keyed by parent node and interned level
+  std::unordered_map<uint64_t, uint32_t> edges_;
+
+  // Level strings live in the deque so the views used as keys stay valid
+  std::deque<std::string> levelStorage_;
+  std::unordered_map<std::string_view, uint32_t> levelIds_;
+
+  size_t ruleCount_;
+};
+
+}
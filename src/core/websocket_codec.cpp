@@ -0,0 +1,375 @@
+#include "websocket_codec.hpp"
+#include <boost/beast/websocket/rfc6455.hpp>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace mitmqtt {
+
+namespace {
+constexpr uint8_t kFin = 0x80;
+constexpr uint8_t kContinuation = 0x0;
+constexpr uint8_t kBinary = 0x2;
+constexpr uint8_t kClose = 0x8;
+constexpr uint8_t kPing = 0x9;
+constexpr uint8_t kPong = 0xA;
+
+constexpr char kAcceptGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+std::string base64(const uint8_t *data, size_t size) {
+  std::string out(4 * ((size + 2) / 3), '\0');
+  int written = EVP_EncodeBlock(reinterpret_cast<unsigned char *>(&out[0]),
+                                data, static_cast<int>(size));
+  out.resize(written > 0 ? static_cast<size_t>(written) : 0);
+  return out;
+}
+
+std::string acceptKey(const std::string &key) {
+  std::string text = key + kAcceptGuid;
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const unsigned char *>(text.data()), text.size(),
+       digest);
+  return base64(digest, sizeof(digest));
+}
+
+// Whether a comma separated header value lists `token`
+bool listsToken(boost::beast::string_view value,
+                boost::beast::string_view token) {
+  for (auto item : boost::beast::http::token_list(value)) {
+    if (boost::beast::iequals(item, token))
+      return true;
+  }
+  return false;
+}
+}
+
+WebSocketCodec::WebSocketCodec(Role role)
+    : role_(role), have_(0), need_(2), inFrame_(false), masked_(false),
+      control_(false), opcode_(0), key_{0, 0, 0, 0}, phase_(0),
+      remaining_(0), inMessage_(false), closed_(false), failed_(false),
+      keyState_(0) {
+  if (role_ == Role::Client &&
+      RAND_bytes(reinterpret_cast<unsigned char *>(&keyState_),
+                 sizeof(keyState_)) != 1)
+    keyState_ = 0;
+  keyState_ |= 1; // xorshift must not start at zero
+}
+
+void WebSocketCodec::applyMask(uint8_t *dst, const uint8_t *src, size_t size,
+                               const uint8_t key[4], size_t phase) {
+  // The key rotated so that src[0] lines up with key[phase]
+  uint8_t rotated[4];
+  for (size_t i = 0; i < 4; ++i)
+    rotated[i] = key[(phase + i) & 3];
+  uint32_t word;
+  std::memcpy(&word, rotated, sizeof(word));
+
+  // Every block is loaded before it is stored, so dst may trail src
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i wide = _mm256_set1_epi32(static_cast<int>(word));
+  for (; i + 32 <= size; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                        _mm256_xor_si256(block, wide));
+  }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+  const __m128i lanes = _mm_set1_epi32(static_cast<int>(word));
+  for (; i + 16 <= size; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_xor_si128(block, lanes));
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t lanes = vreinterpretq_u8_u32(vdupq_n_u32(word));
+  for (; i + 16 <= size; i += 16)
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), lanes));
+#endif
+  const uint64_t doubled = (static_cast<uint64_t>(word) << 32) | word;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t block;
+    std::memcpy(&block, src + i, sizeof(block));
+    block ^= doubled;
+    std::memcpy(dst + i, &block, sizeof(block));
+  }
+  for (; i < size; ++i)
+    dst[i] = src[i] ^ rotated[i & 3];
+}
+
+size_t WebSocketCodec::decode(uint8_t *data, size_t size) {
+  size_t in = 0;
+  size_t out = 0;
+
+  while (in < size && !closed_ && !failed_) {
+    if (!inFrame_) {
+      // Headers are tiny, gather them apart from the payload
+      size_t take = std::min(need_ - have_, size - in);
+      std::memcpy(header_ + have_, data + in, take);
+      have_ += take;
+      in += take;
+      if (have_ < need_)
+        break;
+
+      if (need_ == 2) {
+        uint8_t length = header_[1] & 0x7F;
+        need_ += length == 126 ? 2 : length == 127 ? 8 : 0;
+        need_ += (header_[1] & 0x80) ? 4 : 0;
+        if (have_ < need_)
+          continue;
+      }
+      if (!startFrame()) {
+        failed_ = true;
+        break;
+      }
+      continue;
+    }
+
+    size_t n = static_cast<size_t>(
+        std::min<uint64_t>(remaining_, static_cast<uint64_t>(size - in)));
+    if (control_) {
+      if (masked_)
+        applyMask(data + in, data + in, n, key_, phase_);
+      controlPayload_.insert(controlPayload_.end(), data + in, data + in + n);
+    } else if (masked_) {
+      // Unmask and close the gap left by the headers in one pass
+      applyMask(data + out, data + in, n, key_, phase_);
+      out += n;
+    } else {
+      if (out != in)
+        std::memmove(data + out, data + in, n);
+      out += n;
+    }
+    in += n;
+    remaining_ -= n;
+    phase_ = (phase_ + n) & 3;
+    if (remaining_ == 0)
+      endFrame();
+  }
+  return out;
+}
+
+bool WebSocketCodec::startFrame() {
+  uint8_t first = header_[0];
+  uint8_t second = header_[1];
+  have_ = 0;
+  need_ = 2;
+
+  // No extensions are negotiated, so no reserved bits
+  if (first & 0x70)
+    return false;
+  bool fin = (first & kFin) != 0;
+  opcode_ = first & 0x0F;
+  masked_ = (second & 0x80) != 0;
+  if (masked_ != (role_ == Role::Server))
+    return false;
+
+  size_t pos = 2;
+  uint64_t length = second & 0x7F;
+  if (length == 126) {
+    length = (static_cast<uint64_t>(header_[2]) << 8) | header_[3];
+    pos = 4;
+  } else if (length == 127) {
+    length = 0;
+    for (size_t i = 0; i < 8; ++i)
+      length = (length << 8) | header_[2 + i];
+    if (length >> 63)
+      return false;
+    pos = 10;
+  }
+  if (masked_)
+    std::memcpy(key_, header_ + pos, 4);
+
+  control_ = (opcode_ & 0x8) != 0;
+  if (control_) {
+    if (!fin || length > 125 ||
+        (opcode_ != kClose && opcode_ != kPing && opcode_ != kPong))
+      return false;
+    controlPayload_.clear();
+  } else if (opcode_ == kContinuation) {
+    if (!inMessage_)
+      return false;
+    inMessage_ = !fin;
+  } else if (opcode_ == kBinary) {
+    if (inMessage_)
+      return false;
+    inMessage_ = !fin;
+  } else {
+    // MQTT travels in binary messages only
+    return false;
+  }
+
+  phase_ = 0;
+  remaining_ = length;
+  inFrame_ = true;
+  if (remaining_ == 0)
+    endFrame();
+  return true;
+}
+
+void WebSocketCodec::endFrame() {
+  inFrame_ = false;
+  if (!control_)
+    return;
+
+  if (opcode_ == kPing) {
+    uint8_t header[14];
+    uint8_t key[4];
+    if (role_ == Role::Client)
+      nextKey(key);
+    size_t headerSize = writeHeader(header, kPong, controlPayload_.size(),
+                                    role_ == Role::Client ? key : nullptr);
+    size_t at = pongs_.size();
+    pongs_.insert(pongs_.end(), header, header + headerSize);
+    pongs_.insert(pongs_.end(), controlPayload_.begin(),
+                  controlPayload_.end());
+    if (role_ == Role::Client)
+      applyMask(pongs_.data() + at + headerSize,
+                pongs_.data() + at + headerSize, controlPayload_.size(), key,
+                0);
+  } else if (opcode_ == kClose) {
+    closed_ = true;
+  }
+  controlPayload_.clear();
+}
+
+void WebSocketCodec::nextKey(uint8_t key[4]) {
+  // Masking only keeps intermediaries from reading the stream as HTTP,
+  // xorshift seeded from OpenSSL is unpredictable enough for that
+  keyState_ ^= keyState_ << 13;
+  keyState_ ^= keyState_ >> 7;
+  keyState_ ^= keyState_ << 17;
+  std::memcpy(key, &keyState_, 4);
+}
+
+size_t WebSocketCodec::writeHeader(uint8_t *out, uint8_t opcode, size_t size,
+                                   const uint8_t *key) const {
+  size_t pos = 0;
+  out[pos++] = kFin | opcode;
+  uint8_t maskBit = key ? 0x80 : 0x00;
+  if (size < 126) {
+    out[pos++] = maskBit | static_cast<uint8_t>(size);
+  } else if (size <= 0xFFFF) {
+    out[pos++] = maskBit | 126;
+    out[pos++] = static_cast<uint8_t>(size >> 8);
+    out[pos++] = static_cast<uint8_t>(size);
+  } else {
+    out[pos++] = maskBit | 127;
+    for (int shift = 56; shift >= 0; shift -= 8)
+      out[pos++] = static_cast<uint8_t>(static_cast<uint64_t>(size) >> shift);
+  }
+  if (key) {
+    std::memcpy(out + pos, key, 4);
+    pos += 4;
+  }
+  return pos;
+}
+
+void WebSocketCodec::encode(const uint8_t *data, size_t size,
+                            WriteQueue &queue,
+                            std::shared_ptr<const void> owner) {
+  if (size == 0)
+    return;
+
+  uint8_t header[14];
+  if (role_ == Role::Server) {
+    queue.push(header, writeHeader(header, kBinary, size, nullptr));
+    if (owner)
+      queue.push(data, size, std::move(owner));
+    else
+      queue.push(data, size);
+    return;
+  }
+
+  // Masking needs a copy anyway, make it the queued buffer
+  uint8_t key[4];
+  nextKey(key);
+  size_t headerSize = writeHeader(header, kBinary, size, key);
+  std::vector<uint8_t> frame(headerSize + size);
+  std::memcpy(frame.data(), header, headerSize);
+  applyMask(frame.data() + headerSize, data, size, key, 0);
+  queue.push(std::move(frame));
+}
+
+bool WebSocketCodec::flushControl(WriteQueue &queue) {
+  if (pongs_.empty())
+    return false;
+  queue.push(pongs_.data(), pongs_.size());
+  pongs_.clear();
+  return true;
+}
+
+bool answerWebSocketUpgrade(const WebSocketRequest &request,
+                            WebSocketResponse &response) {
+  namespace http = boost::beast::http;
+  response.version(request.version());
+  response.set(http::field::server, "MITMqtt");
+
+  auto key = request[http::field::sec_websocket_key];
+  if (!boost::beast::websocket::is_upgrade(request) || key.empty() ||
+      request[http::field::sec_websocket_version] != "13") {
+    response.result(http::status::bad_request);
+    response.set(http::field::connection, "close");
+    response.prepare_payload();
+    return false;
+  }
+
+  response.result(http::status::switching_protocols);
+  response.set(http::field::upgrade, "websocket");
+  response.set(http::field::connection, "upgrade");
+  response.set(http::field::sec_websocket_accept,
+               acceptKey(std::string(key.data(), key.size())));
+  if (listsToken(request[http::field::sec_websocket_protocol], "mqtt"))
+    response.set(http::field::sec_websocket_protocol, "mqtt");
+  return true;
+}
+
+void makeWebSocketUpgrade(WebSocketRequest &request, const std::string &host,
+                          const std::string &path, std::string &key) {
+  namespace http = boost::beast::http;
+  uint8_t nonce[16];
+  RAND_bytes(nonce, sizeof(nonce));
+  key = base64(nonce, sizeof(nonce));
+
+  request.method(http::verb::get);
+  request.target(path.empty() ? "/" : path);
+  request.version(11);
+  request.set(http::field::host, host);
+  request.set(http::field::upgrade, "websocket");
+  request.set(http::field::connection, "upgrade");
+  request.set(http::field::sec_websocket_key, key);
+  request.set(http::field::sec_websocket_version, "13");
+  request.set(http::field::sec_websocket_protocol, "mqtt");
+  request.set(http::field::user_agent, "MITMqtt");
+}
+
+bool checkWebSocketUpgrade(const WebSocketResponse &response,
+                           const std::string &key,
+                           boost::system::error_code &ec) {
+  namespace websocket = boost::beast::websocket;
+  if (response.result() != boost::beast::http::status::switching_protocols) {
+    ec = websocket::error::upgrade_declined;
+    return false;
+  }
+  if (response[boost::beast::http::field::sec_websocket_accept] !=
+      acceptKey(key)) {
+    ec = websocket::error::bad_sec_accept;
+    return false;
+  }
+  return true;
+}
+
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "write_queue.hpp"
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/websocket/error.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mitmqtt {
+
+// MQTT over WebSocket (RFC 6455), one side of a connection after the HTTP
+// upgrade.
+//
+// MQTT is a byte stream and WebSocket message boundaries mean nothing to it,
+// so decode() works on the bytes a read just put into an MQTTFramer's
+// buffer: frame headers are dropped and payload is unmasked and moved down
+// over them in the same pass, leaving only MQTT bytes to commit. Outbound,
+// every chunk the connection queues becomes one binary message. Used from
+// its connection's thread only.
+class WebSocketCodec {
+public:
+  enum class Role {
+    Server, // Accepted from a client: inbound masked, outbound not
+    Client  // Towards the broker: outbound masked, inbound not
+  };
+
+  explicit WebSocketCodec(Role role);
+
+  // Decode `size` bytes just read into `data`. Returns how many bytes of
+  // MQTT stream now start at `data`; a frame split across reads carries on
+  // with the next call. Control frames are consumed here.
+  size_t decode(uint8_t *data, size_t size);
+
+  // The peer sent a close frame, or broke the protocol
+  bool closed() const { return closed_; }
+  bool failed() const { return failed_; }
+
+  // Queue `size` bytes of MQTT stream as one binary message. With an
+  // `owner` keeping them alive, unmasked data is queued without a copy.
+  void encode(const uint8_t *data, size_t size, WriteQueue &queue,
+              std::shared_ptr<const void> owner = nullptr);
+
+  // Queue the pongs for pings decode() consumed. Returns false if there
+  // were none.
+  bool flushControl(WriteQueue &queue);
+
+  // XOR `size` bytes of `src` with `key`, starting at byte `phase` of the
+  // key, into `dst`. `dst` may be `src` or lie before it.
+  static void applyMask(uint8_t *dst, const uint8_t *src, size_t size,
+                        const uint8_t key[4], size_t phase);
+
+private:
+  // Check the complete header in header_ and start its frame
+  bool startFrame();
+  void endFrame();
+  void nextKey(uint8_t key[4]);
+  // Header for a frame of `size` bytes, returns its length
+  size_t writeHeader(uint8_t *out, uint8_t opcode, size_t size,
+                     const uint8_t *key) const;
+
+  Role role_;
+
+  // Header being read, need_ grows once its length is known
+  uint8_t header_[14];
+  size_t have_;
+  size_t need_;
+
+  // Frame being read
+  bool inFrame_;
+  bool masked_;
+  bool control_;
+  uint8_t opcode_;
+  uint8_t key_[4];
+  size_t phase_;
+  uint64_t remaining_;
+  std::vector<uint8_t> controlPayload_;
+
+  bool inMessage_; // A fragmented data message expects continuations
+  bool closed_;
+  bool failed_;
+
+  std::vector<uint8_t> pongs_; // Encoded, waiting for flushControl()
+  uint64_t keyState_;          // Masking keys for the Client role
+};
+
+// The HTTP requests and responses of the upgrade
+using WebSocketRequest =
+    boost::beast::http::request<boost::beast::http::empty_body>;
+using WebSocketResponse =
+    boost::beast::http::response<boost::beast::http::empty_body>;
+
+// Answer an upgrade request with 101 Switching Protocols, offering the
+// "mqtt" subprotocol if the client asked for it, or with 400 if it is not a
+// valid upgrade. Returns false in the latter case.
+bool answerWebSocketUpgrade(const WebSocketRequest &request,
+                            WebSocketResponse &response);
+
+// Upgrade request for `path` on `host`, with a fresh key in `key`
+void makeWebSocketUpgrade(WebSocketRequest &request, const std::string &host,
+                          const std::string &path, std::string &key);
+
+// Whether the server accepted the upgrade requested with `key`
+bool checkWebSocketUpgrade(const WebSocketResponse &response,
+                           const std::string &key,
+                           boost::system::error_code &ec);
+
+namespace detail {
+struct WebSocketUpgrade {
+  boost::beast::flat_buffer buffer{8192};
+  WebSocketRequest request;
+  WebSocketResponse response;
+  std::string key;
+};
+}
+
+// Read a client's upgrade request from `stream` and answer it, then
+// `done(ec)`. Clients wait for the answer before sending frames, so nothing
+// is read past the request.
+template <typename Stream, typename Handler>
+void asyncAcceptWebSocket(Stream &stream, Handler &&done) {
+  namespace http = boost::beast::http;
+  auto upgrade = std::make_shared<detail::WebSocketUpgrade>();
+  http::async_read(
+      stream, upgrade->buffer, upgrade->request,
+      [&stream, upgrade, done = std::forward<Handler>(done)](
+          boost::system::error_code ec, size_t) mutable {
+        if (ec) {
+          done(ec);
+          return;
+        }
+        bool accepted = answerWebSocketUpgrade(upgrade->request,
+                                               upgrade->response) &&
+                        upgrade->buffer.size() == 0;
+        http::async_write(
+            stream, upgrade->response,
+            [upgrade, accepted, done = std::move(done)](
+                boost::system::error_code ec, size_t) mutable {
+              if (!ec && !accepted)
+                ec = boost::beast::websocket::error::no_upgrade;
+              done(ec);
+            });
+      });
+}
+
+// Upgrade a connected `stream` to WebSocket at `path` on `host`, then
+// `done(ec)`. MQTT brokers speak only after CONNECT, so nothing is read
+// past the response.
+template <typename Stream, typename Handler>
+void asyncConnectWebSocket(Stream &stream, const std::string &host,
+                           const std::string &path, Handler &&done) {
+  namespace http = boost::beast::http;
+  auto upgrade = std::make_shared<detail::WebSocketUpgrade>();
+  makeWebSocketUpgrade(upgrade->request, host, path, upgrade->key);
+  http::async_write(
+      stream, upgrade->request,
+      [&stream, upgrade, done = std::forward<Handler>(done)](
+          boost::system::error_code ec, size_t) mutable {
+        if (ec) {
+          done(ec);
+          return;
+        }
+        http::async_read(
+            stream, upgrade->buffer, upgrade->response,
+            [upgrade, done = std::move(done)](boost::system::error_code ec,
+                                              size_t) mutable {
+              if (!ec)
+                checkWebSocketUpgrade(upgrade->response, upgrade->key, ec);
+              if (!ec && upgrade->buffer.size() != 0)
+                ec = boost::beast::http::error::unexpected_body;
+              done(ec);
+            });
+      });
+}
+
+}
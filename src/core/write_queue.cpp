@@ -0,0 +1,111 @@
+#include "write_queue.hpp"
+#include <algorithm>
+
+namespace mitmqtt {
+
+WriteQueue::WriteQueue(size_t highWaterMark)
+    : pendingBytes_(0), inflightBytes_(0), highWaterMark_(highWaterMark),
+      peakBytes_(0), batchCount_(0), pendingStamp_(0), inflightStamp_(0),
+      writing_(false), backShared_(false) {}
+
+void WriteQueue::notePush(size_t size) {
+  pendingBytes_ += size;
+  peakBytes_ = std::max(peakBytes_, queuedBytes());
+}
+
+void WriteQueue::push(const uint8_t *data, size_t size) {
+  if (size == 0)
+    return;
+
+  // Append to the current chunk while it stays small
+  if (backShared_ && pending_.back().bytes.size() + size <= kCoalesceLimit) {
+    std::vector<uint8_t> &bytes = pending_.back().bytes;
+    bytes.insert(bytes.end(), data, data + size);
+  } else {
+    Chunk chunk;
+    chunk.bytes.reserve(std::max(size, kCoalesceLimit / 4));
+    chunk.bytes.assign(data, data + size);
+    pending_.push_back(std::move(chunk));
+    backShared_ = size < kCoalesceLimit;
+  }
+
+  notePush(size);
+}
+
+void WriteQueue::push(std::vector<uint8_t> &&data) {
+  if (data.empty())
+    return;
+
+  // Small buffers are cheaper to copy than to give their own iovec
+  if (data.size() < kCoalesceLimit / 4) {
+    push(data.data(), data.size());
+    return;
+  }
+
+  size_t size = data.size();
+  Chunk chunk;
+  chunk.bytes = std::move(data);
+  pending_.push_back(std::move(chunk));
+  backShared_ = false;
+  notePush(size);
+}
+
+void WriteQueue::push(const uint8_t *data, size_t size,
+                      std::shared_ptr<const void> owner) {
+  if (size == 0)
+    return;
+
+  if (size < kCoalesceLimit / 4) {
+    push(data, size);
+    return;
+  }
+
+  Chunk chunk;
+  chunk.owner = std::move(owner);
+  chunk.data = data;
+  chunk.size = size;
+  pending_.push_back(std::move(chunk));
+  backShared_ = false;
+  notePush(size);
+}
+
+const std::vector<boost::asio::const_buffer> &WriteQueue::beginBatch() {
+  gather_.clear();
+
+  while (!pending_.empty()) {
+    inflight_.push_back(std::move(pending_.front()));
+    pending_.pop_front();
+    const Chunk &chunk = inflight_.back();
+    if (chunk.owner)
+      gather_.emplace_back(chunk.data, chunk.size);
+    else
+      gather_.emplace_back(chunk.bytes.data(), chunk.bytes.size());
+  }
+
+  inflightBytes_ = pendingBytes_;
+  pendingBytes_ = 0;
+  inflightStamp_ = pendingStamp_;
+  pendingStamp_ = 0;
+  backShared_ = false;
+  writing_ = true;
+  batchCount_++;
+  return gather_;
+}
+
+void WriteQueue::completeBatch() {
+  inflight_.clear();
+  gather_.clear();
+  inflightBytes_ = 0;
+  inflightStamp_ = 0;
+  writing_ = false;
+}
+
+void WriteQueue::clear() {
+  // An in-flight batch stays alive until its write completes
+  pending_.clear();
+  pendingBytes_ = 0;
+  pendingStamp_ = 0;
+  backShared_ = false;
+}
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace mitmqtt {
+
+// Outbound queue for one direction of a connection.
+//
+// The queue owns every byte it is handed, so callers may pass temporaries,
+// except for shared slices, which it keeps alive by their owner. All
+// data queued while no write is outstanding is flushed with one gather write:
+// beginBatch() moves the pending buffers into the in-flight batch and returns
+// the buffer sequence for async_write, completeBatch() releases it. Small
+// frames are appended into a shared chunk, so a burst of PUBACKs becomes one
+// buffer.
+class WriteQueue {
+public:
+  // Frames up to this size are coalesced into a shared chunk
+  static constexpr size_t kCoalesceLimit = 16 * 1024;
+
+  explicit WriteQueue(size_t highWaterMark = 4 * 1024 * 1024);
+
+  // Queue data for writing (copies into a coalesced chunk)
+  void push(const uint8_t *data, size_t size);
+
+  // Queue an owned buffer without copying it
+  void push(std::vector<uint8_t> &&data);
+
+  // Queue `size` bytes at `data`, which `owner` keeps alive, without copying
+  // them. Small slices are coalesced like copied data.
+  void push(const uint8_t *data, size_t size,
+            std::shared_ptr<const void> owner);
+
+  // Buffer sequence covering everything pending. Only valid while no other
+  // batch is in flight; must be followed by completeBatch().
+  const std::vector<boost::asio::const_buffer> &beginBatch();
+
+  // Release the in-flight batch once its write has completed
+  void completeBatch();
+
+  // Drop pending data. An in-flight batch is kept until completeBatch().
+  void clear();
+
+  bool writing() const { return writing_; }
+  bool hasPending() const { return !pending_.empty(); }
+
+  // Bytes waiting or being written
+  size_t queuedBytes() const { return pendingBytes_ + inflightBytes_; }
+
+  // High-water mark: over this many queued bytes the queue reports itself
+  // as congested
+  size_t highWaterMark() const { return highWaterMark_; }
+  void setHighWaterMark(size_t bytes) { highWaterMark_ = bytes; }
+  bool aboveHighWater() const { return queuedBytes() > highWaterMark_; }
+
+  // Largest queue depth observed, in bytes
+  size_t peakBytes() const { return peakBytes_; }
+
+  // Number of gather writes issued so far
+  uint64_t batchCount() const { return batchCount_; }
+
+  // Latency accounting: remember when the oldest pending data was read
+  // (raw steady_clock ticks). beginBatch() moves the stamp to the batch, so
+  // at completion the batch's stamp tells how long its oldest data waited.
+  void stamp(int64_t readTime) {
+    if (pendingStamp_ == 0)
+      pendingStamp_ = readTime;
+  }
+  int64_t batchStamp() const { return inflightStamp_; }
+
+private:
+  // Owned bytes, or a slice of a buffer shared with others
+  struct Chunk {
+    std::vector<uint8_t> bytes;
+    std::shared_ptr<const void> owner; // Set for a shared slice
+    const uint8_t *data = nullptr;     // of `size` bytes
+    size_t size = 0;
+  };
+
+  void notePush(size_t size);
+
+  std::deque<Chunk> pending_;
+  std::vector<Chunk> inflight_;
+  std::vector<boost::asio::const_buffer> gather_;
+
+  size_t pendingBytes_;
+  size_t inflightBytes_;
+  size_t highWaterMark_;
+  size_t peakBytes_;
+  uint64_t batchCount_;
+  int64_t pendingStamp_;  // 0 when nothing pending was stamped
+  int64_t inflightStamp_;
+  bool writing_;
+  bool backShared_; // pending_.back() is a chunk we may append to
+};
+
+}
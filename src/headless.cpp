@@ -0,0 +1,158 @@
+#include "core/io_context_pool.hpp"
+#include "core/mqtt_handler.hpp"
+#include "core/proxy_config.hpp"
+#include "core/rule_engine.hpp"
+#include "utils/logger.hpp"
+#include <boost/asio/signal_set.hpp>
+#include <chrono>
+#include <csignal>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Runs the proxy without a window: configured from the command line and/or
+// a JSON file, it forwards until SIGINT or SIGTERM.
+
+namespace {
+bool loadRulesInto(mitmqtt::MQTTHandler &handler, const std::string &path) {
+  std::vector<mitmqtt::Rule> rules;
+  std::string error;
+  if (!mitmqtt::loadRules(path, rules, error)) {
+    MITMQTT_LOG_ERROR("Rules: " << error);
+    return false;
+  }
+  MITMQTT_LOG_INFO("Loaded " << rules.size() << " rules from " << path);
+  handler.setRules(std::move(rules));
+  return true;
+}
+}
+
+int main(int argc, char **argv) {
+  mitmqtt::ProxyConfig config;
+  bool help = false;
+  std::string error;
+  if (!mitmqtt::parseProxyArgs(argc, argv, config, help, error)) {
+    std::cerr << error << "\n\n" << mitmqtt::proxyUsage();
+    return 2;
+  }
+  if (help) {
+    std::cout << mitmqtt::proxyUsage();
+    return 0;
+  }
+
+  auto &logger = mitmqtt::utils::Logger::instance();
+  logger.setLevel(config.logLevel);
+  logger.setPacketLogging(config.logPackets);
+
+  int status = 0;
+  mitmqtt::IOContextPool pool(config.threads);
+  std::unique_ptr<mitmqtt::IOContextPool> handshakePool;
+  if (config.tlsEnabled && config.handshakeThreads != 0)
+    handshakePool =
+        std::make_unique<mitmqtt::IOContextPool>(config.handshakeThreads);
+  {
+    mitmqtt::MQTTHandler handler(pool);
+    handler.setBrokerPool(config.brokers, config.brokerBalance);
+    handler.setBrokerHealthCheck(
+        std::chrono::milliseconds(config.brokerHealthCheckMs));
+    handler.setBrokerTLSEnabled(config.brokerTLS);
+    handler.setBrokerWebSocket(config.brokerWebSocket,
+                               config.brokerWebSocketPath);
+    handler.setReplayStoreEnabled(config.replayStore);
+    if (config.replayStore)
+      handler.setReplayStoreBudget(config.replayStoreMB * 1024 * 1024);
+    handler.setZeroCopyEnabled(config.zeroCopy);
+    handler.setHandshakePool(handshakePool.get());
+    handler.setHandshakeLimits(config.maxHandshakes, config.handshakeQueue,
+                               config.handshakeOverflow);
+    handler.setHandshakeTimeout(
+        std::chrono::milliseconds(config.handshakeTimeoutMs));
+    handler.setConnectTimeout(
+        std::chrono::milliseconds(config.connectTimeoutMs));
+    handler.setIdleTimeout(std::chrono::seconds(config.idleTimeoutS));
+    handler.setMaxPacketSize(config.maxPacketSizeKB * 1024);
+    if (!config.rulesFile.empty() &&
+        !loadRulesInto(handler, config.rulesFile)) {
+      logger.flush();
+      return 1;
+    }
+
+    pool.run();
+    MITMQTT_LOG_INFO("I/O threads: " << pool.size());
+    if (handshakePool) {
+      handshakePool->run();
+      MITMQTT_LOG_INFO("TLS handshake threads: " << handshakePool->size());
+    }
+
+    // Signals are waited for on this thread, away from the I/O threads
+    boost::asio::io_context signals;
+    boost::asio::signal_set shutdown(signals, SIGINT, SIGTERM);
+#ifdef SIGHUP
+    boost::asio::signal_set reload(signals, SIGHUP);
+#endif
+
+    try {
+      handler.start(config.listenAddress, config.listenPort);
+      if (config.tlsEnabled) {
+        handler.setTLSCertificate(config.certFile, config.keyFile);
+        if (config.sniCertificates &&
+            !handler.enableSNICertificates(config.sniPrewarm))
+          throw std::runtime_error("cannot mint certificates with " +
+                                   config.certFile);
+        handler.startTLS(config.listenAddress, config.tlsListenPort);
+      }
+      if (config.wsEnabled)
+        handler.startWebSocket(config.listenAddress, config.wsListenPort);
+      if (config.metricsPort != 0)
+        handler.startMetrics(config.listenAddress, config.metricsPort);
+      if (!config.capturePrefix.empty() &&
+          !handler.getCaptureWriter().start(config.capturePrefix))
+        throw std::runtime_error("cannot write capture files at " +
+                                 config.capturePrefix);
+
+      shutdown.async_wait([&](const boost::system::error_code &ec, int sig) {
+        if (ec)
+          return;
+        MITMQTT_LOG_INFO("Signal " << sig << ", shutting down");
+        signals.stop();
+      });
+#ifdef SIGHUP
+      std::function<void()> waitReload = [&]() {
+        reload.async_wait([&](const boost::system::error_code &ec, int) {
+          if (ec)
+            return;
+          if (!config.rulesFile.empty())
+            loadRulesInto(handler, config.rulesFile);
+          waitReload();
+        });
+      };
+      waitReload();
+#endif
+      signals.run();
+    } catch (const std::exception &e) {
+      MITMQTT_LOG_ERROR("Failed to start proxy: " << e.what());
+      status = 1;
+    }
+
+    auto &capture = handler.getCaptureWriter();
+    if (capture.isActive()) {
+      capture.stop();
+      MITMQTT_LOG_INFO("Captured " << capture.packetsCaptured()
+                                   << " packets in " << capture.filesWritten()
+                                   << " files");
+    }
+    handler.stopMetrics();
+    handler.stop();
+    // Handshakes cut short by stop() still finish on both pools, so the
+    // handshake threads run out of work before the I/O threads stop
+    if (handshakePool)
+      handshakePool->join();
+    pool.stop();
+  }
+  logger.flush();
+  return status;
+}
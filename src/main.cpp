@@ -1,33 +1,144 @@
+#include "core/capture_index.hpp"
+#include "core/capture_search.hpp"
 #include "core/mqtt_handler.hpp"
+#include "core/payload_decoder.hpp"
 #include "utils/certificate_manager.hpp"
+#include "utils/logger.hpp"
 #include <GLFW/glfw3.h>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
 
+#include <algorithm>
 #include <chrono>
 #include <ctime>
-#include <fstream>
-#include <iostream>
+#include <deque>
+#include <filesystem>
 #include <memory>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 namespace mitmqtt {
 // Store captured packets for display
 struct PacketInfo {
+  uint64_t row; // Increases by one per captured packet, never reused
+  uint64_t connectionId;
   PacketDirection direction;
   std::string type;
-  std::string payload;
-  std::string timestamp;
+  std::string topic; // PUBLISH only; the payload is in captureStore
+  std::chrono::steady_clock::rep timestamp; // Raw steady_clock ticks
+  uint64_t sequence; // Replay store sequence, 0 if not stored
+
+  // Table text, formatted once when the packet is captured
+  std::string time;
+  std::string summary; // Topic, until the payload cache has the payload
 };
 
-std::vector<PacketInfo> capturedPackets;
-std::mutex packetsMutex; 
+// Only touched by the GUI thread; I/O threads feed it through a CaptureQueue
+std::deque<PacketInfo> capturedPackets;
+uint64_t nextCapturedRow = 1;
+size_t capturedBytes = 0; // historyBytes() of capturedPackets
+
+// Memory one row of the history takes, roughly: the row, the heap part of
+// its strings and its entries in captureIndex
+size_t historyBytes(const PacketInfo &info) {
+  static const size_t inlineCapacity = std::string().capacity();
+  auto heap = [](const std::string &text) {
+    return text.capacity() > inlineCapacity ? text.capacity() + 1 : 0;
+  };
+  constexpr size_t kIndexBytes = 64;
+  return sizeof(PacketInfo) + kIndexBytes + heap(info.type) +
+         heap(info.topic) + heap(info.time) + heap(info.summary);
+}
+
+// Filter indexes over capturedPackets, keyed by PacketInfo::row
+CaptureIndex captureIndex;
+
+// PUBLISH payloads of capturedPackets by row, searched off the GUI thread
+CaptureStore captureStore;
+
+// Rows are consecutive, so a row id maps straight to its position
+const PacketInfo *findCapturedPacket(uint64_t row) {
+  if (capturedPackets.empty() || row < capturedPackets.front().row)
+    return nullptr;
+  uint64_t index = row - capturedPackets.front().row;
+  if (index >= capturedPackets.size())
+    return nullptr;
+  return &capturedPackets[index];
+}
+
+// Format a raw steady_clock timestamp as local wall-clock time. GUI thread
+// only.
+std::string formatTimestamp(std::chrono::steady_clock::rep ticks) {
+  using namespace std::chrono;
+  static const auto steadyStart = steady_clock::now();
+  static const auto systemStart = system_clock::now();
+
+  auto sinceStart =
+      steady_clock::duration(ticks) - steadyStart.time_since_epoch();
+  auto wallClock =
+      systemStart + duration_cast<system_clock::duration>(sinceStart);
+  std::time_t time = system_clock::to_time_t(wallClock);
+  auto millis =
+      duration_cast<milliseconds>(wallClock.time_since_epoch()).count() % 1000;
+
+  // Packets arrive in bursts, so the date part rarely changes between calls
+  static std::time_t cachedTime = -1;
+  static char buffer[32];
+  if (time != cachedTime) {
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S",
+                  std::localtime(&time));
+    cachedTime = time;
+  }
+  char result[40];
+  std::snprintf(result, sizeof(result), "%s.%03d", buffer,
+                static_cast<int>(millis));
+  return result;
+}
+
+// Nanoseconds with a unit that keeps three significant digits
+std::string formatDuration(uint64_t nanos) {
+  char text[32];
+  if (nanos < 1000)
+    std::snprintf(text, sizeof(text), "%llu ns",
+                  static_cast<unsigned long long>(nanos));
+  else if (nanos < 1000000)
+    std::snprintf(text, sizeof(text), "%.1f us", nanos / 1e3);
+  else if (nanos < 1000000000)
+    std::snprintf(text, sizeof(text), "%.1f ms", nanos / 1e6);
+  else
+    std::snprintf(text, sizeof(text), "%.2f s", nanos / 1e9);
+  return text;
+}
 } 
 
+// InputTextMultiline on a std::string, which grows as the text does
+int resizeInputText(ImGuiInputTextCallbackData *data) {
+  if (data->EventFlag == ImGuiInputTextFlags_CallbackResize) {
+    auto *text = static_cast<std::string *>(data->UserData);
+    text->resize(data->BufTextLen);
+    data->Buf = &(*text)[0];
+  }
+  return 0;
+}
+
+bool inputTextMultiline(const char *label, std::string &text,
+                        const ImVec2 &size) {
+  return ImGui::InputTextMultiline(label, &text[0], text.capacity() + 1, size,
+                                   ImGuiInputTextFlags_CallbackResize,
+                                   resizeInputText, &text);
+}
+
+bool inputText(const char *label, std::string &text) {
+  return ImGui::InputText(label, &text[0], text.capacity() + 1,
+                          ImGuiInputTextFlags_CallbackResize, resizeInputText,
+                          &text);
+}
+
 // Custom deleter for GLFW window
 struct GLFWwindowDeleter {
   void operator()(GLFWwindow *window) {
@@ -40,9 +151,14 @@ struct GLFWwindowDeleter {
 class Application {
 public:
   Application()
-      : ioc_(), mqtt_handler_(ioc_),
-        work_guard_(boost::asio::make_work_guard(ioc_)),
+      : io_pool_(), mqtt_handler_(io_pool_),
+        capture_queue_(std::make_shared<mitmqtt::CaptureQueue>(65536)),
+        decode_pool_(2), payload_cache_(decode_pool_), search_pool_(),
+        search_(mitmqtt::captureStore, search_pool_),
         interceptEnabled_(false) {
+    std::error_code ec;
+    spillDirectory_ = std::filesystem::temp_directory_path(ec).string();
+    setHistoryBudget(kDefaultHistoryMB);
 
     // Initialize GLFW
     initializeGLFW();
@@ -53,54 +169,34 @@ public:
     // Initialize ImGui
     initializeImGui();
 
-    // Set packet callback
-    mqtt_handler_.setPacketCallback([this](mitmqtt::PacketDirection direction,
-                                           const std::string &type,
-                                           const std::string &payload) {
-      // Get current timestamp
-      auto now = std::chrono::system_clock::now();
-      auto time = std::chrono::system_clock::to_time_t(now);
-      std::string timestamp = std::ctime(&time);
-      if (!timestamp.empty() && timestamp.back() == '\n') {
-        timestamp.pop_back();
-      }
-
-      // Thread-safe packet addition
-      {
-        std::lock_guard<std::mutex> lock(mitmqtt::packetsMutex);
-        mitmqtt::PacketInfo info{direction, type, payload, timestamp};
-        mitmqtt::capturedPackets.push_back(info);
-
-        // Limit packet history
-        if (mitmqtt::capturedPackets.size() > 1000) {
-          mitmqtt::capturedPackets.erase(mitmqtt::capturedPackets.begin());
-        }
-      }
-    });
-
-    // Start IO context in separate thread
-    io_thread_ = std::thread([this]() {
-      try {
-        ioc_.run();
-      } catch (const std::exception &e) {
-        std::cerr << "IO context error: " << e.what() << std::endl;
-      }
-    });
+    // Captured packets reach the GUI through a lock-free queue that is
+    // drained once per frame
+    mitmqtt::formatTimestamp(0); // Pin the steady/system clock reference
+    mqtt_handler_.setCaptureQueue(capture_queue_);
+
+    // Start one I/O thread per core
+    io_pool_.run();
+    MITMQTT_LOG_INFO("I/O threads: " << io_pool_.size());
+
+    // Payloads are decoded for display, searched and spilled off the GUI
+    // thread
+    decode_pool_.run();
+    search_pool_.run();
+    search_.setIndexedSegments(kIndexedSegments);
+    mitmqtt::captureStore.setSpillExecutor(
+        search_pool_.getIOContext().get_executor());
   }
 
   ~Application() {
+    decode_pool_.stop();
+    search_pool_.stop();
+    mitmqtt::captureStore.setSpillExecutor(boost::asio::any_io_executor());
+
     // Stop MQTT handler
     mqtt_handler_.stop();
 
-    // Stop IO context
-    work_guard_.reset();
-    if (!ioc_.stopped()) {
-      ioc_.stop();
-    }
-
-    if (io_thread_.joinable()) {
-      io_thread_.join();
-    }
+    // Stop I/O threads
+    io_pool_.stop();
 
     // Cleanup ImGui
     ImGui_ImplOpenGL3_Shutdown();
@@ -116,6 +212,10 @@ public:
       // Poll events
       glfwPollEvents();
 
+      // Pick up packets captured since the last frame
+      drainCaptureQueue();
+      collectSearchResults();
+
       // Start ImGui frame
       ImGui_ImplOpenGL3_NewFrame();
       ImGui_ImplGlfw_NewFrame();
@@ -138,6 +238,310 @@ public:
   }
 
 private:
+  void drainCaptureQueue() {
+    std::vector<std::pair<uint64_t, std::string>> newPayloads;
+    capture_queue_->drain([&](mitmqtt::CaptureRecord &&record) {
+      addCapturedPacket(std::move(record), newPayloads);
+    });
+    if (!newPayloads.empty()) {
+      search_.searchNew(std::move(newPayloads));
+    }
+    trimHistory();
+
+    // Client ids outlive their rows until their connections close
+    double now = ImGui::GetTime();
+    if (now - clientSweepTime_ >= 1.0) {
+      const auto &connections = mqtt_handler_.getConnections();
+      mitmqtt::captureIndex.forgetClosedClients(
+          [&](uint64_t id) { return connections.contains(id); });
+      clientSweepTime_ = now;
+    }
+  }
+
+  // Append a packet to the history as the next row. PUBLISH payloads go to
+  // `newPayloads` while a search runs, for the search threads to match.
+  void addCapturedPacket(
+      mitmqtt::CaptureRecord &&record,
+      std::vector<std::pair<uint64_t, std::string>> &newPayloads) {
+    mitmqtt::PacketInfo info;
+    info.row = mitmqtt::nextCapturedRow++;
+    info.connectionId = record.connectionId;
+    info.direction = record.direction;
+    info.type = mitmqtt::packetTypeToString(record.type());
+    if (info.type == "OTHER") {
+      info.type += " (" + std::to_string(record.type()) + ")";
+    }
+    if (record.type() == 3) {
+      info.topic = record.topic;
+      info.summary = "Topic: " + info.topic;
+      mitmqtt::captureStore.add(info.row, record.payload);
+    }
+    info.timestamp = record.timestamp;
+    info.sequence = record.sequence;
+    info.time = mitmqtt::formatTimestamp(record.timestamp);
+    if (info.summary.length() > 100) {
+      info.summary = info.summary.substr(0, 97) + "...";
+    }
+
+    // Index the packet and extend the current filter result with it
+    if (!record.clientId.empty()) {
+      mitmqtt::captureIndex.setClientId(record.connectionId,
+                                        record.clientId);
+    }
+    mitmqtt::captureIndex.add(info.row, record.type(), record.direction,
+                              record.connectionId, record.topic);
+    if (filterActive_ &&
+        mitmqtt::captureIndex.matches(packetFilter_, info.row)) {
+      filteredRows_.push_back(info.row);
+    }
+    // The running search only covers packets stored before it started;
+    // later ones are matched on the search threads too
+    if (searchActive_ && record.type() == 3) {
+      newPayloads.emplace_back(info.row, std::move(record.payload));
+    }
+    mitmqtt::capturedBytes += mitmqtt::historyBytes(info);
+    mitmqtt::capturedPackets.push_back(std::move(info));
+  }
+
+  void trimHistory() {
+    // Keep the rows within their budget, and drop those whose payloads the
+    // store had to drop
+    uint64_t droppedBefore = mitmqtt::captureStore.droppedBefore();
+    while (!mitmqtt::capturedPackets.empty() &&
+           (mitmqtt::capturedBytes > rowBudget_ ||
+            mitmqtt::capturedPackets.front().row < droppedBefore)) {
+      mitmqtt::capturedBytes -=
+          mitmqtt::historyBytes(mitmqtt::capturedPackets.front());
+      mitmqtt::capturedPackets.pop_front();
+    }
+    if (!mitmqtt::capturedPackets.empty()) {
+      uint64_t firstRow = mitmqtt::capturedPackets.front().row;
+      mitmqtt::captureIndex.evictBefore(firstRow);
+      mitmqtt::captureStore.evictBefore(firstRow);
+      while (!filteredRows_.empty() && filteredRows_.front() < firstRow) {
+        filteredRows_.pop_front();
+      }
+      while (!searchRows_.empty() && searchRows_.front() < firstRow) {
+        searchRows_.pop_front();
+      }
+    }
+  }
+
+  // Append the packets of a capture file to the history, as if they had
+  // just been captured. The file is mapped rather than read, so only the
+  // packets themselves are paged in. False if it is not a capture file.
+  bool loadCaptureFile(const std::string &path) {
+    mitmqtt::CaptureReader reader;
+    if (!reader.open(path))
+      return false;
+
+    // The file has wall-clock times, the history steady_clock ticks
+    using namespace std::chrono;
+    auto offset =
+        steady_clock::now().time_since_epoch() -
+        duration_cast<steady_clock::duration>(
+            system_clock::now().time_since_epoch());
+    // PUBLISH is decoded with the MQTT version of its connection's CONNECT
+    std::unordered_map<uint64_t, uint8_t> protocolLevels;
+    std::vector<std::pair<uint64_t, std::string>> newPayloads;
+    for (size_t i = 0; i < reader.size(); ++i) {
+      mitmqtt::CaptureReader::Packet packet = reader.packet(i);
+      if (packet.size == 0)
+        continue;
+
+      mitmqtt::FrameView frame{packet.data, packet.size};
+      mitmqtt::CaptureRecord record;
+      record.timestamp = (duration_cast<steady_clock::duration>(
+                              nanoseconds(packet.timestampNs)) +
+                          offset)
+                             .count();
+      record.connectionId = packet.connectionId;
+      record.size = static_cast<uint32_t>(packet.size);
+      record.header = frame.firstByte();
+      record.direction = packet.direction;
+      mitmqtt::PacketView view;
+      if (frame.typeNibble() == 1 && mitmqtt::decodePacket(frame, 0, view)) {
+        protocolLevels[packet.connectionId] = view.protocolLevel;
+        record.clientId = std::string(view.clientId);
+      } else if (frame.typeNibble() == 3) {
+        auto level = protocolLevels.find(packet.connectionId);
+        if (mitmqtt::decodePacket(
+                frame, level != protocolLevels.end() ? level->second : 4,
+                view)) {
+          record.topic = std::string(view.topic);
+          record.payload = std::string(view.payload);
+        }
+      }
+      addCapturedPacket(std::move(record), newPayloads);
+
+      // Stay within the history budget however large the file is
+      if (i % 65536 == 65535)
+        trimHistory();
+    }
+    if (!newPayloads.empty()) {
+      search_.searchNew(std::move(newPayloads));
+    }
+    trimHistory();
+    MITMQTT_LOG_INFO("Loaded " << reader.size() << " packets from " << path);
+    return true;
+  }
+
+  // A third of the history's memory holds payloads, the rest table rows.
+  // Older payloads spill to disk and are mapped back in when viewed or
+  // searched.
+  void setHistoryBudget(int megabytes) {
+    historyMB_ = megabytes;
+    size_t bytes = static_cast<size_t>(megabytes) * 1024 * 1024;
+    mitmqtt::captureStore.setBudget(bytes / 3, kHistoryDiskBytes,
+                                    spillDirectory_);
+    rowBudget_ = bytes - bytes / 3;
+  }
+
+  // Merge the rows the search threads found since the last frame, keeping
+  // those that pass the packet filter
+  void collectSearchResults() {
+    if (!searchActive_)
+      return;
+    std::vector<uint64_t> rows;
+    search_.take(rows);
+    if (rows.empty())
+      return;
+
+    uint64_t firstRow = mitmqtt::capturedPackets.empty()
+                            ? UINT64_MAX
+                            : mitmqtt::capturedPackets.front().row;
+    rows.erase(std::remove_if(rows.begin(), rows.end(),
+                              [&](uint64_t row) {
+                                return row < firstRow ||
+                                       (filterActive_ &&
+                                        !mitmqtt::captureIndex.matches(
+                                            packetFilter_, row));
+                              }),
+               rows.end());
+    std::sort(rows.begin(), rows.end());
+    size_t middle = searchRows_.size();
+    searchRows_.insert(searchRows_.end(), rows.begin(), rows.end());
+    std::inplace_merge(searchRows_.begin(), searchRows_.begin() + middle,
+                       searchRows_.end());
+  }
+
+  // Search payloads for searchQuery_, or stop searching if it is empty
+  void startSearch() {
+    searchRows_.clear();
+    searchError_.clear();
+    searchActive_ = !searchQuery_.text.empty();
+    try {
+      search_.start(searchQuery_);
+    } catch (const std::regex_error &) {
+      search_.cancel();
+      searchActive_ = false;
+      searchError_ = "Invalid regular expression";
+    }
+  }
+
+  // Answer a new filter from the indexes; later packets are matched one by
+  // one as they are drained
+  void applyPacketFilter(const mitmqtt::CaptureIndex::Filter &filter) {
+    packetFilter_ = filter;
+    filterActive_ = !filter.empty();
+    filteredRows_.clear();
+    if (filterActive_) {
+      std::vector<uint64_t> rows = mitmqtt::captureIndex.query(filter);
+      filteredRows_.assign(rows.begin(), rows.end());
+    }
+    if (searchActive_) {
+      startSearch();
+    }
+  }
+
+  void renderPacketFilterBar() {
+    static int filterType = 0;      // Packet type, 0 for any
+    static int filterDirection = 0; // 0 any, 1 to broker, 2 to client
+    static char filterClient[128] = "";
+    static char filterTopic[256] = "";
+
+    static const char *typeItems[16] = {"Any type"};
+    if (typeItems[1] == nullptr) {
+      for (int type = 1; type < 16; type++) {
+        typeItems[type] = mitmqtt::packetTypeToString(type);
+      }
+    }
+    static const char *directionItems[] = {"Any direction", "Client -> Broker",
+                                           "Broker -> Client"};
+
+    bool changed = false;
+    ImGui::SetNextItemWidth(120.0f);
+    changed |= ImGui::Combo("##type", &filterType, typeItems, 16);
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(140.0f);
+    changed |= ImGui::Combo("##direction", &filterDirection, directionItems, 3);
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(150.0f);
+    changed |= ImGui::InputTextWithHint("##client", "Client id", filterClient,
+                                        sizeof(filterClient));
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(220.0f);
+    changed |= ImGui::InputTextWithHint("##topic", "Topic, e.g. plant/+/temp",
+                                        filterTopic, sizeof(filterTopic));
+
+    if (changed) {
+      mitmqtt::CaptureIndex::Filter filter;
+      if (filterType > 0) {
+        filter.type = static_cast<uint8_t>(filterType);
+      }
+      if (filterDirection == 1) {
+        filter.direction = mitmqtt::PacketDirection::ClientToBroker;
+      } else if (filterDirection == 2) {
+        filter.direction = mitmqtt::PacketDirection::BrokerToClient;
+      }
+      filter.clientId = filterClient;
+      filter.topicFilter = filterTopic;
+      applyPacketFilter(filter);
+    }
+
+    // Full-text search over the payloads
+    static char searchText[256] = "";
+    static bool searchIndex = true;
+    bool searchChanged = false;
+    ImGui::SetNextItemWidth(300.0f);
+    searchChanged |= ImGui::InputTextWithHint(
+        "##search", "Search payloads", searchText, sizeof(searchText));
+    ImGui::SameLine();
+    searchChanged |= ImGui::Checkbox("Regex", &searchQuery_.regex);
+    ImGui::SameLine();
+    bool matchCase = !searchQuery_.ignoreCase;
+    if (ImGui::Checkbox("Match case", &matchCase)) {
+      searchQuery_.ignoreCase = !matchCase;
+      searchChanged = true;
+    }
+    ImGui::SameLine();
+    if (ImGui::Checkbox("Index", &searchIndex)) {
+      search_.setIndexedSegments(searchIndex ? kIndexedSegments : 0);
+    }
+    if (ImGui::IsItemHovered()) {
+      size_t indexedBytes =
+          kIndexedSegments * mitmqtt::CaptureStore::kDefaultSegmentBytes;
+      ImGui::SetTooltip("Keep a trigram index of the newest %d MB of "
+                        "payloads, for repeated searches",
+                        static_cast<int>(indexedBytes >> 20));
+    }
+    if (search_.running()) {
+      ImGui::SameLine();
+      ImGui::Text("Searching... %zu of %zu segments",
+                  search_.segmentsSearched(), search_.segmentsTotal());
+    }
+    if (!searchError_.empty()) {
+      ImGui::SameLine();
+      ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "%s",
+                         searchError_.c_str());
+    }
+
+    if (searchChanged) {
+      searchQuery_.text = searchText;
+      startSearch();
+    }
+  }
+
   void initializeGLFW() {
     if (!glfwInit()) {
       throw std::runtime_error("Failed to initialize GLFW");
@@ -186,53 +590,476 @@ private:
     ImGui_ImplOpenGL3_Init(glsl_version_);
   }
 
+  // Match-and-rewrite rules loaded from a JSON file, with their hit counts
+  void renderRulesWindow(bool *open) {
+    ImGui::SetNextWindowSize(ImVec2(600, 300), ImGuiCond_FirstUseEver);
+    ImGui::Begin("Rules", open);
+
+    static char rulesPath[256] = "mitmqtt_rules.json";
+    static std::string rulesStatus = "No rules loaded";
+    ImGui::InputText("Rules File", rulesPath, sizeof(rulesPath));
+    if (ImGui::Button("Load")) {
+      std::vector<mitmqtt::Rule> rules;
+      std::string error;
+      if (mitmqtt::loadRules(rulesPath, rules, error)) {
+        rulesStatus = "Loaded " + std::to_string(rules.size()) + " rule(s)";
+        mqtt_handler_.setRules(std::move(rules));
+      } else {
+        rulesStatus = "Failed to load rules: " + error;
+      }
+      MITMQTT_LOG_INFO(rulesStatus);
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Clear")) {
+      mqtt_handler_.setRules({});
+      rulesStatus = "No rules loaded";
+    }
+    ImGui::SameLine();
+    ImGui::TextUnformatted(rulesStatus.c_str());
+
+    auto engine = mqtt_handler_.getRules();
+    if (engine && ImGui::BeginTable("RuleTable", 4,
+                                    ImGuiTableFlags_Borders |
+                                        ImGuiTableFlags_RowBg |
+                                        ImGuiTableFlags_ScrollY)) {
+      ImGui::TableSetupColumn("Name");
+      ImGui::TableSetupColumn("Match");
+      ImGui::TableSetupColumn("Action");
+      ImGui::TableSetupColumn("Hits");
+      ImGui::TableHeadersRow();
+
+      const auto &rules = engine->rules();
+      for (size_t i = 0; i < rules.size(); ++i) {
+        const mitmqtt::Rule &rule = rules[i];
+        std::string match;
+        if (rule.direction) {
+          match += mitmqtt::directionToString(*rule.direction);
+          match += " ";
+        }
+        if (rule.type) {
+          match += mitmqtt::packetTypeToString(*rule.type);
+          match += " ";
+        }
+        if (!rule.topicFilter.empty())
+          match += rule.topicFilter + " ";
+        if (!rule.clientId.empty())
+          match += "client=" + rule.clientId + " ";
+        if (!rule.payloadContains.empty())
+          match += "payload~" + rule.payloadContains;
+
+        const mitmqtt::RuleAction &action = rule.action;
+        std::string effect;
+        if (action.drop) {
+          effect = "drop";
+        } else {
+          if (action.delay.count() > 0)
+            effect = "delay " + std::to_string(action.delay.count()) + "ms ";
+          if (action.rewrites())
+            effect += "rewrite";
+        }
+
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::Text("%s%s", rule.name.c_str(), rule.enabled ? "" : " (off)");
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(match.empty() ? "any" : match.c_str());
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(effect.empty() ? "forward" : effect.c_str());
+        ImGui::TableNextColumn();
+        ImGui::Text("%llu", static_cast<unsigned long long>(engine->hits(i)));
+      }
+      ImGui::EndTable();
+    }
+
+    ImGui::End();
+  }
+
+  // Proxy counters and latency percentiles, refreshed twice a second
+  void renderStatsWindow(bool *open) {
+    ImGui::SetNextWindowSize(ImVec2(560, 520), ImGuiCond_FirstUseEver);
+    ImGui::Begin("Stats", open);
+
+    double now = ImGui::GetTime();
+    if (now - statsTime_ >= 0.5) {
+      mitmqtt::MetricsSnapshot snapshot = mqtt_handler_.snapshotMetrics();
+      double elapsed = now - statsTime_;
+      for (size_t d = 0; d < 2; ++d) {
+        uint64_t previous = stats_.traffic.bytes[d];
+        byteRates_[d] =
+            statsTime_ > 0 && elapsed > 0
+                ? double(snapshot.traffic.bytes[d] - previous) / elapsed
+                : 0;
+      }
+      stats_ = std::move(snapshot);
+      statsTime_ = now;
+    }
+    const mitmqtt::TrafficTotals &traffic = stats_.traffic;
+    const mitmqtt::PacketDirection directions[] = {
+        mitmqtt::PacketDirection::ClientToBroker,
+        mitmqtt::PacketDirection::BrokerToClient};
+
+    ImGui::Text("Connections: %llu open, %llu total",
+                static_cast<unsigned long long>(stats_.connectionsActive),
+                static_cast<unsigned long long>(stats_.connectionsOpened));
+    ImGui::Text("Errors: %llu read, %llu write",
+                static_cast<unsigned long long>(traffic.readErrors),
+                static_cast<unsigned long long>(traffic.writeErrors));
+
+    constexpr double kMB = 1024.0 * 1024.0;
+    ImGui::Text("History: %zu packets, %.1f MB rows, %.1f MB payloads, "
+                "%.1f MB on disk",
+                mitmqtt::capturedPackets.size(), mitmqtt::capturedBytes / kMB,
+                mitmqtt::captureStore.memoryBytes() / kMB,
+                mitmqtt::captureStore.diskBytes() / kMB);
+    int historyMB = historyMB_;
+    ImGui::SetNextItemWidth(120);
+    if (ImGui::InputInt("History memory (MB)", &historyMB, 64, 256,
+                        ImGuiInputTextFlags_EnterReturnsTrue) &&
+        historyMB >= 16)
+      setHistoryBudget(historyMB);
+
+    if (ImGui::BeginTable("Traffic", 5, ImGuiTableFlags_Borders)) {
+      ImGui::TableSetupColumn("Direction");
+      ImGui::TableSetupColumn("Bytes");
+      ImGui::TableSetupColumn("Packets");
+      ImGui::TableSetupColumn("Bytes/s");
+      ImGui::TableSetupColumn("Queued");
+      ImGui::TableHeadersRow();
+      for (size_t d = 0; d < 2; ++d) {
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(mitmqtt::directionToString(directions[d]));
+        ImGui::TableNextColumn();
+        ImGui::Text("%llu", static_cast<unsigned long long>(traffic.bytes[d]));
+        ImGui::TableNextColumn();
+        ImGui::Text("%llu", static_cast<unsigned long long>(
+                                traffic.packetCount(directions[d])));
+        ImGui::TableNextColumn();
+        ImGui::Text("%.0f", byteRates_[d]);
+        ImGui::TableNextColumn();
+        ImGui::Text("%llu",
+                    static_cast<unsigned long long>(traffic.queuedBytes[d]));
+      }
+      ImGui::EndTable();
+    }
+
+    // Read completion to write completion, plus TLS handshakes
+    ImGui::Spacing();
+    ImGui::TextColored(ImVec4(0.4f, 0.8f, 1.0f, 1.0f), "Latency");
+    if (ImGui::BeginTable("Latency", 5, ImGuiTableFlags_Borders)) {
+      ImGui::TableSetupColumn("");
+      ImGui::TableSetupColumn("Count");
+      ImGui::TableSetupColumn("p50");
+      ImGui::TableSetupColumn("p99");
+      ImGui::TableSetupColumn("p999");
+      ImGui::TableHeadersRow();
+      auto row = [](const char *name,
+                    const mitmqtt::LatencyHistogram::Snapshot &histogram) {
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(name);
+        ImGui::TableNextColumn();
+        ImGui::Text("%llu", static_cast<unsigned long long>(histogram.count));
+        for (double q : {0.5, 0.99, 0.999}) {
+          ImGui::TableNextColumn();
+          ImGui::TextUnformatted(
+              mitmqtt::formatDuration(histogram.quantile(q)).c_str());
+        }
+      };
+      row("Client to broker", stats_.proxyLatency[0]);
+      row("Broker to client", stats_.proxyLatency[1]);
+      row("TLS handshake, clients", stats_.clientTLS.durations);
+      row("TLS handshake, broker", stats_.brokerTLS.durations);
+      ImGui::EndTable();
+    }
+    for (const auto *side : {&stats_.clientTLS, &stats_.brokerTLS}) {
+      if (side->durations.count == 0 && side->failures == 0)
+        continue;
+      ImGui::Text("TLS %s: %llu resumed, %llu failed",
+                  side == &stats_.clientTLS ? "clients" : "broker",
+                  static_cast<unsigned long long>(side->resumed),
+                  static_cast<unsigned long long>(side->failures));
+    }
+    if (stats_.handshakesActive > 0 || stats_.handshakesQueued > 0 ||
+        stats_.handshakesRejected > 0) {
+      ImGui::Text("TLS handshakes: %llu running, %llu queued, %llu rejected",
+                  static_cast<unsigned long long>(stats_.handshakesActive),
+                  static_cast<unsigned long long>(stats_.handshakesQueued),
+                  static_cast<unsigned long long>(stats_.handshakesRejected));
+    }
+
+    ImGui::Spacing();
+    ImGui::TextColored(ImVec4(0.4f, 0.8f, 1.0f, 1.0f), "Packets by type");
+    if (ImGui::BeginTable("PacketTypes", 3, ImGuiTableFlags_Borders)) {
+      ImGui::TableSetupColumn("Type");
+      ImGui::TableSetupColumn("Client to broker");
+      ImGui::TableSetupColumn("Broker to client");
+      ImGui::TableHeadersRow();
+      for (uint8_t t = 1; t < 16; ++t) {
+        if (traffic.packets[0][t] == 0 && traffic.packets[1][t] == 0)
+          continue;
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(mitmqtt::packetTypeToString(t));
+        for (size_t d = 0; d < 2; ++d) {
+          ImGui::TableNextColumn();
+          ImGui::Text("%llu",
+                      static_cast<unsigned long long>(traffic.packets[d][t]));
+        }
+      }
+      ImGui::EndTable();
+    }
+
+    // Prometheus scrape endpoint
+    ImGui::Spacing();
+    static int metricsPort = 9464;
+    if (mqtt_handler_.isMetricsRunning()) {
+      ImGui::Text("Serving http://%s:%u/metrics", listenAddress_,
+                  static_cast<unsigned>(mqtt_handler_.getMetricsPort()));
+      ImGui::SameLine();
+      if (ImGui::Button("Stop Endpoint"))
+        mqtt_handler_.stopMetrics();
+    } else {
+      ImGui::SetNextItemWidth(120);
+      ImGui::InputInt("Metrics Port", &metricsPort);
+      ImGui::SameLine();
+      if (ImGui::Button("Start Endpoint")) {
+        try {
+          mqtt_handler_.startMetrics(listenAddress_,
+                                     static_cast<uint16_t>(metricsPort));
+        } catch (const std::exception &e) {
+          MITMQTT_LOG_ERROR("Failed to start metrics endpoint: " << e.what());
+        }
+      }
+    }
+
+    ImGui::End();
+  }
+
+  // Intercept switch and the packets it holds, which can be forwarded,
+  // edited or dropped one by one
+  void renderInterceptQueueWindow(bool *open) {
+    ImGui::SetNextWindowSize(ImVec2(650, 500), ImGuiCond_FirstUseEver);
+    ImGui::Begin("Intercept Queue", open);
+
+    static bool intercept = false;
+    static int direction = 0;
+    static bool publishOnly = true;
+    static char topicFilter[256] = "";
+    static uint64_t selectedId = 0;
+    static std::string editTopic;
+    static std::string editPayload;
+    static bool editAsHex = false;
+
+    // Matching packets are held; other flows keep forwarding
+    bool changed = ImGui::Checkbox("Intercept", &intercept);
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(150);
+    const char *directions[] = {"Both directions", "Client -> Broker",
+                                "Broker -> Client"};
+    changed |= ImGui::Combo("##direction", &direction, directions,
+                            IM_ARRAYSIZE(directions));
+    ImGui::SameLine();
+    changed |= ImGui::Checkbox("PUBLISH only", &publishOnly);
+    // The filter applies once editing is done, not at every keystroke
+    ImGui::SetNextItemWidth(-1);
+    ImGui::InputTextWithHint("##filter", "Topic filter, e.g. device/+/cmd",
+                             topicFilter, sizeof(topicFilter));
+    changed |= ImGui::IsItemDeactivatedAfterEdit();
+    if (changed) {
+      std::vector<mitmqtt::Rule> rules;
+      if (intercept) {
+        mitmqtt::Rule rule;
+        rule.name = "intercept";
+        if (direction == 1)
+          rule.direction = mitmqtt::PacketDirection::ClientToBroker;
+        else if (direction == 2)
+          rule.direction = mitmqtt::PacketDirection::BrokerToClient;
+        if (publishOnly || topicFilter[0] != '\0')
+          rule.type = 3;
+        rule.topicFilter = topicFilter;
+        if (mitmqtt::validateRule(rule).empty())
+          rules.push_back(std::move(rule));
+      }
+      mqtt_handler_.setInterceptRules(std::move(rules));
+    }
+
+    // Re-read the held packets only when they changed
+    uint64_t version = mqtt_handler_.getHeldVersion();
+    if (version != heldVersion_) {
+      heldPackets_ = mqtt_handler_.getHeldPackets();
+      heldVersion_ = version;
+    }
+
+    ImGui::Text("%zu packet(s) held", heldPackets_.size());
+    ImGui::SameLine();
+    if (ImGui::Button("Forward All")) {
+      mqtt_handler_.releaseAllHeld();
+    }
+
+    const mitmqtt::HeldPacket *selected = nullptr;
+    if (ImGui::BeginTable("Held", 4,
+                          ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg |
+                              ImGuiTableFlags_ScrollY,
+                          ImVec2(0, 200))) {
+      ImGui::TableSetupColumn("Conn");
+      ImGui::TableSetupColumn("Direction");
+      ImGui::TableSetupColumn("Type");
+      ImGui::TableSetupColumn("Topic");
+      ImGui::TableHeadersRow();
+
+      for (const auto &held : heldPackets_) {
+        mitmqtt::FrameView frame{held.data.data(), held.data.size()};
+        mitmqtt::PublishView publish;
+        bool isPublish =
+            frame.typeNibble() == 3 &&
+            mitmqtt::decodePublish(frame, held.protocolLevel, publish);
+
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::PushID(static_cast<int>(held.id));
+        std::string conn = std::to_string(held.connectionId);
+        if (ImGui::Selectable(conn.c_str(), selectedId == held.id,
+                              ImGuiSelectableFlags_SpanAllColumns)) {
+          selectedId = held.id;
+          std::string_view payload =
+              isPublish ? publish.payload : std::string_view();
+          auto bytes = reinterpret_cast<const uint8_t *>(payload.data());
+          // Payloads that are not text are edited as hex bytes
+          editTopic = std::string(isPublish ? publish.topic
+                                            : std::string_view());
+          editAsHex = !mitmqtt::isPrintableText(bytes, payload.size());
+          editPayload = editAsHex
+                            ? mitmqtt::toHexBytes(bytes, payload.size())
+                            : std::string(payload);
+        }
+        ImGui::PopID();
+        if (selectedId == held.id)
+          selected = &held;
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(mitmqtt::directionToString(held.direction));
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(mitmqtt::packetTypeToString(frame.typeNibble()));
+        ImGui::TableNextColumn();
+        if (isPublish) {
+          ImGui::TextUnformatted(publish.topic.data(),
+                                 publish.topic.data() + publish.topic.size());
+        }
+      }
+      ImGui::EndTable();
+    }
+
+    if (selected) {
+      ImGui::Separator();
+      mitmqtt::FrameView frame{selected->data.data(), selected->data.size()};
+      mitmqtt::PublishView publish;
+      bool isPublish =
+          frame.typeNibble() == 3 &&
+          mitmqtt::decodePublish(frame, selected->protocolLevel, publish);
+
+      if (isPublish) {
+        inputText("Topic", editTopic);
+        if (ImGui::Checkbox("Edit as hex", &editAsHex)) {
+          if (editAsHex) {
+            editPayload = mitmqtt::toHexBytes(
+                reinterpret_cast<const uint8_t *>(editPayload.data()),
+                editPayload.size());
+          } else if (!mitmqtt::parseHexBytes(editPayload, editPayload)) {
+            editAsHex = true; // Stay in hex until it parses
+          }
+        }
+        inputTextMultiline("##payload", editPayload, ImVec2(-1, 120));
+      } else {
+        ImGui::Text("%zu byte %s packet", selected->data.size(),
+                    mitmqtt::packetTypeToString(frame.typeNibble()));
+      }
+
+      uint64_t id = selected->id;
+      if (ImGui::Button("Forward")) {
+        mqtt_handler_.releaseHeld(id);
+      }
+      if (isPublish) {
+        ImGui::SameLine();
+        if (ImGui::Button("Forward Edited")) {
+          // Re-encoded with the new lengths, properties kept
+          mitmqtt::RuleAction edit;
+          edit.topic = editTopic;
+          std::string payload = editPayload;
+          bool parsed =
+              !editAsHex || mitmqtt::parseHexBytes(editPayload, payload);
+          edit.payload = std::move(payload);
+          std::vector<uint8_t> edited;
+          if (parsed && !edit.topic->empty() &&
+              mitmqtt::encodePublish(publish, edit, edited)) {
+            mqtt_handler_.releaseHeld(id, std::move(edited));
+          }
+        }
+      }
+      ImGui::SameLine();
+      if (ImGui::Button("Drop")) {
+        mqtt_handler_.dropHeld(id);
+      }
+    }
+
+    ImGui::End();
+  }
+
   void renderMainWindow() {
     static bool show_packet_window = true;
     static bool show_intercept_window = true;
+    static bool show_rules_window = false;
+    static bool show_intercept_queue = false;
+    static bool show_stats_window = false;
     static bool show_packet_editor = false;
-    static int selected_packet = -1;
-    static char modified_payload[4096] = "";
+    static uint64_t selected_row = 0; // PacketInfo::row, 0 for none
+    static std::string modified_payload;
+    static bool edit_as_hex = false;
+    static uint64_t edited_row = 0; // Row modified_payload was loaded from
     static bool show_about = false;
     static bool show_export_success = false;
     static int exported_count = 0;
     static std::string export_path = "";
     static float export_popup_timer = 0.0f;
+    static bool show_capture_error = false;
+    static bool show_open_capture = false;
+    static std::string open_capture_path;
+    static bool open_capture_failed = false;
 
     // Menu bar
     if (ImGui::BeginMainMenuBar()) {
       if (ImGui::BeginMenu("File")) {
-        if (ImGui::MenuItem("Export to Log")) {
-          std::lock_guard<std::mutex> lock(mitmqtt::packetsMutex);
-          std::ofstream logFile("mitmqtt_capture.log");
-          if (logFile.is_open()) {
-            logFile << "=" << std::string(70, '=') << "\n";
-            logFile << "MITMqtt Capture Log - Exported at " << __DATE__ << " "
-                    << __TIME__ << "\n";
-            logFile << "Total packets: " << mitmqtt::capturedPackets.size()
-                    << "\n";
-            logFile << "=" << std::string(70, '=') << "\n\n";
-
-            for (size_t i = 0; i < mitmqtt::capturedPackets.size(); i++) {
-              const auto &pkt = mitmqtt::capturedPackets[i];
-              logFile << "[" << i << "] " << pkt.timestamp << "\n";
-              logFile << "    Direction: "
-                      << mitmqtt::directionToString(pkt.direction) << "\n";
-              logFile << "    Type: " << pkt.type << "\n";
-              logFile << "    Payload: " << pkt.payload << "\n";
-              logFile << "\n";
+        // Raw packets stream to rotating pcapng files while capturing
+        auto &captureWriter = mqtt_handler_.getCaptureWriter();
+        if (!captureWriter.isActive()) {
+          if (ImGui::MenuItem("Start Capture to File")) {
+            if (!captureWriter.start("mitmqtt_capture")) {
+              show_capture_error = true;
             }
-            logFile.close();
-            exported_count = static_cast<int>(mitmqtt::capturedPackets.size());
-            export_path = "mitmqtt_capture.log";
-            show_export_success = true;
-            export_popup_timer = 3.0f; // Show for 3 seconds
-            std::cout << "Exported " << mitmqtt::capturedPackets.size()
-                      << " packets to mitmqtt_capture.log" << std::endl;
           }
+        } else if (ImGui::MenuItem("Stop Capture to File")) {
+          captureWriter.stop();
+          exported_count = static_cast<int>(captureWriter.packetsCaptured());
+          export_path = captureWriter.getCurrentFile();
+          show_export_success = true;
+          export_popup_timer = 3.0f; // Show for 3 seconds
+          MITMQTT_LOG_INFO("Captured " << captureWriter.packetsCaptured()
+                           << " packets in " << captureWriter.filesWritten()
+                           << " file(s), last one " << export_path);
+        }
+        if (ImGui::MenuItem("Open Capture...")) {
+          show_open_capture = true;
+          open_capture_failed = false;
         }
         if (ImGui::MenuItem("Clear Packets")) {
-          std::lock_guard<std::mutex> lock(mitmqtt::packetsMutex);
           mitmqtt::capturedPackets.clear();
+          mitmqtt::capturedBytes = 0;
+          mitmqtt::captureIndex.clear();
+          mitmqtt::captureStore.clear();
+          payload_cache_.clear();
+          filteredRows_.clear();
+          if (searchActive_) {
+            startSearch();
+          }
         }
         ImGui::Separator();
         if (ImGui::MenuItem("Exit", "Alt+F4")) {
@@ -243,6 +1070,9 @@ private:
       if (ImGui::BeginMenu("View")) {
         ImGui::MenuItem("Packet Window", nullptr, &show_packet_window);
         ImGui::MenuItem("Intercept Window", nullptr, &show_intercept_window);
+        ImGui::MenuItem("Rules Window", nullptr, &show_rules_window);
+        ImGui::MenuItem("Intercept Queue", nullptr, &show_intercept_queue);
+        ImGui::MenuItem("Stats", nullptr, &show_stats_window);
         ImGui::EndMenu();
       }
       if (ImGui::BeginMenu("Help")) {
@@ -255,6 +1085,45 @@ private:
     }
 
    
+    if (show_capture_error) {
+      ImGui::OpenPopup("Capture Error");
+      show_capture_error = false;
+    }
+    if (ImGui::BeginPopupModal("Capture Error", nullptr,
+                               ImGuiWindowFlags_AlwaysAutoResize)) {
+      ImGui::Text("Failed to create the capture file.");
+      if (ImGui::Button("OK", ImVec2(120, 0))) {
+        ImGui::CloseCurrentPopup();
+      }
+      ImGui::EndPopup();
+    }
+
+    if (show_open_capture) {
+      ImGui::OpenPopup("Open Capture");
+      show_open_capture = false;
+    }
+    if (ImGui::BeginPopupModal("Open Capture", nullptr,
+                               ImGuiWindowFlags_AlwaysAutoResize)) {
+      // Packets are appended to the table, after those already there
+      ImGui::SetNextItemWidth(400);
+      inputText("pcapng file", open_capture_path);
+      if (open_capture_failed) {
+        ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f),
+                           "Not a capture file written by MITMqtt.");
+      }
+      if (ImGui::Button("Open", ImVec2(120, 0))) {
+        open_capture_failed = !loadCaptureFile(open_capture_path);
+        if (!open_capture_failed) {
+          ImGui::CloseCurrentPopup();
+        }
+      }
+      ImGui::SameLine();
+      if (ImGui::Button("Cancel", ImVec2(120, 0))) {
+        ImGui::CloseCurrentPopup();
+      }
+      ImGui::EndPopup();
+    }
+
     if (show_about) {
       ImGui::OpenPopup("About MITMqtt");
       show_about = false;
@@ -278,7 +1147,7 @@ private:
           "Capture MQTT packets (CONNECT, PUBLISH, SUBSCRIBE, etc.)");
       ImGui::BulletText("View packet details and payloads");
       ImGui::BulletText("Modify and replay captured packets");
-      ImGui::BulletText("Export captures to log file");
+      ImGui::BulletText("Capture raw packets to pcapng files");
       ImGui::Spacing();
       ImGui::Separator();
       ImGui::TextColored(ImVec4(0.6f, 0.6f, 0.6f, 1.0f),
@@ -299,8 +1168,8 @@ private:
       ImGui::Begin("##ExportNotification", nullptr,
                    ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoResize |
                        ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoScrollbar);
-      ImGui::TextColored(ImVec4(0.2f, 1.0f, 0.2f, 1.0f), "Export Successful!");
-      ImGui::Text("Exported %d packets to:", exported_count);
+      ImGui::TextColored(ImVec4(0.2f, 1.0f, 0.2f, 1.0f), "Capture Saved!");
+      ImGui::Text("Captured %d packets, last file:", exported_count);
       ImGui::TextColored(ImVec4(0.4f, 0.8f, 1.0f, 1.0f), "%s",
                          export_path.c_str());
       ImGui::End();
@@ -309,6 +1178,13 @@ private:
       }
     }
 
+    if (show_rules_window)
+      renderRulesWindow(&show_rules_window);
+    if (show_intercept_queue)
+      renderInterceptQueueWindow(&show_intercept_queue);
+    if (show_stats_window)
+      renderStatsWindow(&show_stats_window);
+
     // Intercept control window
     if (show_intercept_window) {
       ImGui::SetNextWindowSize(ImVec2(400, 300), ImGuiCond_FirstUseEver);
@@ -332,6 +1208,12 @@ private:
                        IM_ARRAYSIZE(listenAddress_));
       ImGui::InputInt("Listen Port", &listenPort_);
 
+      static bool wsEnabled = false;
+      static int wsListenPort = 8080;
+      ImGui::Checkbox("Accept MQTT over WebSocket", &wsEnabled);
+      if (wsEnabled)
+        ImGui::InputInt("WebSocket Listen Port", &wsListenPort);
+
       ImGui::Spacing();
       ImGui::Separator();
       ImGui::Text("Broker Settings");
@@ -340,6 +1222,14 @@ private:
                        IM_ARRAYSIZE(brokerAddress_));
       ImGui::InputInt("Broker Port", &brokerPort_);
 
+      static bool brokerTLS = false;
+      ImGui::Checkbox("Connect to Broker over TLS", &brokerTLS);
+      static bool brokerWS = false;
+      static char brokerWSPath[128] = "/mqtt";
+      ImGui::Checkbox("Connect to Broker over WebSocket", &brokerWS);
+      if (brokerWS)
+        ImGui::InputText("WebSocket Path", brokerWSPath, sizeof(brokerWSPath));
+
       ImGui::Spacing();
       ImGui::Separator();
       ImGui::TextColored(ImVec4(0.4f, 0.8f, 1.0f, 1.0f), "TLS Settings");
@@ -348,6 +1238,8 @@ private:
       static int tlsListenPort = 8883;
       static char certPath[256] = "mitmqtt_ca.crt";
       static char keyPath[256] = "mitmqtt_ca.key";
+      static bool sniCerts = false;
+      static char sniPrewarm[512] = "";
       static bool certGenerated = false;
       static std::string certStatus = "No certificate generated";
 
@@ -357,6 +1249,11 @@ private:
         ImGui::InputInt("TLS Listen Port", &tlsListenPort);
         ImGui::InputText("Certificate", certPath, sizeof(certPath));
         ImGui::InputText("Private Key", keyPath, sizeof(keyPath));
+        ImGui::Checkbox("Certificate per server name (SNI)", &sniCerts);
+        if (sniCerts) {
+          // Comma-separated, minted when interception starts
+          ImGui::InputText("Prewarm Names", sniPrewarm, sizeof(sniPrewarm));
+        }
       }
 
       // Certificate generation button
@@ -387,6 +1284,13 @@ private:
       ImGui::Spacing();
       ImGui::Separator();
 
+      // Console line per forwarded packet, rate limited by the logger
+      static bool logPackets =
+          mitmqtt::utils::Logger::instance().isPacketLogging();
+      if (ImGui::Checkbox("Log packets to console", &logPackets)) {
+        mitmqtt::utils::Logger::instance().setPacketLogging(logPackets);
+      }
+
       // Start/Stop button
       if (ImGui::Button(interceptEnabled_ ? "Stop Intercepting"
                                           : "Start Intercepting",
@@ -396,40 +1300,58 @@ private:
             // Configure broker
             mqtt_handler_.setBrokerConfig(brokerAddress_,
                                           static_cast<uint16_t>(brokerPort_));
+            mqtt_handler_.setBrokerTLSEnabled(brokerTLS);
+            mqtt_handler_.setBrokerWebSocket(brokerWS, brokerWSPath);
 
             // Start plain MQTT handler
             mqtt_handler_.start(listenAddress_,
                                 static_cast<uint16_t>(listenPort_));
+            if (wsEnabled)
+              mqtt_handler_.startWebSocket(
+                  listenAddress_, static_cast<uint16_t>(wsListenPort));
 
             // Start TLS listener if enabled
             if (tlsEnabled) {
               try {
                 // Load certificate first
                 mqtt_handler_.setTLSCertificate(certPath, keyPath);
+                if (sniCerts) {
+                  std::vector<std::string> names;
+                  std::istringstream list(sniPrewarm);
+                  std::string name;
+                  while (std::getline(list, name, ',')) {
+                    if (!name.empty())
+                      names.push_back(name);
+                  }
+                  if (!mqtt_handler_.enableSNICertificates(names))
+                    MITMQTT_LOG_WARN("Certificate per server name disabled, "
+                                     << certPath << " is not a usable CA");
+                } else {
+                  mqtt_handler_.disableSNICertificates();
+                }
                 // Start TLS listener
                 mqtt_handler_.startTLS(listenAddress_,
                                        static_cast<uint16_t>(tlsListenPort));
-                std::cout << "TLS interception enabled on port "
-                          << tlsListenPort << std::endl;
+                MITMQTT_LOG_INFO("TLS interception enabled on port "
+                                 << tlsListenPort);
               } catch (const std::exception &e) {
-                std::cerr << "TLS setup failed: " << e.what() << std::endl;
+                MITMQTT_LOG_WARN("TLS setup failed: " << e.what());
                 // Continue without TLS
               }
             }
 
             interceptEnabled_ = true;
 
-            std::cout << "Interception started successfully" << std::endl;
+            MITMQTT_LOG_INFO("Interception started successfully");
           } catch (const std::exception &e) {
-            std::cerr << "Failed to start interceptor: " << e.what()
-                      << std::endl;
+            MITMQTT_LOG_ERROR("Failed to start interceptor: " << e.what());
             errorMessage_ = std::string("Failed to start: ") + e.what();
             ImGui::OpenPopup("Error");
           }
         } else {
           mqtt_handler_.stop();
           interceptEnabled_ = false;
-          std::cout << "Interception stopped" << std::endl;
+          MITMQTT_LOG_INFO("Interception stopped");
         }
       }
 
@@ -451,8 +1373,15 @@ private:
       ImGui::SetNextWindowSize(ImVec2(800, 400), ImGuiCond_FirstUseEver);
       ImGui::Begin("MQTT Packets", &show_packet_window);
 
-      // Packet table
-      if (ImGui::BeginTable("Packets", 4,
+      renderPacketFilterBar();
+
+      // Packet table, all packets or the rows matching the filter and the
+      // search
+      const std::deque<uint64_t> *rows =
+          searchActive_ ? &searchRows_
+                        : (filterActive_ ? &filteredRows_ : nullptr);
+      size_t rowCount = rows ? rows->size() : mitmqtt::capturedPackets.size();
+      if (ImGui::BeginTable("Packets", 5,
                             ImGuiTableFlags_Borders | ImGuiTableFlags_ScrollY |
                                 ImGuiTableFlags_RowBg |
                                 ImGuiTableFlags_Resizable)) {
@@ -463,61 +1392,92 @@ private:
                                 120.0f);
         ImGui::TableSetupColumn("Type", ImGuiTableColumnFlags_WidthFixed,
                                 100.0f);
+        ImGui::TableSetupColumn("Client", ImGuiTableColumnFlags_WidthFixed,
+                                120.0f);
         ImGui::TableSetupColumn("Payload", ImGuiTableColumnFlags_WidthStretch);
         ImGui::TableSetupScrollFreeze(0, 1);
         ImGui::TableHeadersRow();
 
-        // Thread-safe packet access
-        std::lock_guard<std::mutex> lock(mitmqtt::packetsMutex);
-
-        for (int i = 0; i < static_cast<int>(mitmqtt::capturedPackets.size());
-             i++) {
-          const auto &packet = mitmqtt::capturedPackets[i];
-          bool is_selected = (i == selected_packet);
-
-          ImGui::TableNextRow();
-          ImGui::TableNextColumn();
-
-          if (ImGui::Selectable(packet.timestamp.c_str(), is_selected,
-                                ImGuiSelectableFlags_SpanAllColumns |
-                                    ImGuiSelectableFlags_AllowItemOverlap)) {
-            selected_packet = i;
-            show_packet_editor = true;
-            strncpy(modified_payload, packet.payload.c_str(),
-                    sizeof(modified_payload) - 1);
-            modified_payload[sizeof(modified_payload) - 1] = '\0';
-          }
-
-          ImGui::TableNextColumn();
-          ImGui::TextUnformatted(mitmqtt::directionToString(packet.direction));
-
-          ImGui::TableNextColumn();
-          ImGui::TextUnformatted(packet.type.c_str());
-
-          ImGui::TableNextColumn();
-          // Truncate long payloads for display
-          std::string displayPayload = packet.payload;
-          if (displayPayload.length() > 100) {
-            displayPayload = displayPayload.substr(0, 97) + "...";
+        // Only the visible rows are submitted
+        ImGuiListClipper clipper;
+        clipper.Begin(static_cast<int>(rowCount));
+        while (clipper.Step()) {
+          for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+            const mitmqtt::PacketInfo *found =
+                rows ? mitmqtt::findCapturedPacket((*rows)[i])
+                     : &mitmqtt::capturedPackets[i];
+            if (!found)
+              continue;
+            const auto &packet = *found;
+            bool is_selected = (packet.row == selected_row);
+
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+
+            ImGui::PushID(i);
+            if (ImGui::Selectable(packet.time.c_str(), is_selected,
+                                  ImGuiSelectableFlags_SpanAllColumns |
+                                      ImGuiSelectableFlags_AllowItemOverlap)) {
+              selected_row = packet.row;
+              show_packet_editor = true;
+            }
+            ImGui::PopID();
+
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(
+                mitmqtt::directionToString(packet.direction));
+
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(packet.type.c_str());
+
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(
+                mitmqtt::captureIndex.getClientId(packet.connectionId)
+                    .c_str());
+
+            // Visible payloads are decoded on the worker pool, the topic
+            // alone shows until they are
+            ImGui::TableNextColumn();
+            std::string_view payload = mitmqtt::captureStore.find(packet.row);
+            auto decoded = payload.empty()
+                               ? nullptr
+                               : payload_cache_.get(packet.row, payload);
+            if (decoded) {
+              ImGui::Text("Topic: %s, %s: %s", packet.topic.c_str(),
+                          mitmqtt::payloadFormatToString(decoded->format),
+                          decoded->summary.c_str());
+            } else {
+              ImGui::TextUnformatted(packet.summary.c_str());
+            }
           }
-          ImGui::TextUnformatted(displayPayload.c_str());
         }
 
         ImGui::EndTable();
       }
 
-      ImGui::Text("Total packets: %d",
-                  static_cast<int>(mitmqtt::capturedPackets.size()));
+      if (rows) {
+        ImGui::Text("Showing %d of %d packets", static_cast<int>(rowCount),
+                    static_cast<int>(mitmqtt::capturedPackets.size()));
+      } else {
+        ImGui::Text("Total packets: %d",
+                    static_cast<int>(mitmqtt::capturedPackets.size()));
+      }
+      if (capture_queue_->dropped() > 0) {
+        ImGui::SameLine();
+        ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.2f, 1.0f),
+                           "(%llu dropped while the GUI was busy)",
+                           static_cast<unsigned long long>(
+                               capture_queue_->dropped()));
+      }
 
       ImGui::End();
     }
 
     // Packet editor window
-    if (show_packet_editor && selected_packet >= 0) {
-      std::lock_guard<std::mutex> lock(mitmqtt::packetsMutex);
-
-      if (selected_packet < static_cast<int>(mitmqtt::capturedPackets.size())) {
-        const auto &packet = mitmqtt::capturedPackets[selected_packet];
+    if (show_packet_editor && selected_row != 0) {
+      // The selected packet may have aged out of the history
+      if (const auto *selected = mitmqtt::findCapturedPacket(selected_row)) {
+        const auto &packet = *selected;
         std::string title = "Packet Editor - " + packet.type;
 
         // Static variables for injection
@@ -530,17 +1490,89 @@ private:
         // Packet info section
         ImGui::TextColored(ImVec4(0.4f, 0.8f, 1.0f, 1.0f),
                            "Original Packet Info");
-        ImGui::Text("Time: %s", packet.timestamp.c_str());
+        ImGui::Text("Time: %s", packet.time.c_str());
         ImGui::Text("Direction: %s",
                     mitmqtt::directionToString(packet.direction));
         ImGui::Text("Type: %s", packet.type.c_str());
         ImGui::Separator();
 
-        // Payload section
-        ImGui::TextColored(ImVec4(0.4f, 0.8f, 1.0f, 1.0f),
-                           "Payload (editable)");
-        ImGui::InputTextMultiline("##payload", modified_payload,
-                                  sizeof(modified_payload), ImVec2(-1, 150));
+        // Payload section, views rendered by the payload cache
+        ImGui::TextColored(ImVec4(0.4f, 0.8f, 1.0f, 1.0f), "Payload");
+        std::string_view captured = mitmqtt::captureStore.find(packet.row);
+        auto decoded = payload_cache_.get(packet.row, captured);
+        if (!decoded) {
+          ImGui::SameLine();
+          ImGui::TextDisabled("decoding...");
+        } else {
+          if (edited_row != packet.row) {
+            // Formats that are not text are edited as hex bytes
+            edit_as_hex = decoded->format != mitmqtt::PayloadFormat::Empty &&
+                          decoded->format != mitmqtt::PayloadFormat::Text &&
+                          decoded->format != mitmqtt::PayloadFormat::JSON;
+            modified_payload =
+                edit_as_hex ? mitmqtt::toHexBytes(
+                                  reinterpret_cast<const uint8_t *>(
+                                      captured.data()),
+                                  captured.size())
+                            : std::string(captured);
+            edited_row = packet.row;
+          }
+          ImGui::SameLine();
+          ImGui::TextDisabled("%s, %zu bytes",
+                              mitmqtt::payloadFormatToString(decoded->format),
+                              decoded->size);
+
+          if (ImGui::BeginTabBar("##payloadViews")) {
+            if (ImGui::BeginTabItem("Decoded")) {
+              ImGui::BeginChild("##decoded", ImVec2(-1, 150), true,
+                                ImGuiWindowFlags_HorizontalScrollbar);
+              ImGui::TextUnformatted(decoded->view.data(),
+                                     decoded->view.data() +
+                                         decoded->view.size());
+              ImGui::EndChild();
+              ImGui::EndTabItem();
+            }
+            if (ImGui::BeginTabItem("Hex")) {
+              ImGui::BeginChild("##hex", ImVec2(-1, 150), true,
+                                ImGuiWindowFlags_HorizontalScrollbar);
+              ImGui::TextUnformatted(decoded->hexDump.data(),
+                                     decoded->hexDump.data() +
+                                         decoded->hexDump.size());
+              ImGui::EndChild();
+              ImGui::EndTabItem();
+            }
+            if (ImGui::BeginTabItem("Edit")) {
+              if (ImGui::Checkbox("Edit as hex", &edit_as_hex)) {
+                if (edit_as_hex) {
+                  modified_payload = mitmqtt::toHexBytes(
+                      reinterpret_cast<const uint8_t *>(
+                          modified_payload.data()),
+                      modified_payload.size());
+                } else if (!mitmqtt::parseHexBytes(modified_payload,
+                                                   modified_payload)) {
+                  edit_as_hex = true; // Stay in hex until it parses
+                }
+              }
+              inputTextMultiline("##payload", modified_payload,
+                                 ImVec2(-1, 150));
+              ImGui::EndTabItem();
+            }
+            ImGui::EndTabBar();
+          }
+        }
+
+        // The payload to inject, false until the editor has loaded this
+        // packet or while its hex does not parse
+        static bool bad_hex = false;
+        auto editedPayload = [&](std::string &payload) {
+          if (edited_row != packet.row)
+            return false;
+          bad_hex = edit_as_hex &&
+                    !mitmqtt::parseHexBytes(modified_payload, payload);
+          if (!edit_as_hex)
+            payload = modified_payload;
+          return !bad_hex;
+        };
 
         ImGui::Spacing();
         ImGui::Separator();
@@ -548,9 +1580,56 @@ private:
         // Replay section
         ImGui::TextColored(ImVec4(1.0f, 0.8f, 0.2f, 1.0f), "Replay Original");
         if (ImGui::Button("Replay Original Packet", ImVec2(-1, 30))) {
-          mqtt_handler_.replayPacket(selected_packet);
+          mqtt_handler_.replayPacket(packet.sequence);
+        }
+        ImGui::TextWrapped("Sends the exact original packet again, the same "
+                           "way, on the connection it came from.");
+
+        // Timed replay of everything stored from this packet on
+        static int replaySpeed = 0;
+        static int replayDirection = 0;
+        static bool replayOwnConnection = true;
+        static bool replayAllTypes = false;
+        const char *speeds[] = {"Captured pace", "10x", "100x",
+                                "As fast as possible"};
+        const double speedValues[] = {1.0, 10.0, 100.0, 0.0};
+        const char *directions[] = {"As captured", "All to clients",
+                                    "All to broker"};
+        ImGui::SetNextItemWidth(170);
+        ImGui::Combo("##replaySpeed", &replaySpeed, speeds,
+                     IM_ARRAYSIZE(speeds));
+        ImGui::SameLine();
+        ImGui::SetNextItemWidth(150);
+        ImGui::Combo("##replayDirection", &replayDirection, directions,
+                     IM_ARRAYSIZE(directions));
+        ImGui::SameLine();
+        ImGui::Checkbox("This connection only", &replayOwnConnection);
+        ImGui::SameLine();
+        ImGui::Checkbox("All packet types", &replayAllTypes);
+        if (ImGui::Button("Replay From Here", ImVec2(-1, 30)) &&
+            packet.sequence != 0) {
+          mitmqtt::ReplayOptions options;
+          options.speed = speedValues[replaySpeed];
+          options.direction =
+              static_cast<mitmqtt::ReplayDirection>(replayDirection);
+          if (replayOwnConnection)
+            options.connectionId = packet.connectionId;
+          if (replayAllTypes)
+            options.packetTypes = mitmqtt::ReplayOptions::kAllPacketTypes;
+          mqtt_handler_.startReplay(packet.sequence,
+                                    mqtt_handler_.getLastStoredSequence(),
+                                    std::move(options));
+        }
+        for (const auto &replay : mqtt_handler_.getReplays()) {
+          ImGui::PushID(static_cast<int>(replay.id));
+          ImGui::Text("Replay %llu: %zu of %zu sent",
+                      static_cast<unsigned long long>(replay.id), replay.sent,
+                      replay.frames);
+          ImGui::SameLine();
+          if (ImGui::SmallButton("Stop"))
+            mqtt_handler_.stopReplay(replay.id);
+          ImGui::PopID();
         }
-        ImGui::TextWrapped("Sends the exact original packet again.");
 
         ImGui::Spacing();
         ImGui::Separator();
@@ -562,11 +1641,19 @@ private:
         ImGui::Text("Topic:");
         ImGui::InputText("##topic", inject_topic, sizeof(inject_topic));
 
+        if (bad_hex) {
+          ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f),
+                             "Payload is not valid hex");
+        }
+
         ImGui::Spacing();
 
         // Send to Client button (inject as if coming from broker)
-        if (ImGui::Button("Send to Client (as Broker)", ImVec2(-1, 35))) {
-          mqtt_handler_.injectPacket(inject_topic, modified_payload, true);
+        std::string payload;
+        if (ImGui::Button("Send to Client (as Broker)", ImVec2(-1, 35)) &&
+            editedPayload(payload)) {
+          mqtt_handler_.injectPacket(inject_topic, payload, true,
+                                     packet.connectionId);
         }
         ImGui::TextWrapped(
             "Injects packet to the client as if from the broker.");
@@ -574,8 +1661,10 @@ private:
         ImGui::Spacing();
 
         // Send to Broker button (inject as if coming from client)
-        if (ImGui::Button("Send to Broker (as Client)", ImVec2(-1, 35))) {
-          mqtt_handler_.injectPacket(inject_topic, modified_payload, false);
+        if (ImGui::Button("Send to Broker (as Client)", ImVec2(-1, 35)) &&
+            editedPayload(payload)) {
+          mqtt_handler_.injectPacket(inject_topic, payload, false,
+                                     packet.connectionId);
         }
         ImGui::TextWrapped(
             "Injects packet to the broker as if from the client.");
@@ -583,7 +1672,7 @@ private:
         ImGui::End();
       } else {
         show_packet_editor = false;
-        selected_packet = -1;
+        selected_row = 0;
       }
     }
   }
@@ -592,11 +1681,44 @@ private:
   std::unique_ptr<GLFWwindow, GLFWwindowDeleter> window_;
   const char *glsl_version_;
 
-  boost::asio::io_context ioc_;
+  mitmqtt::IOContextPool io_pool_;
   mitmqtt::MQTTHandler mqtt_handler_;
-  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
-      work_guard_;
-  std::thread io_thread_;
+  std::shared_ptr<mitmqtt::CaptureQueue> capture_queue_;
+
+  // Decoded views of captured payloads, by PacketInfo::row
+  mitmqtt::IOContextPool decode_pool_;
+  mitmqtt::PayloadDecodeCache payload_cache_;
+
+  // Packets window filter and the rows currently matching it
+  mitmqtt::CaptureIndex::Filter packetFilter_;
+  bool filterActive_ = false;
+  std::deque<uint64_t> filteredRows_;
+  double clientSweepTime_ = 0; // ImGui time of the last forgetClosedClients
+
+  // Payload search, its matching rows so far, ascending
+  static constexpr size_t kIndexedSegments = 16;
+  mitmqtt::IOContextPool search_pool_;
+  mitmqtt::CaptureSearch search_;
+  mitmqtt::SearchQuery searchQuery_;
+  bool searchActive_ = false;
+  std::deque<uint64_t> searchRows_;
+  std::string searchError_;
+
+  // Packet history budget, see setHistoryBudget()
+  static constexpr int kDefaultHistoryMB = 256;
+  static constexpr size_t kHistoryDiskBytes = size_t(4) << 30;
+  int historyMB_ = 0;
+  size_t rowBudget_ = 0;
+  std::string spillDirectory_;
+
+  // Snapshot of the held packets as of heldVersion_
+  std::vector<mitmqtt::HeldPacket> heldPackets_;
+  uint64_t heldVersion_ = UINT64_MAX;
+
+  // Stats window snapshot, taken at statsTime_ (ImGui time)
+  mitmqtt::MetricsSnapshot stats_;
+  double statsTime_ = 0;
+  double byteRates_[2] = {0, 0};
 
   bool interceptEnabled_;
   char listenAddress_[128] = "0.0.0.0";
@@ -608,15 +1730,15 @@ private:
 
 int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
   try {
-    std::cout << "MITMqtt - MQTT Intercepting Proxy" << std::endl;
-    std::cout << "Starting application..." << std::endl;
+    MITMQTT_LOG_INFO("MITMqtt - MQTT Intercepting Proxy");
+    MITMQTT_LOG_INFO("Starting application...");
 
     Application app;
     app.run();
 
-    std::cout << "Application closed successfully" << std::endl;
+    MITMQTT_LOG_INFO("Application closed successfully");
   } catch (const std::exception &e) {
-    std::cerr << "Fatal error: " << e.what() << std::endl;
+    MITMQTT_LOG_ERROR("Fatal error: " << e.what());
     return 1;
   }
   return 0;
@@ -1,5 +1,5 @@
 #include "certificate_manager.hpp"
-#include <iostream>
+#include "logger.hpp"
 
 #ifdef MITMQTT_HAS_SSL
 #include <openssl/err.h>
@@ -49,23 +49,23 @@ bool CertificateManager::loadCACertificate(const std::string &caFile) {
   if (!clientCtx_) {
     clientCtx_ = SSL_CTX_new(TLS_client_method());
     if (!clientCtx_) {
-      std::cerr << "Failed to create SSL client context" << std::endl;
+      MITMQTT_LOG_ERROR("Failed to create SSL client context");
       return false;
     }
   }
 
   // Load CA certificate
   if (SSL_CTX_load_verify_locations(clientCtx_, caFile.c_str(), nullptr) != 1) {
-    std::cerr << "Failed to load CA certificate: " << caFile << std::endl;
+    MITMQTT_LOG_ERROR("Failed to load CA certificate: " << caFile);
     ERR_print_errors_fp(stderr);
     return false;
   }
 
-  std::cout << "Loaded CA certificate: " << caFile << std::endl;
+  MITMQTT_LOG_INFO("Loaded CA certificate: " << caFile);
   return true;
 #else
   (void)caFile;
-  std::cerr << "SSL support not compiled in" << std::endl;
+  MITMQTT_LOG_ERROR("SSL support not compiled in");
   return false;
 #endif
 }
@@ -77,7 +77,7 @@ bool CertificateManager::loadServerCertificate(const std::string &certFile,
   if (!serverCtx_) {
     serverCtx_ = SSL_CTX_new(TLS_server_method());
     if (!serverCtx_) {
-      std::cerr << "Failed to create SSL server context" << std::endl;
+      MITMQTT_LOG_ERROR("Failed to create SSL server context");
       return false;
     }
   }
@@ -85,7 +85,7 @@ bool CertificateManager::loadServerCertificate(const std::string &certFile,
   // Load certificate
   if (SSL_CTX_use_certificate_file(serverCtx_, certFile.c_str(),
                                    SSL_FILETYPE_PEM) != 1) {
-    std::cerr << "Failed to load server certificate: " << certFile << std::endl;
+    MITMQTT_LOG_ERROR("Failed to load server certificate: " << certFile);
     ERR_print_errors_fp(stderr);
     return false;
   }
@@ -93,24 +93,24 @@ bool CertificateManager::loadServerCertificate(const std::string &certFile,
   // Load private key
   if (SSL_CTX_use_PrivateKey_file(serverCtx_, keyFile.c_str(),
                                   SSL_FILETYPE_PEM) != 1) {
-    std::cerr << "Failed to load server private key: " << keyFile << std::endl;
+    MITMQTT_LOG_ERROR("Failed to load server private key: " << keyFile);
     ERR_print_errors_fp(stderr);
     return false;
   }
 
   // Verify private key
   if (SSL_CTX_check_private_key(serverCtx_) != 1) {
-    std::cerr << "Server private key does not match certificate" << std::endl;
+    MITMQTT_LOG_ERROR("Server private key does not match certificate");
     ERR_print_errors_fp(stderr);
     return false;
   }
 
-  std::cout << "Loaded server certificate and key" << std::endl;
+  MITMQTT_LOG_INFO("Loaded server certificate and key");
   return true;
 #else
   (void)certFile;
   (void)keyFile;
-  std::cerr << "SSL support not compiled in" << std::endl;
+  MITMQTT_LOG_ERROR("SSL support not compiled in");
   return false;
 #endif
 }
@@ -122,7 +122,7 @@ bool CertificateManager::loadClientCertificate(const std::string &certFile,
   if (!clientCtx_) {
     clientCtx_ = SSL_CTX_new(TLS_client_method());
     if (!clientCtx_) {
-      std::cerr << "Failed to create SSL client context" << std::endl;
+      MITMQTT_LOG_ERROR("Failed to create SSL client context");
       return false;
     }
   }
@@ -130,7 +130,7 @@ bool CertificateManager::loadClientCertificate(const std::string &certFile,
   // Load certificate
   if (SSL_CTX_use_certificate_file(clientCtx_, certFile.c_str(),
                                    SSL_FILETYPE_PEM) != 1) {
-    std::cerr << "Failed to load client certificate: " << certFile << std::endl;
+    MITMQTT_LOG_ERROR("Failed to load client certificate: " << certFile);
     ERR_print_errors_fp(stderr);
     return false;
   }
@@ -138,24 +138,24 @@ bool CertificateManager::loadClientCertificate(const std::string &certFile,
   // Load private key
   if (SSL_CTX_use_PrivateKey_file(clientCtx_, keyFile.c_str(),
                                   SSL_FILETYPE_PEM) != 1) {
-    std::cerr << "Failed to load client private key: " << keyFile << std::endl;
+    MITMQTT_LOG_ERROR("Failed to load client private key: " << keyFile);
     ERR_print_errors_fp(stderr);
     return false;
   }
 
   // Verify private key
   if (SSL_CTX_check_private_key(clientCtx_) != 1) {
-    std::cerr << "Client private key does not match certificate" << std::endl;
+    MITMQTT_LOG_ERROR("Client private key does not match certificate");
     ERR_print_errors_fp(stderr);
     return false;
   }
 
-  std::cout << "Loaded client certificate and key" << std::endl;
+  MITMQTT_LOG_INFO("Loaded client certificate and key");
   return true;
 #else
   (void)certFile;
   (void)keyFile;
-  std::cerr << "SSL support not compiled in" << std::endl;
+  MITMQTT_LOG_ERROR("SSL support not compiled in");
   return false;
 #endif
 }
@@ -167,21 +167,27 @@ SSL_CTX *CertificateManager::getClientContext() { return clientCtx_; }
 bool CertificateManager::generateSelfSignedCertificate(
     const std::string &certFile, const std::string &keyFile) {
 #ifdef MITMQTT_HAS_SSL
-  std::cout << "Generating self-signed CA certificate..." << std::endl;
-
-  // Generate RSA key pair using EVP_PKEY_Q_keygen (OpenSSL 3.x)
-  EVP_PKEY *pkey = EVP_PKEY_Q_keygen(nullptr, nullptr, "RSA", (size_t)2048);
+  MITMQTT_LOG_INFO("Generating self-signed CA certificate...");
+
+  // Generate RSA key pair (EVP_PKEY_CTX works with OpenSSL 1.1 and 3.x)
+  EVP_PKEY *pkey = nullptr;
+  EVP_PKEY_CTX *keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+  if (keyCtx && EVP_PKEY_keygen_init(keyCtx) > 0 &&
+      EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx, 2048) > 0 &&
+      EVP_PKEY_keygen(keyCtx, &pkey) <= 0)
+    pkey = nullptr;
+  EVP_PKEY_CTX_free(keyCtx);
   if (!pkey) {
-    std::cerr << "Failed to generate RSA key pair" << std::endl;
+    MITMQTT_LOG_ERROR("Failed to generate RSA key pair");
     ERR_print_errors_fp(stderr);
     return false;
   }
-  std::cout << "RSA key pair generated successfully" << std::endl;
+  MITMQTT_LOG_INFO("RSA key pair generated successfully");
 
   // Create X509 certificate
   X509 *x509 = X509_new();
   if (!x509) {
-    std::cerr << "Failed to create X509 certificate" << std::endl;
+    MITMQTT_LOG_ERROR("Failed to create X509 certificate");
     EVP_PKEY_free(pkey);
     return false;
   }
@@ -236,67 +242,63 @@ bool CertificateManager::generateSelfSignedCertificate(
 
   // Sign the certificate with its own private key (self-signed)
   if (!X509_sign(x509, pkey, EVP_sha256())) {
-    std::cerr << "Failed to sign certificate" << std::endl;
+    MITMQTT_LOG_ERROR("Failed to sign certificate");
     X509_free(x509);
     EVP_PKEY_free(pkey);
     return false;
   }
-  std::cout << "Certificate signed successfully" << std::endl;
+  MITMQTT_LOG_INFO("Certificate signed successfully");
 
   // Write private key to file using BIO (Windows compatible)
   BIO *keyBio = BIO_new_file(keyFile.c_str(), "wb");
   if (!keyBio) {
-    std::cerr << "Failed to open key file for writing: " << keyFile
-              << std::endl;
+    MITMQTT_LOG_ERROR("Failed to open key file for writing: " << keyFile);
     X509_free(x509);
     EVP_PKEY_free(pkey);
     return false;
   }
   if (!PEM_write_bio_PrivateKey(keyBio, pkey, nullptr, nullptr, 0, nullptr,
                                 nullptr)) {
-    std::cerr << "Failed to write private key" << std::endl;
+    MITMQTT_LOG_ERROR("Failed to write private key");
     BIO_free(keyBio);
     X509_free(x509);
     EVP_PKEY_free(pkey);
     return false;
   }
   BIO_free(keyBio);
-  std::cout << "Private key saved to: " << keyFile << std::endl;
+  MITMQTT_LOG_INFO("Private key saved to: " << keyFile);
 
   // Write certificate to file using BIO (Windows compatible)
   BIO *certBio = BIO_new_file(certFile.c_str(), "wb");
   if (!certBio) {
-    std::cerr << "Failed to open cert file for writing: " << certFile
-              << std::endl;
+    MITMQTT_LOG_ERROR("Failed to open cert file for writing: " << certFile);
     X509_free(x509);
     EVP_PKEY_free(pkey);
     return false;
   }
   if (!PEM_write_bio_X509(certBio, x509)) {
-    std::cerr << "Failed to write certificate" << std::endl;
+    MITMQTT_LOG_ERROR("Failed to write certificate");
     BIO_free(certBio);
     X509_free(x509);
     EVP_PKEY_free(pkey);
     return false;
   }
   BIO_free(certBio);
-  std::cout << "Certificate saved to: " << certFile << std::endl;
+  MITMQTT_LOG_INFO("Certificate saved to: " << certFile);
 
   // Cleanup
   X509_free(x509);
   EVP_PKEY_free(pkey);
 
-  std::cout << "Self-signed CA certificate generated successfully!"
-            << std::endl;
-  std::cout
-      << "Add this CA certificate to your devices to enable TLS interception."
-      << std::endl;
+  MITMQTT_LOG_INFO("Self-signed CA certificate generated successfully!");
+  MITMQTT_LOG_INFO(
+      "Add this CA certificate to your devices to enable TLS interception.");
 
   return true;
 #else
   (void)certFile;
   (void)keyFile;
-  std::cerr << "SSL support not compiled in" << std::endl;
+  MITMQTT_LOG_ERROR("SSL support not compiled in");
   return false;
 #endif
 }
@@ -0,0 +1,121 @@
+#include "logger.hpp"
+#include <chrono>
+#include <iostream>
+
+namespace mitmqtt {
+namespace utils {
+
+namespace {
+constexpr size_t kQueueCapacity = 8192;
+constexpr uint32_t kDefaultPacketRateLimit = 100;
+}
+
+Logger &Logger::instance() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger()
+    : level_(LogLevel::Info), packetLogging_(true),
+      packetRateLimit_(kDefaultPacketRateLimit), packetWindow_(0),
+      packetLines_(0), packetSuppressed_(0), queue_(kQueueCapacity),
+      queued_(0), written_(0), flushWaiters_(0), running_(true) {
+  writer_ = std::thread([this]() { run(); });
+}
+
+Logger::~Logger() {
+  {
+    std::lock_guard<std::mutex> lock(wakeMutex_);
+    running_ = false;
+  }
+  wake_.notify_one();
+  flushed_.notify_all();
+  if (writer_.joinable())
+    writer_.join();
+}
+
+bool Logger::allowPacketLine() {
+  uint32_t limit = packetRateLimit_.load(std::memory_order_relaxed);
+  if (limit == 0)
+    return true;
+
+  int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  int64_t window = packetWindow_.load(std::memory_order_relaxed);
+  if (now != window && packetWindow_.compare_exchange_strong(
+                           window, now, std::memory_order_relaxed)) {
+    // First line of a new second resets the budget
+    packetLines_.store(0, std::memory_order_relaxed);
+    uint64_t suppressed =
+        packetSuppressed_.exchange(0, std::memory_order_relaxed);
+    if (suppressed > 0) {
+      write(LogLevel::Info, std::to_string(suppressed) +
+                                " packet log lines suppressed");
+    }
+  }
+
+  if (packetLines_.fetch_add(1, std::memory_order_relaxed) < limit)
+    return true;
+  packetSuppressed_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void Logger::write(LogLevel level, std::string message) {
+  if (!queue_.tryPush(Line{level, std::move(message)}))
+    return;
+  // Only the line that finds the queue empty may have to wake the writer
+  if (queued_.fetch_add(1) == written_.load()) {
+    std::lock_guard<std::mutex> lock(wakeMutex_);
+    wake_.notify_one();
+  }
+}
+
+void Logger::flush() {
+  uint64_t target = queued_.load();
+  std::unique_lock<std::mutex> lock(wakeMutex_);
+  ++flushWaiters_;
+  flushed_.wait(lock,
+                [&]() { return written_.load() >= target || !running_; });
+  --flushWaiters_;
+}
+
+void Logger::run() {
+  while (running_) {
+    if (writeQueued() > 0)
+      continue;
+    std::unique_lock<std::mutex> lock(wakeMutex_);
+    wake_.wait(lock, [this]() { return queued_ != written_ || !running_; });
+  }
+  // Whatever was queued before shutdown
+  writeQueued();
+}
+
+size_t Logger::writeQueued() {
+  bool wroteOut = false;
+  bool wroteErr = false;
+  size_t count = queue_.drain([&](Line &&line) {
+    if (line.level >= LogLevel::Warn) {
+      std::cerr << line.message << '\n';
+      wroteErr = true;
+    } else {
+      std::cout << line.message << '\n';
+      wroteOut = true;
+    }
+  });
+
+  // One flush per batch instead of one per line
+  if (wroteOut)
+    std::cout.flush();
+  if (wroteErr)
+    std::cerr.flush();
+  written_.fetch_add(count);
+  if (count > 0 && flushWaiters_ > 0) {
+    std::lock_guard<std::mutex> lock(wakeMutex_);
+    flushed_.notify_all();
+  }
+  return count;
+}
+
+}
+}
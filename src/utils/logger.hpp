@@ -0,0 +1,136 @@
+#pragma once
+
+#include "mpsc_ring.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace mitmqtt {
+namespace utils {
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error, Off };
+
+// Process-wide asynchronous logger.
+//
+// Callers format a line and push it into a lock-free queue; a background
+// thread writes queued lines out and flushes once per batch, so no I/O
+// thread ever blocks on the console. Lines are dropped and counted when the
+// queue is full. Warn and Error go to stderr, everything else to stdout.
+//
+// Per-packet lines have their own switch and a per-second rate limit, see
+// MITMQTT_LOG_PACKET.
+class Logger {
+public:
+  static Logger &instance();
+
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  void setLevel(LogLevel level) { level_ = level; }
+  LogLevel getLevel() const { return level_; }
+  bool enabled(LogLevel level) const {
+    return level >= level_.load(std::memory_order_relaxed);
+  }
+
+  // Per-packet logging, on by default
+  void setPacketLogging(bool enabled) { packetLogging_ = enabled; }
+  bool isPacketLogging() const {
+    return packetLogging_.load(std::memory_order_relaxed);
+  }
+
+  // Per-packet lines allowed per second, 0 for no limit
+  void setPacketRateLimit(uint32_t linesPerSecond) {
+    packetRateLimit_ = linesPerSecond;
+  }
+  uint32_t getPacketRateLimit() const { return packetRateLimit_; }
+
+  // True if a per-packet line may be written now. Counts the lines that are
+  // suppressed and reports them once the next second begins.
+  bool allowPacketLine();
+
+  // Queue a line, without trailing newline
+  void write(LogLevel level, std::string message);
+
+  // Wait until everything queued so far has been written
+  void flush();
+
+  // Lines lost because the queue was full
+  uint64_t dropped() const { return queue_.dropped(); }
+
+private:
+  struct Line {
+    LogLevel level = LogLevel::Info;
+    std::string message;
+  };
+
+  Logger();
+  ~Logger();
+
+  void run();
+  size_t writeQueued();
+
+  std::atomic<LogLevel> level_;
+  std::atomic<bool> packetLogging_;
+  std::atomic<uint32_t> packetRateLimit_;
+
+  // Rate limit window, in whole seconds of steady_clock
+  std::atomic<int64_t> packetWindow_;
+  std::atomic<uint32_t> packetLines_;
+  std::atomic<uint64_t> packetSuppressed_;
+
+  MPSCRing<Line> queue_;
+  std::atomic<uint64_t> queued_;
+  std::atomic<uint64_t> written_;
+  std::atomic<uint32_t> flushWaiters_;
+  std::atomic<bool> running_;
+
+  // The writer waits on `wake_` while the queue is empty, flush() on
+  // `flushed_`; both are notified under `wakeMutex_`
+  std::mutex wakeMutex_;
+  std::condition_variable wake_;
+  std::condition_variable flushed_;
+  std::thread writer_;
+};
+
+}
+}
+
+// Stream-style logging, e.g. MITMQTT_LOG_INFO("Connected to " << host).
+// Nothing is formatted when the level is disabled.
+#define MITMQTT_LOG(level, expr)                                               \
+  do {                                                                         \
+    auto &mitmqttLogger_ = ::mitmqtt::utils::Logger::instance();               \
+    if (mitmqttLogger_.enabled(level)) {                                       \
+      std::ostringstream mitmqttLogStream_;                                    \
+      mitmqttLogStream_ << expr;                                               \
+      mitmqttLogger_.write(level, mitmqttLogStream_.str());                    \
+    }                                                                          \
+  } while (0)
+
+#define MITMQTT_LOG_DEBUG(expr)                                                \
+  MITMQTT_LOG(::mitmqtt::utils::LogLevel::Debug, expr)
+#define MITMQTT_LOG_INFO(expr)                                                 \
+  MITMQTT_LOG(::mitmqtt::utils::LogLevel::Info, expr)
+#define MITMQTT_LOG_WARN(expr)                                                 \
+  MITMQTT_LOG(::mitmqtt::utils::LogLevel::Warn, expr)
+#define MITMQTT_LOG_ERROR(expr)                                                \
+  MITMQTT_LOG(::mitmqtt::utils::LogLevel::Error, expr)
+
+// One line per forwarded packet. Costs a relaxed load when packet logging is
+// off and is rate limited when it is on.
+#define MITMQTT_LOG_PACKET(expr)                                               \
+  do {                                                                         \
+    auto &mitmqttLogger_ = ::mitmqtt::utils::Logger::instance();               \
+    if (mitmqttLogger_.isPacketLogging() &&                                    \
+        mitmqttLogger_.enabled(::mitmqtt::utils::LogLevel::Info) &&            \
+        mitmqttLogger_.allowPacketLine()) {                                    \
+      std::ostringstream mitmqttLogStream_;                                    \
+      mitmqttLogStream_ << expr;                                               \
+      mitmqttLogger_.write(::mitmqtt::utils::LogLevel::Info,                   \
+                           mitmqttLogStream_.str());                           \
+    }                                                                          \
+  } while (0)
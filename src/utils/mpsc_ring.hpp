@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace mitmqtt {
+namespace utils {
+
+// Bounded lock-free multi-producer/single-consumer ring.
+//
+// Each cell carries a sequence number that tells producers and the consumer
+// whose turn it is (Vyukov's bounded queue), so neither side ever blocks.
+// When the ring is full tryPush() fails and the drop is counted instead of
+// waiting for the consumer.
+template <typename T> class MPSCRing {
+public:
+  // Capacity is rounded up to a power of two
+  explicit MPSCRing(size_t capacity)
+      : mask_(roundUp(capacity) - 1), cells_(new Cell[mask_ + 1]),
+        enqueuePos_(0), dequeuePos_(0), dropped_(0) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MPSCRing(const MPSCRing &) = delete;
+  MPSCRing &operator=(const MPSCRing &) = delete;
+
+  // Any thread. On failure `value` is left untouched.
+  bool tryPush(T &&value) {
+    Cell *cell;
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueuePos_.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = enqueuePos_.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer thread only
+  bool tryPop(T &value) {
+    Cell *cell = &cells_[dequeuePos_ & mask_];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff =
+        static_cast<intptr_t>(seq) - static_cast<intptr_t>(dequeuePos_ + 1);
+    if (diff < 0)
+      return false;
+
+    value = std::move(cell->value);
+    cell->sequence.store(dequeuePos_ + mask_ + 1, std::memory_order_release);
+    ++dequeuePos_;
+    return true;
+  }
+
+  // Consumer thread only: pop up to `max` items into `fn`
+  template <typename Fn> size_t drain(Fn &&fn, size_t max = SIZE_MAX) {
+    size_t count = 0;
+    T value;
+    while (count < max && tryPop(value)) {
+      fn(std::move(value));
+      ++count;
+    }
+    return count;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Pushes rejected because the ring was full
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  static size_t roundUp(size_t n) {
+    size_t size = 2;
+    while (size < n)
+      size <<= 1;
+    return size;
+  }
+
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(64) std::atomic<size_t> enqueuePos_;
+  alignas(64) size_t dequeuePos_;
+  alignas(64) std::atomic<uint64_t> dropped_;
+};
+
+}
+}